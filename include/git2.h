@@ -23,6 +23,7 @@
 #include "git2/repository.h"
 #include "git2/revwalk.h"
 #include "git2/merge.h"
+#include "git2/graph.h"
 #include "git2/refs.h"
 #include "git2/reflog.h"
 #include "git2/revparse.h"
@@ -53,6 +54,8 @@
 #include "git2/reset.h"
 #include "git2/message.h"
 #include "git2/pack.h"
+#include "git2/midx.h"
+#include "git2/commit_graph.h"
 #include "git2/stash.h"
 
 #endif
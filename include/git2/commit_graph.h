@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_git_commit_graph_h__
+#define INCLUDE_git_commit_graph_h__
+
+#include "common.h"
+#include "types.h"
+
+/**
+ * @file git2/commit_graph.h
+ * @brief Git commit-graph routines
+ * @defgroup git_commit_graph Git commit-graph routines
+ * @ingroup Git
+ * @{
+ */
+GIT_BEGIN_DECL
+
+/**
+ * Create a new writer for the `commit-graph` file of an object
+ * database.
+ *
+ * The commit-graph holds the parents, root tree, commit time and
+ * generation number of a set of commits, so the revision walker
+ * and the merge-base search can use it instead of reading and
+ * parsing each commit from the object database.
+ *
+ * @param out the new writer
+ * @param objects_info_dir the `info` folder of the object database,
+ * usually `objects/info`; the file will be written there
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_commit_graph_writer_new(
+	git_commit_graph_writer **out,
+	const char *objects_info_dir);
+
+/**
+ * Add the commits a revision walk returns to the commit-graph
+ *
+ * The walk is run to completion. The history of the commits it
+ * returns is added as well, since the file can only refer to
+ * commits it contains.
+ *
+ * @param w the writer
+ * @param walk the walk, with the commits to start from pushed
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_commit_graph_writer_add_revwalk(
+	git_commit_graph_writer *w,
+	git_revwalk *walk);
+
+/**
+ * Choose whether to store changed-path filters in the commit-graph
+ *
+ * The filter of a commit is a Bloom filter of the paths it changes
+ * compared to its first parent. A revision walk limited to some paths
+ * checks it before comparing any trees, and skips the commits which
+ * certainly left the paths alone; that's most commits, for most paths.
+ *
+ * Building a filter means comparing the trees of a commit and its
+ * parent, so it's only done for the commits the existing file has
+ * no filter for.
+ *
+ * By default, filters are stored if the existing file has them.
+ *
+ * @param w the writer
+ * @param enabled non-zero to store filters, 0 to leave them out
+ */
+GIT_EXTERN(void) git_commit_graph_writer_set_changed_paths(
+	git_commit_graph_writer *w,
+	int enabled);
+
+/**
+ * Write the commit-graph, replacing any existing one.
+ *
+ * @param w the writer
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_commit_graph_writer_commit(git_commit_graph_writer *w);
+
+/**
+ * Free a commit-graph writer
+ *
+ * @param w the writer
+ */
+GIT_EXTERN(void) git_commit_graph_writer_free(git_commit_graph_writer *w);
+
+/** @} */
+GIT_END_DECL
+#endif
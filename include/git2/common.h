@@ -118,6 +118,101 @@ enum {
  */
 GIT_EXTERN(int) git_libgit2_capabilities(void);
 
+/**
+ * Global library options, for `git_libgit2_opts`.
+ */
+typedef enum {
+	GIT_OPT_SET_CACHE_MAX_SIZE,
+	GIT_OPT_GET_CACHE_MAX_SIZE,
+	GIT_OPT_SET_CACHE_OBJECT_LIMIT,
+	GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL,
+	GIT_OPT_GET_ODB_NEGATIVE_CACHE_TTL,
+	GIT_OPT_SET_MWINDOW_SIZE,
+	GIT_OPT_GET_MWINDOW_SIZE,
+	GIT_OPT_SET_MWINDOW_MAPPED_LIMIT,
+	GIT_OPT_GET_MWINDOW_MAPPED_LIMIT,
+	GIT_OPT_SET_MWINDOW_FILE_LIMIT,
+	GIT_OPT_GET_MWINDOW_FILE_LIMIT,
+	GIT_OPT_SET_MWINDOW_MAP_WHOLE_FILES,
+	GIT_OPT_GET_MWINDOW_MAP_WHOLE_FILES,
+	GIT_OPT_SET_PACK_CHECK_CRC,
+	GIT_OPT_GET_PACK_CHECK_CRC,
+} git_libgit2_opt_t;
+
+/**
+ * Set or query a global library option.
+ *
+ * Available options:
+ *
+ * - GIT_OPT_SET_CACHE_MAX_SIZE, size_t bytes
+ *   Set the memory budget of each object cache (one per repository
+ *   and one per object database). Defaults to 256MB.
+ *
+ * - GIT_OPT_GET_CACHE_MAX_SIZE, size_t *bytes
+ *   Get the current memory budget of each object cache.
+ *
+ * - GIT_OPT_SET_CACHE_OBJECT_LIMIT, git_otype type, size_t bytes
+ *   Only cache objects of the given type up to this size. Use 0 to
+ *   never cache that type. By default commits, trees and tags are
+ *   always cached, and blobs up to 4kB.
+ *
+ * - GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL, int seconds
+ *   Have each object database remember for this long which objects
+ *   `git_odb_exists` couldn't find, instead of asking the backends
+ *   again. Writing through the database forgets them, but objects
+ *   added by other processes may be reported missing until the time
+ *   runs out. Defaults to 0, which disables the cache.
+ *
+ * - GIT_OPT_GET_ODB_NEGATIVE_CACHE_TTL, int *seconds
+ *   Get the current negative lookup cache lifetime.
+ *
+ * - GIT_OPT_SET_MWINDOW_SIZE, size_t bytes
+ *   Set the size of the windows packfiles are mapped in, rounded up
+ *   to a multiple of twice the page size. Defaults to 1GB on 64-bit
+ *   platforms and 32MB elsewhere.
+ *
+ * - GIT_OPT_GET_MWINDOW_SIZE, size_t *bytes
+ *   Get the current window size.
+ *
+ * - GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, size_t bytes
+ *   Unmap the least recently used windows when more than this much
+ *   is mapped. Defaults to 8GB on 64-bit platforms and 256MB
+ *   elsewhere.
+ *
+ * - GIT_OPT_GET_MWINDOW_MAPPED_LIMIT, size_t *bytes
+ *   Get the current mapped limit.
+ *
+ * - GIT_OPT_SET_MWINDOW_FILE_LIMIT, size_t files
+ *   Close the least recently used packfiles when more than this many
+ *   are open; they get opened again when needed. Defaults to 0,
+ *   meaning no limit.
+ *
+ * - GIT_OPT_GET_MWINDOW_FILE_LIMIT, size_t *files
+ *   Get the current open file limit.
+ *
+ * - GIT_OPT_SET_MWINDOW_MAP_WHOLE_FILES, int enabled
+ *   Map packfiles as a whole instead of in windows. This is only
+ *   honoured on 64-bit platforms. Disabled by default.
+ *
+ * - GIT_OPT_GET_MWINDOW_MAP_WHOLE_FILES, int *enabled
+ *   Get whether whole packfiles are mapped.
+ *
+ * - GIT_OPT_SET_PACK_CHECK_CRC, int enabled
+ *   Check every packed object read from disk against the CRC32 its
+ *   pack index records, so a damaged pack fails the read instead of
+ *   giving back bad data. This costs a pass over the compressed
+ *   data of each object, and indices of version 1 have no CRC to
+ *   check. Disabled by default.
+ *
+ * - GIT_OPT_GET_PACK_CHECK_CRC, int *enabled
+ *   Get whether packed objects are checked against their CRC32.
+ *
+ * @param option Option key
+ * @param ... value to set the option
+ * @return 0 on success, <0 on failure
+ */
+GIT_EXTERN(int) git_libgit2_opts(int option, ...);
+
 /** @} */
 GIT_END_DECL
 
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_git_graph_h__
+#define INCLUDE_git_graph_h__
+
+#include "common.h"
+#include "types.h"
+#include "oid.h"
+
+/**
+ * @file git2/graph.h
+ * @brief Git graph traversal routines
+ * @defgroup git_revwalk Git graph traversal routines
+ * @ingroup Git
+ * @{
+ */
+GIT_BEGIN_DECL
+
+/**
+ * Determine if a commit is the descendant of another commit.
+ *
+ * The walk stops as soon as it gets below the generation number of
+ * the ancestor, so asking about a recent ancestor is cheap however
+ * long the history behind it. Generation numbers come from the
+ * commit-graph when there is one, and are otherwise worked out once
+ * and remembered by the object database.
+ *
+ * @param repo the repository where the commits exist
+ * @param commit the commit
+ * @param ancestor a potential ancestor commit
+ * @return 1 if the given commit is a descendant of the potential
+ * ancestor, 0 if not (including when they are the same commit),
+ * error code otherwise
+ */
+GIT_EXTERN(int) git_graph_descendant_of(
+	git_repository *repo,
+	const git_oid *commit,
+	const git_oid *ancestor);
+
+/**
+ * Count the unique commits between two commit objects
+ *
+ * There is no need for branches containing the commits to have any
+ * upstream relationship, but it helps to think of one as a branch and
+ * the other as its upstream, the `ahead` and `behind` values will be
+ * what git would report for the branches.
+ *
+ * Both counts come out of a single walk, which stops once it has
+ * found the merge bases of the two commits.
+ *
+ * @param ahead number of unique commits in `local`
+ * @param behind number of unique commits in `upstream`
+ * @param repo the repository where the commits exist
+ * @param local the commit for local
+ * @param upstream the commit for upstream
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_graph_ahead_behind(
+	size_t *ahead,
+	size_t *behind,
+	git_repository *repo,
+	const git_oid *local,
+	const git_oid *upstream);
+
+/**
+ * Count the unique commits between many commits and a common upstream
+ *
+ * This gives the same counts as calling `git_graph_ahead_behind` for
+ * each of the `locals`, but the commits read for one of them are kept
+ * for the next, so the history they share with `upstream` is only
+ * parsed once.
+ *
+ * @param ahead array of `count` entries, filled with the number of
+ * unique commits in each of the `locals`
+ * @param behind array of `count` entries, filled with the number of
+ * unique commits in `upstream` compared to each of the `locals`
+ * @param repo the repository where the commits exist
+ * @param upstream the commit for upstream
+ * @param locals the commits to compare to `upstream`
+ * @param count the number of `locals`
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_graph_ahead_behind_many(
+	size_t *ahead,
+	size_t *behind,
+	git_repository *repo,
+	const git_oid *upstream,
+	const git_oid locals[],
+	size_t count);
+
+/** @} */
+GIT_END_DECL
+#endif
@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include "oid.h"
+#include "types.h"
 
 GIT_BEGIN_DECL
 
@@ -56,6 +57,37 @@ GIT_EXTERN(int) git_indexer_stream_new(
  */
 GIT_EXTERN(int) git_indexer_stream_add(git_indexer_stream *idx, const void *data, size_t size, git_transfer_progress *stats);
 
+/**
+ * Set number of threads to resolve deltas with
+ *
+ * The deltas of the pack are resolved when it is finalized, by walking
+ * down from each full object to the deltas made against it; these
+ * walks are independent, so they can be spread over several threads.
+ *
+ * By default, libgit2 won't spawn any threads at all;
+ * when set to 0, libgit2 will autodetect the number of
+ * CPUs.
+ *
+ * @param idx the indexer
+ * @param n Number of threads to use
+ */
+GIT_EXTERN(void) git_indexer_stream_set_threads(git_indexer_stream *idx, unsigned int n);
+
+/**
+ * Set the object database to complete thin packs from
+ *
+ * A thin pack leaves out the bases of some of its deltas, as the
+ * other end knows the receiving repository has them already. When
+ * given an object database, the indexer copies any such base it
+ * finds there to the end of the pack when it is finalized, so the
+ * stored pack doesn't depend on anything outside of it. Without one,
+ * thin packs fail to index.
+ *
+ * @param idx the indexer
+ * @param odb the object database; it must outlive the indexer
+ */
+GIT_EXTERN(void) git_indexer_stream_set_odb(git_indexer_stream *idx, git_odb *odb);
+
 /**
  * Finalize the pack and index
  *
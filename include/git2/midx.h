@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_git_midx_h__
+#define INCLUDE_git_midx_h__
+
+#include "common.h"
+#include "types.h"
+
+/**
+ * @file git2/midx.h
+ * @brief Git multi-pack index routines
+ * @defgroup git_midx Git multi-pack index routines
+ * @ingroup Git
+ * @{
+ */
+GIT_BEGIN_DECL
+
+/**
+ * Create a new writer for the `multi-pack-index` file of a pack
+ * directory.
+ *
+ * A multi-pack index lets the pack backend find any object in
+ * the covered packfiles with a single binary search, instead of
+ * searching the index of every pack in turn.
+ *
+ * @param out the new writer
+ * @param pack_dir the directory holding the packfiles, usually
+ * `objects/pack`; the index will be written there
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_midx_writer_new(git_midx_writer **out, const char *pack_dir);
+
+/**
+ * Add a packfile to the multi-pack index
+ *
+ * @param w the writer
+ * @param idx_path the path of the `.idx` file of the pack, either
+ * absolute or relative to the pack directory
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_midx_writer_add(git_midx_writer *w, const char *idx_path);
+
+/**
+ * Add every packfile found in the pack directory
+ *
+ * @param w the writer
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_midx_writer_add_all(git_midx_writer *w);
+
+/**
+ * Write the multi-pack index to the pack directory, replacing any
+ * existing one.
+ *
+ * When an object is present in several packs, the index points
+ * at the most recently modified one.
+ *
+ * @param w the writer
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_midx_writer_commit(git_midx_writer *w);
+
+/**
+ * Free a multi-pack index writer
+ *
+ * @param w the writer
+ */
+GIT_EXTERN(void) git_midx_writer_free(git_midx_writer *w);
+
+/** @} */
+GIT_END_DECL
+#endif
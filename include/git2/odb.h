@@ -95,6 +95,14 @@ GIT_EXTERN(int) git_odb_add_alternate(git_odb *odb, git_odb_backend *backend, in
  */
 GIT_EXTERN(void) git_odb_free(git_odb *db);
 
+/**
+ * Get statistics about the cache of raw objects in the database.
+ *
+ * @param stats Structure to fill with the current statistics
+ * @param db database to get the statistics of
+ */
+GIT_EXTERN(void) git_odb_cache_stats(git_cache_stats *stats, git_odb *db);
+
 /**
  * Read an object from the database.
  *
@@ -142,15 +150,46 @@ GIT_EXTERN(int) git_odb_read(git_odb_object **out, git_odb *db, const git_oid *i
  */
 GIT_EXTERN(int) git_odb_read_prefix(git_odb_object **out, git_odb *db, const git_oid *short_id, size_t len);
 
+/**
+ * Read many objects from the database at once.
+ *
+ * The objects are handed to the callback in whatever order is
+ * cheapest for the backends to produce them; for packfiles that's
+ * the order in which they are stored, so that reading a set of
+ * objects becomes a near-sequential scan of each pack and delta
+ * bases shared between them are only reconstructed once.
+ *
+ * The callback owns the object it is given and must free it with
+ * `git_odb_object_free`. Duplicate ids are only delivered once.
+ * Return a non-zero value from the callback to stop reading.
+ *
+ * @param db database to read the objects from
+ * @param ids the ids of the objects to read
+ * @param count number of entries in `ids`
+ * @param cb the callback to call for each object
+ * @param payload data to pass to the callback
+ * @return 0 if every object was read; GIT_ENOTFOUND if any of them
+ *	is not in the database; GIT_EUSER on non-zero callback; or
+ *	an error code
+ */
+GIT_EXTERN(int) git_odb_read_many(
+	git_odb *db,
+	const git_oid *ids,
+	size_t count,
+	int (*cb)(git_odb_object *object, void *payload),
+	void *payload);
+
 /**
  * Read the header of an object from the database, without
  * reading its full contents.
  *
  * The header includes the length and the type of an object.
  *
- * Note that most backends do not support reading only the header
- * of an object, so the whole object will be read and then the
- * header will be returned.
+ * Loose and packed objects both answer from their headers alone;
+ * for a packed delta, only the start of the delta is inflated for
+ * the size, and the chain is followed through the object headers
+ * for the type. Custom backends which can't read only the header
+ * have the whole object read, and its header returned.
  *
  * @param len_p pointer where to store the length
  * @param type_p pointer where to store the type
@@ -249,11 +288,16 @@ GIT_EXTERN(int) git_odb_open_wstream(git_odb_stream **stream, git_odb *db, size_
  * The returned stream will be of type `GIT_STREAM_RDONLY` and
  * will have the following methods:
  *
- *		- stream->read: read `n` bytes from the stream
+ *		- stream->read: read up to `n` bytes from the stream; returns
+ *		  the number of bytes read, 0 at the end of the object, or an
+ *		  error code
  *		- stream->free: free the stream
  *
  * The stream must always be free'd or will leak memory.
  *
+ * The pack backend streams objects without loading them whole;
+ * for deltified objects only the delta base is kept in memory.
+ *
  * @see git_odb_stream
  *
  * @param stream pointer where to store the stream
@@ -283,6 +327,47 @@ GIT_EXTERN(int) git_odb_open_rstream(git_odb_stream **stream, git_odb *db, const
  */
 GIT_EXTERN(int) git_odb_write_pack(git_odb_writepack **writepack, git_odb *db, git_transfer_progress_callback progress_cb, void *progress_payload);
 
+/**
+ * Start writing new objects into a single packfile.
+ *
+ * Until the transaction is committed or rolled back, the objects
+ * written to the ODB through `git_odb_write` or a write stream are
+ * appended to a temporary pack in `objects/pack` instead of being
+ * stored as loose files. Objects the database already has are not
+ * written again. The new objects can be read back while the
+ * transaction is still open.
+ *
+ * Only databases opened from a folder with `git_odb_open` (e.g. the
+ * one of a repository) support bulk writes. Starting or finishing a
+ * transaction must not race with other uses of the database.
+ *
+ * @param db object database to write to
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_odb_bulk_begin(git_odb *db);
+
+/**
+ * Finish a bulk write, and index the pack it wrote.
+ *
+ * The pack is moved to its final name, next to its `.idx`, from
+ * where the database reads its objects from then on. Nothing is
+ * written if no new object was added.
+ *
+ * If the pack can't be stored, the objects written during the
+ * transaction are lost and the transaction is closed all the same.
+ *
+ * @param db object database in a bulk write
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_odb_bulk_commit(git_odb *db);
+
+/**
+ * Abandon a bulk write, and every object written during it.
+ *
+ * @param db object database in a bulk write
+ */
+GIT_EXTERN(void) git_odb_bulk_rollback(git_odb *db);
+
 /**
  * Determine the object-ID (sha1 hash) of a data buffer
  *
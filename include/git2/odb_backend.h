@@ -55,6 +55,18 @@ struct git_odb_backend {
 			struct git_odb_backend *,
 			const git_oid *);
 
+	/* Read the objects it has from a list of ids, in any
+	 * order, handing each one to the callback; the callback
+	 * takes ownership of the data. Ids which aren't found
+	 * are silently skipped. A non-zero value from the
+	 * callback stops the read, and is returned as is.
+	 */
+	int (* read_many)(
+			struct git_odb_backend *,
+			const git_oid *, size_t,
+			int (*cb)(const git_oid *id, void *data, size_t len, git_otype type, void *payload),
+			void *payload);
+
 	int (* write)(
 			git_oid *,
 			struct git_odb_backend *,
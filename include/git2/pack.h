@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include "oid.h"
+#include "indexer.h"
 
 /**
  * @file git2/pack.h
@@ -67,6 +68,33 @@ GIT_EXTERN(int) git_packbuilder_insert(git_packbuilder *pb, const git_oid *oid,
  */
 GIT_EXTERN(int) git_packbuilder_insert_tree(git_packbuilder *pb, const git_oid *oid);
 
+/**
+ * Insert the objects reachable from a set of commits
+ *
+ * Every object reachable from `wants` is added, except for those
+ * also reachable from `haves`, i.e. what a fetch of `wants` by
+ * somebody who has `haves` needs. Both may also name tags, trees
+ * and blobs; the objects in `haves` must be in the repository.
+ *
+ * When the repository has a pack with a bitmap index (see
+ * `git_pack_write_bitmap`) which holds these objects, they are
+ * counted with the bitmaps instead of walking history and trees.
+ *
+ * @param pb The packbuilder
+ * @param wants the objects to send
+ * @param wants_len number of entries in `wants`
+ * @param haves the objects the receiving side has
+ * @param haves_len number of entries in `haves`
+ *
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_packbuilder_insert_reachable(
+	git_packbuilder *pb,
+	const git_oid *wants,
+	size_t wants_len,
+	const git_oid *haves,
+	size_t haves_len);
+
 /**
  * Write the new pack and the corresponding index to path
  *
@@ -101,6 +129,72 @@ GIT_EXTERN(uint32_t) git_packbuilder_object_count(git_packbuilder *pb);
  */
 GIT_EXTERN(uint32_t) git_packbuilder_written(git_packbuilder *pb);
 
+/**
+ * Write a reachability bitmap index for a pack
+ *
+ * The `.bitmap` file is written next to the pack, in the format
+ * used by `git repack -b`. It gives a bitmap of the objects
+ * reachable from a selection of the pack's commits, favouring
+ * recent ones and those refs point to, which lets
+ * `git_packbuilder_insert_reachable` count objects without walking
+ * the whole history.
+ *
+ * The pack must hold every object reachable from its commits, as
+ * is the case for the result of a full repack.
+ *
+ * @param repo the repository the pack belongs to
+ * @param idx_path the path of the `.idx` file of the pack
+ *
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_pack_write_bitmap(git_repository *repo, const char *idx_path);
+
+/**
+ * Callback for each corrupt object found by `git_pack_verify`
+ *
+ * @param oid the name of the object, as its index has it
+ * @param offset where the object starts in the pack
+ * @param message what is wrong with the object
+ * @param payload the payload given to `git_pack_verify`
+ * @return 0 to go on, non-zero to stop reporting
+ */
+typedef int (*git_pack_verify_cb)(
+	const git_oid *oid,
+	git_off_t offset,
+	const char *message,
+	void *payload);
+
+/**
+ * Check a pack for corruption, like `git verify-pack`
+ *
+ * Both the pack and its index are checked against the checksums they
+ * end with, then every object is checked against the CRC32 its index
+ * records, unpacked, and hashed to check that it matches its name.
+ * The objects are handed out to the threads in ranges, in the order
+ * they are in the pack.
+ *
+ * The progress callback is given the number of objects in the pack as
+ * `total_objects`, and how many have been checked so far as
+ * `indexed_objects`. Both callbacks are only called from the calling
+ * thread, and corrupt objects are reported once they're all checked,
+ * in pack order.
+ *
+ * @param idx_path the path of the `.idx` file of the pack
+ * @param nr_threads number of threads to use; 0 to use one per CPU
+ * @param progress_cb function to call with progress information, or NULL
+ * @param corrupt_cb function to call for each corrupt object, or NULL
+ * @param payload payload for both callbacks
+ *
+ * @return 0 if the pack is sound, GIT_EUSER if a callback stopped the
+ * check, or an error code
+ */
+GIT_EXTERN(int) git_pack_verify(
+	const char *idx_path,
+	unsigned int nr_threads,
+	git_transfer_progress_callback progress_cb,
+	git_pack_verify_cb corrupt_cb,
+	void *payload);
+
 /**
  * Free the packbuilder and all associated data
  *
@@ -410,6 +410,14 @@ GIT_EXTERN(void) git_repository_set_config(git_repository *repo, git_config *con
  */
 GIT_EXTERN(int) git_repository_odb(git_odb **out, git_repository *repo);
 
+/**
+ * Get statistics about the repository's cache of parsed objects.
+ *
+ * @param stats Structure to fill with the current statistics
+ * @param repo A repository object
+ */
+GIT_EXTERN(void) git_repository_cache_stats(git_cache_stats *stats, git_repository *repo);
+
 /**
  * Set the Object Database for this repository
  *
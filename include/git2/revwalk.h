@@ -10,6 +10,7 @@
 #include "common.h"
 #include "types.h"
 #include "oid.h"
+#include "strarray.h"
 
 /**
  * @file git2/revwalk.h
@@ -185,16 +186,85 @@ GIT_EXTERN(int) git_revwalk_push_ref(git_revwalk *walk, const char *refname);
  */
 GIT_EXTERN(int) git_revwalk_hide_ref(git_revwalk *walk, const char *refname);
 
+/**
+ * Only show the commits which change some of the given paths.
+ *
+ * Each path is a file or a folder, relative to the root of the
+ * repository; a folder stands for everything in it. Paths are
+ * taken literally, without any glob matching.
+ *
+ * Like `git log -- <paths>`, the history is simplified: when a
+ * commit leaves the paths as one of its parents had them, it is
+ * not shown, and only that parent's history is walked. Trees are
+ * compared one path component at a time, so subtrees which are
+ * the same in a commit and its parent are never read.
+ *
+ * Setting the pathspec resets the walker.
+ *
+ * @param walk the walker being used for the traversal
+ * @param pathspec the paths to limit the walk to; NULL or an
+ * empty array to show every commit again
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_revwalk_set_pathspec(git_revwalk *walk, const git_strarray *pathspec);
+
+/**
+ * Only follow the first parent of each merge.
+ *
+ * Like `git log --first-parent`, this shows the history of a branch
+ * as it was merged into, rather than what was merged in. The history
+ * of hidden commits is still hidden in full.
+ *
+ * Changing this resets the walker.
+ *
+ * @param walk the walker being used for the traversal
+ * @param enabled non-zero to only follow first parents
+ */
+GIT_EXTERN(void) git_revwalk_set_first_parent(git_revwalk *walk, int enabled);
+
+/**
+ * Stop the walk after a number of commits.
+ *
+ * The walk is over once that many commits have been returned, and
+ * the history beyond them isn't looked at. In a reversed walk, these
+ * are the commits which come out last.
+ *
+ * Changing this resets the walker.
+ *
+ * @param walk the walker being used for the traversal
+ * @param max_count the most commits to return, or 0 for no limit
+ */
+GIT_EXTERN(void) git_revwalk_set_max_count(git_revwalk *walk, size_t max_count);
+
+/**
+ * Only show the commits made within a range of time.
+ *
+ * Like `git log --since`, commits older than `since` are not shown,
+ * and the walk doesn't go past them to their parents, so the history
+ * before that time isn't looked at. Commits newer than `until` are
+ * not shown either, but their history is walked.
+ *
+ * Changing this resets the walker.
+ *
+ * @param walk the walker being used for the traversal
+ * @param since the earliest commit time to show, or 0 for no limit
+ * @param until the latest commit time to show, or 0 for no limit
+ */
+GIT_EXTERN(void) git_revwalk_set_time_range(
+	git_revwalk *walk, git_time_t since, git_time_t until);
+
 /**
  * Get the next commit from the revision walk.
  *
  * The initial call to this method is *not* blocking when
  * iterating through a repo with a time-sorting mode.
  *
- * Iterating with Topological or inverted modes makes the initial
- * call blocking to preprocess the commit list, but this block should be
- * mostly unnoticeable on most repositories (topological preprocessing
- * times at 0.3s on the git.git repo).
+ * Topological walks are worked out as they go, using the generation
+ * numbers of the commits, so the first commits come out without the
+ * rest of the history being visited; this is fastest when the
+ * repository has a commit-graph. Walks which are reversed, or which
+ * hide some commits, make the initial call blocking to preprocess the
+ * commit list instead.
  *
  * The revision walker is reset when the walk is over.
  *
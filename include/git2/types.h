@@ -143,6 +143,21 @@ typedef struct git_note git_note;
 /** Representation of a git packbuilder */
 typedef struct git_packbuilder git_packbuilder;
 
+/** Writer for a multi-pack index */
+typedef struct git_midx_writer git_midx_writer;
+
+/** Writer for a commit-graph file */
+typedef struct git_commit_graph_writer git_commit_graph_writer;
+
+/** Statistics about an object cache */
+typedef struct git_cache_stats {
+	size_t hits; /** lookups answered from the cache */
+	size_t misses; /** lookups which had to go to the object database */
+	size_t evictions; /** objects dropped to stay within the memory budget */
+	size_t objects; /** objects currently cached */
+	size_t memory_used; /** bytes currently charged to the cache */
+} git_cache_stats;
+
 /** Time in a signature */
 typedef struct git_time {
 	git_time_t time; /** time in seconds from epoch */
@@ -13,90 +13,242 @@
 #include "cache.h"
 #include "git2/oid.h"
 
-int git_cache_init(git_cache *cache, size_t size, git_cached_obj_freeptr free_ptr)
+GIT__USE_OIDMAP;
+
+size_t git_cache__max_storage = GIT_CACHE_MAX_STORAGE;
+
+/* commits, trees and tags are always worth keeping; only small blobs are */
+size_t git_cache__max_object_size[GIT_OBJ_REF_DELTA + 1] = {
+	0,				/* GIT_OBJ__EXT1 */
+	(size_t)-1,		/* GIT_OBJ_COMMIT */
+	(size_t)-1,		/* GIT_OBJ_TREE */
+	GIT_CACHE_MAX_BLOB_SIZE, /* GIT_OBJ_BLOB */
+	(size_t)-1,		/* GIT_OBJ_TAG */
+	0,				/* GIT_OBJ__EXT2 */
+	0,				/* GIT_OBJ_OFS_DELTA */
+	0,				/* GIT_OBJ_REF_DELTA */
+};
+
+int git_cache_set_max_object_size(git_otype type, size_t size)
 {
-	if (size < 8)
-		size = 8;
-	size = git__size_t_powerof2(size);
+	if (type < 0 || (size_t)type >= ARRAY_SIZE(git_cache__max_object_size)) {
+		giterr_set(GITERR_INVALID, "Type out of bounds");
+		return -1;
+	}
+
+	git_cache__max_object_size[type] = size;
+	return 0;
+}
+
+GIT_INLINE(git_cache_shard *) cache_shard(git_cache *cache, const git_oid *oid)
+{
+	/* the hash tables use the leading bytes; shard on the last one */
+	return &cache->shards[oid->id[GIT_OID_RAWSZ - 1] & (GIT_CACHE_SHARDS - 1)];
+}
+
+GIT_INLINE(size_t) cache_shard_limit(void)
+{
+	return git_cache__max_storage / GIT_CACHE_SHARDS;
+}
+
+static bool cache_should_store(git_cached_obj *entry)
+{
+	if (entry->type < 0 ||
+		(size_t)entry->type >= ARRAY_SIZE(git_cache__max_object_size))
+		return false;
+
+	return entry->size <= git_cache__max_object_size[entry->type] &&
+		entry->size <= cache_shard_limit();
+}
+
+int git_cache_init(git_cache *cache, git_cached_obj_freeptr free_ptr)
+{
+	size_t i;
 
-	cache->size_mask = size - 1;
-	cache->lru_count = 0;
+	memset(cache, 0x0, sizeof(git_cache));
 	cache->free_obj = free_ptr;
 
-	git_mutex_init(&cache->lock);
+	for (i = 0; i < GIT_CACHE_SHARDS; ++i) {
+		git_cache_shard *shard = &cache->shards[i];
 
-	cache->nodes = git__malloc(size * sizeof(git_cached_obj *));
-	GITERR_CHECK_ALLOC(cache->nodes);
+		if ((shard->map = git_oidmap_alloc()) == NULL) {
+			git_cache_free(cache);
+			giterr_set_oom();
+			return -1;
+		}
+
+		git_mutex_init(&shard->lock);
+	}
 
-	memset(cache->nodes, 0x0, size * sizeof(git_cached_obj *));
 	return 0;
 }
 
 void git_cache_free(git_cache *cache)
 {
+	git_cached_obj *node;
 	size_t i;
 
-	for (i = 0; i < (cache->size_mask + 1); ++i) {
-		if (cache->nodes[i] != NULL)
-			git_cached_obj_decref(cache->nodes[i], cache->free_obj);
+	for (i = 0; i < GIT_CACHE_SHARDS; ++i) {
+		git_cache_shard *shard = &cache->shards[i];
+
+		if (shard->map == NULL)
+			continue;
+
+		kh_foreach_value(shard->map, node, {
+			git_cached_obj_decref(node, cache->free_obj);
+		});
+
+		git_oidmap_free(shard->map);
+		git_mutex_free(&shard->lock);
+	}
+}
+
+void git_cache_clear(git_cache *cache)
+{
+	git_cached_obj *node;
+	size_t i;
+
+	for (i = 0; i < GIT_CACHE_SHARDS; ++i) {
+		git_cache_shard *shard = &cache->shards[i];
+
+		git_mutex_lock(&shard->lock);
+
+		kh_foreach_value(shard->map, node, {
+			git_cached_obj_decref(node, cache->free_obj);
+		});
+
+		kh_clear(oid, shard->map);
+		shard->memory_used = 0;
+		shard->clock_hand = 0;
+
+		git_mutex_unlock(&shard->lock);
 	}
+}
+
+/*
+ * Sweep the clock hand until the shard has `size` bytes to spare.
+ * Must be called with the shard lock held.
+ */
+static void cache_make_room(git_cache *cache, git_cache_shard *shard, size_t size)
+{
+	size_t limit = cache_shard_limit();
+	git_cached_obj *node;
+	khiter_t pos;
+
+	while (shard->memory_used + size > limit && kh_size(shard->map) > 0) {
+		pos = shard->clock_hand;
+		if (pos >= kh_end(shard->map))
+			pos = 0;
+
+		shard->clock_hand = pos + 1;
+
+		if (!kh_exist(shard->map, pos))
+			continue;
 
-	git_mutex_free(&cache->lock);
-	git__free(cache->nodes);
+		node = kh_val(shard->map, pos);
+
+		if (node->flags & GIT_CACHE_REFERENCED) {
+			node->flags &= ~GIT_CACHE_REFERENCED;
+			continue;
+		}
+
+		kh_del(oid, shard->map, pos);
+		shard->memory_used -= node->size;
+		shard->evictions++;
+
+		git_cached_obj_decref(node, cache->free_obj);
+	}
 }
 
 void *git_cache_get(git_cache *cache, const git_oid *oid)
 {
-	uint32_t hash;
-	git_cached_obj *node = NULL, *result = NULL;
-
-	memcpy(&hash, oid->id, sizeof(hash));
+	git_cache_shard *shard = cache_shard(cache, oid);
+	git_cached_obj *node = NULL;
+	khiter_t pos;
 
-	git_mutex_lock(&cache->lock);
+	git_mutex_lock(&shard->lock);
 	{
-		node = cache->nodes[hash & cache->size_mask];
+		pos = kh_get(oid, shard->map, oid);
 
-		if (node != NULL && git_oid_cmp(&node->oid, oid) == 0) {
+		if (pos != kh_end(shard->map)) {
+			node = kh_val(shard->map, pos);
+			node->flags |= GIT_CACHE_REFERENCED;
 			git_cached_obj_incref(node);
-			result = node;
+			shard->hits++;
+		} else {
+			shard->misses++;
 		}
 	}
-	git_mutex_unlock(&cache->lock);
+	git_mutex_unlock(&shard->lock);
 
-	return result;
+	return node;
 }
 
 void *git_cache_try_store(git_cache *cache, void *_entry)
 {
 	git_cached_obj *entry = _entry;
-	uint32_t hash;
-
-	memcpy(&hash, &entry->oid, sizeof(uint32_t));
+	git_cache_shard *shard = cache_shard(cache, &entry->oid);
+	khiter_t pos;
+	int ret;
 
-	/* increase the refcount on this object, because
-	 * the cache now owns it */
-	git_cached_obj_incref(entry);
+	/* the caller gets a reference to whatever we return */
+	if (!cache_should_store(entry)) {
+		git_cached_obj_incref(entry);
+		return entry;
+	}
 
-	git_mutex_lock(&cache->lock);
+	git_mutex_lock(&shard->lock);
 	{
-		git_cached_obj *node = cache->nodes[hash & cache->size_mask];
+		pos = kh_get(oid, shard->map, &entry->oid);
+
+		if (pos != kh_end(shard->map)) {
+			/* someone beat us to it; use theirs */
+			git_cached_obj *node = kh_val(shard->map, pos);
 
-		if (node == NULL) {
-			cache->nodes[hash & cache->size_mask] = entry;
-		} else if (git_oid_cmp(&node->oid, &entry->oid) == 0) {
+			git_cached_obj_incref(entry);
 			git_cached_obj_decref(entry, cache->free_obj);
+
 			entry = node;
+			entry->flags |= GIT_CACHE_REFERENCED;
 		} else {
-			git_cached_obj_decref(node, cache->free_obj);
-			cache->nodes[hash & cache->size_mask] = entry;
+			cache_make_room(cache, shard, entry->size);
+
+			pos = kh_put(oid, shard->map, &entry->oid, &ret);
+
+			if (ret >= 0) {
+				kh_val(shard->map, pos) = entry;
+				shard->memory_used += entry->size;
+
+				/* increase the refcount on this object, because
+				 * the cache now owns it */
+				git_cached_obj_incref(entry);
+			}
 		}
 
 		/* increase the refcount again, because we are
 		 * returning it to the user */
 		git_cached_obj_incref(entry);
-
 	}
-	git_mutex_unlock(&cache->lock);
+	git_mutex_unlock(&shard->lock);
 
 	return entry;
 }
+
+void git_cache_get_stats(git_cache_stats *stats, git_cache *cache)
+{
+	size_t i;
+
+	memset(stats, 0x0, sizeof(git_cache_stats));
+
+	for (i = 0; i < GIT_CACHE_SHARDS; ++i) {
+		git_cache_shard *shard = &cache->shards[i];
+
+		git_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->objects += kh_size(shard->map);
+		stats->memory_used += shard->memory_used;
+		git_mutex_unlock(&shard->lock);
+	}
+}
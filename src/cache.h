@@ -12,31 +12,69 @@
 #include "git2/odb.h"
 
 #include "thread-utils.h"
+#include "oidmap.h"
 
-#define GIT_DEFAULT_CACHE_SIZE 128
+/* must be a power of two */
+#define GIT_CACHE_SHARDS 16
+
+#define GIT_CACHE_MAX_STORAGE (256 * 1024 * 1024)
+#define GIT_CACHE_MAX_BLOB_SIZE 4096
+
+enum {
+	GIT_CACHE_REFERENCED = (1 << 0), /* hit since the clock hand last passed */
+};
 
 typedef void (*git_cached_obj_freeptr)(void *);
 
 typedef struct {
 	git_oid oid;
+	git_otype type; /* for admission, set by the owner before storing */
+	size_t size; /* bytes charged against the budget */
+	unsigned int flags;
 	git_atomic refcount;
 } git_cached_obj;
 
+/*
+ * The cache is split in shards by object id, each with its own lock,
+ * so that threads looking up different objects rarely contend.
+ *
+ * Every shard gets an equal slice of the memory budget. When a shard
+ * is full, a CLOCK hand sweeps over its hash table: entries which have
+ * been hit since the hand last passed get a second chance, the rest
+ * are evicted until there's room for the new entry.
+ */
 typedef struct {
-	git_cached_obj **nodes;
 	git_mutex lock;
+	git_oidmap *map;
+	khiter_t clock_hand;
+	size_t memory_used;
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+} git_cache_shard;
 
-	unsigned int lru_count;
-	size_t size_mask;
+typedef struct {
+	git_cache_shard shards[GIT_CACHE_SHARDS];
 	git_cached_obj_freeptr free_obj;
 } git_cache;
 
-int git_cache_init(git_cache *cache, size_t size, git_cached_obj_freeptr free_ptr);
+/* Global limits, tweakable through `git_libgit2_opts` */
+extern size_t git_cache__max_storage;
+extern size_t git_cache__max_object_size[GIT_OBJ_REF_DELTA + 1];
+
+int git_cache_set_max_object_size(git_otype type, size_t size);
+
+int git_cache_init(git_cache *cache, git_cached_obj_freeptr free_ptr);
 void git_cache_free(git_cache *cache);
 
+/* Drop every entry, e.g. when the objects they are for went away */
+void git_cache_clear(git_cache *cache);
+
 void *git_cache_try_store(git_cache *cache, void *entry);
 void *git_cache_get(git_cache *cache, const git_oid *oid);
 
+void git_cache_get_stats(git_cache_stats *stats, git_cache *cache);
+
 GIT_INLINE(void) git_cached_obj_incref(void *_obj)
 {
 	git_cached_obj *obj = _obj;
@@ -0,0 +1,1348 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "common.h"
+#include "commit_graph.h"
+#include "buffer.h"
+#include "filebuf.h"
+#include "hash.h"
+#include "oidmap.h"
+#include "pack.h"
+#include "path.h"
+#include "pool.h"
+#include "sha1_lookup.h"
+
+#include "git2/commit.h"
+#include "git2/revwalk.h"
+#include "git2/tree.h"
+
+GIT__USE_OIDMAP;
+
+#define COMMIT_GRAPH_SIGNATURE 0x43475048 /* "CGPH" */
+#define COMMIT_GRAPH_VERSION 1
+#define COMMIT_GRAPH_OBJECT_ID_VERSION 1 /* SHA1 */
+
+#define COMMIT_GRAPH_OID_FANOUT_ID 0x4f494446 /* "OIDF" */
+#define COMMIT_GRAPH_OID_LOOKUP_ID 0x4f49444c /* "OIDL" */
+#define COMMIT_GRAPH_COMMIT_DATA_ID 0x43444154 /* "CDAT" */
+#define COMMIT_GRAPH_EXTRA_EDGE_LIST_ID 0x45444745 /* "EDGE" */
+#define COMMIT_GRAPH_BLOOM_INDEX_ID 0x42494458 /* "BIDX" */
+#define COMMIT_GRAPH_BLOOM_DATA_ID 0x42444154 /* "BDAT" */
+
+#define COMMIT_GRAPH_HEADER_SIZE 8
+#define COMMIT_GRAPH_CHUNK_ENTRY_SIZE 12
+#define COMMIT_GRAPH_FANOUT_SIZE (256 * 4)
+
+/* tree, two parents, generation and time */
+#define COMMIT_GRAPH_DATA_ENTRY_SIZE (GIT_OID_RAWSZ + 4 + 4 + 8)
+
+#define COMMIT_GRAPH_PARENT_NONE 0x70000000
+#define COMMIT_GRAPH_EXTRA_EDGES 0x80000000
+#define COMMIT_GRAPH_LAST_EDGE 0x80000000
+
+/* the changed-path filters we write, with git's default settings */
+#define COMMIT_GRAPH_BLOOM_HEADER_SIZE 12
+#define COMMIT_GRAPH_BLOOM_VERSION 1
+#define COMMIT_GRAPH_BLOOM_NUM_HASHES 7
+#define COMMIT_GRAPH_BLOOM_BITS_PER_ENTRY 10
+#define COMMIT_GRAPH_BLOOM_MAX_CHANGES 512
+
+struct git_commit_graph_chunk {
+	uint64_t offset;
+	uint64_t length;
+};
+
+static int commit_graph_error(const char *message)
+{
+	giterr_set(GITERR_ODB, "Invalid commit-graph file - %s", message);
+	return -1;
+}
+
+GIT_INLINE(uint32_t) get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+GIT_INLINE(uint64_t) get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+GIT_INLINE(void) put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+GIT_INLINE(void) put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, (uint32_t)(v >> 32));
+	put_be32(p + 4, (uint32_t)v);
+}
+
+/***********************************************************
+ *
+ * CHANGED-PATH FILTERS
+ *
+ ***********************************************************/
+
+/*
+ * The 32-bit murmur3 hash, which is what git's filters are built
+ * from. Version 1 of the filters widens the bytes of the path as
+ * signed chars, so we have to as well to set the same bits.
+ */
+static uint32_t murmur3_seeded(uint32_t seed, const char *data, size_t len, uint32_t version)
+{
+	const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+	const uint32_t r1 = 15, r2 = 13, m = 5, n = 0xe6546b64;
+	uint32_t k, k1 = 0, h = seed;
+	size_t i, len4 = len / 4;
+
+#define BYTE(i) (version == 1 ? (uint32_t)(signed char)data[i] : (uint32_t)(unsigned char)data[i])
+
+	for (i = 0; i < len4; ++i) {
+		k = BYTE(4 * i) | (BYTE(4 * i + 1) << 8) |
+			(BYTE(4 * i + 2) << 16) | (BYTE(4 * i + 3) << 24);
+		k *= c1;
+		k = (k << r1) | (k >> (32 - r1));
+		k *= c2;
+
+		h ^= k;
+		h = ((h << r2) | (h >> (32 - r2))) * m + n;
+	}
+
+	i = len4 * 4;
+	switch (len & 3) {
+	case 3:
+		k1 ^= BYTE(i + 2) << 16;
+		/* fall through */
+	case 2:
+		k1 ^= BYTE(i + 1) << 8;
+		/* fall through */
+	case 1:
+		k1 ^= BYTE(i);
+		k1 *= c1;
+		k1 = (k1 << r1) | (k1 >> (32 - r1));
+		k1 *= c2;
+		h ^= k1;
+	}
+
+#undef BYTE
+
+	h ^= (uint32_t)len;
+	h ^= (h >> 16);
+	h *= 0x85ebca6b;
+	h ^= (h >> 13);
+	h *= 0xc2b2ae35;
+	h ^= (h >> 16);
+
+	return h;
+}
+
+static void bloom_key_fill(
+	git_commit_graph_bloom_key *key,
+	uint32_t version, uint32_t num_hashes,
+	const char *path, size_t len)
+{
+	uint32_t h0 = murmur3_seeded(0x293ae76f, path, len, version);
+	uint32_t h1 = murmur3_seeded(0x7e646e2c, path, len, version);
+	uint32_t i;
+
+	for (i = 0; i < num_hashes; ++i)
+		key->hashes[i] = h0 + i * h1;
+}
+
+static void bloom_filter_add(
+	unsigned char *filter, size_t len,
+	const git_commit_graph_bloom_key *key, uint32_t num_hashes)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_hashes; ++i) {
+		uint64_t bit = key->hashes[i] % ((uint64_t)len * 8);
+		filter[bit / 8] |= (unsigned char)(1 << (bit & 7));
+	}
+}
+
+static bool bloom_filter_contains(
+	const unsigned char *filter, size_t len,
+	const git_commit_graph_bloom_key *key, uint32_t num_hashes)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_hashes; ++i) {
+		uint64_t bit = key->hashes[i] % ((uint64_t)len * 8);
+		if (!(filter[bit / 8] & (1 << (bit & 7))))
+			return false;
+	}
+
+	return true;
+}
+
+/***********************************************************
+ *
+ * READING
+ *
+ ***********************************************************/
+
+static int commit_graph_parse_oid_fanout(
+	git_commit_graph_file *file,
+	const unsigned char *data,
+	struct git_commit_graph_chunk *chunk)
+{
+	uint32_t i, nr = 0, n;
+
+	if (!chunk->offset)
+		return commit_graph_error("missing OID fanout chunk");
+	if (chunk->length != COMMIT_GRAPH_FANOUT_SIZE)
+		return commit_graph_error("OID fanout chunk has wrong length");
+
+	file->oid_fanout = (const uint32_t *)(data + chunk->offset);
+
+	for (i = 0; i < 256; ++i) {
+		n = ntohl(file->oid_fanout[i]);
+		if (n < nr)
+			return commit_graph_error("index is non-monotonic");
+		nr = n;
+	}
+
+	file->num_commits = nr;
+	return 0;
+}
+
+static int commit_graph_parse_oid_lookup(
+	git_commit_graph_file *file,
+	const unsigned char *data,
+	struct git_commit_graph_chunk *chunk)
+{
+	uint32_t i;
+
+	if (!chunk->offset)
+		return commit_graph_error("missing OID lookup chunk");
+	if (chunk->length != (uint64_t)file->num_commits * GIT_OID_RAWSZ)
+		return commit_graph_error("OID lookup chunk has wrong length");
+
+	file->oid_lookup = data + chunk->offset;
+
+	for (i = 1; i < file->num_commits; ++i) {
+		if (memcmp(file->oid_lookup + (i - 1) * GIT_OID_RAWSZ,
+				file->oid_lookup + i * GIT_OID_RAWSZ, GIT_OID_RAWSZ) >= 0)
+			return commit_graph_error("OID lookup is not sorted");
+	}
+
+	return 0;
+}
+
+static int commit_graph_parse_bloom(
+	git_commit_graph_file *file,
+	const unsigned char *data,
+	struct git_commit_graph_chunk *index,
+	struct git_commit_graph_chunk *filters)
+{
+	const unsigned char *hdr;
+	uint32_t i, end, last_end = 0;
+
+	/* both chunks or neither; a graph without filters is fine */
+	if (!index->offset || !filters->offset)
+		return 0;
+
+	if (index->length != (uint64_t)file->num_commits * 4)
+		return commit_graph_error("filter index chunk has wrong length");
+	if (filters->length < COMMIT_GRAPH_BLOOM_HEADER_SIZE)
+		return commit_graph_error("filter data chunk is too short");
+
+	hdr = data + filters->offset;
+	file->bloom_version = get_be32(hdr);
+	file->bloom_num_hashes = get_be32(hdr + 4);
+	file->bloom_bits_per_entry = get_be32(hdr + 8);
+
+	/* filters we can't read are simply not used */
+	if ((file->bloom_version != 1 && file->bloom_version != 2) ||
+		file->bloom_num_hashes == 0 ||
+		file->bloom_num_hashes > GIT_COMMIT_GRAPH_BLOOM_MAX_HASHES)
+		return 0;
+
+	file->bloom_index = (const uint32_t *)(data + index->offset);
+	file->bloom_data = hdr + COMMIT_GRAPH_BLOOM_HEADER_SIZE;
+	file->bloom_data_len = (size_t)(filters->length - COMMIT_GRAPH_BLOOM_HEADER_SIZE);
+
+	for (i = 0; i < file->num_commits; ++i) {
+		end = ntohl(file->bloom_index[i]);
+		if (end < last_end || end > file->bloom_data_len)
+			return commit_graph_error("filter index is out of bounds");
+		last_end = end;
+	}
+
+	return 0;
+}
+
+static int commit_graph_parse(git_commit_graph_file *file, const unsigned char *data, size_t size)
+{
+	struct git_commit_graph_chunk oid_fanout = {0}, oid_lookup = {0},
+		commit_data = {0}, extra_edges = {0}, bloom_index = {0},
+		bloom_data = {0}, *chunk = NULL;
+	const unsigned char *chunk_hdr;
+	uint32_t i, num_chunks;
+	uint64_t last_offset;
+	size_t trailer_offset;
+
+	if (size < COMMIT_GRAPH_HEADER_SIZE + GIT_OID_RAWSZ)
+		return commit_graph_error("commit-graph is too short");
+
+	if (get_be32(data) != COMMIT_GRAPH_SIGNATURE ||
+		data[4] != COMMIT_GRAPH_VERSION ||
+		data[5] != COMMIT_GRAPH_OBJECT_ID_VERSION)
+		return commit_graph_error("unsupported commit-graph version");
+
+	num_chunks = data[6];
+	if (data[7] != 0)
+		return commit_graph_error("chained commit-graphs are not supported");
+
+	trailer_offset = size - GIT_OID_RAWSZ;
+	if (trailer_offset < COMMIT_GRAPH_HEADER_SIZE + (num_chunks + 1) * COMMIT_GRAPH_CHUNK_ENTRY_SIZE)
+		return commit_graph_error("wrong commit-graph size");
+
+	chunk_hdr = data + COMMIT_GRAPH_HEADER_SIZE;
+	last_offset = COMMIT_GRAPH_HEADER_SIZE + (num_chunks + 1) * COMMIT_GRAPH_CHUNK_ENTRY_SIZE;
+
+	for (i = 0; i < num_chunks; ++i, chunk_hdr += COMMIT_GRAPH_CHUNK_ENTRY_SIZE) {
+		uint64_t offset = get_be64(chunk_hdr + 4);
+
+		if (offset < last_offset || offset >= trailer_offset)
+			return commit_graph_error("chunks are non-monotonic");
+
+		if (chunk)
+			chunk->length = offset - last_offset;
+		last_offset = offset;
+
+		switch (get_be32(chunk_hdr)) {
+		case COMMIT_GRAPH_OID_FANOUT_ID:
+			chunk = &oid_fanout;
+			break;
+		case COMMIT_GRAPH_OID_LOOKUP_ID:
+			chunk = &oid_lookup;
+			break;
+		case COMMIT_GRAPH_COMMIT_DATA_ID:
+			chunk = &commit_data;
+			break;
+		case COMMIT_GRAPH_EXTRA_EDGE_LIST_ID:
+			chunk = &extra_edges;
+			break;
+		case COMMIT_GRAPH_BLOOM_INDEX_ID:
+			chunk = &bloom_index;
+			break;
+		case COMMIT_GRAPH_BLOOM_DATA_ID:
+			chunk = &bloom_data;
+			break;
+		default:
+			/* chunks we don't know about are skipped */
+			chunk = NULL;
+			continue;
+		}
+
+		chunk->offset = offset;
+	}
+
+	/* the terminating entry gives the end of the last chunk */
+	last_offset = get_be64(chunk_hdr + 4);
+	if (last_offset > trailer_offset || (chunk && last_offset < chunk->offset))
+		return commit_graph_error("chunks extend past the trailer");
+
+	if (chunk)
+		chunk->length = last_offset - chunk->offset;
+
+	if (commit_graph_parse_oid_fanout(file, data, &oid_fanout) < 0 ||
+		commit_graph_parse_oid_lookup(file, data, &oid_lookup) < 0)
+		return -1;
+
+	if (!commit_data.offset)
+		return commit_graph_error("missing commit data chunk");
+	if (commit_data.length != (uint64_t)file->num_commits * COMMIT_GRAPH_DATA_ENTRY_SIZE)
+		return commit_graph_error("commit data chunk has wrong length");
+	file->commit_data = data + commit_data.offset;
+
+	if (extra_edges.offset) {
+		if (extra_edges.length % 4 != 0)
+			return commit_graph_error("malformed extra edge list chunk");
+		file->extra_edge_list = (const uint32_t *)(data + extra_edges.offset);
+		file->num_extra_edge_list = (size_t)(extra_edges.length / 4);
+	}
+
+	return commit_graph_parse_bloom(file, data, &bloom_index, &bloom_data);
+}
+
+int git_commit_graph_open(git_commit_graph_file **file_out, const char *path)
+{
+	git_commit_graph_file *file;
+	git_file fd;
+	struct stat st;
+	int error;
+
+	*file_out = NULL;
+
+	if ((fd = git_futils_open_ro(path)) < 0)
+		return fd;
+
+	if (p_fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+		!git__is_sizet(st.st_size)) {
+		p_close(fd);
+		giterr_set(GITERR_OS, "Failed to stat commit-graph '%s'", path);
+		return -1;
+	}
+
+	file = git__calloc(1, sizeof(git_commit_graph_file));
+	GITERR_CHECK_ALLOC(file);
+
+	git_atomic_set(&file->refcount, 1);
+
+	if ((file->filename = git__strdup(path)) == NULL) {
+		p_close(fd);
+		git_commit_graph_free(file);
+		return -1;
+	}
+
+	file->stamp.mtime = (git_time_t)st.st_mtime;
+	file->stamp.size = (git_off_t)st.st_size;
+	file->stamp.ino = (unsigned int)st.st_ino;
+
+	error = git_futils_mmap_ro(&file->graph_map, fd, 0, (size_t)st.st_size);
+	p_close(fd);
+
+	if (error < 0 ||
+		(error = commit_graph_parse(file, file->graph_map.data, file->graph_map.len)) < 0) {
+		git_commit_graph_free(file);
+		return error;
+	}
+
+	*file_out = file;
+	return 0;
+}
+
+bool git_commit_graph_needs_refresh(git_commit_graph_file *file)
+{
+	git_futils_filestamp stamp;
+
+	git_futils_filestamp_set(&stamp, &file->stamp);
+	return git_futils_filestamp_check(&stamp, file->filename) != 0;
+}
+
+static int commit_graph_entry_get_byindex(
+	git_commit_graph_entry *e,
+	const git_commit_graph_file *file,
+	uint32_t pos)
+{
+	const unsigned char *data;
+	uint32_t parent2;
+	uint64_t generation_and_time;
+
+	if (pos >= file->num_commits)
+		return commit_graph_error("commit index out of bounds");
+
+	data = file->commit_data + (size_t)pos * COMMIT_GRAPH_DATA_ENTRY_SIZE;
+
+	git_oid_fromraw(&e->sha1, file->oid_lookup + (size_t)pos * GIT_OID_RAWSZ);
+	git_oid_fromraw(&e->tree_oid, data);
+
+	e->parent_indices[0] = get_be32(data + GIT_OID_RAWSZ);
+	parent2 = get_be32(data + GIT_OID_RAWSZ + 4);
+
+	e->parent_count = (e->parent_indices[0] != COMMIT_GRAPH_PARENT_NONE) +
+		(parent2 != COMMIT_GRAPH_PARENT_NONE);
+	e->parent_indices[1] = parent2;
+	e->extra_parents_index = 0;
+
+	if (parent2 != COMMIT_GRAPH_PARENT_NONE && (parent2 & COMMIT_GRAPH_EXTRA_EDGES)) {
+		size_t i = parent2 & ~COMMIT_GRAPH_EXTRA_EDGES;
+
+		/* the second parent is the first of the extra edges */
+		e->extra_parents_index = i;
+		e->parent_count = 1;
+
+		for (;; ++i) {
+			if (i >= file->num_extra_edge_list)
+				return commit_graph_error("extra edge list out of bounds");
+
+			e->parent_count++;
+			if (ntohl(file->extra_edge_list[i]) & COMMIT_GRAPH_LAST_EDGE)
+				break;
+		}
+
+		e->parent_indices[1] = ntohl(file->extra_edge_list[e->extra_parents_index]) &
+			~COMMIT_GRAPH_LAST_EDGE;
+	}
+
+	generation_and_time = get_be64(data + GIT_OID_RAWSZ + 8);
+	e->generation = (uint32_t)(generation_and_time >> 34);
+	e->commit_time = (git_time_t)(generation_and_time & 0x3ffffffffULL);
+	e->index = pos;
+
+	return 0;
+}
+
+int git_commit_graph_entry_find(
+	git_commit_graph_entry *e,
+	const git_commit_graph_file *file,
+	const git_oid *short_oid,
+	size_t len)
+{
+	int pos, found = 0;
+	unsigned hi, lo;
+	const unsigned char *current = NULL;
+
+	hi = ntohl(file->oid_fanout[(int)short_oid->id[0]]);
+	lo = ((short_oid->id[0] == 0x0) ? 0 : ntohl(file->oid_fanout[(int)short_oid->id[0] - 1]));
+
+	pos = sha1_entry_pos(file->oid_lookup, GIT_OID_RAWSZ, 0, lo, hi, file->num_commits, short_oid->id);
+
+	if (pos >= 0) {
+		/* An object matching exactly the oid was found */
+		found = 1;
+		current = file->oid_lookup + pos * GIT_OID_RAWSZ;
+	} else {
+		/* pos refers to the object with the "closest" oid to short_oid */
+		pos = -1 - pos;
+		if (pos < (int)file->num_commits) {
+			current = file->oid_lookup + pos * GIT_OID_RAWSZ;
+
+			if (!git_oid_ncmp(short_oid, (const git_oid *)current, len))
+				found = 1;
+		}
+	}
+
+	if (found && len != GIT_OID_HEXSZ && pos + 1 < (int)file->num_commits) {
+		/* Check for ambiguousity */
+		const unsigned char *next = current + GIT_OID_RAWSZ;
+
+		if (!git_oid_ncmp(short_oid, (const git_oid *)next, len))
+			found = 2;
+	}
+
+	if (!found)
+		return GIT_ENOTFOUND;
+	if (found > 1)
+		return GIT_EAMBIGUOUS;
+
+	return commit_graph_entry_get_byindex(e, file, (uint32_t)pos);
+}
+
+int git_commit_graph_entry_parent(
+	git_commit_graph_entry *parent,
+	const git_commit_graph_file *file,
+	const git_commit_graph_entry *entry,
+	size_t n)
+{
+	size_t edge;
+
+	if (n >= entry->parent_count)
+		return commit_graph_error("parent index out of bounds");
+
+	if (n == 0 || (n == 1 && entry->parent_count == 2))
+		return commit_graph_entry_get_byindex(parent, file, entry->parent_indices[n]);
+
+	/* the extra edges start with the second parent */
+	edge = entry->extra_parents_index + n - 1;
+	return commit_graph_entry_get_byindex(parent, file,
+		ntohl(file->extra_edge_list[edge]) & ~COMMIT_GRAPH_LAST_EDGE);
+}
+
+/* The changed-path filter of the commit at `pos`, or NULL if there's none */
+static const unsigned char *commit_graph_bloom_filter(
+	size_t *len, const git_commit_graph_file *file, uint32_t pos)
+{
+	uint32_t start, end;
+
+	if (file->bloom_data == NULL || pos >= file->num_commits)
+		return NULL;
+
+	start = pos ? ntohl(file->bloom_index[pos - 1]) : 0;
+	end = ntohl(file->bloom_index[pos]);
+
+	/* git leaves the filters it didn't get to empty */
+	if (end <= start)
+		return NULL;
+
+	*len = end - start;
+	return file->bloom_data + start;
+}
+
+void git_commit_graph_bloom_key_init(
+	git_commit_graph_bloom_key *key,
+	const git_commit_graph_file *file,
+	const char *path,
+	size_t len)
+{
+	assert(file->bloom_data);
+	bloom_key_fill(key, file->bloom_version, file->bloom_num_hashes, path, len);
+}
+
+int git_commit_graph_bloom_maybe_changed(
+	const git_commit_graph_file *file,
+	const git_oid *commit,
+	const git_commit_graph_bloom_key *keys,
+	size_t keys_len)
+{
+	const unsigned char *filter;
+	size_t i, len;
+	int pos;
+
+	if (file->bloom_data == NULL)
+		return GIT_ENOTFOUND;
+
+	pos = sha1_entry_pos(file->oid_lookup, GIT_OID_RAWSZ, 0,
+		commit->id[0] ? ntohl(file->oid_fanout[commit->id[0] - 1]) : 0,
+		ntohl(file->oid_fanout[commit->id[0]]),
+		file->num_commits, commit->id);
+
+	if (pos < 0 || (filter = commit_graph_bloom_filter(&len, file, (uint32_t)pos)) == NULL)
+		return GIT_ENOTFOUND;
+
+	for (i = 0; i < keys_len; ++i) {
+		if (!bloom_filter_contains(filter, len, &keys[i], file->bloom_num_hashes))
+			return 0;
+	}
+
+	return 1;
+}
+
+void git_commit_graph_incref(git_commit_graph_file *file)
+{
+	git_atomic_inc(&file->refcount);
+}
+
+void git_commit_graph_free(git_commit_graph_file *file)
+{
+	if (file == NULL || git_atomic_dec(&file->refcount) > 0)
+		return;
+
+	if (file->graph_map.data)
+		git_futils_mmap_free(&file->graph_map);
+
+	git__free(file->filename);
+	git__free(file);
+}
+
+/***********************************************************
+ *
+ * WRITING
+ *
+ ***********************************************************/
+
+struct git_commit_graph_writer {
+	git_buf objects_info_dir;
+	git_repository *repo;
+
+	/* every commit added, then sorted by name on commit */
+	git_vector commits;
+	git_oidmap *commit_ix;
+
+	/* whether to write changed-path filters; -1 to do as the old file did */
+	int changed_paths;
+};
+
+struct packed_commit {
+	git_oid sha1;
+	git_oid tree_oid;
+	git_time_t commit_time;
+
+	git_oid *parents;
+	size_t parent_count;
+
+	/* filled in when writing */
+	uint32_t index;
+	uint32_t *parent_indices;
+	uint32_t generation;
+	unsigned generating:1; /* on the path `writer_prepare` is walking */
+	unsigned char *bloom;
+	size_t bloom_len;
+};
+
+static int packed_commit_cmp(const void *a_, const void *b_)
+{
+	const struct packed_commit *a = a_, *b = b_;
+	return git_oid_cmp(&a->sha1, &b->sha1);
+}
+
+static void packed_commit_free(struct packed_commit *p)
+{
+	if (p == NULL)
+		return;
+
+	git__free(p->parents);
+	git__free(p->parent_indices);
+	git__free(p->bloom);
+	git__free(p);
+}
+
+int git_commit_graph_writer_new(git_commit_graph_writer **out, const char *objects_info_dir)
+{
+	git_commit_graph_writer *w;
+
+	assert(out && objects_info_dir);
+
+	w = git__calloc(1, sizeof(git_commit_graph_writer));
+	GITERR_CHECK_ALLOC(w);
+
+	if (git_buf_sets(&w->objects_info_dir, objects_info_dir) < 0 ||
+		git_vector_init(&w->commits, 0, packed_commit_cmp) < 0 ||
+		(w->commit_ix = git_oidmap_alloc()) == NULL) {
+		git_commit_graph_writer_free(w);
+		return -1;
+	}
+
+	w->changed_paths = -1;
+
+	*out = w;
+	return 0;
+}
+
+static int writer_add_commit(git_commit_graph_writer *w, git_repository *repo, const git_oid *id)
+{
+	struct packed_commit *p;
+	git_commit *commit;
+	khiter_t pos;
+	size_t i;
+	int error;
+
+	if (kh_get(oid, w->commit_ix, id) != kh_end(w->commit_ix))
+		return 0;
+
+	if ((error = git_commit_lookup(&commit, repo, id)) < 0)
+		return error;
+
+	p = git__calloc(1, sizeof(struct packed_commit));
+	if (p == NULL)
+		goto oom;
+
+	git_oid_cpy(&p->sha1, id);
+	git_oid_cpy(&p->tree_oid, git_commit_tree_oid(commit));
+	p->commit_time = git_commit_time(commit);
+	p->parent_count = git_commit_parentcount(commit);
+
+	if (p->parent_count > 0) {
+		if ((p->parents = git__malloc(p->parent_count * sizeof(git_oid))) == NULL)
+			goto oom;
+
+		for (i = 0; i < p->parent_count; ++i)
+			git_oid_cpy(&p->parents[i], git_commit_parent_oid(commit, (unsigned int)i));
+	}
+
+	git_commit_free(commit);
+	commit = NULL;
+
+	if (git_vector_insert(&w->commits, p) < 0) {
+		packed_commit_free(p);
+		return -1;
+	}
+
+	pos = kh_put(oid, w->commit_ix, &p->sha1, &error);
+	if (error < 0) {
+		git_vector_pop(&w->commits);
+		packed_commit_free(p);
+		giterr_set_oom();
+		return -1;
+	}
+
+	kh_value(w->commit_ix, pos) = p;
+	return 0;
+
+oom:
+	git_commit_free(commit);
+	packed_commit_free(p);
+	giterr_set_oom();
+	return -1;
+}
+
+int git_commit_graph_writer_add_revwalk(git_commit_graph_writer *w, git_revwalk *walk)
+{
+	git_repository *repo;
+	struct packed_commit *p;
+	git_oid id;
+	size_t i, j;
+	int error;
+
+	assert(w && walk);
+
+	repo = git_revwalk_repository(walk);
+	w->repo = repo;
+
+	while ((error = git_revwalk_next(&id, walk)) == 0) {
+		if ((error = writer_add_commit(w, repo, &id)) < 0)
+			return error;
+	}
+
+	if (error != GIT_ITEROVER)
+		return error;
+
+	/* the file can't point at commits it doesn't have, so bring in
+	 * the history the walk left out, e.g. that of hidden commits */
+	for (i = 0; i < w->commits.length; ++i) {
+		p = git_vector_get(&w->commits, i);
+
+		for (j = 0; j < p->parent_count; ++j) {
+			if ((error = writer_add_commit(w, repo, &p->parents[j])) < 0)
+				return error;
+		}
+	}
+
+	return 0;
+}
+
+static int commit_index(uint32_t *out, git_commit_graph_writer *w, const git_oid *id)
+{
+	khiter_t pos = kh_get(oid, w->commit_ix, id);
+
+	if (pos == kh_end(w->commit_ix)) {
+		giterr_set(GITERR_INVALID, "The parent of a commit is missing from the commit-graph");
+		return -1;
+	}
+
+	*out = ((struct packed_commit *)kh_value(w->commit_ix, pos))->index;
+	return 0;
+}
+
+struct writer_frame {
+	struct packed_commit *commit;
+	size_t parent;
+};
+
+/* Resolve the parents to positions and compute the generation numbers */
+static int writer_prepare(git_commit_graph_writer *w)
+{
+	struct packed_commit *p, *c, *parent;
+	struct writer_frame *stack = NULL, *frame;
+	size_t i, j, depth = 0, alloc = 0;
+	uint32_t generation;
+	int error = -1;
+
+	git_vector_sort(&w->commits);
+
+	git_vector_foreach(&w->commits, i, p) {
+		p->index = (uint32_t)i;
+		p->generation = 0;
+		p->generating = 0;
+	}
+
+	git_vector_foreach(&w->commits, i, p) {
+		git__free(p->parent_indices);
+		p->parent_indices = NULL;
+
+		if (p->parent_count == 0)
+			continue;
+
+		p->parent_indices = git__malloc(p->parent_count * sizeof(uint32_t));
+		GITERR_CHECK_ALLOC(p->parent_indices);
+
+		for (j = 0; j < p->parent_count; ++j) {
+			if (commit_index(&p->parent_indices[j], w, &p->parents[j]) < 0)
+				return -1;
+		}
+	}
+
+	/*
+	 * Generation numbers, parents first, depth-first without recursing;
+	 * each frame remembers which parent it is up to, so a commit is on
+	 * the stack at most once, and meeting one that is means a cycle.
+	 */
+	git_vector_foreach(&w->commits, i, p) {
+		for (c = p->generation ? NULL : p; c != NULL; ) {
+			if (depth == alloc) {
+				alloc = alloc ? alloc * 2 : 32;
+				frame = git__realloc(stack, alloc * sizeof(struct writer_frame));
+				if (frame == NULL)
+					goto cleanup;
+				stack = frame;
+			}
+
+			stack[depth].commit = c;
+			stack[depth].parent = 0;
+			depth++;
+			c->generating = 1;
+
+			for (c = NULL; depth > 0 && c == NULL; ) {
+				frame = &stack[depth - 1];
+
+				if (frame->parent < frame->commit->parent_count) {
+					parent = git_vector_get(&w->commits,
+						frame->commit->parent_indices[frame->parent++]);
+
+					if (parent->generating) {
+						giterr_set(GITERR_INVALID, "The commits form a cycle");
+						goto cleanup;
+					}
+
+					if (!parent->generation)
+						c = parent;
+					continue;
+				}
+
+				generation = 0;
+				for (j = 0; j < frame->commit->parent_count; ++j) {
+					parent = git_vector_get(&w->commits, frame->commit->parent_indices[j]);
+					if (parent->generation > generation)
+						generation = parent->generation;
+				}
+
+				if (generation < GIT_COMMIT_GRAPH_GENERATION_MAX)
+					generation++;
+
+				frame->commit->generation = generation;
+				frame->commit->generating = 0;
+				depth--;
+			}
+		}
+	}
+
+	error = 0;
+
+cleanup:
+	for (i = 0; i < depth; ++i)
+		stack[i].commit->generating = 0;
+
+	git__free(stack);
+	return error;
+}
+
+void git_commit_graph_writer_set_changed_paths(git_commit_graph_writer *w, int enabled)
+{
+	assert(w);
+	w->changed_paths = !!enabled;
+}
+
+struct bloom_changes {
+	git_repository *repo;
+	git_buf prefix;
+	git_pool pool;
+	git_vector paths;
+	size_t count;
+};
+
+static int bloom_diff_trees(struct bloom_changes *c, const git_oid *a, const git_oid *b);
+
+static int bloom_add_change(struct bloom_changes *c, const char *name)
+{
+	size_t prefix_len = c->prefix.size;
+	char *path;
+
+	c->count++;
+
+	if (git_buf_puts(&c->prefix, name) < 0)
+		return -1;
+
+	path = git_pool_strndup(&c->pool, c->prefix.ptr, c->prefix.size);
+	git_buf_truncate(&c->prefix, prefix_len);
+
+	if (path == NULL || git_vector_insert(&c->paths, path) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* One name from two trees, either of which may not have it */
+static int bloom_diff_entries(
+	struct bloom_changes *c, const git_tree_entry *a, const git_tree_entry *b)
+{
+	const char *name = git_tree_entry_name(b ? b : a);
+	bool tree_a = a && git_tree_entry_type(a) == GIT_OBJ_TREE;
+	bool tree_b = b && git_tree_entry_type(b) == GIT_OBJ_TREE;
+	size_t prefix_len = c->prefix.size;
+	int error = 0;
+
+	if (a && b && !git_oid_cmp(git_tree_entry_id(a), git_tree_entry_id(b)) &&
+		git_tree_entry_filemode(a) == git_tree_entry_filemode(b))
+		return 0;
+
+	if (tree_a || tree_b) {
+		if (git_buf_puts(&c->prefix, name) < 0 || git_buf_putc(&c->prefix, '/') < 0)
+			return -1;
+
+		error = bloom_diff_trees(c,
+			tree_a ? git_tree_entry_id(a) : NULL,
+			tree_b ? git_tree_entry_id(b) : NULL);
+
+		git_buf_truncate(&c->prefix, prefix_len);
+	}
+
+	/* a file on either side, even one replacing a folder, is a change */
+	if (!error && ((a && !tree_a) || (b && !tree_b)))
+		error = bloom_add_change(c, name);
+
+	return error;
+}
+
+/*
+ * Collect the files which differ between two trees, either of which
+ * can be NULL for the empty tree. Subtrees which are the same on both
+ * sides are skipped, and so is everything once there are too many
+ * changes for a filter to be of any use.
+ */
+static int bloom_diff_trees(struct bloom_changes *c, const git_oid *a, const git_oid *b)
+{
+	git_tree *tree_a = NULL, *tree_b = NULL;
+	const git_tree_entry *entry;
+	unsigned int i;
+	int error = 0;
+
+	if (c->count > COMMIT_GRAPH_BLOOM_MAX_CHANGES ||
+		(a == NULL && b == NULL) || (a != NULL && b != NULL && !git_oid_cmp(a, b)))
+		return 0;
+
+	if ((a != NULL && (error = git_tree_lookup(&tree_a, c->repo, a)) < 0) ||
+		(b != NULL && (error = git_tree_lookup(&tree_b, c->repo, b)) < 0))
+		goto cleanup;
+
+	for (i = 0; tree_b && i < git_tree_entrycount(tree_b) && !error; ++i) {
+		entry = git_tree_entry_byindex(tree_b, i);
+		error = bloom_diff_entries(c,
+			tree_a ? git_tree_entry_byname(tree_a, git_tree_entry_name(entry)) : NULL,
+			entry);
+	}
+
+	/* and what's only on the old side */
+	for (i = 0; tree_a && i < git_tree_entrycount(tree_a) && !error; ++i) {
+		entry = git_tree_entry_byindex(tree_a, i);
+		if (tree_b == NULL || git_tree_entry_byname(tree_b, git_tree_entry_name(entry)) == NULL)
+			error = bloom_diff_entries(c, entry, NULL);
+	}
+
+cleanup:
+	git_tree_free(tree_a);
+	git_tree_free(tree_b);
+	return error;
+}
+
+/*
+ * Build the filter of the paths a commit changes compared to its
+ * first parent: each changed file, and each folder leading to one.
+ */
+static int writer_compute_bloom(
+	git_commit_graph_writer *w, struct bloom_changes *c, struct packed_commit *p)
+{
+	struct packed_commit *parent = NULL;
+	git_commit_graph_bloom_key key;
+	size_t i, j, n;
+	const char *path;
+	char *folder;
+	int error;
+
+	git_buf_clear(&c->prefix);
+	git_vector_clear(&c->paths);
+	git_pool_clear(&c->pool);
+	c->count = 0;
+
+	if (p->parent_count > 0)
+		parent = kh_value(w->commit_ix, kh_get(oid, w->commit_ix, &p->parents[0]));
+
+	if ((error = bloom_diff_trees(c, parent ? &parent->tree_oid : NULL, &p->tree_oid)) < 0)
+		return error;
+
+	if (c->count > COMMIT_GRAPH_BLOOM_MAX_CHANGES) {
+		/* every bit set: "maybe" for any path */
+		p->bloom_len = 1;
+		p->bloom = git__malloc(1);
+		GITERR_CHECK_ALLOC(p->bloom);
+		p->bloom[0] = 0xff;
+		return 0;
+	}
+
+	n = c->paths.length;
+	for (i = 0; i < n; ++i) {
+		path = git_vector_get(&c->paths, i);
+
+		for (j = 0; path[j]; ++j) {
+			if (path[j] != '/')
+				continue;
+
+			if ((folder = git_pool_strndup(&c->pool, path, j)) == NULL ||
+				git_vector_insert(&c->paths, folder) < 0)
+				return -1;
+		}
+	}
+
+	git_vector_uniq(&c->paths);
+
+	/* an empty filter still takes a byte, so it isn't taken for a missing one */
+	p->bloom_len = (c->paths.length * COMMIT_GRAPH_BLOOM_BITS_PER_ENTRY + 7) / 8;
+	if (p->bloom_len == 0)
+		p->bloom_len = 1;
+
+	p->bloom = git__calloc(p->bloom_len, 1);
+	GITERR_CHECK_ALLOC(p->bloom);
+
+	git_vector_foreach(&c->paths, i, path) {
+		bloom_key_fill(&key, COMMIT_GRAPH_BLOOM_VERSION,
+			COMMIT_GRAPH_BLOOM_NUM_HASHES, path, strlen(path));
+		bloom_filter_add(p->bloom, p->bloom_len, &key, COMMIT_GRAPH_BLOOM_NUM_HASHES);
+	}
+
+	return 0;
+}
+
+/*
+ * Fill in the filter of each commit, taking those the old file already
+ * has when they were built the same way, so that only the new commits
+ * cost us any tree reads.
+ */
+static int writer_prepare_bloom(git_commit_graph_writer *w, const git_commit_graph_file *previous)
+{
+	struct bloom_changes c;
+	struct packed_commit *p;
+	const unsigned char *filter;
+	git_commit_graph_entry entry;
+	size_t i, len;
+	int error = 0;
+
+	if (previous != NULL && previous->bloom_data != NULL &&
+		(previous->bloom_version != COMMIT_GRAPH_BLOOM_VERSION ||
+		 previous->bloom_num_hashes != COMMIT_GRAPH_BLOOM_NUM_HASHES ||
+		 previous->bloom_bits_per_entry != COMMIT_GRAPH_BLOOM_BITS_PER_ENTRY))
+		previous = NULL;
+
+	memset(&c, 0, sizeof(c));
+	c.repo = w->repo;
+
+	if (git_pool_init(&c.pool, 1, 0) < 0 ||
+		git_vector_init(&c.paths, 0, git__strcmp_cb) < 0)
+		return -1;
+
+	git_vector_foreach(&w->commits, i, p) {
+		if (p->bloom != NULL)
+			continue;
+
+		if (previous != NULL &&
+			!git_commit_graph_entry_find(&entry, previous, &p->sha1, GIT_OID_HEXSZ) &&
+			(filter = commit_graph_bloom_filter(&len, previous, entry.index)) != NULL) {
+			if ((p->bloom = git__malloc(len)) == NULL) {
+				error = -1;
+				break;
+			}
+
+			memcpy(p->bloom, filter, len);
+			p->bloom_len = len;
+			continue;
+		}
+
+		if ((error = writer_compute_bloom(w, &c, p)) < 0)
+			break;
+	}
+
+	git_buf_free(&c.prefix);
+	git_vector_free(&c.paths);
+	git_pool_clear(&c.pool);
+	return error;
+}
+
+static int commit_graph_write_chunk_header(git_buf *buf, uint32_t id, uint64_t offset)
+{
+	unsigned char hdr[COMMIT_GRAPH_CHUNK_ENTRY_SIZE];
+
+	put_be32(hdr, id);
+	put_be64(hdr + 4, offset);
+	return git_buf_put(buf, (const char *)hdr, sizeof(hdr));
+}
+
+static int commit_graph_write_buf(
+	git_buf *buf,
+	git_commit_graph_writer *w,
+	const git_commit_graph_file *previous,
+	bool changed_paths)
+{
+	git_buf oids = GIT_BUF_INIT, data = GIT_BUF_INIT, edges = GIT_BUF_INIT,
+		bloom_index = GIT_BUF_INIT, bloom_data = GIT_BUF_INIT;
+	unsigned char be[8];
+	uint32_t fanout[256] = {0};
+	struct packed_commit *p;
+	size_t i, j, num_chunks;
+	uint64_t offset;
+	git_oid checksum;
+	int error;
+
+	if ((error = writer_prepare(w)) < 0 ||
+		(changed_paths && (error = writer_prepare_bloom(w, previous)) < 0))
+		return error;
+
+	if (changed_paths) {
+		put_be32(be, COMMIT_GRAPH_BLOOM_VERSION);
+		put_be32(be + 4, COMMIT_GRAPH_BLOOM_NUM_HASHES);
+		git_buf_put(&bloom_data, (const char *)be, 8);
+		put_be32(be, COMMIT_GRAPH_BLOOM_BITS_PER_ENTRY);
+		git_buf_put(&bloom_data, (const char *)be, 4);
+	}
+
+	git_vector_foreach(&w->commits, i, p) {
+		uint32_t parent1 = COMMIT_GRAPH_PARENT_NONE, parent2 = COMMIT_GRAPH_PARENT_NONE;
+		uint64_t commit_time = (uint64_t)p->commit_time & 0x3ffffffffULL;
+
+		git_buf_put(&oids, (const char *)p->sha1.id, GIT_OID_RAWSZ);
+
+		if (p->parent_count > 0)
+			parent1 = p->parent_indices[0];
+
+		if (p->parent_count == 2) {
+			parent2 = p->parent_indices[1];
+		} else if (p->parent_count > 2) {
+			parent2 = COMMIT_GRAPH_EXTRA_EDGES | (uint32_t)(edges.size / 4);
+
+			for (j = 1; j < p->parent_count; ++j) {
+				uint32_t edge = p->parent_indices[j];
+
+				if (j == p->parent_count - 1)
+					edge |= COMMIT_GRAPH_LAST_EDGE;
+
+				put_be32(be, edge);
+				git_buf_put(&edges, (const char *)be, 4);
+			}
+		}
+
+		git_buf_put(&data, (const char *)p->tree_oid.id, GIT_OID_RAWSZ);
+		put_be32(be, parent1);
+		put_be32(be + 4, parent2);
+		git_buf_put(&data, (const char *)be, 8);
+		put_be64(be, ((uint64_t)p->generation << 34) | commit_time);
+		git_buf_put(&data, (const char *)be, 8);
+
+		if (changed_paths) {
+			git_buf_put(&bloom_data, (const char *)p->bloom, p->bloom_len);
+			put_be32(be, (uint32_t)(bloom_data.size - COMMIT_GRAPH_BLOOM_HEADER_SIZE));
+			git_buf_put(&bloom_index, (const char *)be, 4);
+		}
+
+		fanout[p->sha1.id[0]]++;
+	}
+
+	for (i = 1; i < 256; ++i)
+		fanout[i] += fanout[i - 1];
+
+	if (git_buf_oom(&oids) || git_buf_oom(&data) || git_buf_oom(&edges) ||
+		git_buf_oom(&bloom_index) || git_buf_oom(&bloom_data)) {
+		error = -1;
+		goto cleanup;
+	}
+
+	num_chunks = 3 + (edges.size ? 1 : 0) + (changed_paths ? 2 : 0);
+
+	/* header */
+	put_be32(be, COMMIT_GRAPH_SIGNATURE);
+	be[4] = COMMIT_GRAPH_VERSION;
+	be[5] = COMMIT_GRAPH_OBJECT_ID_VERSION;
+	be[6] = (unsigned char)num_chunks;
+	be[7] = 0; /* no base commit-graphs */
+	git_buf_put(buf, (const char *)be, 8);
+
+	/* chunk table */
+	offset = COMMIT_GRAPH_HEADER_SIZE + (num_chunks + 1) * COMMIT_GRAPH_CHUNK_ENTRY_SIZE;
+
+	commit_graph_write_chunk_header(buf, COMMIT_GRAPH_OID_FANOUT_ID, offset);
+	offset += COMMIT_GRAPH_FANOUT_SIZE;
+	commit_graph_write_chunk_header(buf, COMMIT_GRAPH_OID_LOOKUP_ID, offset);
+	offset += oids.size;
+	commit_graph_write_chunk_header(buf, COMMIT_GRAPH_COMMIT_DATA_ID, offset);
+	offset += data.size;
+	if (edges.size) {
+		commit_graph_write_chunk_header(buf, COMMIT_GRAPH_EXTRA_EDGE_LIST_ID, offset);
+		offset += edges.size;
+	}
+	if (changed_paths) {
+		commit_graph_write_chunk_header(buf, COMMIT_GRAPH_BLOOM_INDEX_ID, offset);
+		offset += bloom_index.size;
+		commit_graph_write_chunk_header(buf, COMMIT_GRAPH_BLOOM_DATA_ID, offset);
+		offset += bloom_data.size;
+	}
+	commit_graph_write_chunk_header(buf, 0, offset);
+
+	/* chunks */
+	for (i = 0; i < 256; ++i) {
+		put_be32(be, fanout[i]);
+		git_buf_put(buf, (const char *)be, 4);
+	}
+	git_buf_put(buf, oids.ptr, oids.size);
+	git_buf_put(buf, data.ptr, data.size);
+	git_buf_put(buf, edges.ptr, edges.size);
+	git_buf_put(buf, bloom_index.ptr, bloom_index.size);
+	git_buf_put(buf, bloom_data.ptr, bloom_data.size);
+
+	if (git_buf_oom(buf)) {
+		error = -1;
+		goto cleanup;
+	}
+
+	/* trailer */
+	git_hash_buf(&checksum, buf->ptr, buf->size);
+	error = git_buf_put(buf, (const char *)checksum.id, GIT_OID_RAWSZ);
+
+cleanup:
+	git_buf_free(&oids);
+	git_buf_free(&data);
+	git_buf_free(&edges);
+	git_buf_free(&bloom_index);
+	git_buf_free(&bloom_data);
+	return error;
+}
+
+int git_commit_graph_writer_commit(git_commit_graph_writer *w)
+{
+	git_buf path = GIT_BUF_INIT, contents = GIT_BUF_INIT;
+	git_filebuf output = GIT_FILEBUF_INIT;
+	git_commit_graph_file *previous = NULL;
+	bool changed_paths;
+	int error;
+
+	assert(w);
+
+	if ((error = git_buf_joinpath(&path, git_buf_cstr(&w->objects_info_dir), "commit-graph")) < 0)
+		goto cleanup;
+
+	/* the file we replace may have filters we can reuse; if it's
+	 * missing or broken, there's simply nothing to reuse */
+	if (w->changed_paths != 0 && git_commit_graph_open(&previous, git_buf_cstr(&path)) < 0)
+		giterr_clear();
+
+	changed_paths = w->changed_paths > 0 ||
+		(w->changed_paths < 0 && previous != NULL && previous->bloom_data != NULL);
+
+	error = commit_graph_write_buf(&contents, w, previous, changed_paths);
+
+	git_commit_graph_free(previous);
+
+	if (error < 0)
+		goto cleanup;
+
+	if ((error = git_futils_mkdir_r(git_buf_cstr(&w->objects_info_dir), NULL, GIT_OBJECT_DIR_MODE)) < 0 ||
+		(error = git_filebuf_open(&output, git_buf_cstr(&path), 0)) < 0)
+		goto cleanup;
+
+	if ((error = git_filebuf_write(&output, contents.ptr, contents.size)) < 0) {
+		git_filebuf_cleanup(&output);
+		goto cleanup;
+	}
+
+	error = git_filebuf_commit(&output, GIT_PACK_FILE_MODE);
+
+cleanup:
+	git_buf_free(&path);
+	git_buf_free(&contents);
+	return error;
+}
+
+void git_commit_graph_writer_free(git_commit_graph_writer *w)
+{
+	struct packed_commit *p;
+	unsigned int i;
+
+	if (w == NULL)
+		return;
+
+	git_vector_foreach(&w->commits, i, p)
+		packed_commit_free(p);
+
+	git_vector_free(&w->commits);
+	git_oidmap_free(w->commit_ix);
+	git_buf_free(&w->objects_info_dir);
+	git__free(w);
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_commit_graph_h__
+#define INCLUDE_commit_graph_h__
+
+#include "git2/commit_graph.h"
+#include "git2/oid.h"
+
+#include "common.h"
+#include "fileops.h"
+#include "map.h"
+#include "thread-utils.h"
+
+#define GIT_COMMIT_GRAPH_FILE "info/commit-graph"
+
+/* generation numbers are stored in 30 bits */
+#define GIT_COMMIT_GRAPH_GENERATION_MAX 0x3fffffff
+
+/* the most hash functions a changed-path filter may use */
+#define GIT_COMMIT_GRAPH_BLOOM_MAX_HASHES 32
+
+/*
+ * A commit-graph file, as written by `git commit-graph write`: the
+ * parents, root tree, commit time and generation number of a set of
+ * commits, so that walking history needs no commit to be parsed.
+ *
+ * Like the multi-pack index, the file is a header, a table of chunks
+ * and a trailing SHA1. We understand the OID fanout, OID lookup,
+ * commit data and extra edges chunks.
+ */
+typedef struct git_commit_graph_file {
+	git_atomic refcount;
+	git_map graph_map;
+
+	/* the fanout table of commit names, in network order */
+	const uint32_t *oid_fanout;
+	uint32_t num_commits;
+
+	/* the sorted commit names */
+	const unsigned char *oid_lookup;
+
+	/* tree, parents, generation and time of every commit */
+	const unsigned char *commit_data;
+
+	/* the parents of octopus merges beyond the first, in network order */
+	const uint32_t *extra_edge_list;
+	size_t num_extra_edge_list;
+
+	/* the optional changed-path Bloom filters: the end of each
+	 * commit's filter, in network order, then the filters */
+	const uint32_t *bloom_index;
+	const unsigned char *bloom_data;
+	size_t bloom_data_len;
+	uint32_t bloom_version;
+	uint32_t bloom_num_hashes;
+	uint32_t bloom_bits_per_entry;
+
+	git_futils_filestamp stamp;
+	char *filename;
+} git_commit_graph_file;
+
+typedef struct git_commit_graph_entry {
+	git_oid sha1;
+	git_oid tree_oid;
+
+	/* one more than the highest generation of the parents */
+	uint32_t generation;
+	git_time_t commit_time;
+
+	size_t parent_count;
+	uint32_t parent_indices[2];
+
+	/* the rest of the parents of an octopus merge, in the extra edges */
+	size_t extra_parents_index;
+
+	/* the position of the commit in the file */
+	uint32_t index;
+} git_commit_graph_entry;
+
+/*
+ * Map and validate the commit-graph at `path`. Returns GIT_ENOTFOUND
+ * when there is no such file.
+ *
+ * The trailing checksum is not verified, as that would mean reading
+ * the whole file up front; everything we use from it is checked.
+ */
+int git_commit_graph_open(git_commit_graph_file **file_out, const char *path);
+
+/*
+ * Whether the file backing `file` has been replaced or removed
+ * since it was opened.
+ */
+bool git_commit_graph_needs_refresh(git_commit_graph_file *file);
+
+/*
+ * Find a commit given a prefix of its name. Returns GIT_ENOTFOUND
+ * or GIT_EAMBIGUOUS without setting an error message, since the
+ * caller usually has other places to look.
+ */
+int git_commit_graph_entry_find(
+	git_commit_graph_entry *e,
+	const git_commit_graph_file *file,
+	const git_oid *short_oid,
+	size_t len);
+
+/* Load the `n`th parent of a commit */
+int git_commit_graph_entry_parent(
+	git_commit_graph_entry *parent,
+	const git_commit_graph_file *file,
+	const git_commit_graph_entry *entry,
+	size_t n);
+
+/* The positions a path sets in a changed-path filter */
+typedef struct git_commit_graph_bloom_key {
+	uint32_t hashes[GIT_COMMIT_GRAPH_BLOOM_MAX_HASHES];
+} git_commit_graph_bloom_key;
+
+/*
+ * Work out the key of a path, for the filters of `file`, which
+ * must have some.
+ */
+void git_commit_graph_bloom_key_init(
+	git_commit_graph_bloom_key *key,
+	const git_commit_graph_file *file,
+	const char *path,
+	size_t len);
+
+/*
+ * Whether a commit may have changed a path compared to its first
+ * parent, given the keys of the path and of each of the folders
+ * leading to it. Returns 1 if it may have, 0 if it certainly has
+ * not, and GIT_ENOTFOUND if there is no filter for the commit.
+ */
+int git_commit_graph_bloom_maybe_changed(
+	const git_commit_graph_file *file,
+	const git_oid *commit,
+	const git_commit_graph_bloom_key *keys,
+	size_t keys_len);
+
+/* Take another reference to the file; `git_commit_graph_free` drops one */
+void git_commit_graph_incref(git_commit_graph_file *file);
+
+void git_commit_graph_free(git_commit_graph_file *file);
+
+#endif
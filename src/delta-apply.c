@@ -36,8 +36,26 @@ static int hdr_sz(
 	return 0;
 }
 
-int git__delta_apply(
-	git_rawobj *out,
+int git__delta_read_header(
+	const unsigned char *delta,
+	size_t delta_len,
+	size_t *base_sz,
+	size_t *res_sz)
+{
+	const unsigned char *delta_end = delta + delta_len;
+
+	if ((hdr_sz(base_sz, &delta, delta_end) < 0) ||
+		(hdr_sz(res_sz, &delta, delta_end) < 0)) {
+		giterr_set(GITERR_INVALID, "Failed to apply delta. Delta header is corrupted");
+		return -1;
+	}
+
+	return 0;
+}
+
+int git__delta_apply_to(
+	unsigned char *res_dp,
+	size_t res_len,
 	const unsigned char *base,
 	size_t base_len,
 	const unsigned char *delta,
@@ -45,7 +63,6 @@ int git__delta_apply(
 {
 	const unsigned char *delta_end = delta + delta_len;
 	size_t base_sz, res_sz;
-	unsigned char *res_dp;
 
 	/* Check that the base size matches the data we were given;
 	 * if not we would underflow while accessing data from the
@@ -56,17 +73,12 @@ int git__delta_apply(
 		return -1;
 	}
 
-	if (hdr_sz(&res_sz, &delta, delta_end) < 0) {
+	if (hdr_sz(&res_sz, &delta, delta_end) < 0 || res_sz != res_len) {
 		giterr_set(GITERR_INVALID, "Failed to apply delta. Base size does not match given data");
 		return -1;
 	}
 
-	res_dp = git__malloc(res_sz + 1);
-	GITERR_CHECK_ALLOC(res_dp);
-
 	res_dp[res_sz] = '\0';
-	out->data = res_dp;
-	out->len = res_sz;
 
 	while (delta < delta_end) {
 		unsigned char cmd = *delta++;
@@ -114,8 +126,32 @@ int git__delta_apply(
 	return 0;
 
 fail:
-	git__free(out->data);
-	out->data = NULL;
 	giterr_set(GITERR_INVALID, "Failed to apply delta");
 	return -1;
 }
+
+int git__delta_apply(
+	git_rawobj *out,
+	const unsigned char *base,
+	size_t base_len,
+	const unsigned char *delta,
+	size_t delta_len)
+{
+	size_t base_sz, res_sz;
+	unsigned char *res_dp;
+
+	if (git__delta_read_header(delta, delta_len, &base_sz, &res_sz) < 0)
+		return -1;
+
+	res_dp = git__malloc(res_sz + 1);
+	GITERR_CHECK_ALLOC(res_dp);
+
+	if (git__delta_apply_to(res_dp, res_sz, base, base_len, delta, delta_len) < 0) {
+		git__free(res_dp);
+		return -1;
+	}
+
+	out->data = res_dp;
+	out->len = res_sz;
+	return 0;
+}
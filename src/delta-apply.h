@@ -30,4 +30,43 @@ extern int git__delta_apply(
 	const unsigned char *delta,
 	size_t delta_len);
 
+/**
+ * Read the header of a git binary delta.
+ *
+ * @param delta the delta to read the header from.
+ * @param delta_len total number of bytes available at delta.
+ * @param base_sz receives the size of the base the delta applies to.
+ * @param res_sz receives the size of the result of the delta.
+ * @return
+ * - 0 on a successful read.
+ * - GIT_ERROR if the header is truncated or corrupt.
+ */
+extern int git__delta_read_header(
+	const unsigned char *delta,
+	size_t delta_len,
+	size_t *base_sz,
+	size_t *res_sz);
+
+/**
+ * Apply a git binary delta into a caller-provided buffer.
+ *
+ * @param res_dp buffer of at least res_len + 1 bytes to receive
+ *		the original data; it will be NUL-terminated.
+ * @param res_len the result size, as read from the delta header.
+ * @param base the base to copy from during copy instructions.
+ * @param base_len number of bytes available at base.
+ * @param delta the delta to execute copy/insert instructions from.
+ * @param delta_len total number of bytes in the delta.
+ * @return
+ * - 0 on a successful delta unpack.
+ * - GIT_ERROR if the delta is corrupt or doesn't match the base.
+ */
+extern int git__delta_apply_to(
+	unsigned char *res_dp,
+	size_t res_len,
+	const unsigned char *base,
+	size_t base_len,
+	const unsigned char *delta,
+	size_t delta_len);
+
 #endif
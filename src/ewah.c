@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "ewah.h"
+
+/*
+ * A marker word (RLW, for "running length word") is laid out as:
+ *
+ *   bit 0       the bit the run is made of
+ *   bits 1-32   the number of words in the run
+ *   bits 33-63  the number of literal words following the marker
+ */
+#define RLW_RUNNING_BITS 32
+#define RLW_LITERAL_BITS 31
+
+#define RLW_MAX_RUN (((git_eword)1 << RLW_RUNNING_BITS) - 1)
+#define RLW_MAX_LITERALS (((git_eword)1 << RLW_LITERAL_BITS) - 1)
+
+#define rlw_run_bit(w) ((int)((w) & 1))
+#define rlw_run_len(w) (((w) >> 1) & RLW_MAX_RUN)
+#define rlw_literals(w) ((w) >> (1 + RLW_RUNNING_BITS))
+
+GIT_INLINE(git_eword) rlw_make(int bit, git_eword run, git_eword literals)
+{
+	return (git_eword)(bit & 1) | (run << 1) | (literals << (1 + RLW_RUNNING_BITS));
+}
+
+/***********************************************************
+ *
+ * UNCOMPRESSED BITMAPS
+ *
+ ***********************************************************/
+
+static int bitmap_grow(git_bitmap *b, size_t words)
+{
+	git_eword *grown;
+	size_t alloc;
+
+	if (words <= b->word_alloc)
+		return 0;
+
+	alloc = b->word_alloc * 3 / 2;
+	if (alloc < words)
+		alloc = words;
+
+	grown = git__realloc(b->words, alloc * sizeof(git_eword));
+	GITERR_CHECK_ALLOC(grown);
+
+	memset(grown + b->word_alloc, 0x0, (alloc - b->word_alloc) * sizeof(git_eword));
+
+	b->words = grown;
+	b->word_alloc = alloc;
+	return 0;
+}
+
+int git_bitmap_set(git_bitmap *b, size_t pos)
+{
+	size_t block = pos / GIT_EWORD_BITS;
+
+	if (bitmap_grow(b, block + 1) < 0)
+		return -1;
+
+	b->words[block] |= (git_eword)1 << (pos % GIT_EWORD_BITS);
+	return 0;
+}
+
+bool git_bitmap_get(const git_bitmap *b, size_t pos)
+{
+	size_t block = pos / GIT_EWORD_BITS;
+
+	return block < b->word_alloc &&
+		((b->words[block] >> (pos % GIT_EWORD_BITS)) & 1) != 0;
+}
+
+void git_bitmap_clear(git_bitmap *b)
+{
+	if (b->words)
+		memset(b->words, 0x0, b->word_alloc * sizeof(git_eword));
+}
+
+void git_bitmap_free(git_bitmap *b)
+{
+	git__free(b->words);
+	b->words = NULL;
+	b->word_alloc = 0;
+}
+
+int git_bitmap_or(git_bitmap *b, const git_bitmap *other)
+{
+	size_t i;
+
+	if (bitmap_grow(b, other->word_alloc) < 0)
+		return -1;
+
+	for (i = 0; i < other->word_alloc; ++i)
+		b->words[i] |= other->words[i];
+
+	return 0;
+}
+
+void git_bitmap_and_not(git_bitmap *b, const git_bitmap *other)
+{
+	size_t i, len = min(b->word_alloc, other->word_alloc);
+
+	for (i = 0; i < len; ++i)
+		b->words[i] &= ~other->words[i];
+}
+
+size_t git_bitmap_popcount(const git_bitmap *b)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < b->word_alloc; ++i) {
+		git_eword word = b->words[i];
+
+		while (word) {
+			word &= word - 1;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+int git_bitmap_foreach(
+	const git_bitmap *b,
+	int (*cb)(size_t pos, void *payload),
+	void *payload)
+{
+	size_t i, bit;
+	int error;
+
+	for (i = 0; i < b->word_alloc; ++i) {
+		git_eword word = b->words[i];
+
+		for (bit = 0; word != 0; ++bit, word >>= 1) {
+			if ((word & 1) &&
+				(error = cb(i * GIT_EWORD_BITS + bit, payload)) != 0)
+				return error;
+		}
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ *
+ * EWAH BITMAPS
+ *
+ ***********************************************************/
+
+static int ewah_push(git_ewah *e, git_eword word)
+{
+	if (e->buffer_size == e->alloc_size) {
+		size_t alloc = e->alloc_size * 3 / 2 + 8;
+		git_eword *buffer = git__realloc(e->buffer, alloc * sizeof(git_eword));
+		GITERR_CHECK_ALLOC(buffer);
+
+		e->buffer = buffer;
+		e->alloc_size = alloc;
+	}
+
+	e->buffer[e->buffer_size++] = word;
+	return 0;
+}
+
+static int ewah_new_marker(git_ewah *e)
+{
+	if (ewah_push(e, 0) < 0)
+		return -1;
+
+	e->rlw = e->buffer_size - 1;
+	return 0;
+}
+
+git_ewah *git_ewah_new(void)
+{
+	git_ewah *e = git__calloc(1, sizeof(git_ewah));
+
+	if (e == NULL || ewah_new_marker(e) < 0) {
+		git__free(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+void git_ewah_free(git_ewah *e)
+{
+	if (e == NULL)
+		return;
+
+	git__free(e->buffer);
+	git__free(e);
+}
+
+static int ewah_add_empty_words(git_ewah *e, int bit, size_t count)
+{
+	e->bit_size += count * GIT_EWORD_BITS;
+
+	while (count > 0) {
+		git_eword rlw = e->buffer[e->rlw];
+		git_eword run = rlw_run_len(rlw);
+
+		/* runs can only grow while no literals follow them */
+		if (rlw_literals(rlw) == 0 && run < RLW_MAX_RUN &&
+			(run == 0 || rlw_run_bit(rlw) == bit)) {
+			git_eword n = min((git_eword)count, RLW_MAX_RUN - run);
+
+			e->buffer[e->rlw] = rlw_make(bit, run + n, 0);
+			count -= (size_t)n;
+			continue;
+		}
+
+		if (ewah_new_marker(e) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int ewah_add_literal(git_ewah *e, git_eword word)
+{
+	git_eword rlw = e->buffer[e->rlw];
+
+	e->bit_size += GIT_EWORD_BITS;
+
+	if (rlw_literals(rlw) == RLW_MAX_LITERALS) {
+		if (ewah_new_marker(e) < 0)
+			return -1;
+
+		rlw = 0;
+	}
+
+	e->buffer[e->rlw] = rlw_make(
+		rlw_run_bit(rlw), rlw_run_len(rlw), rlw_literals(rlw) + 1);
+
+	return ewah_push(e, word);
+}
+
+git_ewah *git_ewah_from_bitmap(const git_bitmap *b)
+{
+	git_ewah *e;
+	size_t i, zeroes = 0;
+	int error = 0;
+
+	if ((e = git_ewah_new()) == NULL)
+		return NULL;
+
+	for (i = 0; i < b->word_alloc && !error; ++i) {
+		git_eword word = b->words[i];
+
+		/* zeroes are only added once we know they're not trailing */
+		if (word == 0) {
+			zeroes++;
+			continue;
+		}
+
+		if (zeroes > 0)
+			error = ewah_add_empty_words(e, 0, zeroes);
+		zeroes = 0;
+
+		if (error < 0)
+			break;
+
+		if (word == ~(git_eword)0)
+			error = ewah_add_empty_words(e, 1, 1);
+		else
+			error = ewah_add_literal(e, word);
+	}
+
+	if (error < 0) {
+		git_ewah_free(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+static int bitmap_apply_ewah(git_bitmap *b, const git_ewah *e, bool xor)
+{
+	size_t i = 0, pos = 0, k;
+
+	while (i < e->buffer_size) {
+		git_eword rlw = e->buffer[i++];
+		size_t run = (size_t)rlw_run_len(rlw);
+		size_t literals = (size_t)rlw_literals(rlw);
+
+		if ((literals > 0 || rlw_run_bit(rlw)) &&
+			bitmap_grow(b, pos + run + literals) < 0)
+			return -1;
+
+		if (rlw_run_bit(rlw)) {
+			for (k = 0; k < run; ++k) {
+				if (xor)
+					b->words[pos + k] = ~b->words[pos + k];
+				else
+					b->words[pos + k] = ~(git_eword)0;
+			}
+		}
+
+		pos += run;
+
+		for (k = 0; k < literals; ++k, ++pos) {
+			if (xor)
+				b->words[pos] ^= e->buffer[i++];
+			else
+				b->words[pos] |= e->buffer[i++];
+		}
+	}
+
+	return 0;
+}
+
+int git_bitmap_or_ewah(git_bitmap *b, const git_ewah *e)
+{
+	return bitmap_apply_ewah(b, e, false);
+}
+
+int git_bitmap_xor_ewah(git_bitmap *b, const git_ewah *e)
+{
+	return bitmap_apply_ewah(b, e, true);
+}
+
+GIT_INLINE(uint32_t) get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+GIT_INLINE(git_eword) get_be64(const unsigned char *p)
+{
+	return ((git_eword)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+GIT_INLINE(void) put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static int ewah_error_corrupt(git_ewah *e)
+{
+	git_ewah_free(e);
+	giterr_set(GITERR_ODB, "Corrupted EWAH bitmap");
+	return -1;
+}
+
+int git_ewah_read(
+	git_ewah **out,
+	size_t *read_out,
+	const unsigned char *data,
+	size_t len,
+	size_t max_bits)
+{
+	git_ewah *e = NULL;
+	uint32_t bit_size, words, rlw, i;
+	size_t max_words, expanded = 0, last_marker = 0;
+
+	/* bit count, word count, at least one word, marker position */
+	if (len < 4 + 4 + 8 + 4)
+		return ewah_error_corrupt(NULL);
+
+	bit_size = get_be32(data);
+	words = get_be32(data + 4);
+
+	if (bit_size > max_bits || words == 0 || words > (len - 12) / 8)
+		return ewah_error_corrupt(NULL);
+
+	rlw = get_be32(data + 8 + (size_t)words * 8);
+
+	e = git__calloc(1, sizeof(git_ewah));
+	GITERR_CHECK_ALLOC(e);
+
+	e->buffer = git__malloc((size_t)words * sizeof(git_eword));
+	if (!e->buffer) {
+		git__free(e);
+		giterr_set_oom();
+		return -1;
+	}
+
+	e->buffer_size = e->alloc_size = words;
+	e->bit_size = bit_size;
+
+	for (i = 0; i < words; ++i)
+		e->buffer[i] = get_be64(data + 8 + (size_t)i * 8);
+
+	/* make sure the markers add up before anybody walks them */
+	max_words = (bit_size + GIT_EWORD_BITS - 1) / GIT_EWORD_BITS;
+
+	for (i = 0; i < words; ) {
+		git_eword marker = e->buffer[i];
+		git_eword run = rlw_run_len(marker), literals = rlw_literals(marker);
+
+		if (literals > words - i - 1 ||
+			run > max_words - expanded ||
+			literals > max_words - expanded - run)
+			return ewah_error_corrupt(e);
+
+		expanded += (size_t)(run + literals);
+		last_marker = i;
+		i += 1 + (uint32_t)literals;
+	}
+
+	if (rlw != last_marker)
+		return ewah_error_corrupt(e);
+
+	e->rlw = last_marker;
+
+	*out = e;
+	*read_out = 4 + 4 + (size_t)words * 8 + 4;
+	return 0;
+}
+
+int git_ewah_serialize(git_buf *out, const git_ewah *e)
+{
+	unsigned char word[8];
+	size_t i;
+
+	put_be32(word, (uint32_t)e->bit_size);
+	put_be32(word + 4, (uint32_t)e->buffer_size);
+	git_buf_put(out, (const char *)word, 8);
+
+	for (i = 0; i < e->buffer_size; ++i) {
+		put_be32(word, (uint32_t)(e->buffer[i] >> 32));
+		put_be32(word + 4, (uint32_t)e->buffer[i]);
+		git_buf_put(out, (const char *)word, 8);
+	}
+
+	put_be32(word, (uint32_t)e->rlw);
+	git_buf_put(out, (const char *)word, 4);
+
+	return git_buf_oom(out) ? -1 : 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_ewah_h__
+#define INCLUDE_ewah_h__
+
+#include "common.h"
+#include "buffer.h"
+
+typedef uint64_t git_eword;
+
+#define GIT_EWORD_BITS 64
+
+/*
+ * A plain, uncompressed bitmap which grows as bits get set. This is
+ * what we compute with; `git_ewah` is what we store.
+ */
+typedef struct {
+	git_eword *words;
+	size_t word_alloc;
+} git_bitmap;
+
+#define GIT_BITMAP_INIT {NULL, 0}
+
+int git_bitmap_set(git_bitmap *b, size_t pos);
+bool git_bitmap_get(const git_bitmap *b, size_t pos);
+void git_bitmap_clear(git_bitmap *b);
+void git_bitmap_free(git_bitmap *b);
+
+int git_bitmap_or(git_bitmap *b, const git_bitmap *other);
+
+/* Remove from `b` every bit set in `other` */
+void git_bitmap_and_not(git_bitmap *b, const git_bitmap *other);
+
+size_t git_bitmap_popcount(const git_bitmap *b);
+
+/*
+ * Call `cb` with the position of every bit set in `b`, in order. A
+ * non-zero return from the callback stops the iteration and is
+ * returned.
+ */
+int git_bitmap_foreach(
+	const git_bitmap *b,
+	int (*cb)(size_t pos, void *payload),
+	void *payload);
+
+/*
+ * An EWAH (Enhanced Word-Aligned Hybrid) compressed bitmap, as used
+ * by the `.bitmap` files of packs. The buffer is a sequence of marker
+ * words, each followed by the literal words it announces: a marker
+ * holds a run of identical (all zero or all one) words, then the
+ * number of literal words which come after it.
+ *
+ * Bitmaps can only be built by appending words at the end.
+ */
+typedef struct {
+	git_eword *buffer;
+	size_t buffer_size;
+	size_t alloc_size;
+
+	/* where the last marker is */
+	size_t rlw;
+
+	size_t bit_size;
+} git_ewah;
+
+git_ewah *git_ewah_new(void);
+void git_ewah_free(git_ewah *e);
+
+/* Compress a bitmap, dropping its trailing zero words */
+git_ewah *git_ewah_from_bitmap(const git_bitmap *b);
+
+int git_bitmap_or_ewah(git_bitmap *b, const git_ewah *e);
+int git_bitmap_xor_ewah(git_bitmap *b, const git_ewah *e);
+
+/*
+ * Read a bitmap serialized at `data`, as written by `git_ewah_serialize`.
+ * The number of bytes it took is stored in `read_out`. Bitmaps whose
+ * markers don't add up, or which would expand beyond `max_bits`, are
+ * rejected.
+ */
+int git_ewah_read(
+	git_ewah **out,
+	size_t *read_out,
+	const unsigned char *data,
+	size_t len,
+	size_t max_bits);
+
+int git_ewah_serialize(git_buf *out, const git_ewah *e);
+
+#endif
@@ -85,7 +85,11 @@ static int _tls_init = 0;
 
 static void cb__free_status(void *st)
 {
-	git__free(st);
+	git_global_st *state = st;
+
+	/* the last error of a thread which is going away */
+	git__free(state->error_t.message);
+	git__free(state);
 }
 
 void git_threads_init(void)
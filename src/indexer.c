@@ -10,6 +10,7 @@
 #include "git2/indexer.h"
 #include "git2/object.h"
 #include "git2/oid.h"
+#include "git2/odb.h"
 
 #include "common.h"
 #include "pack.h"
@@ -18,9 +19,26 @@
 #include "pack.h"
 #include "filebuf.h"
 #include "sha1.h"
+#include "hash.h"
+#include "compress.h"
+#include "delta-apply.h"
+#include "thread-utils.h"
 
 #define UINT31_MAX (0x7FFFFFFF)
 
+/* How much of an object is inflated at a time while it comes in */
+#define INFLATE_CHUNK (16 * 1024)
+
+/* How much of the delta bases each thread resolving them keeps around */
+#define RESOLVE_BASES_LIMIT (16 * 1024 * 1024)
+
+/* Which part of an entry the stream indexer is waiting for */
+enum entry_state {
+	ENTRY_HEADER = 0,	/* the type and size */
+	ENTRY_BASE,		/* the base of a delta, by offset or by name */
+	ENTRY_DATA,		/* the compressed data */
+};
+
 struct entry {
 	git_oid oid;
 	uint32_t crc;
@@ -37,6 +55,30 @@ struct git_indexer {
 	git_oid hash;
 };
 
+/*
+ * The stream indexer keeps its bookkeeping in arrays it grows as a
+ * whole, rather than in an allocation per object, so a pack costs a few
+ * dozen bytes per object: one slot per object, and one record per delta
+ * saying where its base is. Everything else about a delta is read back
+ * from the pack when it's resolved.
+ */
+struct object_entry {
+	git_oid oid; /* only known once resolved, for deltas */
+	uint32_t crc;
+	git_off_t offset;
+};
+
+struct ofs_delta {
+	git_off_t base_off;
+	uint32_t entry; /* the delta's slot in idx->entries */
+};
+
+struct ref_delta {
+	git_oid base_oid;
+	uint32_t entry;
+	git_atomic resolved;
+};
+
 struct git_indexer_stream {
 	unsigned int parsed_header :1,
 		opened_pack;
@@ -45,16 +87,50 @@ struct git_indexer_stream {
 	git_filebuf index_file;
 	git_off_t off;
 	size_t nr_objects;
-	git_vector objects;
-	git_vector deltas;
 	unsigned int fanout[256];
 	git_oid hash;
 	git_transfer_progress_callback progress_cb;
 	void *progress_payload;
-};
-
-struct delta_info {
-	git_off_t delta_off;
+	unsigned int nr_threads;
+	git_odb *odb;
+
+	/*
+	 * One slot per object, grown as they come in rather than sized
+	 * from what the header claims. Objects which aren't deltas go to
+	 * `entries` and deltas to `delta_entries`, which are joined before
+	 * resolving, so the first nr_roots are the roots of the delta
+	 * trees. Bases appended to complete a thin pack go past the end.
+	 */
+	struct object_entry *entries;
+	size_t nr_roots, entries_alloc;
+	struct object_entry *delta_entries;
+	size_t nr_deltas, delta_alloc;
+	struct ofs_delta *ofs_deltas;
+	size_t ofs_len, ofs_alloc;
+	struct ref_delta *ref_deltas;
+	size_t ref_len, ref_alloc;
+
+	/*
+	 * Entries are parsed as their bytes come in: the CRC, the object
+	 * hash and the pack checksum are all worked out in one pass, and
+	 * no more than INFLATE_CHUNK of the object is held at once.
+	 */
+	size_t parsed_objects;
+	enum entry_state entry_state;
+	git_off_t entry_start;
+	git_otype entry_type;
+	size_t entry_size;
+	unsigned int entry_shift;
+	git_off_t entry_base_off;
+	unsigned char entry_base_oid[GIT_OID_RAWSZ];
+	size_t entry_base_len;
+	git_off_t entry_data_off;
+	uint32_t entry_crc;
+	z_stream zstream;
+	int zstream_open;
+	git_hash_ctx *object_ctx;
+	git_hash_ctx *pack_ctx;
+	unsigned char inflated[INFLATE_CHUNK];
 };
 
 const git_oid *git_indexer_hash(git_indexer *idx)
@@ -93,6 +169,13 @@ static int open_pack(struct git_pack_file **out, const char *filename)
 	pack->mwf.fd = fd;
 	pack->mwf.size = (git_off_t)st.st_size;
 
+	if (git_pack_cache_init(&pack->bases) < 0) {
+		p_close(fd);
+		goto cleanup;
+	}
+
+	git_mwindow_file_init(&pack->mwf);
+
 	*out = pack;
 	return 0;
 
@@ -155,6 +238,7 @@ int git_indexer_stream_new(
 	GITERR_CHECK_ALLOC(idx);
 	idx->progress_cb = progress_cb;
 	idx->progress_payload = progress_payload;
+	idx->nr_threads = 1; /* do not spawn any thread by default */
 
 	error = git_buf_joinpath(&path, prefix, suff);
 	if (error < 0)
@@ -176,144 +260,337 @@ cleanup:
 	return -1;
 }
 
-/* Try to store the delta so we can try to resolve it later */
-static int store_delta(git_indexer_stream *idx, git_off_t entry_start, size_t entry_size, git_otype type)
+/* Resize an array to `nr` items, failing rather than wrapping around */
+static int resize_array(void **array, size_t nr, size_t item_size)
 {
-	git_mwindow *w = NULL;
-	struct delta_info *delta;
-	git_rawobj obj;
-	int error;
+	void *new_array;
 
-	assert(type == GIT_OBJ_REF_DELTA || type == GIT_OBJ_OFS_DELTA);
+	if (nr > (size_t)-1 / item_size) {
+		giterr_set_oom();
+		return -1;
+	}
 
-	if (type == GIT_OBJ_REF_DELTA) {
-		idx->off += GIT_OID_RAWSZ;
-	} else {
-		git_off_t base_off;
+	new_array = git__realloc(*array, nr * item_size);
+	GITERR_CHECK_ALLOC(new_array);
 
-		base_off = get_delta_base(idx->pack, &w, &idx->off, type, entry_start);
-		git_mwindow_close(&w);
-		if (base_off < 0)
-			return (int)base_off;
-	}
+	*array = new_array;
+	return 0;
+}
 
-	error = packfile_unpack_compressed(&obj, idx->pack, &w, &idx->off, entry_size, type);
-	if (error == GIT_EBUFS) {
-		idx->off = entry_start;
-		return GIT_EBUFS;
-	} else if (error < 0){
+/* Make room for one more item at the end of an array */
+static int grow_array(void **array, size_t *alloc, size_t len, size_t item_size)
+{
+	size_t new_alloc;
+
+	if (len < *alloc)
+		return 0;
+
+	new_alloc = *alloc + *alloc / 2 + 64;
+	if (new_alloc < *alloc) {
+		giterr_set_oom();
 		return -1;
 	}
 
-	delta = git__calloc(1, sizeof(struct delta_info));
-	GITERR_CHECK_ALLOC(delta);
-	delta->delta_off = entry_start;
+	if (resize_array(array, new_alloc, item_size) < 0)
+		return -1;
+
+	*alloc = new_alloc;
+	return 0;
+}
 
-	git__free(obj.data);
+static int save_root(git_indexer_stream *idx, const git_oid *oid, uint32_t crc, git_off_t entry_start)
+{
+	struct object_entry *entry;
 
-	if (git_vector_insert(&idx->deltas, delta) < 0)
+	if (grow_array((void **)&idx->entries, &idx->entries_alloc,
+			idx->nr_roots, sizeof(*entry)) < 0)
 		return -1;
 
+	entry = &idx->entries[idx->nr_roots++];
+	git_oid_cpy(&entry->oid, oid);
+	entry->crc = crc;
+	entry->offset = entry_start;
 	return 0;
 }
 
-static int hash_and_save(git_indexer_stream *idx, git_rawobj *obj, git_off_t entry_start)
+/* The delta records point into `delta_entries` until join_entries() */
+static int save_delta(git_indexer_stream *idx, uint32_t crc)
 {
-	int i;
-	git_oid oid;
-	void *packed;
-	size_t entry_size;
-	unsigned int left;
-	struct entry *entry;
-	git_mwindow *w = NULL;
-	git_mwindow_file *mwf = &idx->pack->mwf;
-	struct git_pack_entry *pentry;
+	struct object_entry *entry;
+	uint32_t slot = (uint32_t)idx->nr_deltas;
+
+	if (grow_array((void **)&idx->delta_entries, &idx->delta_alloc,
+			idx->nr_deltas, sizeof(*entry)) < 0)
+		return -1;
+
+	entry = &idx->delta_entries[idx->nr_deltas++];
+	entry->crc = crc;
+	entry->offset = idx->entry_start;
 
-	entry = git__calloc(1, sizeof(*entry));
-	GITERR_CHECK_ALLOC(entry);
+	if (idx->entry_type == GIT_OBJ_OFS_DELTA) {
+		struct ofs_delta *delta;
+
+		if (grow_array((void **)&idx->ofs_deltas, &idx->ofs_alloc,
+				idx->ofs_len, sizeof(*delta)) < 0)
+			return -1;
 
-	if (entry_start > UINT31_MAX) {
-		entry->offset = UINT32_MAX;
-		entry->offset_long = entry_start;
+		delta = &idx->ofs_deltas[idx->ofs_len++];
+		delta->base_off = idx->entry_base_off;
+		delta->entry = slot;
 	} else {
-		entry->offset = (uint32_t)entry_start;
+		struct ref_delta *delta;
+
+		if (grow_array((void **)&idx->ref_deltas, &idx->ref_alloc,
+				idx->ref_len, sizeof(*delta)) < 0)
+			return -1;
+
+		delta = &idx->ref_deltas[idx->ref_len++];
+		git_oid_fromraw(&delta->base_oid, idx->entry_base_oid);
+		delta->entry = slot;
+		delta->resolved.val = 0;
 	}
 
-	/* FIXME: Parse the object instead of hashing it */
-	if (git_odb__hashobj(&oid, obj) < 0) {
-		giterr_set(GITERR_INDEXER, "Failed to hash object");
+	return 0;
+}
+
+static void do_progress_callback(git_indexer_stream *idx, git_transfer_progress *stats)
+{
+	if (!idx->progress_cb) return;
+	idx->progress_cb(stats, idx->progress_payload);
+}
+
+static int format_object_header(char *hdr, size_t n, size_t obj_len, git_otype obj_type)
+{
+	const char *type_str = git_object_type2string(obj_type);
+	int len = p_snprintf(hdr, n, "%s %"PRIuZ, type_str, obj_len);
+	assert(len > 0 && len <= (int)n);
+	return len+1;
+}
+
+/* The bytes of the current entry, in the order they come */
+static void entry_consume(git_indexer_stream *idx, const unsigned char *data, size_t len)
+{
+	idx->entry_crc = crc32(idx->entry_crc, data, (uInt)len);
+	git_hash_update(idx->pack_ctx, data, len);
+	idx->off += len;
+}
+
+static int entry_begin_data(git_indexer_stream *idx)
+{
+	idx->entry_state = ENTRY_DATA;
+	idx->entry_data_off = idx->off;
+
+	if (idx->entry_type != GIT_OBJ_OFS_DELTA && idx->entry_type != GIT_OBJ_REF_DELTA) {
+		char hdr[64];
+		int hdr_len = format_object_header(hdr, sizeof(hdr), idx->entry_size, idx->entry_type);
+
+		git_hash_init(idx->object_ctx);
+		git_hash_update(idx->object_ctx, hdr, hdr_len);
+	}
+
+	if (!idx->zstream_open) {
+		memset(&idx->zstream, 0, sizeof(idx->zstream));
+		if (inflateInit(&idx->zstream) != Z_OK) {
+			giterr_set(GITERR_ZLIB, "Failed to initialize the decompressor");
+			return -1;
+		}
+		idx->zstream_open = 1;
+	} else if (inflateReset(&idx->zstream) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "Failed to reset the decompressor");
 		return -1;
 	}
 
-	pentry = git__malloc(sizeof(struct git_pack_entry));
-	GITERR_CHECK_ALLOC(pentry);
+	return 0;
+}
 
-	git_oid_cpy(&pentry->sha1, &oid);
-	pentry->offset = entry_start;
-	if (git_vector_insert(&idx->pack->cache, pentry) < 0)
-		goto on_error;
+/* Parse the type and size of an entry, and the base of a delta */
+static int entry_parse_header(git_indexer_stream *idx, unsigned char c)
+{
+	if (idx->entry_state == ENTRY_HEADER) {
+		if (idx->entry_shift == 0) {
+			idx->entry_type = (c >> 4) & 7;
+			idx->entry_size = c & 15;
+			idx->entry_shift = 4;
+		} else {
+			if (idx->entry_shift >= sizeof(size_t) * 8 - 7) {
+				giterr_set(GITERR_INDEXER, "Indexing error: object size is too large");
+				return -1;
+			}
+			idx->entry_size += (size_t)(c & 0x7f) << idx->entry_shift;
+			idx->entry_shift += 7;
+		}
 
-	git_oid_cpy(&entry->oid, &oid);
-	entry->crc = crc32(0L, Z_NULL, 0);
+		if (c & 0x80)
+			return 0;
 
-	entry_size = (size_t)(idx->off - entry_start);
-	packed = git_mwindow_open(mwf, &w, entry_start, entry_size, &left);
-	if (packed == NULL)
-		goto on_error;
+		switch (idx->entry_type) {
+		case GIT_OBJ_COMMIT:
+		case GIT_OBJ_TREE:
+		case GIT_OBJ_BLOB:
+		case GIT_OBJ_TAG:
+			return entry_begin_data(idx);
+		case GIT_OBJ_OFS_DELTA:
+		case GIT_OBJ_REF_DELTA:
+			idx->entry_state = ENTRY_BASE;
+			idx->entry_base_off = 0;
+			idx->entry_base_len = 0;
+			return 0;
+		default:
+			giterr_set(GITERR_INDEXER, "Indexing error: invalid object type");
+			return -1;
+		}
+	}
 
-	entry->crc = htonl(crc32(entry->crc, packed, (uInt)entry_size));
-	git_mwindow_close(&w);
+	if (idx->entry_type == GIT_OBJ_REF_DELTA) {
+		idx->entry_base_oid[idx->entry_base_len++] = c;
+		return idx->entry_base_len < GIT_OID_RAWSZ ? 0 : entry_begin_data(idx);
+	}
 
-	/* Add the object to the list */
-	if (git_vector_insert(&idx->objects, entry) < 0)
-		goto on_error;
+	/* the offset back to the base, see get_delta_base() */
+	if (idx->entry_base_len++ > 0) {
+		if (idx->entry_base_off >= (idx->entry_start >> 7)) {
+			giterr_set(GITERR_INDEXER, "Delta base offset is out of bounds");
+			return -1;
+		}
+		idx->entry_base_off = (idx->entry_base_off + 1) << 7;
+	}
+	idx->entry_base_off += c & 0x7f;
+
+	if (c & 0x80)
+		return 0;
+
+	if (idx->entry_base_off == 0 || idx->entry_base_off > idx->entry_start) {
+		giterr_set(GITERR_INDEXER, "Delta base offset is out of bounds");
+		return -1;
+	}
+	idx->entry_base_off = idx->entry_start - idx->entry_base_off;
+
+	return entry_begin_data(idx);
+}
+
+/* The entry is all in: index it if it's an object, remember it if it's a delta */
+static int entry_finish(git_indexer_stream *idx, git_transfer_progress *stats)
+{
+	uint32_t crc = htonl(idx->entry_crc);
+
+	if (idx->zstream.total_out != idx->entry_size) {
+		giterr_set(GITERR_INDEXER, "Indexing error: object size mismatch");
+		return -1;
+	}
+
+	if (idx->entry_type == GIT_OBJ_OFS_DELTA || idx->entry_type == GIT_OBJ_REF_DELTA) {
+		if (save_delta(idx, crc) < 0)
+			return -1;
+	} else {
+		git_oid oid;
+
+		git_hash_final(&oid, idx->object_ctx);
+		if (save_root(idx, &oid, crc, idx->entry_start) < 0)
+			return -1;
 
-	for (i = oid.id[0]; i < 256; ++i) {
-		idx->fanout[i]++;
+		stats->indexed_objects++;
 	}
 
+	idx->parsed_objects++;
+	idx->entry_state = ENTRY_HEADER;
+
+	stats->received_objects++;
+	do_progress_callback(idx, stats);
 	return 0;
+}
 
-on_error:
-	git__free(entry);
-	git__free(pentry);
-	git__free(obj->data);
-	return -1;
+/* Inflate as much of the entry's data as there is, hashing what comes out */
+static int entry_inflate(
+	size_t *used, git_indexer_stream *idx,
+	const unsigned char *data, size_t len, git_transfer_progress *stats)
+{
+	z_stream *zs = &idx->zstream;
+	int is_delta = (idx->entry_type == GIT_OBJ_OFS_DELTA || idx->entry_type == GIT_OBJ_REF_DELTA);
+	int status;
+
+	zs->next_in = (Bytef *)data;
+	zs->avail_in = (uInt)len;
+
+	do {
+		zs->next_out = idx->inflated;
+		zs->avail_out = sizeof(idx->inflated);
+
+		status = inflate(zs, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+			giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
+			return -1;
+		}
+
+		if (zs->total_out > idx->entry_size) {
+			giterr_set(GITERR_INDEXER, "Indexing error: object size mismatch");
+			return -1;
+		}
+
+		/* deltas are only inflated to find where they end */
+		if (!is_delta)
+			git_hash_update(idx->object_ctx, idx->inflated, sizeof(idx->inflated) - zs->avail_out);
+	} while (status == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
+
+	*used = len - zs->avail_in;
+	entry_consume(idx, data, *used);
+
+	return status == Z_STREAM_END ? entry_finish(idx, stats) : 0;
 }
 
-static void do_progress_callback(git_indexer_stream *idx, git_transfer_progress *stats)
+static int parse_entries(
+	git_indexer_stream *idx, const unsigned char *data, size_t len,
+	git_transfer_progress *stats)
 {
-	if (!idx->progress_cb) return;
-	idx->progress_cb(stats, idx->progress_payload);
+	while (len > 0 && idx->parsed_objects < idx->nr_objects) {
+		size_t used = 1;
+
+		if (idx->entry_state == ENTRY_DATA) {
+			if (entry_inflate(&used, idx, data, len, stats) < 0)
+				return -1;
+		} else {
+			if (idx->entry_state == ENTRY_HEADER && idx->entry_shift == 0) {
+				idx->entry_start = idx->off;
+				idx->entry_crc = crc32(0L, Z_NULL, 0);
+			}
+
+			entry_consume(idx, data, 1);
+			if (entry_parse_header(idx, *data) < 0)
+				return -1;
+
+			if (idx->entry_state != ENTRY_HEADER)
+				idx->entry_shift = 0;
+		}
+
+		data += used;
+		len -= used;
+	}
+
+	return 0;
 }
 
 int git_indexer_stream_add(git_indexer_stream *idx, const void *data, size_t size, git_transfer_progress *stats)
 {
-	int error;
 	struct git_pack_header hdr;
-	size_t processed; 
-	git_mwindow_file *mwf = &idx->pack->mwf;
+	git_off_t chunk_start;
 
 	assert(idx && data && stats);
 
-	processed = stats->indexed_objects;
-
 	if (git_filebuf_write(&idx->pack_file, data, size) < 0)
 		return -1;
 
 	/* Make sure we set the new size of the pack */
 	if (idx->opened_pack) {
 		idx->pack->mwf.size += size;
-		//printf("\nadding %zu for %zu\n", size, idx->pack->mwf.size);
 	} else {
 		if (open_pack(&idx->pack, idx->pack_file.path_lock) < 0)
 			return -1;
 		idx->opened_pack = 1;
-		mwf = &idx->pack->mwf;
 		if (git_mwindow_file_register(&idx->pack->mwf) < 0)
 			return -1;
 	}
 
+	chunk_start = idx->pack->mwf.size - size;
+
 	if (!idx->parsed_header) {
 		if ((unsigned)idx->pack->mwf.size < sizeof(hdr))
 			return 0;
@@ -325,152 +602,781 @@ int git_indexer_stream_add(git_indexer_stream *idx, const void *data, size_t siz
 		idx->nr_objects = ntohl(hdr.hdr_entries);
 		idx->off = sizeof(struct git_pack_header);
 
+		idx->object_ctx = git_hash_new_ctx();
+		GITERR_CHECK_ALLOC(idx->object_ctx);
+		idx->pack_ctx = git_hash_new_ctx();
+		GITERR_CHECK_ALLOC(idx->pack_ctx);
+		git_hash_update(idx->pack_ctx, &hdr, sizeof(hdr));
+
 		/* for now, limit to 2^32 objects */
 		assert(idx->nr_objects == (size_t)((unsigned int)idx->nr_objects));
 
-		if (git_vector_init(&idx->pack->cache, (unsigned int)idx->nr_objects, cache_cmp) < 0)
-			return -1;
-
-		idx->pack->has_cache = 1;
-		if (git_vector_init(&idx->objects, (unsigned int)idx->nr_objects, objects_cmp) < 0)
-			return -1;
-
-		if (git_vector_init(&idx->deltas, (unsigned int)(idx->nr_objects / 2), NULL) < 0)
-			return -1;
-
 		stats->received_objects = 0;
 		stats->indexed_objects = 0;
 		stats->total_objects = (unsigned int)idx->nr_objects;
 		do_progress_callback(idx, stats);
 	}
 
-	/* Now that we have data in the pack, let's try to parse it */
+	/* Parse whatever part of this data hasn't been */
+	if (idx->off > chunk_start) {
+		size_t skip = (size_t)(idx->off - chunk_start);
 
-	/* As the file grows any windows we try to use will be out of date */
-	git_mwindow_free_all(mwf);
-	while (processed < idx->nr_objects) {
-		git_rawobj obj;
-		git_off_t entry_start = idx->off;
-		size_t entry_size;
-		git_otype type;
-		git_mwindow *w = NULL;
-
-		if (idx->pack->mwf.size <= idx->off + 20)
+		if (skip >= size)
 			return 0;
 
-		error = git_packfile_unpack_header(&entry_size, &type, mwf, &w, &idx->off);
-		if (error == GIT_EBUFS) {
-			idx->off = entry_start;
-			return 0;
+		data = (const unsigned char *)data + skip;
+		size -= skip;
+	}
+
+	return parse_entries(idx, data, size, stats);
+}
+
+static int index_path_stream(git_buf *path, git_indexer_stream *idx, const char *suffix)
+{
+	const char prefix[] = "pack-";
+	size_t slash = (size_t)path->size;
+
+	/* search backwards for '/' */
+	while (slash > 0 && path->ptr[slash - 1] != '/')
+		slash--;
+
+	if (git_buf_grow(path, slash + 1 + strlen(prefix) +
+					 GIT_OID_HEXSZ + strlen(suffix) + 1) < 0)
+		return -1;
+
+	git_buf_truncate(path, slash);
+	git_buf_puts(path, prefix);
+	git_oid_fmt(path->ptr + git_buf_len(path), &idx->hash);
+	path->size += GIT_OID_HEXSZ;
+	git_buf_puts(path, suffix);
+
+	return git_buf_oom(path) ? -1 : 0;
+}
+
+/*
+ * Deltas are resolved from their bases down: every object which isn't a
+ * delta is the root of a tree of the deltas made against it, directly or
+ * not. Each delta is found as a child of its base, so its chain is never
+ * unpacked again. The trees don't share anything, so they are spread
+ * over the threads.
+ *
+ * A tree is walked depth-first with a stack of its own rather than by
+ * recursing, as chains can be many thousands of deltas deep. The bases
+ * on the way down are kept for their other children, up to
+ * RESOLVE_BASES_LIMIT bytes a thread; past that, the ones nearest the
+ * root are dropped, and built again from their closest ancestor still
+ * in memory when they are needed.
+ */
+struct delta_tree {
+	git_indexer_stream *idx;
+
+	git_atomic next_root;
+	git_atomic resolved;
+	git_atomic failed;
+};
+
+static int ofs_delta_cmp(const void *a, const void *b)
+{
+	const struct ofs_delta *da = a;
+	const struct ofs_delta *db = b;
+
+	if (da->base_off < db->base_off)
+		return -1;
+	return da->base_off > db->base_off;
+}
+
+static int ref_delta_cmp(const void *a, const void *b)
+{
+	const struct ref_delta *da = a;
+	const struct ref_delta *db = b;
+
+	return git_oid_cmp(&da->base_oid, &db->base_oid);
+}
+
+/* A base on the way down, and where it is up to in its children */
+struct resolve_frame {
+	struct object_entry *entry;
+	git_rawobj obj; /* NULL data when dropped */
+	size_t ofs_pos, ofs_end;
+	size_t ref_pos, ref_end;
+	unsigned int pinned:1; /* not ours, and can't be read back */
+};
+
+struct resolve_stack {
+	struct resolve_frame *frames;
+	size_t depth, alloc;
+	size_t cached; /* bytes of bases held */
+};
+
+/* Find the deltas made against a base, if there are any */
+static bool find_children(git_indexer_stream *idx, struct resolve_frame *frame)
+{
+	struct ofs_delta ofs_key, *ofs;
+	struct ref_delta ref_key, *ref;
+	size_t pos;
+
+	frame->ofs_pos = frame->ofs_end = 0;
+	frame->ref_pos = frame->ref_end = 0;
+
+	ofs_key.base_off = frame->entry->offset;
+	ofs = bsearch(&ofs_key, idx->ofs_deltas, idx->ofs_len, sizeof(ofs_key), ofs_delta_cmp);
+	if (ofs != NULL) {
+		pos = ofs - idx->ofs_deltas;
+		while (pos > 0 && idx->ofs_deltas[pos - 1].base_off == ofs_key.base_off)
+			pos--;
+		frame->ofs_pos = frame->ofs_end = pos;
+		while (frame->ofs_end < idx->ofs_len &&
+			idx->ofs_deltas[frame->ofs_end].base_off == ofs_key.base_off)
+			frame->ofs_end++;
+	}
+
+	git_oid_cpy(&ref_key.base_oid, &frame->entry->oid);
+	ref = bsearch(&ref_key, idx->ref_deltas, idx->ref_len, sizeof(ref_key), ref_delta_cmp);
+	if (ref != NULL) {
+		pos = ref - idx->ref_deltas;
+		while (pos > 0 && !git_oid_cmp(&idx->ref_deltas[pos - 1].base_oid, &ref_key.base_oid))
+			pos--;
+		frame->ref_pos = frame->ref_end = pos;
+		while (frame->ref_end < idx->ref_len &&
+			!git_oid_cmp(&idx->ref_deltas[frame->ref_end].base_oid, &ref_key.base_oid))
+			frame->ref_end++;
+	}
+
+	return frame->ofs_pos < frame->ofs_end || frame->ref_pos < frame->ref_end;
+}
+
+/* Find the slot of the next child of a base to resolve, if there is one */
+static bool next_child(uint32_t *slot, git_indexer_stream *idx, struct resolve_frame *frame)
+{
+	/* an offset is only resolved once, so neither are its deltas */
+	if (frame->ofs_pos < frame->ofs_end) {
+		*slot = idx->ofs_deltas[frame->ofs_pos++].entry;
+		return true;
+	}
+
+	while (frame->ref_pos < frame->ref_end) {
+		struct ref_delta *delta = &idx->ref_deltas[frame->ref_pos++];
+
+		/* a base can be in the pack twice, but its deltas are only resolved once */
+		if (git_atomic_inc(&delta->resolved) == 1) {
+			*slot = delta->entry;
+			return true;
 		}
-		if (error < 0)
+	}
+
+	return false;
+}
+
+static void drop_base(struct resolve_stack *stack, struct resolve_frame *frame)
+{
+	if (frame->obj.data == NULL || frame->pinned)
+		return;
+
+	stack->cached -= frame->obj.len;
+	git__free(frame->obj.data);
+	frame->obj.data = NULL;
+}
+
+/* Drop the bases nearest the root, below `keep`, until we are under the limit */
+static void prune_bases(struct resolve_stack *stack, size_t keep)
+{
+	size_t i;
+
+	for (i = 0; i < keep && stack->cached > RESOLVE_BASES_LIMIT; ++i)
+		drop_base(stack, &stack->frames[i]);
+}
+
+static int push_base(
+	struct resolve_stack *stack, struct object_entry *entry,
+	git_rawobj *obj, bool pinned)
+{
+	struct resolve_frame *frame;
+
+	if (grow_array((void **)&stack->frames, &stack->alloc,
+			stack->depth, sizeof(*frame)) < 0)
+		return -1;
+
+	frame = &stack->frames[stack->depth++];
+	frame->entry = entry;
+	frame->obj = *obj;
+	frame->pinned = pinned;
+
+	if (!pinned)
+		stack->cached += obj->len;
+
+	prune_bases(stack, stack->depth - 1);
+	return 0;
+}
+
+/* Apply the delta in `entry` to its base */
+static int unpack_delta(
+	git_rawobj *out, git_indexer_stream *idx,
+	struct object_entry *entry, const git_rawobj *base)
+{
+	git_mwindow *w = NULL;
+	git_off_t curpos = entry->offset;
+	git_rawobj diff;
+	git_otype type;
+	size_t size;
+	int error;
+
+	/* the header was checked as it came in; only find the data again */
+	error = git_packfile_unpack_header(&size, &type, &idx->pack->mwf, &w, &curpos);
+	if (error == 0 && type == GIT_OBJ_OFS_DELTA &&
+		get_delta_base(idx->pack, &w, &curpos, type, entry->offset) <= 0)
+		error = -1;
+	git_mwindow_close(&w);
+	if (error < 0)
+		return -1;
+
+	if (type == GIT_OBJ_REF_DELTA)
+		curpos += GIT_OID_RAWSZ;
+
+	if (packfile_unpack_compressed(&diff, idx->pack, &w, &curpos, size, type) < 0)
+		return -1;
+
+	out->type = base->type;
+	error = git__delta_apply(out, base->data, base->len, diff.data, diff.len);
+	git__free(diff.data);
+
+	return error;
+}
+
+/*
+ * Get the base on top of the stack back, if it was dropped: start from
+ * its closest ancestor we still have, reading the root from the pack
+ * if need be, and apply the deltas on the way up again.
+ */
+static int rebuild_top(git_indexer_stream *idx, struct resolve_stack *stack)
+{
+	struct resolve_frame *frames = stack->frames;
+	size_t i, top = stack->depth - 1;
+
+	if (frames[top].obj.data != NULL)
+		return 0;
+
+	for (i = top; i > 0 && frames[i].obj.data == NULL; --i)
+		/* nothing */;
+
+	if (frames[i].obj.data == NULL) {
+		git_off_t curpos = frames[i].entry->offset;
+
+		if (git_packfile_unpack(&frames[i].obj, idx->pack, &curpos) < 0)
 			return -1;
+		stack->cached += frames[i].obj.len;
+	}
 
-		git_mwindow_close(&w);
+	for (++i; i <= top; ++i) {
+		if (unpack_delta(&frames[i].obj, idx, frames[i].entry, &frames[i - 1].obj) < 0)
+			return -1;
 
-		if (type == GIT_OBJ_REF_DELTA || type == GIT_OBJ_OFS_DELTA) {
-			error = store_delta(idx, entry_start, entry_size, type);
-			if (error == GIT_EBUFS) {
-				idx->off = entry_start;
-				return 0;
-			}
-			if (error < 0)
-				return error;
+		stack->cached += frames[i].obj.len;
+		prune_bases(stack, i);
+	}
 
-			stats->received_objects++;
-			do_progress_callback(idx, stats);
+	return 0;
+}
+
+/* Resolve every delta below a base, which is then freed unless pinned */
+static int resolve_tree(
+	struct delta_tree *tree, struct object_entry *root,
+	git_rawobj *root_obj, bool pinned)
+{
+	git_indexer_stream *idx = tree->idx;
+	struct resolve_stack stack;
+	struct resolve_frame *frame;
+	struct object_entry *entry;
+	git_rawobj obj;
+	uint32_t slot;
+	int error = 0;
+
+	memset(&stack, 0, sizeof(stack));
+
+	if (push_base(&stack, root, root_obj, pinned) < 0) {
+		if (!pinned)
+			git__free(root_obj->data);
+		return -1;
+	}
+
+	find_children(idx, &stack.frames[0]);
+
+	while (stack.depth > 0) {
+		frame = &stack.frames[stack.depth - 1];
+
+		if (!next_child(&slot, idx, frame)) {
+			drop_base(&stack, frame);
+			stack.depth--;
 			continue;
 		}
 
-		idx->off = entry_start;
-		error = git_packfile_unpack(&obj, idx->pack, &idx->off);
-		if (error == GIT_EBUFS) {
-			idx->off = entry_start;
-			return 0;
+		if (git_atomic_get(&tree->failed)) {
+			error = -1;
+			goto cleanup;
 		}
-		if (error < 0)
+
+		if ((error = rebuild_top(idx, &stack)) < 0 ||
+			(error = unpack_delta(&obj, idx, &idx->entries[slot], &frame->obj)) < 0)
+			goto cleanup;
+
+		/* each slot is only ever written by the thread which resolved it */
+		entry = &idx->entries[slot];
+		if (git_odb__hashobj(&entry->oid, &obj) < 0) {
+			giterr_set(GITERR_INDEXER, "Failed to hash object");
+			git__free(obj.data);
+			error = -1;
+			goto cleanup;
+		}
+
+		git_atomic_inc(&tree->resolved);
+
+		if ((error = push_base(&stack, entry, &obj, false)) < 0) {
+			git__free(obj.data);
+			goto cleanup;
+		}
+
+		/* most objects aren't the base of anything; don't keep them */
+		frame = &stack.frames[stack.depth - 1];
+		if (!find_children(idx, frame)) {
+			drop_base(&stack, frame);
+			stack.depth--;
+		}
+	}
+
+cleanup:
+	while (stack.depth > 0)
+		drop_base(&stack, &stack.frames[--stack.depth]);
+
+	git__free(stack.frames);
+	return error < 0 ? -1 : 0;
+}
+
+static int resolve_roots(struct delta_tree *tree, git_transfer_progress *stats)
+{
+	git_indexer_stream *idx = tree->idx;
+	unsigned int indexed = stats ? stats->indexed_objects : 0;
+	size_t i;
+
+	while ((i = (size_t)git_atomic_inc(&tree->next_root) - 1) < idx->nr_roots) {
+		struct object_entry *root = &idx->entries[i];
+		git_off_t curpos = root->offset;
+		struct resolve_frame probe;
+		git_rawobj obj;
+
+		if (git_atomic_get(&tree->failed))
 			return -1;
 
-		if (hash_and_save(idx, &obj, entry_start) < 0)
-			goto on_error;
+		/* most objects aren't the base of anything; don't inflate them again */
+		probe.entry = root;
+		if (!find_children(idx, &probe))
+			continue;
 
-		git__free(obj.data);
+		if (git_packfile_unpack(&obj, idx->pack, &curpos) < 0 ||
+			resolve_tree(tree, root, &obj, false) < 0)
+			goto on_error;
 
-		stats->indexed_objects = (unsigned int)++processed;
-		stats->received_objects++;
-		do_progress_callback(idx, stats);
+		/* only the thread which was given the stats reports progress */
+		if (stats) {
+			stats->indexed_objects = indexed + git_atomic_get(&tree->resolved);
+			do_progress_callback(idx, stats);
+		}
 	}
 
 	return 0;
 
 on_error:
-	git_mwindow_free_all(mwf);
+	git_atomic_inc(&tree->failed);
 	return -1;
 }
 
-static int index_path_stream(git_buf *path, git_indexer_stream *idx, const char *suffix)
+#ifdef GIT_THREADS
+
+struct resolve_thread {
+	git_thread thread;
+	struct delta_tree *tree;
+	int error;
+};
+
+static void *threaded_resolve_roots(void *arg)
 {
-	const char prefix[] = "pack-";
-	size_t slash = (size_t)path->size;
+	struct resolve_thread *me = arg;
 
-	/* search backwards for '/' */
-	while (slash > 0 && path->ptr[slash - 1] != '/')
-		slash--;
+	me->error = resolve_roots(me->tree, NULL);
+	return NULL;
+}
 
-	if (git_buf_grow(path, slash + 1 + strlen(prefix) +
-					 GIT_OID_HEXSZ + strlen(suffix) + 1) < 0)
+static int resolve_roots_threaded(struct delta_tree *tree, git_transfer_progress *stats)
+{
+	git_indexer_stream *idx = tree->idx;
+	struct resolve_thread *p;
+	unsigned int i, nr_threads = idx->nr_threads, started = 0;
+	int error;
+
+	if (!nr_threads)
+		nr_threads = git_online_cpus();
+
+	if (nr_threads > idx->nr_roots)
+		nr_threads = (unsigned int)idx->nr_roots;
+
+	if (nr_threads <= 1)
+		return resolve_roots(tree, stats);
+
+	/* this thread works too, and is the one reporting progress */
+	p = git__calloc(nr_threads - 1, sizeof(*p));
+	GITERR_CHECK_ALLOC(p);
+
+	for (i = 0; i < nr_threads - 1; ++i) {
+		p[i].tree = tree;
+		if (git_thread_create(&p[i].thread, NULL, threaded_resolve_roots, &p[i]))
+			break;
+		started++;
+	}
+
+	error = resolve_roots(tree, stats);
+
+	for (i = 0; i < started; ++i) {
+		git_thread_join(p[i].thread, NULL);
+		if (p[i].error < 0 && !error) {
+			giterr_set(GITERR_INDEXER, "Failed to resolve the deltas of the pack");
+			error = -1;
+		}
+	}
+
+	git__free(p);
+	return error;
+}
+
+#else
+#define resolve_roots_threaded(t, s) resolve_roots(t, s)
+#endif
+
+static size_t gen_pack_object_header(unsigned char *hdr, size_t size, git_otype type)
+{
+	unsigned char *hdr_base = hdr;
+	unsigned char c;
+
+	c = (unsigned char)((type << 4) | (size & 15));
+	size >>= 4;
+
+	while (size) {
+		*hdr++ = c | 0x80;
+		c = size & 0x7f;
+		size >>= 7;
+	}
+	*hdr++ = c;
+
+	return hdr - hdr_base;
+}
+
+static int write_pack_at(git_indexer_stream *idx, git_off_t off, const void *data, size_t len)
+{
+	if (p_lseek(idx->pack_file.fd, off, SEEK_SET) < 0 ||
+		p_write(idx->pack_file.fd, data, len) < 0) {
+		giterr_set(GITERR_OS, "Failed to write to '%s'", idx->pack_file.path_lock);
 		return -1;
+	}
 
-	git_buf_truncate(path, slash);
-	git_buf_puts(path, prefix);
-	git_oid_fmt(path->ptr + git_buf_len(path), &idx->hash);
-	path->size += GIT_OID_HEXSZ;
-	git_buf_puts(path, suffix);
+	return 0;
+}
 
-	return git_buf_oom(path) ? -1 : 0;
+/* Write an object from the object database at the end of the pack */
+static int append_object(
+	git_off_t *entry_start, uint32_t *crc, git_indexer_stream *idx,
+	git_off_t *end, const git_rawobj *obj)
+{
+	git_buf buf = GIT_BUF_INIT;
+	unsigned char hdr[32];
+	size_t hdr_len;
+	int error;
+
+	hdr_len = gen_pack_object_header(hdr, obj->len, obj->type);
+
+	if (git_buf_put(&buf, (char *)hdr, hdr_len) < 0 ||
+		git__compress(&buf, obj->data, obj->len) < 0) {
+		git_buf_free(&buf);
+		return -1;
+	}
+
+	if ((error = write_pack_at(idx, *end, buf.ptr, buf.size)) == 0) {
+		*entry_start = *end;
+		*crc = htonl(crc32(crc32(0L, Z_NULL, 0), (Bytef *)buf.ptr, (uInt)buf.size));
+		*end += buf.size;
+	}
+
+	git_buf_free(&buf);
+	return error;
 }
 
-static int resolve_deltas(git_indexer_stream *idx, git_transfer_progress *stats)
+/* Give the pack its new object count, and the trailer to go with it */
+static int rewrite_pack_trailer(git_indexer_stream *idx, git_off_t end)
 {
-	unsigned int i;
-	struct delta_info *delta;
+	struct git_pack_header hdr;
+	git_hash_ctx *ctx;
+	git_oid hash;
+	char buffer[64 * 1024];
+	ssize_t read_bytes = 0;
+	git_off_t off = 0;
+
+	hdr.hdr_signature = htonl(PACK_SIGNATURE);
+	hdr.hdr_version = htonl(PACK_VERSION);
+	hdr.hdr_entries = htonl((uint32_t)idx->nr_objects);
+
+	if (write_pack_at(idx, 0, &hdr, sizeof(hdr)) < 0 ||
+		p_lseek(idx->pack_file.fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	if ((ctx = git_hash_new_ctx()) == NULL)
+		return -1;
+
+	while (off < end && (read_bytes = p_read(idx->pack_file.fd, buffer,
+			(size_t)min((git_off_t)sizeof(buffer), end - off))) > 0) {
+		git_hash_update(ctx, buffer, read_bytes);
+		off += read_bytes;
+	}
+
+	git_hash_final(&hash, ctx);
+	git_hash_free_ctx(ctx);
+
+	if (read_bytes < 0 || off != end) {
+		giterr_set(GITERR_OS, "Failed to read back '%s'", idx->pack_file.path_lock);
+		return -1;
+	}
+
+	if (write_pack_at(idx, end, hash.id, GIT_OID_RAWSZ) < 0)
+		return -1;
+
+	git_mwindow_free_all(&idx->pack->mwf);
+	idx->pack->mwf.size = end + GIT_OID_RAWSZ;
+	return 0;
+}
+
+/*
+ * A thin pack leaves out the bases of some of its REF deltas, since
+ * the other end knows we have them already. Copy these bases from the
+ * object database to the end of the pack, so it stands on its own.
+ */
+static int fix_thin_pack(struct delta_tree *tree, git_transfer_progress *stats)
+{
+	git_indexer_stream *idx = tree->idx;
+	git_off_t end = idx->pack->mwf.size - GIT_OID_RAWSZ;
+	size_t i, appended = 0;
+
+	/* each missing base is named by a REF delta, so there can't be more */
+	if (resize_array((void **)&idx->entries,
+			idx->nr_objects + idx->ref_len, sizeof(*idx->entries)) < 0)
+		return -1;
+	idx->entries_alloc = idx->nr_objects + idx->ref_len;
 
-	git_vector_foreach(&idx->deltas, i, delta) {
+	for (i = 0; i < idx->ref_len; ++i) {
+		struct ref_delta *delta = &idx->ref_deltas[i];
+		struct object_entry *entry;
+		git_odb_object *base;
 		git_rawobj obj;
+		int error;
+
+		/* an earlier base may have brought this one in already */
+		if (git_atomic_get(&delta->resolved))
+			continue;
 
-		idx->off = delta->delta_off;
-		if (git_packfile_unpack(&obj, idx->pack, &idx->off) < 0)
+		error = git_odb_read(&base, idx->odb, &delta->base_oid);
+		if (error == GIT_ENOTFOUND) {
+			giterr_clear();
+			continue;
+		}
+		if (error < 0)
 			return -1;
 
-		if (hash_and_save(idx, &obj, delta->delta_off) < 0)
+		obj.data = (void *)git_odb_object_data(base);
+		obj.len = git_odb_object_size(base);
+		obj.type = git_odb_object_type(base);
+
+		entry = &idx->entries[idx->nr_objects + appended];
+		git_oid_cpy(&entry->oid, &delta->base_oid);
+
+		if ((error = append_object(&entry->offset, &entry->crc, idx, &end, &obj)) == 0) {
+			appended++;
+			error = resolve_tree(tree, entry, &obj, true);
+		}
+
+		git_odb_object_free(base);
+		if (error < 0)
 			return -1;
+	}
 
-		git__free(obj.data);
-		stats->indexed_objects++;
-		do_progress_callback(idx, stats);
+	if (!appended)
+		return 0;
+
+	idx->nr_objects += appended;
+	stats->total_objects += (unsigned int)appended;
+
+	return rewrite_pack_trailer(idx, end);
+}
+
+/* Move the deltas' slots after the roots', and point the records there */
+static int join_entries(git_indexer_stream *idx)
+{
+	size_t i;
+
+	if (idx->nr_roots + idx->nr_deltas > idx->entries_alloc) {
+		if (resize_array((void **)&idx->entries,
+				idx->nr_roots + idx->nr_deltas, sizeof(*idx->entries)) < 0)
+			return -1;
+		idx->entries_alloc = idx->nr_roots + idx->nr_deltas;
 	}
 
+	if (idx->nr_deltas > 0)
+		memcpy(idx->entries + idx->nr_roots, idx->delta_entries,
+			idx->nr_deltas * sizeof(*idx->entries));
+
+	git__free(idx->delta_entries);
+	idx->delta_entries = NULL;
+	idx->delta_alloc = 0;
+
+	for (i = 0; i < idx->ofs_len; ++i)
+		idx->ofs_deltas[i].entry += (uint32_t)idx->nr_roots;
+	for (i = 0; i < idx->ref_len; ++i)
+		idx->ref_deltas[i].entry += (uint32_t)idx->nr_roots;
+
 	return 0;
 }
 
+static int resolve_deltas(git_indexer_stream *idx, git_transfer_progress *stats)
+{
+	struct delta_tree tree;
+	size_t nr_objects = idx->nr_objects;
+
+	memset(&tree, 0, sizeof(tree));
+	tree.idx = idx;
+
+	qsort(idx->ofs_deltas, idx->ofs_len, sizeof(*idx->ofs_deltas), ofs_delta_cmp);
+	qsort(idx->ref_deltas, idx->ref_len, sizeof(*idx->ref_deltas), ref_delta_cmp);
+
+	if (resolve_roots_threaded(&tree, stats) < 0)
+		return -1;
+
+	if (idx->odb != NULL &&
+		idx->nr_roots + git_atomic_get(&tree.resolved) < idx->nr_objects &&
+		fix_thin_pack(&tree, stats) < 0)
+		return -1;
+
+	/* deltas whose base never showed up leave the count short */
+	stats->indexed_objects = (unsigned int)(idx->nr_roots +
+		(idx->nr_objects - nr_objects) + git_atomic_get(&tree.resolved));
+	do_progress_callback(idx, stats);
+	return 0;
+}
+
+static void close_pack(git_indexer_stream *idx)
+{
+	git_mwindow_free_all(&idx->pack->mwf);
+
+	if (idx->pack->mwf.fd >= 0) {
+		p_close(idx->pack->mwf.fd);
+		idx->pack->mwf.fd = -1;
+	}
+}
+
+void git_indexer_stream_set_threads(git_indexer_stream *idx, unsigned int n)
+{
+	assert(idx);
+	idx->nr_threads = n;
+}
+
+void git_indexer_stream_set_odb(git_indexer_stream *idx, git_odb *odb)
+{
+	assert(idx);
+	idx->odb = odb;
+}
+
+static int object_entry_cmp(const void *a, const void *b)
+{
+	const struct object_entry *ea = a;
+	const struct object_entry *eb = b;
+
+	return git_oid_cmp(&ea->oid, &eb->oid);
+}
+
+/*
+ * Sort the objects by name: a radix pass on the first byte moves each
+ * of them to its fanout bucket, in place, and then the buckets are
+ * sorted on their own.
+ */
+static void sort_entries(git_indexer_stream *idx)
+{
+	struct object_entry *entries = idx->entries;
+	size_t i, next[256];
+	unsigned int b;
+
+	memset(idx->fanout, 0, sizeof(idx->fanout));
+	for (i = 0; i < idx->nr_objects; ++i)
+		idx->fanout[entries[i].oid.id[0]]++;
+
+	for (b = 0; b < 256; ++b) {
+		next[b] = b ? idx->fanout[b - 1] : 0;
+		idx->fanout[b] += (unsigned int)next[b];
+	}
+
+	for (b = 0; b < 256; ++b) {
+		while (next[b] < idx->fanout[b]) {
+			unsigned int to = entries[next[b]].oid.id[0];
+			struct object_entry tmp;
+
+			if (to == b) {
+				next[b]++;
+				continue;
+			}
+
+			tmp = entries[next[to]];
+			entries[next[to]++] = entries[next[b]];
+			entries[next[b]] = tmp;
+		}
+	}
+
+	for (b = 0; b < 256; ++b) {
+		size_t start = b ? idx->fanout[b - 1] : 0;
+		qsort(entries + start, idx->fanout[b] - start, sizeof(*entries), object_entry_cmp);
+	}
+}
+
 int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *stats)
 {
 	git_mwindow *w = NULL;
 	unsigned int i, long_offsets = 0, left;
 	struct git_pack_idx_header hdr;
 	git_buf filename = GIT_BUF_INIT;
-	struct entry *entry;
+	struct object_entry *entry;
 	void *packfile_hash;
 	git_oid file_hash;
 	SHA_CTX ctx;
 
-	/* Test for this before resolve_deltas(), as it plays with idx->off */
+	if (!idx->parsed_header || idx->parsed_objects < idx->nr_objects ||
+		idx->off > idx->pack->mwf.size - GIT_OID_RAWSZ) {
+		giterr_set(GITERR_INDEXER, "Indexing error: early EOF");
+		return -1;
+	}
+
+	/* Test for this before resolve_deltas(), as it may grow the pack */
 	if (idx->off < idx->pack->mwf.size - GIT_OID_RAWSZ) {
 		giterr_set(GITERR_INDEXER, "Indexing error: junk at the end of the pack");
 		return -1;
 	}
 
-	if (idx->deltas.length > 0)
+	/* Everything up to the trailer was hashed as it came in */
+	git_hash_final(&file_hash, idx->pack_ctx);
+	packfile_hash = git_mwindow_open(&idx->pack->mwf, &w, idx->off, GIT_OID_RAWSZ, &left);
+	if (packfile_hash == NULL)
+		return -1;
+
+	i = git_oid_cmp(&file_hash, (git_oid *)packfile_hash);
+	git_mwindow_close(&w);
+	if (i != 0) {
+		giterr_set(GITERR_INDEXER, "Indexing error: pack checksum mismatch");
+		return -1;
+	}
+
+	if (join_entries(idx) < 0)
+		return -1;
+
+	if (idx->nr_deltas > 0)
 		if (resolve_deltas(idx, stats) < 0)
 			return -1;
 
@@ -479,7 +1385,7 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 		return -1;
 	}
 
-	git_vector_sort(&idx->objects);
+	sort_entries(idx);
 
 	git_buf_sets(&filename, idx->pack->pack_name);
 	git_buf_truncate(&filename, filename.size - strlen("pack"));
@@ -503,38 +1409,40 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 
 	/* Write out the object names (SHA-1 hashes) */
 	SHA1_Init(&ctx);
-	git_vector_foreach(&idx->objects, i, entry) {
+	for (i = 0; i < idx->nr_objects; ++i) {
+		entry = &idx->entries[i];
 		git_filebuf_write(&idx->index_file, &entry->oid, sizeof(git_oid));
 		SHA1_Update(&ctx, &entry->oid, GIT_OID_RAWSZ);
 	}
 	SHA1_Final(idx->hash.id, &ctx);
 
 	/* Write out the CRC32 values */
-	git_vector_foreach(&idx->objects, i, entry) {
-		git_filebuf_write(&idx->index_file, &entry->crc, sizeof(uint32_t));
-	}
+	for (i = 0; i < idx->nr_objects; ++i)
+		git_filebuf_write(&idx->index_file, &idx->entries[i].crc, sizeof(uint32_t));
 
 	/* Write out the offsets */
-	git_vector_foreach(&idx->objects, i, entry) {
+	for (i = 0; i < idx->nr_objects; ++i) {
 		uint32_t n;
 
-		if (entry->offset == UINT32_MAX)
+		entry = &idx->entries[i];
+		if (entry->offset > UINT31_MAX)
 			n = htonl(0x80000000 | long_offsets++);
 		else
-			n = htonl(entry->offset);
+			n = htonl((uint32_t)entry->offset);
 
 		git_filebuf_write(&idx->index_file, &n, sizeof(uint32_t));
 	}
 
 	/* Write out the long offsets */
-	git_vector_foreach(&idx->objects, i, entry) {
+	for (i = 0; i < idx->nr_objects; ++i) {
 		uint32_t split[2];
 
-		if (entry->offset != UINT32_MAX)
+		entry = &idx->entries[i];
+		if (entry->offset <= UINT31_MAX)
 			continue;
 
-		split[0] = htonl(entry->offset_long >> 32);
-		split[1] = htonl(entry->offset_long & 0xffffffff);
+		split[0] = htonl((uint32_t)(entry->offset >> 32));
+		split[1] = htonl((uint32_t)(entry->offset & 0xffffffff));
 
 		git_filebuf_write(&idx->index_file, &split, sizeof(uint32_t) * 2);
 	}
@@ -565,8 +1473,7 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 	if (git_filebuf_commit_at(&idx->index_file, filename.ptr, GIT_PACK_FILE_MODE) < 0)
 		goto on_error;
 
-	git_mwindow_free_all(&idx->pack->mwf);
-	p_close(idx->pack->mwf.fd);
+	close_pack(idx);
 
 	if (index_path_stream(&filename, idx, ".pack") < 0)
 		goto on_error;
@@ -578,8 +1485,7 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 	return 0;
 
 on_error:
-	git_mwindow_free_all(&idx->pack->mwf);
-	p_close(idx->pack->mwf.fd);
+	close_pack(idx);
 	git_filebuf_cleanup(&idx->index_file);
 	git_buf_free(&filename);
 	return -1;
@@ -587,25 +1493,26 @@ on_error:
 
 void git_indexer_stream_free(git_indexer_stream *idx)
 {
-	unsigned int i;
-	struct entry *e;
-	struct git_pack_entry *pe;
-	struct delta_info *delta;
-
 	if (idx == NULL)
 		return;
 
-	git_vector_foreach(&idx->objects, i, e)
-		git__free(e);
-	git_vector_free(&idx->objects);
 	if (idx->pack) {
-		git_vector_foreach(&idx->pack->cache, i, pe)
-			git__free(pe);
-		git_vector_free(&idx->pack->cache);
+		git_pack_cache_free(&idx->pack->bases);
+		close_pack(idx);
+		git_mwindow_file_free(&idx->pack->mwf);
 	}
-	git_vector_foreach(&idx->deltas, i, delta)
-		git__free(delta);
-	git_vector_free(&idx->deltas);
+	git__free(idx->entries);
+	git__free(idx->delta_entries);
+	git__free(idx->ofs_deltas);
+	git__free(idx->ref_deltas);
+	if (idx->zstream_open)
+		inflateEnd(&idx->zstream);
+	if (idx->object_ctx)
+		git_hash_free_ctx(idx->object_ctx);
+	if (idx->pack_ctx)
+		git_hash_free_ctx(idx->pack_ctx);
+	/* a pack which didn't make it to finalize is thrown away */
+	git_filebuf_cleanup(&idx->pack_file);
 	git__free(idx->pack);
 	git__free(idx);
 }
@@ -914,6 +1821,8 @@ void git_indexer_free(git_indexer *idx)
 	git_vector_foreach(&idx->pack->cache, i, pe)
 		git__free(pe);
 	git_vector_free(&idx->pack->cache);
+	git_pack_cache_free(&idx->pack->bases);
+	git_mwindow_file_free(&idx->pack->mwf);
 	git__free(idx->pack);
 	git__free(idx);
 }
@@ -0,0 +1,767 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "common.h"
+#include "midx.h"
+#include "buffer.h"
+#include "filebuf.h"
+#include "hash.h"
+#include "odb.h"
+#include "pack.h"
+#include "path.h"
+#include "sha1_lookup.h"
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_OBJECT_ID_VERSION 1 /* SHA1 */
+
+#define MIDX_PACKFILE_NAMES_ID 0x504e414d /* "PNAM" */
+#define MIDX_OID_FANOUT_ID 0x4f494446 /* "OIDF" */
+#define MIDX_OID_LOOKUP_ID 0x4f49444c /* "OIDL" */
+#define MIDX_OBJECT_OFFSETS_ID 0x4f4f4646 /* "OOFF" */
+#define MIDX_OBJECT_LARGE_OFFSETS_ID 0x4c4f4646 /* "LOFF" */
+
+#define MIDX_HEADER_SIZE 12
+#define MIDX_CHUNK_ENTRY_SIZE 12
+#define MIDX_FANOUT_SIZE (256 * 4)
+#define MIDX_OFFSET_ENTRY_SIZE 8
+
+struct git_midx_chunk {
+	uint32_t id;
+	uint64_t offset;
+	uint64_t length;
+};
+
+static int midx_error(const char *message)
+{
+	giterr_set(GITERR_ODB, "Invalid multi-pack index - %s", message);
+	return -1;
+}
+
+GIT_INLINE(uint32_t) get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+GIT_INLINE(uint64_t) get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+GIT_INLINE(void) put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+GIT_INLINE(void) put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, (uint32_t)(v >> 32));
+	put_be32(p + 4, (uint32_t)v);
+}
+
+/***********************************************************
+ *
+ * READING
+ *
+ ***********************************************************/
+
+static int midx_parse_packfile_names(
+	git_midx_file *idx,
+	const unsigned char *data,
+	uint32_t packfiles,
+	struct git_midx_chunk *chunk)
+{
+	const char *name, *end, *prev = NULL;
+	uint32_t i;
+
+	if (!chunk->offset)
+		return midx_error("missing packfile names chunk");
+
+	name = (const char *)(data + chunk->offset);
+	end = name + chunk->length;
+
+	for (i = 0; i < packfiles; ++i) {
+		const char *nul = memchr(name, '\0', end - name);
+		size_t len;
+
+		if (nul == NULL || nul == name)
+			return midx_error("unterminated packfile name");
+
+		len = nul - name;
+		if (git__suffixcmp(name, ".idx") != 0)
+			return midx_error("non-.idx packfile name");
+		if (prev != NULL && strcmp(prev, name) >= 0)
+			return midx_error("packfile names are not sorted");
+
+		if (git_vector_insert(&idx->packfile_names, (char *)name) < 0)
+			return -1;
+
+		prev = name;
+		name += len + 1;
+	}
+
+	return 0;
+}
+
+static int midx_parse_oid_fanout(
+	git_midx_file *idx,
+	const unsigned char *data,
+	struct git_midx_chunk *chunk)
+{
+	uint32_t i, nr = 0, n;
+
+	if (!chunk->offset)
+		return midx_error("missing OID fanout chunk");
+	if (chunk->length != MIDX_FANOUT_SIZE)
+		return midx_error("OID fanout chunk has wrong length");
+
+	idx->oid_fanout = (const uint32_t *)(data + chunk->offset);
+
+	for (i = 0; i < 256; ++i) {
+		n = ntohl(idx->oid_fanout[i]);
+		if (n < nr)
+			return midx_error("index is non-monotonic");
+		nr = n;
+	}
+
+	idx->num_objects = nr;
+	return 0;
+}
+
+static int midx_parse_oid_lookup(
+	git_midx_file *idx,
+	const unsigned char *data,
+	struct git_midx_chunk *chunk)
+{
+	uint32_t i;
+
+	if (!chunk->offset)
+		return midx_error("missing OID lookup chunk");
+	if (chunk->length != (uint64_t)idx->num_objects * GIT_OID_RAWSZ)
+		return midx_error("OID lookup chunk has wrong length");
+
+	idx->oid_lookup = data + chunk->offset;
+
+	for (i = 1; i < idx->num_objects; ++i) {
+		if (memcmp(idx->oid_lookup + (i - 1) * GIT_OID_RAWSZ,
+				idx->oid_lookup + i * GIT_OID_RAWSZ, GIT_OID_RAWSZ) >= 0)
+			return midx_error("OID lookup is not sorted");
+	}
+
+	return 0;
+}
+
+static int midx_parse(git_midx_file *idx, const unsigned char *data, size_t size)
+{
+	struct git_midx_chunk packfile_names = {0}, oid_fanout = {0},
+		oid_lookup = {0}, object_offsets = {0}, large_offsets = {0},
+		*chunk = NULL;
+	const unsigned char *chunk_hdr;
+	uint32_t i, packfiles, num_chunks;
+	uint64_t last_offset;
+	git_oid checksum;
+	size_t trailer_offset;
+
+	if (size < MIDX_HEADER_SIZE + GIT_OID_RAWSZ)
+		return midx_error("multi-pack index is too short");
+
+	if (get_be32(data) != MIDX_SIGNATURE ||
+		data[4] != MIDX_VERSION ||
+		data[5] != MIDX_OBJECT_ID_VERSION)
+		return midx_error("unsupported multi-pack index version");
+
+	num_chunks = data[6];
+	if (data[7] != 0)
+		return midx_error("chained multi-pack indexes are not supported");
+
+	packfiles = get_be32(data + 8);
+
+	trailer_offset = size - GIT_OID_RAWSZ;
+	if (trailer_offset < MIDX_HEADER_SIZE + (num_chunks + 1) * MIDX_CHUNK_ENTRY_SIZE)
+		return midx_error("wrong multi-pack index size");
+
+	git_hash_buf(&checksum, data, trailer_offset);
+	if (memcmp(checksum.id, data + trailer_offset, GIT_OID_RAWSZ) != 0)
+		return midx_error("checksum mismatch");
+	git_oid_cpy(&idx->checksum, &checksum);
+
+	chunk_hdr = data + MIDX_HEADER_SIZE;
+	last_offset = MIDX_HEADER_SIZE + (num_chunks + 1) * MIDX_CHUNK_ENTRY_SIZE;
+
+	for (i = 0; i < num_chunks; ++i, chunk_hdr += MIDX_CHUNK_ENTRY_SIZE) {
+		uint64_t offset = get_be64(chunk_hdr + 4);
+
+		if (offset < last_offset || offset >= trailer_offset)
+			return midx_error("chunks are non-monotonic");
+
+		if (chunk)
+			chunk->length = offset - last_offset;
+		last_offset = offset;
+
+		switch (get_be32(chunk_hdr)) {
+		case MIDX_PACKFILE_NAMES_ID:
+			chunk = &packfile_names;
+			break;
+		case MIDX_OID_FANOUT_ID:
+			chunk = &oid_fanout;
+			break;
+		case MIDX_OID_LOOKUP_ID:
+			chunk = &oid_lookup;
+			break;
+		case MIDX_OBJECT_OFFSETS_ID:
+			chunk = &object_offsets;
+			break;
+		case MIDX_OBJECT_LARGE_OFFSETS_ID:
+			chunk = &large_offsets;
+			break;
+		default:
+			/* chunks we don't know about are skipped */
+			chunk = NULL;
+			continue;
+		}
+
+		chunk->offset = offset;
+	}
+
+	/* the terminating entry gives the end of the last chunk */
+	last_offset = get_be64(chunk_hdr + 4);
+	if (last_offset > trailer_offset || (chunk && last_offset < chunk->offset))
+		return midx_error("chunks extend past the trailer");
+
+	if (chunk)
+		chunk->length = last_offset - chunk->offset;
+
+	if (midx_parse_packfile_names(idx, data, packfiles, &packfile_names) < 0 ||
+		midx_parse_oid_fanout(idx, data, &oid_fanout) < 0 ||
+		midx_parse_oid_lookup(idx, data, &oid_lookup) < 0)
+		return -1;
+
+	if (!object_offsets.offset)
+		return midx_error("missing object offsets chunk");
+	if (object_offsets.length != (uint64_t)idx->num_objects * MIDX_OFFSET_ENTRY_SIZE)
+		return midx_error("object offsets chunk has wrong length");
+	idx->object_offsets = data + object_offsets.offset;
+
+	if (large_offsets.offset) {
+		if (large_offsets.length % 8 != 0)
+			return midx_error("malformed large offsets chunk");
+		idx->object_large_offsets = data + large_offsets.offset;
+		idx->num_object_large_offsets = (size_t)(large_offsets.length / 8);
+	}
+
+	return 0;
+}
+
+int git_midx_open(git_midx_file **idx_out, const char *path)
+{
+	git_midx_file *idx;
+	git_file fd;
+	struct stat st;
+	int error;
+
+	*idx_out = NULL;
+
+	if ((fd = git_futils_open_ro(path)) < 0)
+		return fd;
+
+	if (p_fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+		!git__is_sizet(st.st_size)) {
+		p_close(fd);
+		giterr_set(GITERR_OS, "Failed to stat multi-pack index '%s'", path);
+		return -1;
+	}
+
+	idx = git__calloc(1, sizeof(git_midx_file));
+	GITERR_CHECK_ALLOC(idx);
+
+	idx->filename = git__strdup(path);
+	if (idx->filename == NULL ||
+		git_vector_init(&idx->packfile_names, 0, NULL) < 0) {
+		p_close(fd);
+		git_midx_free(idx);
+		return -1;
+	}
+
+	idx->stamp.mtime = (git_time_t)st.st_mtime;
+	idx->stamp.size = (git_off_t)st.st_size;
+	idx->stamp.ino = (unsigned int)st.st_ino;
+
+	error = git_futils_mmap_ro(&idx->index_map, fd, 0, (size_t)st.st_size);
+	p_close(fd);
+
+	if (error < 0 ||
+		(error = midx_parse(idx, idx->index_map.data, idx->index_map.len)) < 0) {
+		git_midx_free(idx);
+		return error;
+	}
+
+	*idx_out = idx;
+	return 0;
+}
+
+bool git_midx_needs_refresh(git_midx_file *idx)
+{
+	git_futils_filestamp stamp;
+
+	git_futils_filestamp_set(&stamp, &idx->stamp);
+	return git_futils_filestamp_check(&stamp, idx->filename) != 0;
+}
+
+static git_off_t midx_object_offset(git_midx_file *idx, uint32_t pos, size_t *pack_index)
+{
+	const unsigned char *entry = idx->object_offsets + pos * MIDX_OFFSET_ENTRY_SIZE;
+	uint32_t offset = get_be32(entry + 4);
+
+	*pack_index = get_be32(entry);
+
+	if (!(offset & 0x80000000))
+		return offset;
+
+	offset &= 0x7fffffff;
+	if (offset >= idx->num_object_large_offsets)
+		return midx_error("invalid large offset");
+
+	return (git_off_t)get_be64(idx->object_large_offsets + 8 * offset);
+}
+
+int git_midx_entry_find(
+	git_midx_entry *e,
+	git_midx_file *idx,
+	const git_oid *short_oid,
+	size_t len)
+{
+	int pos, found = 0;
+	unsigned hi, lo;
+	const unsigned char *current = NULL;
+	git_off_t offset;
+
+	hi = ntohl(idx->oid_fanout[(int)short_oid->id[0]]);
+	lo = ((short_oid->id[0] == 0x0) ? 0 : ntohl(idx->oid_fanout[(int)short_oid->id[0] - 1]));
+
+	pos = sha1_entry_pos(idx->oid_lookup, GIT_OID_RAWSZ, 0, lo, hi, idx->num_objects, short_oid->id);
+
+	if (pos >= 0) {
+		/* An object matching exactly the oid was found */
+		found = 1;
+		current = idx->oid_lookup + pos * GIT_OID_RAWSZ;
+	} else {
+		/* No object was found */
+		/* pos refers to the object with the "closest" oid to short_oid */
+		pos = -1 - pos;
+		if (pos < (int)idx->num_objects) {
+			current = idx->oid_lookup + pos * GIT_OID_RAWSZ;
+
+			if (!git_oid_ncmp(short_oid, (const git_oid *)current, len))
+				found = 1;
+		}
+	}
+
+	if (found && len != GIT_OID_HEXSZ && pos + 1 < (int)idx->num_objects) {
+		/* Check for ambiguousity */
+		const unsigned char *next = current + GIT_OID_RAWSZ;
+
+		if (!git_oid_ncmp(short_oid, (const git_oid *)next, len))
+			found = 2;
+	}
+
+	if (!found)
+		return GIT_ENOTFOUND;
+	if (found > 1)
+		return GIT_EAMBIGUOUS;
+
+	if ((offset = midx_object_offset(idx, (uint32_t)pos, &e->pack_index)) < 0)
+		return -1;
+
+	if (e->pack_index >= idx->packfile_names.length)
+		return midx_error("invalid pack index");
+
+	e->offset = offset;
+	git_oid_fromraw(&e->sha1, current);
+	return 0;
+}
+
+int git_midx_foreach_entry(
+	git_midx_file *idx,
+	int (*cb)(git_oid *oid, void *data),
+	void *data)
+{
+	git_oid oid;
+	uint32_t i;
+
+	for (i = 0; i < idx->num_objects; ++i) {
+		git_oid_fromraw(&oid, idx->oid_lookup + i * GIT_OID_RAWSZ);
+		if (cb(&oid, data))
+			return GIT_EUSER;
+	}
+
+	return 0;
+}
+
+void git_midx_free(git_midx_file *idx)
+{
+	if (idx == NULL)
+		return;
+
+	if (idx->index_map.data)
+		git_futils_mmap_free(&idx->index_map);
+
+	git_vector_free(&idx->packfile_names);
+	git__free(idx->filename);
+	git__free(idx);
+}
+
+/***********************************************************
+ *
+ * WRITING
+ *
+ ***********************************************************/
+
+struct git_midx_writer {
+	git_buf pack_dir;
+	git_vector packs;
+};
+
+struct midx_write_entry {
+	git_oid oid;
+	git_off_t offset;
+	uint32_t pack_index;
+	git_time_t mtime;
+};
+
+struct midx_write_ctx {
+	struct git_pack_file *pack;
+	uint32_t pack_index;
+	struct midx_write_entry *entries;
+	size_t nr, alloc;
+};
+
+static const char *pack_basename(struct git_pack_file *p)
+{
+	const char *name = strrchr(p->pack_name, '/');
+	return name ? name + 1 : p->pack_name;
+}
+
+static int packfile_name_cmp(const void *a, const void *b)
+{
+	return strcmp(pack_basename((struct git_pack_file *)a),
+		pack_basename((struct git_pack_file *)b));
+}
+
+int git_midx_writer_new(git_midx_writer **out, const char *pack_dir)
+{
+	git_midx_writer *w;
+
+	assert(out && pack_dir);
+
+	w = git__calloc(1, sizeof(git_midx_writer));
+	GITERR_CHECK_ALLOC(w);
+
+	if (git_buf_sets(&w->pack_dir, pack_dir) < 0 ||
+		git_path_to_dir(&w->pack_dir) < 0 ||
+		git_vector_init(&w->packs, 0, packfile_name_cmp) < 0) {
+		git_midx_writer_free(w);
+		return -1;
+	}
+
+	*out = w;
+	return 0;
+}
+
+int git_midx_writer_add(git_midx_writer *w, const char *idx_path)
+{
+	git_buf path = GIT_BUF_INIT;
+	struct git_pack_file *p, *other;
+	unsigned int i;
+	int error;
+
+	assert(w && idx_path);
+
+	if (git_path_root(idx_path) >= 0)
+		error = git_buf_sets(&path, idx_path);
+	else
+		error = git_buf_joinpath(&path, git_buf_cstr(&w->pack_dir), idx_path);
+
+	if (error < 0)
+		return error;
+
+	if (git__suffixcmp(git_buf_cstr(&path), ".idx") != 0) {
+		giterr_set(GITERR_INVALID, "'%s' is not a pack index", git_buf_cstr(&path));
+		git_buf_free(&path);
+		return -1;
+	}
+
+	error = git_packfile_check(&p, git_buf_cstr(&path));
+	git_buf_free(&path);
+
+	if (error < 0)
+		return error;
+
+	git_vector_foreach(&w->packs, i, other) {
+		if (strcmp(pack_basename(other), pack_basename(p)) == 0) {
+			packfile_free(p);
+			return 0;
+		}
+	}
+
+	if ((error = git_vector_insert(&w->packs, p)) < 0)
+		packfile_free(p);
+
+	return error;
+}
+
+static int midx_add_all__cb(void *payload, git_buf *path)
+{
+	git_midx_writer *w = payload;
+
+	if (git__suffixcmp(path->ptr, ".idx") != 0)
+		return 0;
+
+	return git_midx_writer_add(w, path->ptr);
+}
+
+int git_midx_writer_add_all(git_midx_writer *w)
+{
+	git_buf path = GIT_BUF_INIT;
+	int error;
+
+	assert(w);
+
+	if (git_buf_set(&path, w->pack_dir.ptr, w->pack_dir.size) < 0)
+		return -1;
+
+	error = git_path_direach(&path, midx_add_all__cb, w);
+	git_buf_free(&path);
+
+	return error;
+}
+
+static int midx_write_entry_cmp(const void *a_, const void *b_)
+{
+	const struct midx_write_entry *a = a_, *b = b_;
+	int cmp = git_oid_cmp(&a->oid, &b->oid);
+
+	if (cmp)
+		return cmp;
+
+	/* prefer the object from the most recent pack */
+	if (a->mtime != b->mtime)
+		return (a->mtime > b->mtime) ? -1 : 1;
+
+	return (int)a->pack_index - (int)b->pack_index;
+}
+
+static int midx_collect__cb(git_oid *oid, void *data)
+{
+	struct midx_write_ctx *ctx = data;
+	struct git_pack_entry e;
+	struct midx_write_entry *entry;
+
+	if (git_pack_entry_find(&e, ctx->pack, oid, GIT_OID_HEXSZ) < 0)
+		return -1;
+
+	if (ctx->nr == ctx->alloc) {
+		struct midx_write_entry *entries;
+
+		ctx->alloc = (ctx->alloc + 1024) * 3 / 2;
+		entries = git__realloc(ctx->entries, ctx->alloc * sizeof(*entries));
+		GITERR_CHECK_ALLOC(entries);
+		ctx->entries = entries;
+	}
+
+	entry = &ctx->entries[ctx->nr++];
+	git_oid_cpy(&entry->oid, oid);
+	entry->offset = e.offset;
+	entry->pack_index = ctx->pack_index;
+	entry->mtime = ctx->pack->mtime;
+
+	return 0;
+}
+
+static int midx_write_chunk_header(git_buf *buf, uint32_t id, uint64_t offset)
+{
+	unsigned char hdr[MIDX_CHUNK_ENTRY_SIZE];
+
+	put_be32(hdr, id);
+	put_be64(hdr + 4, offset);
+	return git_buf_put(buf, (const char *)hdr, sizeof(hdr));
+}
+
+static int midx_write_buf(git_buf *buf, git_midx_writer *w)
+{
+	struct midx_write_ctx ctx = {0};
+	git_buf names = GIT_BUF_INIT, oids = GIT_BUF_INIT,
+		offsets = GIT_BUF_INIT, large_offsets = GIT_BUF_INIT;
+	unsigned char be[8];
+	uint32_t fanout[256] = {0};
+	size_t i, nr = 0, num_chunks;
+	uint64_t offset;
+	struct git_pack_file *p;
+	const char *name;
+	git_oid checksum;
+	int error = 0;
+
+	git_vector_sort(&w->packs);
+
+	/* gather every object from every pack, then sort and dedup */
+	git_vector_foreach(&w->packs, i, p) {
+		ctx.pack = p;
+		ctx.pack_index = (uint32_t)i;
+
+		if ((error = git_pack_foreach_entry(p, midx_collect__cb, &ctx)) < 0)
+			goto cleanup;
+
+		/* the file records the names of the indexes, not the packs */
+		name = pack_basename(p);
+		git_buf_put(&names, name, strlen(name) - strlen(".pack"));
+		git_buf_puts(&names, ".idx");
+		git_buf_putc(&names, '\0');
+	}
+
+	/* the names chunk is padded to a multiple of four bytes */
+	while (names.size % 4)
+		git_buf_putc(&names, '\0');
+
+	if (ctx.nr)
+		qsort(ctx.entries, ctx.nr, sizeof(*ctx.entries), midx_write_entry_cmp);
+
+	for (i = 0; i < ctx.nr; ++i) {
+		struct midx_write_entry *entry = &ctx.entries[i];
+		uint32_t ofs;
+		int j;
+
+		if (i > 0 && git_oid_cmp(&entry->oid, &ctx.entries[i - 1].oid) == 0)
+			continue;
+
+		git_buf_put(&oids, (const char *)entry->oid.id, GIT_OID_RAWSZ);
+
+		if (entry->offset > 0x7fffffff) {
+			ofs = 0x80000000 | (uint32_t)(large_offsets.size / 8);
+			put_be64(be, (uint64_t)entry->offset);
+			git_buf_put(&large_offsets, (const char *)be, 8);
+		} else {
+			ofs = (uint32_t)entry->offset;
+		}
+
+		put_be32(be, entry->pack_index);
+		put_be32(be + 4, ofs);
+		git_buf_put(&offsets, (const char *)be, 8);
+
+		for (j = entry->oid.id[0]; j < 256; ++j)
+			fanout[j]++;
+		nr++;
+	}
+
+	if (git_buf_oom(&names) || git_buf_oom(&oids) ||
+		git_buf_oom(&offsets) || git_buf_oom(&large_offsets)) {
+		error = -1;
+		goto cleanup;
+	}
+
+	num_chunks = large_offsets.size ? 5 : 4;
+
+	/* header */
+	put_be32(be, MIDX_SIGNATURE);
+	be[4] = MIDX_VERSION;
+	be[5] = MIDX_OBJECT_ID_VERSION;
+	be[6] = (unsigned char)num_chunks;
+	be[7] = 0; /* no base multi-pack indexes */
+	git_buf_put(buf, (const char *)be, 8);
+	put_be32(be, (uint32_t)w->packs.length);
+	git_buf_put(buf, (const char *)be, 4);
+
+	/* chunk table */
+	offset = MIDX_HEADER_SIZE + (num_chunks + 1) * MIDX_CHUNK_ENTRY_SIZE;
+
+	midx_write_chunk_header(buf, MIDX_PACKFILE_NAMES_ID, offset);
+	offset += names.size;
+	midx_write_chunk_header(buf, MIDX_OID_FANOUT_ID, offset);
+	offset += MIDX_FANOUT_SIZE;
+	midx_write_chunk_header(buf, MIDX_OID_LOOKUP_ID, offset);
+	offset += oids.size;
+	midx_write_chunk_header(buf, MIDX_OBJECT_OFFSETS_ID, offset);
+	offset += offsets.size;
+	if (large_offsets.size) {
+		midx_write_chunk_header(buf, MIDX_OBJECT_LARGE_OFFSETS_ID, offset);
+		offset += large_offsets.size;
+	}
+	midx_write_chunk_header(buf, 0, offset);
+
+	/* chunks */
+	git_buf_put(buf, names.ptr, names.size);
+	for (i = 0; i < 256; ++i) {
+		put_be32(be, fanout[i]);
+		git_buf_put(buf, (const char *)be, 4);
+	}
+	git_buf_put(buf, oids.ptr, oids.size);
+	git_buf_put(buf, offsets.ptr, offsets.size);
+	git_buf_put(buf, large_offsets.ptr, large_offsets.size);
+
+	if (git_buf_oom(buf)) {
+		error = -1;
+		goto cleanup;
+	}
+
+	/* trailer */
+	git_hash_buf(&checksum, buf->ptr, buf->size);
+	error = git_buf_put(buf, (const char *)checksum.id, GIT_OID_RAWSZ);
+
+cleanup:
+	git__free(ctx.entries);
+	git_buf_free(&names);
+	git_buf_free(&oids);
+	git_buf_free(&offsets);
+	git_buf_free(&large_offsets);
+	return error;
+}
+
+int git_midx_writer_commit(git_midx_writer *w)
+{
+	git_buf path = GIT_BUF_INIT, contents = GIT_BUF_INIT;
+	git_filebuf output = GIT_FILEBUF_INIT;
+	int error;
+
+	assert(w);
+
+	if ((error = git_buf_joinpath(&path, git_buf_cstr(&w->pack_dir), GIT_MIDX_FILE)) < 0 ||
+		(error = midx_write_buf(&contents, w)) < 0)
+		goto cleanup;
+
+	if ((error = git_filebuf_open(&output, git_buf_cstr(&path), 0)) < 0)
+		goto cleanup;
+
+	if ((error = git_filebuf_write(&output, contents.ptr, contents.size)) < 0) {
+		git_filebuf_cleanup(&output);
+		goto cleanup;
+	}
+
+	error = git_filebuf_commit(&output, GIT_PACK_FILE_MODE);
+
+cleanup:
+	git_buf_free(&path);
+	git_buf_free(&contents);
+	return error;
+}
+
+void git_midx_writer_free(git_midx_writer *w)
+{
+	struct git_pack_file *p;
+	unsigned int i;
+
+	if (w == NULL)
+		return;
+
+	git_vector_foreach(&w->packs, i, p)
+		packfile_free(p);
+
+	git_vector_free(&w->packs);
+	git_buf_free(&w->pack_dir);
+	git__free(w);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_midx_h__
+#define INCLUDE_midx_h__
+
+#include "git2/midx.h"
+#include "git2/oid.h"
+
+#include "common.h"
+#include "fileops.h"
+#include "map.h"
+#include "vector.h"
+
+#define GIT_MIDX_FILE "multi-pack-index"
+
+/*
+ * A multi-pack index, as written by `git multi-pack-index write`:
+ * one sorted table of object names covering several packfiles,
+ * mapping every object to the pack and offset it lives at.
+ *
+ * The file is made of a header, a table of chunks and a trailing
+ * SHA1 of the whole contents. We understand the mandatory chunks
+ * (pack names, OID fanout, OID lookup, object offsets) and the
+ * optional large offsets chunk.
+ */
+typedef struct git_midx_file {
+	git_map index_map;
+
+	/* the fanout table of object names, in network order */
+	const uint32_t *oid_fanout;
+	uint32_t num_objects;
+
+	/* the sorted object names */
+	const unsigned char *oid_lookup;
+
+	/* pack id and offset for every object, in network order */
+	const unsigned char *object_offsets;
+
+	/* offsets which don't fit in 31 bits, in network order */
+	const unsigned char *object_large_offsets;
+	size_t num_object_large_offsets;
+
+	/* the names of the indexes of the covered packs, sorted */
+	git_vector packfile_names;
+
+	git_oid checksum;
+	git_futils_filestamp stamp;
+
+	char *filename;
+} git_midx_file;
+
+typedef struct git_midx_entry {
+	git_oid sha1;
+	git_off_t offset;
+	size_t pack_index;
+} git_midx_entry;
+
+/*
+ * Map and validate the multi-pack index at `path`. Returns
+ * GIT_ENOTFOUND when there is no such file.
+ */
+int git_midx_open(git_midx_file **idx_out, const char *path);
+
+/*
+ * Whether the file backing `idx` has been replaced or removed
+ * since it was opened.
+ */
+bool git_midx_needs_refresh(git_midx_file *idx);
+
+/*
+ * Find an object given a prefix of its name. Returns GIT_ENOTFOUND
+ * or GIT_EAMBIGUOUS without setting an error message, since the
+ * caller usually has other places to look.
+ */
+int git_midx_entry_find(
+	git_midx_entry *e,
+	git_midx_file *idx,
+	const git_oid *short_oid,
+	size_t len);
+
+int git_midx_foreach_entry(
+	git_midx_file *idx,
+	int (*cb)(git_oid *oid, void *data),
+	void *data);
+
+void git_midx_free(git_midx_file *idx);
+
+#endif
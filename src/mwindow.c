@@ -20,21 +20,84 @@
 #define DEFAULT_MAPPED_LIMIT \
 	((1024 * 1024) * (sizeof(void*) >= 8 ? 8192ULL : 256UL))
 
+/* By default, we keep every file we've opened open */
+#define DEFAULT_FILE_LIMIT 0
+
 /*
  * These are the global options for mmmap limits.
- * TODO: allow the user to change these
  */
-static struct {
-	size_t window_size;
-	size_t mapped_limit;
-} _mw_options = {
-	DEFAULT_WINDOW_SIZE,
-	DEFAULT_MAPPED_LIMIT,
-};
+size_t git_mwindow__window_size = DEFAULT_WINDOW_SIZE;
+size_t git_mwindow__mapped_limit = DEFAULT_MAPPED_LIMIT;
+size_t git_mwindow__file_limit = DEFAULT_FILE_LIMIT;
+int git_mwindow__map_whole_files = 0;
 
 /* Whenever you want to read or modify this, grab git__mwindow_mutex */
 static git_mwindow_ctl mem_ctl;
 
+static size_t mwindow_page_size(void)
+{
+	static size_t page_size;
+
+	if (!page_size) {
+#ifdef GIT_WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		page_size = (size_t)info.dwAllocationGranularity;
+#else
+		page_size = (size_t)sysconf(_SC_PAGE_SIZE);
+#endif
+	}
+
+	return page_size;
+}
+
+int git_mwindow_set_window_size(size_t size)
+{
+	/* windows start at a multiple of half their size, which must be page aligned */
+	size_t align = 2 * mwindow_page_size();
+
+	if (size == 0) {
+		giterr_set(GITERR_INVALID, "The memory window size cannot be 0");
+		return -1;
+	}
+
+	git_mwindow__window_size = ((size + align - 1) / align) * align;
+	return 0;
+}
+
+void git_mwindow_file_init(git_mwindow_file *mwf)
+{
+#ifndef GIT_THREADS
+	GIT_UNUSED(mwf);
+#endif
+	git_mutex_init(&mwf->lock);
+}
+
+void git_mwindow_file_free(git_mwindow_file *mwf)
+{
+#ifndef GIT_THREADS
+	GIT_UNUSED(mwf);
+#endif
+	git_mutex_free(&mwf->lock);
+}
+
+/* Unmap all the windows of a file; call with both locks held */
+static void mwindow_unmap_all(git_mwindow_ctl *ctl, git_mwindow_file *mwf)
+{
+	while (mwf->windows) {
+		git_mwindow *w = mwf->windows;
+		assert(git_atomic_get(&w->inuse_cnt) == 0);
+
+		ctl->mapped -= w->window_map.len;
+		ctl->open_windows--;
+
+		git_futils_mmap_free(&w->window_map);
+
+		mwf->windows = w->next;
+		git__free(w);
+	}
+}
+
 /*
  * Free all the windows in a sequence, typically because we're done
  * with the file
@@ -44,6 +107,7 @@ void git_mwindow_free_all(git_mwindow_file *mwf)
 	git_mwindow_ctl *ctl = &mem_ctl;
 	unsigned int i;
 
+	git_mutex_lock(&mwf->lock);
 	git_mutex_lock(&git__mwindow_mutex);
 
 	/*
@@ -61,20 +125,10 @@ void git_mwindow_free_all(git_mwindow_file *mwf)
 		ctl->windowfiles.contents = NULL;
 	}
 
-	while (mwf->windows) {
-		git_mwindow *w = mwf->windows;
-		assert(w->inuse_cnt == 0);
-
-		ctl->mapped -= w->window_map.len;
-		ctl->open_windows--;
-
-		git_futils_mmap_free(&w->window_map);
-
-		mwf->windows = w->next;
-		git__free(w);
-	}
+	mwindow_unmap_all(ctl, mwf);
 
 	git_mutex_unlock(&git__mwindow_mutex);
+	git_mutex_unlock(&mwf->lock);
 }
 
 /*
@@ -98,7 +152,7 @@ static void git_mwindow_scan_lru(
 	git_mwindow *w, *w_l;
 
 	for (w_l = NULL, w = mwf->windows; w; w = w->next) {
-		if (!w->inuse_cnt) {
+		if (!git_atomic_get(&w->inuse_cnt)) {
 			/*
 			 * If the current one is more recent than the last one,
 			 * store it in the output parameter. If lru_w is NULL,
@@ -115,14 +169,18 @@ static void git_mwindow_scan_lru(
 
 /*
  * Close the least recently used window. You should check to see if
- * the file descriptors need closing from time to time. Called under
- * lock from new_window.
+ * the file descriptors need closing from time to time. Called from
+ * new_window with the lock of `mwf` and the global lock held.
+ *
+ * The other files are only looked at if we can get their lock right
+ * away: whoever holds it may well be waiting for the global lock.
  */
 static int git_mwindow_close_lru(git_mwindow_file *mwf)
 {
 	git_mwindow_ctl *ctl = &mem_ctl;
 	unsigned int i;
-	git_mwindow *lru_w = NULL, *lru_l = NULL, **list = &mwf->windows;
+	git_mwindow *lru_w = NULL, *lru_l = NULL;
+	git_mwindow_file *lru_f = mwf;
 
 	/* FIXME: Does this give us any advantage? */
 	if(mwf->windows)
@@ -131,9 +189,21 @@ static int git_mwindow_close_lru(git_mwindow_file *mwf)
 	for (i = 0; i < ctl->windowfiles.length; ++i) {
 		git_mwindow *last = lru_w;
 		git_mwindow_file *cur = git_vector_get(&ctl->windowfiles, i);
+
+		if (cur == mwf || git_mutex_trylock(&cur->lock) != 0)
+			continue;
+
 		git_mwindow_scan_lru(cur, &lru_w, &lru_l);
-		if (lru_w != last)
-			list = &cur->windows;
+
+		if (lru_w == last) {
+			git_mutex_unlock(&cur->lock);
+			continue;
+		}
+
+		/* keep the file holding the best candidate locked */
+		if (lru_f != mwf)
+			git_mutex_unlock(&lru_f->lock);
+		lru_f = cur;
 	}
 
 	if (!lru_w) {
@@ -147,15 +217,75 @@ static int git_mwindow_close_lru(git_mwindow_file *mwf)
 	if (lru_l)
 		lru_l->next = lru_w->next;
 	else
-		*list = lru_w->next;
+		lru_f->windows = lru_w->next;
 
 	git__free(lru_w);
 	ctl->open_windows--;
 
+	if (lru_f != mwf)
+		git_mutex_unlock(&lru_f->lock);
+
 	return 0;
 }
 
-/* This gets called under lock from git_mwindow_open */
+/*
+ * Close the descriptors of the files we haven't used for the longest
+ * time until we're back below the open file limit. Their windows stay
+ * mapped. Called with the global lock held, from `mwf` being registered.
+ */
+static void mwindow_close_files(git_mwindow_file *mwf)
+{
+	git_mwindow_ctl *ctl = &mem_ctl;
+	git_mwindow_file *cur;
+	git_mwindow *w;
+	size_t open_files = 0;
+	unsigned int i;
+
+	git_vector_foreach(&ctl->windowfiles, i, cur) {
+		if (cur->fd != -1)
+			open_files++;
+	}
+
+	while (open_files > git_mwindow__file_limit) {
+		git_mwindow_file *lru_f = NULL;
+		unsigned int lru_used = 0;
+
+		git_vector_foreach(&ctl->windowfiles, i, cur) {
+			unsigned int last_used = 0;
+
+			if (cur == mwf || cur->reopen == NULL || cur->fd == -1 ||
+				git_mutex_trylock(&cur->lock) != 0)
+				continue;
+
+			for (w = cur->windows; w; w = w->next) {
+				if (w->last_used > last_used)
+					last_used = w->last_used;
+			}
+
+			if (lru_f == NULL || last_used < lru_used) {
+				if (lru_f != NULL)
+					git_mutex_unlock(&lru_f->lock);
+
+				lru_f = cur;
+				lru_used = last_used;
+			} else {
+				git_mutex_unlock(&cur->lock);
+			}
+		}
+
+		/* the limit is a soft one */
+		if (lru_f == NULL)
+			break;
+
+		p_close(lru_f->fd);
+		lru_f->fd = -1;
+		git_mutex_unlock(&lru_f->lock);
+
+		open_files--;
+	}
+}
+
+/* This gets called from git_mwindow_open with the file's lock held */
 static git_mwindow *new_window(
 	git_mwindow_file *mwf,
 	git_file fd,
@@ -163,7 +293,7 @@ static git_mwindow *new_window(
 	git_off_t offset)
 {
 	git_mwindow_ctl *ctl = &mem_ctl;
-	size_t walign = _mw_options.window_size / 2;
+	size_t walign = git_mwindow__window_size / 2;
 	git_off_t len;
 	git_mwindow *w;
 
@@ -173,28 +303,45 @@ static git_mwindow *new_window(
 		return NULL;
 
 	memset(w, 0x0, sizeof(*w));
-	w->offset = (offset / walign) * walign;
 
-	len = size - w->offset;
-	if (len > (git_off_t)_mw_options.window_size)
-		len = (git_off_t)_mw_options.window_size;
+	/* with a 64-bit address space, we can afford to map whole files */
+	if (git_mwindow__map_whole_files && sizeof(void *) >= 8) {
+		w->offset = 0;
+		len = size;
+	} else {
+		w->offset = (offset / walign) * walign;
+
+		len = size - w->offset;
+		if (len > (git_off_t)git_mwindow__window_size)
+			len = (git_off_t)git_mwindow__window_size;
+	}
+
+	git_mutex_lock(&git__mwindow_mutex);
 
 	ctl->mapped += (size_t)len;
 
-	while (_mw_options.mapped_limit < ctl->mapped &&
+	while (git_mwindow__mapped_limit < ctl->mapped &&
 			git_mwindow_close_lru(mwf) == 0) /* nop */;
 
+	git_mutex_unlock(&git__mwindow_mutex);
+
 	/*
-	 * We treat _mw_options.mapped_limit as a soft limit. If we can't find a
-	 * window to close and are above the limit, we still mmap the new
-	 * window.
+	 * We treat git_mwindow__mapped_limit as a soft limit. If we can't
+	 * find a window to close and are above the limit, we still mmap
+	 * the new window.
 	 */
 
 	if (git_futils_mmap_ro(&w->window_map, fd, w->offset, (size_t)len) < 0) {
+		git_mutex_lock(&git__mwindow_mutex);
+		ctl->mapped -= (size_t)len;
+		git_mutex_unlock(&git__mwindow_mutex);
+
 		git__free(w);
 		return NULL;
 	}
 
+	git_mutex_lock(&git__mwindow_mutex);
+
 	ctl->mmap_calls++;
 	ctl->open_windows++;
 
@@ -204,6 +351,8 @@ static git_mwindow *new_window(
 	if (ctl->open_windows > ctl->peak_open_windows)
 		ctl->peak_open_windows = ctl->open_windows;
 
+	git_mutex_unlock(&git__mwindow_mutex);
+
 	return w;
 }
 
@@ -221,10 +370,11 @@ unsigned char *git_mwindow_open(
 	git_mwindow_ctl *ctl = &mem_ctl;
 	git_mwindow *w = *cursor;
 
-	git_mutex_lock(&git__mwindow_mutex);
+	git_mutex_lock(&mwf->lock);
 	if (!w || !(git_mwindow_contains(w, offset) && git_mwindow_contains(w, offset + extra))) {
 		if (w) {
-			w->inuse_cnt--;
+			git_atomic_dec(&w->inuse_cnt);
+			*cursor = NULL;
 		}
 
 		for (w = mwf->windows; w; w = w->next) {
@@ -238,9 +388,15 @@ unsigned char *git_mwindow_open(
 		 * one.
 		 */
 		if (!w) {
+			/* we may have closed it to stay below the open file limit */
+			if (mwf->fd == -1 && mwf->reopen != NULL && mwf->reopen(mwf) < 0) {
+				git_mutex_unlock(&mwf->lock);
+				return NULL;
+			}
+
 			w = new_window(mwf, mwf->fd, mwf->size, offset);
 			if (w == NULL) {
-				git_mutex_unlock(&git__mwindow_mutex);
+				git_mutex_unlock(&mwf->lock);
 				return NULL;
 			}
 			w->next = mwf->windows;
@@ -250,24 +406,29 @@ unsigned char *git_mwindow_open(
 
 	/* If we changed w, store it in the cursor */
 	if (w != *cursor) {
-		w->last_used = ctl->used_ctr++;
-		w->inuse_cnt++;
+		w->last_used = (unsigned int)git_atomic_inc(&ctl->used_ctr);
+		git_atomic_inc(&w->inuse_cnt);
 		*cursor = w;
 	}
 
 	offset -= w->offset;
 
-	if (left)
-		*left = (unsigned int)(w->window_map.len - offset);
+	/* a window may be larger than `left` can say; callers come back for the rest */
+	if (left) {
+		size_t avail = w->window_map.len - (size_t)offset;
+		*left = avail > UINT_MAX ? UINT_MAX : (unsigned int)avail;
+	}
 
-	git_mutex_unlock(&git__mwindow_mutex);
+	git_mutex_unlock(&mwf->lock);
 	return (unsigned char *) w->window_map.data + offset;
 }
 
 int git_mwindow_file_register(git_mwindow_file *mwf)
 {
 	git_mwindow_ctl *ctl = &mem_ctl;
-	int ret;
+	git_mwindow_file *cur;
+	unsigned int i;
+	int ret = 0;
 
 	git_mutex_lock(&git__mwindow_mutex);
 	if (ctl->windowfiles.length == 0 &&
@@ -276,7 +437,18 @@ int git_mwindow_file_register(git_mwindow_file *mwf)
 		return -1;
 	}
 
-	ret = git_vector_insert(&ctl->windowfiles, mwf);
+	/* files which get reopened are already registered */
+	git_vector_foreach(&ctl->windowfiles, i, cur) {
+		if (cur == mwf)
+			break;
+	}
+
+	if (i == ctl->windowfiles.length)
+		ret = git_vector_insert(&ctl->windowfiles, mwf);
+
+	if (!ret && git_mwindow__file_limit > 0)
+		mwindow_close_files(mwf);
+
 	git_mutex_unlock(&git__mwindow_mutex);
 
 	return ret;
@@ -306,9 +478,7 @@ void git_mwindow_close(git_mwindow **window)
 {
 	git_mwindow *w = *window;
 	if (w) {
-		git_mutex_lock(&git__mwindow_mutex);
-		w->inuse_cnt--;
-		git_mutex_unlock(&git__mwindow_mutex);
+		git_atomic_dec(&w->inuse_cnt);
 		*window = NULL;
 	}
 }
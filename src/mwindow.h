@@ -10,19 +10,33 @@
 
 #include "map.h"
 #include "vector.h"
+#include "thread-utils.h"
 
 typedef struct git_mwindow {
 	struct git_mwindow *next;
 	git_map window_map;
 	git_off_t offset;
-	size_t last_used;
-	size_t inuse_cnt;
+	unsigned int last_used;
+	git_atomic inuse_cnt;
 } git_mwindow;
 
+/*
+ * The windows of a file are guarded by the file's own lock, so that
+ * threads reading from different files never wait on each other. The
+ * global `git__mwindow_mutex` is only taken to account for windows
+ * being mapped or unmapped, and for the list of files.
+ *
+ * Files which know how to `reopen` themselves may have their descriptor
+ * closed to stay below the open file limit; their windows stay mapped,
+ * and `reopen` is called with the file's lock held when a new window
+ * is needed.
+ */
 typedef struct git_mwindow_file {
+	git_mutex lock;
 	git_mwindow *windows;
 	int fd;
 	git_off_t size;
+	int (*reopen)(struct git_mwindow_file *mwf);
 } git_mwindow_file;
 
 typedef struct git_mwindow_ctl {
@@ -31,10 +45,21 @@ typedef struct git_mwindow_ctl {
 	unsigned int mmap_calls;
 	unsigned int peak_open_windows;
 	size_t peak_mapped;
-	size_t used_ctr;
+	git_atomic used_ctr;
 	git_vector windowfiles;
 } git_mwindow_ctl;
 
+/* Global limits, tweakable through `git_libgit2_opts` */
+extern size_t git_mwindow__window_size;
+extern size_t git_mwindow__mapped_limit;
+extern size_t git_mwindow__file_limit;
+extern int git_mwindow__map_whole_files;
+
+int git_mwindow_set_window_size(size_t size);
+
+void git_mwindow_file_init(git_mwindow_file *mwf);
+void git_mwindow_file_free(git_mwindow_file *mwf);
+
 int git_mwindow_contains(git_mwindow *win, git_off_t offset);
 void git_mwindow_free_all(git_mwindow_file *mwf);
 unsigned char *git_mwindow_open(git_mwindow_file *mwf, git_mwindow **cursor, git_off_t offset, size_t extra, unsigned int *left);
@@ -13,15 +13,20 @@
 #include "odb.h"
 #include "delta-apply.h"
 #include "filter.h"
+#include "commit_graph.h"
 
 #include "git2/odb_backend.h"
 #include "git2/oid.h"
 
+GIT__USE_OIDMAP;
+
 #define GIT_ALTERNATES_FILE "info/alternates"
 
 /* TODO: is this correct? */
 #define GIT_LOOSE_PRIORITY 2
 #define GIT_PACKED_PRIORITY 1
+/* ahead of anything else, so bulk writes aren't taken by another backend */
+#define GIT_BULK_PRIORITY 1000
 
 typedef struct
 {
@@ -30,6 +35,8 @@ typedef struct
 	int is_alternate;
 } backend_internal;
 
+int git_odb__negative_cache_ttl = 0;
+
 static int format_object_header(char *hdr, size_t n, size_t obj_len, git_otype obj_type)
 {
 	const char *type_str = git_object_type2string(obj_type);
@@ -67,9 +74,14 @@ int git_odb__hashobj(git_oid *id, git_rawobj *obj)
 static git_odb_object *new_odb_object(const git_oid *oid, git_rawobj *source)
 {
 	git_odb_object *object = git__malloc(sizeof(git_odb_object));
+	if (object == NULL)
+		return NULL;
+
 	memset(object, 0x0, sizeof(git_odb_object));
 
 	git_oid_cpy(&object->cached.oid, oid);
+	object->cached.type = source->type;
+	object->cached.size = source->len;
 	memcpy(&object->raw, source, sizeof(git_rawobj));
 
 	return object;
@@ -335,18 +347,173 @@ static int backend_sort_cmp(const void *a, const void *b)
 	return backend_a->is_alternate ? 1 : -1;
 }
 
+/*
+ * Negative lookup cache
+ *
+ * Checking for an object which isn't there means asking every backend,
+ * and every backend going to disk (and the pack backend rescanning its
+ * folder) before giving up. Callers which probe for lots of absent
+ * objects, like the fetch negotiation, can have those answers remembered
+ * for a little while.
+ *
+ * Objects written through this ODB forget the whole set, as we can't
+ * tell which ids a stream or a pack will add; objects written by
+ * someone else may be reported missing until the set expires.
+ */
+static void missing_clear_locked(git_odb *db)
+{
+	git_oid *id;
+
+	if (db->missing == NULL)
+		return;
+
+	kh_foreach_value(db->missing, id, {
+		git__free(id);
+	});
+
+	kh_clear(oid, db->missing);
+	db->missing_since = time(NULL);
+}
+
+static void missing_clear(git_odb *db)
+{
+	git_mutex_lock(&db->missing_lock);
+	missing_clear_locked(db);
+	git_mutex_unlock(&db->missing_lock);
+}
+
+static void missing_expire_locked(git_odb *db)
+{
+	if (time(NULL) - db->missing_since >= git_odb__negative_cache_ttl)
+		missing_clear_locked(db);
+}
+
+static bool missing_contains(git_odb *db, const git_oid *id)
+{
+	bool found = false;
+
+	if (git_odb__negative_cache_ttl <= 0 || db->missing == NULL)
+		return false;
+
+	git_mutex_lock(&db->missing_lock);
+	missing_expire_locked(db);
+	found = (kh_get(oid, db->missing, id) != kh_end(db->missing));
+	git_mutex_unlock(&db->missing_lock);
+
+	return found;
+}
+
+static void missing_add(git_odb *db, const git_oid *id)
+{
+	git_oid *key;
+	khiter_t pos;
+	int ret;
+
+	if (git_odb__negative_cache_ttl <= 0)
+		return;
+
+	git_mutex_lock(&db->missing_lock);
+
+	if (db->missing == NULL) {
+		if ((db->missing = git_oidmap_alloc()) == NULL)
+			goto done;
+
+		db->missing_since = time(NULL);
+	}
+
+	missing_expire_locked(db);
+
+	/* this is only a hint, so allocation failures are fine */
+	if ((key = git__malloc(sizeof(git_oid))) == NULL) {
+		giterr_clear();
+		goto done;
+	}
+
+	git_oid_cpy(key, id);
+	pos = kh_put(oid, db->missing, key, &ret);
+
+	if (ret > 0)
+		kh_val(db->missing, pos) = key;
+	else
+		git__free(key);
+
+done:
+	git_mutex_unlock(&db->missing_lock);
+}
+
+struct generation_entry {
+	git_oid id;
+	uint32_t generation;
+};
+
+int git_odb__generation(uint32_t *out, git_odb *db, const git_oid *id)
+{
+	khiter_t pos;
+	int error = GIT_ENOTFOUND;
+
+	git_mutex_lock(&db->cgraph_lock);
+
+	if (db->generations != NULL &&
+		(pos = kh_get(oid, db->generations, id)) != kh_end(db->generations)) {
+		*out = ((struct generation_entry *)kh_val(db->generations, pos))->generation;
+		error = 0;
+	}
+
+	git_mutex_unlock(&db->cgraph_lock);
+	return error;
+}
+
+void git_odb__set_generation(git_odb *db, const git_oid *id, uint32_t generation)
+{
+	struct generation_entry *entry;
+	khiter_t pos;
+	int ret;
+
+	git_mutex_lock(&db->cgraph_lock);
+
+	if (db->generations == NULL &&
+		(db->generations = git_oidmap_alloc()) == NULL)
+		goto done;
+
+	/* this is only a hint, so allocation failures are fine */
+	if ((entry = git_pool_malloc(&db->generation_pool, 1)) == NULL) {
+		giterr_clear();
+		goto done;
+	}
+
+	git_oid_cpy(&entry->id, id);
+	entry->generation = generation;
+
+	pos = kh_put(oid, db->generations, &entry->id, &ret);
+	if (ret > 0)
+		kh_val(db->generations, pos) = entry;
+
+done:
+	git_mutex_unlock(&db->cgraph_lock);
+}
+
 int git_odb_new(git_odb **out)
 {
 	git_odb *db = git__calloc(1, sizeof(*db));
 	GITERR_CHECK_ALLOC(db);
 
-	if (git_cache_init(&db->cache, GIT_DEFAULT_CACHE_SIZE, &free_odb_object) < 0 ||
+	if (git_cache_init(&db->cache, &free_odb_object) < 0 ||
 		git_vector_init(&db->backends, 4, backend_sort_cmp) < 0)
 	{
 		git__free(db);
 		return -1;
 	}
 
+	git_mutex_init(&db->missing_lock);
+	git_mutex_init(&db->cgraph_lock);
+
+	if (git_pool_init(&db->generation_pool, sizeof(struct generation_entry), 0) < 0) {
+		git_vector_free(&db->backends);
+		git_cache_free(&db->cache);
+		git__free(db);
+		return -1;
+	}
+
 	*out = db;
 	GIT_REFCOUNT_INC(db);
 	return 0;
@@ -375,6 +542,8 @@ static int add_backend_internal(git_odb *odb, git_odb_backend *backend, int prio
 
 	git_vector_sort(&odb->backends);
 	internal->backend->odb = odb;
+
+	missing_clear(odb);
 	return 0;
 }
 
@@ -461,7 +630,10 @@ int git_odb_open(git_odb **out, const char *objects_dir)
 	if (git_odb_new(&db) < 0)
 		return -1;
 
-	if (add_default_backends(db, objects_dir, 0) < 0 ||
+	db->objects_dir = git__strdup(objects_dir);
+
+	if (db->objects_dir == NULL ||
+		add_default_backends(db, objects_dir, 0) < 0 ||
 		load_alternates(db, objects_dir) < 0)
 	{
 		git_odb_free(db);
@@ -488,6 +660,19 @@ static void odb_free(git_odb *db)
 
 	git_vector_free(&db->backends);
 	git_cache_free(&db->cache);
+	git__free(db->objects_dir);
+
+	missing_clear_locked(db);
+	if (db->missing != NULL)
+		git_oidmap_free(db->missing);
+	git_mutex_free(&db->missing_lock);
+
+	git_commit_graph_free(db->cgraph);
+	if (db->generations != NULL)
+		git_oidmap_free(db->generations);
+	git_pool_clear(&db->generation_pool);
+	git_mutex_free(&db->cgraph_lock);
+
 	git__free(db);
 }
 
@@ -499,7 +684,7 @@ void git_odb_free(git_odb *db)
 	GIT_REFCOUNT_DEC(db, odb_free);
 }
 
-int git_odb_exists(git_odb *db, const git_oid *id)
+int git_odb__exists(git_odb *db, const git_oid *id)
 {
 	git_odb_object *object;
 	unsigned int i;
@@ -523,6 +708,21 @@ int git_odb_exists(git_odb *db, const git_oid *id)
 	return (int)found;
 }
 
+int git_odb_exists(git_odb *db, const git_oid *id)
+{
+	int found;
+
+	assert(db && id);
+
+	if (missing_contains(db, id))
+		return (int)false;
+
+	if (!(found = git_odb__exists(db, id)))
+		missing_add(db, id);
+
+	return found;
+}
+
 int git_odb_read_header(size_t *len_p, git_otype *type_p, git_odb *db, const git_oid *id)
 {
 	int error;
@@ -580,6 +780,12 @@ int git_odb__read_header_or_object(
 	return 0;
 }
 
+void git_odb_cache_stats(git_cache_stats *stats, git_odb *db)
+{
+	assert(stats && db);
+	git_cache_get_stats(stats, &db->cache);
+}
+
 int git_odb_read(git_odb_object **out, git_odb *db, const git_oid *id)
 {
 	unsigned int i;
@@ -664,6 +870,182 @@ int git_odb_read_prefix(
 	return 0;
 }
 
+struct read_many_ctx {
+	git_odb *db;
+	git_oid *pending; /* sorted, without duplicates */
+	char *found;
+	size_t pending_count;
+	int (*cb)(git_odb_object *object, void *payload);
+	void *payload;
+};
+
+static int read_many_oid_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
+
+static int read_many_deliver(struct read_many_ctx *ctx, size_t pos, git_odb_object *object)
+{
+	ctx->found[pos] = 1;
+
+	if (ctx->cb(object, ctx->payload))
+		return GIT_EUSER;
+
+	return 0;
+}
+
+/* Wrap data read from a backend into an object, which takes it over */
+static int read_many_deliver_raw(
+	struct read_many_ctx *ctx, size_t pos, const git_oid *id, git_rawobj *raw)
+{
+	git_odb_object *object;
+
+	if ((object = new_odb_object(id, raw)) == NULL) {
+		git__free(raw->data);
+		return -1;
+	}
+
+	return read_many_deliver(ctx, pos, git_cache_try_store(&ctx->db->cache, object));
+}
+
+static int read_many_backend_cb(
+	const git_oid *id, void *data, size_t len, git_otype type, void *payload)
+{
+	struct read_many_ctx *ctx = payload;
+	git_oid *found;
+	git_rawobj raw;
+
+	found = bsearch(id, ctx->pending, ctx->pending_count, sizeof(git_oid), read_many_oid_cmp);
+
+	/* not something we asked for, or something we already have */
+	if (found == NULL || ctx->found[found - ctx->pending]) {
+		git__free(data);
+		return 0;
+	}
+
+	raw.data = data;
+	raw.len = len;
+	raw.type = type;
+
+	return read_many_deliver_raw(ctx, found - ctx->pending, id, &raw);
+}
+
+/* Drop the objects we've already delivered from the pending list */
+static void read_many_compact(struct read_many_ctx *ctx)
+{
+	size_t i, j;
+
+	for (i = 0, j = 0; i < ctx->pending_count; ++i) {
+		if (ctx->found[i])
+			continue;
+
+		git_oid_cpy(&ctx->pending[j++], &ctx->pending[i]);
+	}
+
+	ctx->pending_count = j;
+	memset(ctx->found, 0x0, j);
+}
+
+static int read_many_one_by_one(struct read_many_ctx *ctx, git_odb_backend *b)
+{
+	git_rawobj raw;
+	size_t i;
+	int error;
+
+	if (b->read == NULL)
+		return 0;
+
+	for (i = 0; i < ctx->pending_count; ++i) {
+		/* like `git_odb_read`, a failure means "try elsewhere" */
+		if (b->read(&raw.data, &raw.len, &raw.type, b, &ctx->pending[i]) < 0)
+			continue;
+
+		if ((error = read_many_deliver_raw(ctx, i, &ctx->pending[i], &raw)) < 0)
+			return error;
+	}
+
+	return 0;
+}
+
+int git_odb_read_many(
+	git_odb *db,
+	const git_oid *ids,
+	size_t count,
+	int (*cb)(git_odb_object *object, void *payload),
+	void *payload)
+{
+	struct read_many_ctx ctx;
+	git_odb_object *object;
+	unsigned int i;
+	size_t j;
+	int error = 0;
+
+	assert(db && (ids || !count) && cb);
+
+	if (!count)
+		return 0;
+
+	memset(&ctx, 0x0, sizeof(ctx));
+	ctx.db = db;
+	ctx.cb = cb;
+	ctx.payload = payload;
+
+	ctx.pending = git__malloc(count * sizeof(git_oid));
+	GITERR_CHECK_ALLOC(ctx.pending);
+
+	ctx.found = git__calloc(count, sizeof(char));
+	if (!ctx.found) {
+		git__free(ctx.pending);
+		giterr_set_oom();
+		return -1;
+	}
+
+	memcpy(ctx.pending, ids, count * sizeof(git_oid));
+	qsort(ctx.pending, count, sizeof(git_oid), read_many_oid_cmp);
+
+	for (ctx.pending_count = 0, j = 0; j < count; ++j) {
+		if (ctx.pending_count > 0 &&
+			!git_oid_cmp(&ctx.pending[ctx.pending_count - 1], &ctx.pending[j]))
+			continue;
+
+		git_oid_cpy(&ctx.pending[ctx.pending_count++], &ctx.pending[j]);
+	}
+
+	/* first hand out whatever we have in the cache */
+	for (j = 0; j < ctx.pending_count; ++j) {
+		if ((object = git_cache_get(&db->cache, &ctx.pending[j])) != NULL &&
+			(error = read_many_deliver(&ctx, j, object)) < 0)
+			goto cleanup;
+	}
+
+	read_many_compact(&ctx);
+
+	for (i = 0; i < db->backends.length && ctx.pending_count > 0; ++i) {
+		backend_internal *internal = git_vector_get(&db->backends, i);
+		git_odb_backend *b = internal->backend;
+
+		if (b->read_many != NULL)
+			error = b->read_many(b, ctx.pending, ctx.pending_count,
+				read_many_backend_cb, &ctx);
+		else
+			error = read_many_one_by_one(&ctx, b);
+
+		if (error < 0 && error != GIT_ENOTFOUND)
+			goto cleanup;
+
+		error = 0;
+		read_many_compact(&ctx);
+	}
+
+	if (ctx.pending_count > 0)
+		error = git_odb__error_notfound("failed to read objects", &ctx.pending[0]);
+
+cleanup:
+	git__free(ctx.pending);
+	git__free(ctx.found);
+	return error;
+}
+
 int git_odb_foreach(git_odb *db, int (*cb)(git_oid *oid, void *data), void *data)
 {
 	unsigned int i;
@@ -688,6 +1070,8 @@ int git_odb_write(
 
 	assert(oid && db);
 
+	missing_clear(db);
+
 	for (i = 0; i < db->backends.length && error < 0; ++i) {
 		backend_internal *internal = git_vector_get(&db->backends, i);
 		git_odb_backend *b = internal->backend;
@@ -725,6 +1109,8 @@ int git_odb_open_wstream(
 
 	assert(stream && db);
 
+	missing_clear(db);
+
 	for (i = 0; i < db->backends.length && error < 0; ++i) {
 		backend_internal *internal = git_vector_get(&db->backends, i);
 		git_odb_backend *b = internal->backend;
@@ -745,6 +1131,123 @@ int git_odb_open_wstream(
 	return error;
 }
 
+int git_odb_bulk_begin(git_odb *db)
+{
+	git_odb_backend *bulk;
+
+	assert(db);
+
+	if (db->objects_dir == NULL) {
+		giterr_set(GITERR_ODB, "Bulk writes need an object database on disk");
+		return -1;
+	}
+
+	if (db->bulk != NULL) {
+		giterr_set(GITERR_ODB, "A bulk write is already in progress");
+		return -1;
+	}
+
+	if (git_odb__bulk_backend(&bulk, db->objects_dir) < 0)
+		return -1;
+
+	if (add_backend_internal(db, bulk, GIT_BULK_PRIORITY, 0) < 0) {
+		bulk->free(bulk);
+		return -1;
+	}
+
+	db->bulk = bulk;
+	return 0;
+}
+
+static void bulk_close(git_odb *db, bool committed)
+{
+	unsigned int i;
+	backend_internal *internal;
+
+	git_vector_foreach(&db->backends, i, internal) {
+		if (internal->backend != db->bulk)
+			continue;
+
+		git_vector_remove(&db->backends, i);
+		git__free(internal);
+		break;
+	}
+
+	db->bulk->free(db->bulk);
+	db->bulk = NULL;
+
+	/* the objects now live in a pack nobody has looked at... */
+	missing_clear(db);
+
+	/* ...or nowhere, and the cache mustn't keep pretending otherwise */
+	if (!committed)
+		git_cache_clear(&db->cache);
+}
+
+int git_odb_bulk_commit(git_odb *db)
+{
+	int error;
+
+	assert(db);
+
+	if (db->bulk == NULL) {
+		giterr_set(GITERR_ODB, "No bulk write is in progress");
+		return -1;
+	}
+
+	error = git_odb__bulk_commit(db->bulk);
+	bulk_close(db, error == 0);
+
+	return error;
+}
+
+void git_odb_bulk_rollback(git_odb *db)
+{
+	assert(db);
+
+	if (db->bulk != NULL)
+		bulk_close(db, false);
+}
+
+int git_odb__commit_graph(git_commit_graph_file **out, git_odb *db)
+{
+	git_buf path = GIT_BUF_INIT;
+	int error = 0;
+
+	assert(out && db);
+
+	*out = NULL;
+
+	if (db->objects_dir == NULL)
+		return 0;
+
+	git_mutex_lock(&db->cgraph_lock);
+
+	if (db->cgraph != NULL && git_commit_graph_needs_refresh(db->cgraph)) {
+		git_commit_graph_free(db->cgraph);
+		db->cgraph = NULL;
+	}
+
+	if (db->cgraph == NULL) {
+		if ((error = git_buf_joinpath(&path, db->objects_dir, GIT_COMMIT_GRAPH_FILE)) < 0)
+			goto done;
+
+		/* a missing or broken graph only means walking the slow way */
+		if (git_commit_graph_open(&db->cgraph, path.ptr) < 0)
+			giterr_clear();
+	}
+
+	if (db->cgraph != NULL) {
+		git_commit_graph_incref(db->cgraph);
+		*out = db->cgraph;
+	}
+
+done:
+	git_mutex_unlock(&db->cgraph_lock);
+	git_buf_free(&path);
+	return error;
+}
+
 int git_odb_open_rstream(git_odb_stream **stream, git_odb *db, const git_oid *oid)
 {
 	unsigned int i;
@@ -773,6 +1276,8 @@ int git_odb_write_pack(struct git_odb_writepack **out, git_odb *db, git_transfer
 
 	assert(out && db);
 
+	missing_clear(db);
+
 	for (i = 0; i < db->backends.length && error < 0; ++i) {
 		backend_internal *internal = git_vector_get(&db->backends, i);
 		git_odb_backend *b = internal->backend;
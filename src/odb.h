@@ -14,6 +14,7 @@
 #include "vector.h"
 #include "cache.h"
 #include "posix.h"
+#include "pool.h"
 
 #define GIT_OBJECTS_DIR "objects/"
 #define GIT_OBJECT_DIR_MODE 0777
@@ -37,8 +38,27 @@ struct git_odb {
 	git_refcount rc;
 	git_vector backends;
 	git_cache cache;
+
+	/* set by `git_odb_open`; needed for bulk writes */
+	char *objects_dir;
+	git_odb_backend *bulk;
+
+	/* ids `git_odb_exists` recently failed to find */
+	git_mutex missing_lock;
+	git_oidmap *missing;
+	time_t missing_since;
+
+	/* the commit-graph of `objects_dir`, loaded on demand, and the
+	 * generation numbers worked out for commits it doesn't have */
+	git_mutex cgraph_lock;
+	struct git_commit_graph_file *cgraph;
+	git_oidmap *generations;
+	git_pool generation_pool;
 };
 
+/* Seconds a negative lookup is remembered, tweakable through `git_libgit2_opts` */
+extern int git_odb__negative_cache_ttl;
+
 /*
  * Hash a git_rawobj internally.
  * The `git_rawobj` is supposed to be previously initialized
@@ -74,6 +94,13 @@ int git_odb__hashfd_filtered(
  */
 int git_odb__hashlink(git_oid *out, const char *path);
 
+/*
+ * Like `git_odb_exists`, but without looking at or adding to the
+ * negative lookup cache; for backends checking what the others have
+ * while an object is being written.
+ */
+int git_odb__exists(git_odb *db, const git_oid *id);
+
 /*
  * Generate a GIT_ENOTFOUND error for the ODB.
  */
@@ -84,6 +111,31 @@ int git_odb__error_notfound(const char *message, const git_oid *oid);
  */
 int git_odb__error_ambiguous(const char *message);
 
+/*
+ * The backend behind `git_odb_bulk_begin`: it appends the objects
+ * written to it to a temporary pack in `objects_dir`/pack, which
+ * `git_odb__bulk_commit` finishes and indexes. Freeing the backend
+ * throws the temporary pack away.
+ */
+int git_odb__bulk_backend(git_odb_backend **out, const char *objects_dir);
+int git_odb__bulk_commit(git_odb_backend *backend);
+
+/*
+ * Get the commit-graph of the database, reloading it if the file has
+ * changed. `*out` is NULL if there is none, or it can't be used; else
+ * it holds a new reference, to be dropped with `git_commit_graph_free`.
+ */
+int git_odb__commit_graph(struct git_commit_graph_file **out, git_odb *db);
+
+/*
+ * Generation numbers computed by the revision walker for commits
+ * outside the commit-graph, remembered for as long as the database
+ * lives. Getting one returns GIT_ENOTFOUND if it isn't known; setting
+ * one is only a hint, and can't fail.
+ */
+int git_odb__generation(uint32_t *out, git_odb *db, const git_oid *id);
+void git_odb__set_generation(git_odb *db, const git_oid *id, uint32_t generation);
+
 /*
  * Attempt to read object header or just return whole object if it could
  * not be read.
@@ -0,0 +1,673 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "common.h"
+#include <zlib.h>
+#include "git2/object.h"
+#include "git2/oid.h"
+#include "fileops.h"
+#include "filebuf.h"
+#include "hash.h"
+#include "odb.h"
+#include "oidmap.h"
+#include "pack.h"
+#include "pool.h"
+#include "thread-utils.h"
+
+#include "git2/odb_backend.h"
+#include "git2/types.h"
+
+GIT__USE_OIDMAP;
+
+/*
+ * Bulk checkin
+ *
+ * While a bulk transaction is open, the objects written to the ODB
+ * are appended to a single temporary packfile instead of becoming
+ * loose files. The pack is given its header, trailer and index when
+ * the transaction is committed.
+ *
+ * Objects are stored whole (no deltas), so they can be read back
+ * straight from the temporary file while the transaction is open.
+ */
+
+struct bulk_entry {
+	git_oid id;
+	git_otype type;
+	size_t size;
+
+	git_off_t offset;
+	size_t hdr_len;		/* the pack object header */
+	size_t packed_len;	/* header and compressed data */
+	uint32_t crc;		/* over the packed bytes, in network order */
+};
+
+typedef struct {
+	git_odb_backend parent;
+
+	char *pack_folder;
+	git_buf tmp_path;
+	git_file fd;
+	git_off_t size;
+
+	git_mutex lock;
+	git_pool entry_pool;
+	git_vector entries;
+	git_oidmap *entry_ix;
+} bulk_backend;
+
+/***********************************************************
+ *
+ * WRITING
+ *
+ ***********************************************************/
+
+static size_t gen_pack_object_header(unsigned char *hdr, size_t size, git_otype type)
+{
+	unsigned char *hdr_base = hdr;
+	unsigned char c;
+
+	c = (unsigned char)((type << 4) | (size & 15));
+	size >>= 4;
+
+	while (size) {
+		*hdr++ = c | 0x80;
+		c = size & 0x7f;
+		size >>= 7;
+	}
+	*hdr++ = c;
+
+	return hdr - hdr_base;
+}
+
+static int write_all(bulk_backend *backend, const void *data, size_t len)
+{
+	if (p_write(backend->fd, data, len) < 0) {
+		giterr_set(GITERR_OS, "Failed to write to '%s'", backend->tmp_path.ptr);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pack_object(git_buf *out, const void *data, size_t len, git_otype type)
+{
+	unsigned char hdr[32];
+	size_t hdr_len;
+	z_stream zs;
+	int status;
+
+	hdr_len = gen_pack_object_header(hdr, len, type);
+
+	memset(&zs, 0x0, sizeof(zs));
+	if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "Failed to initialize the compressor");
+		return -1;
+	}
+
+	if (git_buf_grow(out, hdr_len + deflateBound(&zs, (uLong)len)) < 0) {
+		deflateEnd(&zs);
+		return -1;
+	}
+
+	git_buf_put(out, (char *)hdr, hdr_len);
+
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = (uInt)len;
+	zs.next_out = (Bytef *)out->ptr + out->size;
+	zs.avail_out = (uInt)(out->asize - out->size);
+
+	status = deflate(&zs, Z_FINISH);
+	out->size += zs.total_out;
+	deflateEnd(&zs);
+
+	if (status != Z_STREAM_END) {
+		giterr_set(GITERR_ZLIB, "Failed to compress object");
+		return -1;
+	}
+
+	return (int)hdr_len;
+}
+
+static int bulk_backend__write(
+	git_oid *oid, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	struct bulk_entry *entry;
+	git_buf packed = GIT_BUF_INIT;
+	git_rawobj raw;
+	khiter_t pos;
+	int hdr_len, error = 0;
+
+	raw.data = (void *)data;
+	raw.len = len;
+	raw.type = type;
+
+	if (git_odb__hashobj(oid, &raw) < 0) {
+		giterr_set(GITERR_INVALID, "Cannot write object of type %d", (int)type);
+		return -1;
+	}
+
+	/* the repository already has it, through us or through anybody else;
+	 * a miss mustn't be remembered, as we are about to write it */
+	if (git_odb__exists(backend->parent.odb, oid))
+		return 0;
+
+	if ((hdr_len = pack_object(&packed, data, len, type)) < 0) {
+		git_buf_free(&packed);
+		return -1;
+	}
+
+	git_mutex_lock(&backend->lock);
+
+	/* somebody may have raced us to it */
+	if (kh_get(oid, backend->entry_ix, oid) != kh_end(backend->entry_ix))
+		goto done;
+
+	if ((entry = git_pool_malloc(&backend->entry_pool, 1)) == NULL) {
+		giterr_set_oom();
+		error = -1;
+		goto done;
+	}
+
+	git_oid_cpy(&entry->id, oid);
+	entry->type = type;
+	entry->size = len;
+	entry->offset = backend->size;
+	entry->hdr_len = (size_t)hdr_len;
+	entry->packed_len = packed.size;
+	entry->crc = htonl(crc32(crc32(0L, Z_NULL, 0), (Bytef *)packed.ptr, (uInt)packed.size));
+
+	if ((error = git_vector_insert(&backend->entries, entry)) < 0)
+		goto done;
+
+	pos = kh_put(oid, backend->entry_ix, &entry->id, &error);
+	if (error < 0) {
+		git_vector_pop(&backend->entries);
+		giterr_set_oom();
+		error = -1;
+		goto done;
+	}
+
+	kh_value(backend->entry_ix, pos) = entry;
+
+	if ((error = write_all(backend, packed.ptr, packed.size)) < 0) {
+		kh_del(oid, backend->entry_ix, pos);
+		git_vector_pop(&backend->entries);
+		/* we don't know how much of it made it out; start over from there */
+		p_lseek(backend->fd, backend->size, SEEK_SET);
+		goto done;
+	}
+
+	backend->size += packed.size;
+	error = 0;
+
+done:
+	git_mutex_unlock(&backend->lock);
+	git_buf_free(&packed);
+	return error;
+}
+
+/***********************************************************
+ *
+ * READING
+ *
+ ***********************************************************/
+
+static struct bulk_entry *find_entry(bulk_backend *backend, const git_oid *oid)
+{
+	khiter_t pos = kh_get(oid, backend->entry_ix, oid);
+
+	if (pos == kh_end(backend->entry_ix))
+		return NULL;
+
+	return kh_value(backend->entry_ix, pos);
+}
+
+static int read_entry(void **buffer_p, bulk_backend *backend, struct bulk_entry *entry)
+{
+	size_t compressed_len = entry->packed_len - entry->hdr_len;
+	unsigned char *compressed, *buffer;
+	z_stream zs;
+	int status;
+
+	compressed = git__malloc(compressed_len);
+	GITERR_CHECK_ALLOC(compressed);
+
+	if (p_lseek(backend->fd, entry->offset + entry->hdr_len, SEEK_SET) < 0 ||
+		p_read(backend->fd, compressed, compressed_len) != (ssize_t)compressed_len)
+	{
+		giterr_set(GITERR_OS, "Failed to read from '%s'", backend->tmp_path.ptr);
+		p_lseek(backend->fd, backend->size, SEEK_SET);
+		git__free(compressed);
+		return -1;
+	}
+
+	/* writes carry on at the end of the file */
+	p_lseek(backend->fd, backend->size, SEEK_SET);
+
+	buffer = git__malloc(entry->size + 1);
+	if (!buffer) {
+		git__free(compressed);
+		giterr_set_oom();
+		return -1;
+	}
+
+	memset(&zs, 0x0, sizeof(zs));
+	zs.next_in = compressed;
+	zs.avail_in = (uInt)compressed_len;
+	zs.next_out = buffer;
+	zs.avail_out = (uInt)entry->size + 1;
+
+	if (inflateInit(&zs) != Z_OK) {
+		git__free(compressed);
+		git__free(buffer);
+		giterr_set(GITERR_ZLIB, "Failed to initialize the decompressor");
+		return -1;
+	}
+
+	status = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	git__free(compressed);
+
+	if (status != Z_STREAM_END || zs.total_out != entry->size) {
+		git__free(buffer);
+		giterr_set(GITERR_ZLIB, "Failed to inflate object from '%s'", backend->tmp_path.ptr);
+		return -1;
+	}
+
+	buffer[entry->size] = '\0';
+	*buffer_p = buffer;
+	return 0;
+}
+
+static int bulk_backend__read(
+	void **buffer_p, size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *oid)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	struct bulk_entry *entry;
+	int error = GIT_ENOTFOUND;
+
+	git_mutex_lock(&backend->lock);
+
+	if ((entry = find_entry(backend, oid)) != NULL &&
+		(error = read_entry(buffer_p, backend, entry)) == 0) {
+		*len_p = entry->size;
+		*type_p = entry->type;
+	}
+
+	git_mutex_unlock(&backend->lock);
+
+	if (error == GIT_ENOTFOUND)
+		return git_odb__error_notfound("not found in the bulk checkin", oid);
+
+	return error;
+}
+
+static int bulk_backend__read_header(
+	size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *oid)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	struct bulk_entry *entry;
+
+	git_mutex_lock(&backend->lock);
+
+	if ((entry = find_entry(backend, oid)) != NULL) {
+		*len_p = entry->size;
+		*type_p = entry->type;
+	}
+
+	git_mutex_unlock(&backend->lock);
+
+	if (entry == NULL)
+		return git_odb__error_notfound("not found in the bulk checkin", oid);
+
+	return 0;
+}
+
+static int bulk_backend__read_prefix(
+	git_oid *out_oid, void **buffer_p, size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	struct bulk_entry *entry, *found = NULL;
+	unsigned int i;
+	int error = 0;
+
+	git_mutex_lock(&backend->lock);
+
+	git_vector_foreach(&backend->entries, i, entry) {
+		if (git_oid_ncmp(short_oid, &entry->id, len) != 0)
+			continue;
+
+		if (found != NULL) {
+			error = git_odb__error_ambiguous("found multiple objects in the bulk checkin");
+			goto done;
+		}
+
+		found = entry;
+	}
+
+	if (found == NULL) {
+		error = git_odb__error_notfound("no match in the bulk checkin", short_oid);
+		goto done;
+	}
+
+	if ((error = read_entry(buffer_p, backend, found)) == 0) {
+		git_oid_cpy(out_oid, &found->id);
+		*len_p = found->size;
+		*type_p = found->type;
+	}
+
+done:
+	git_mutex_unlock(&backend->lock);
+	return error;
+}
+
+static int bulk_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	bool found;
+
+	git_mutex_lock(&backend->lock);
+	found = (find_entry(backend, oid) != NULL);
+	git_mutex_unlock(&backend->lock);
+
+	return (int)found;
+}
+
+static int bulk_backend__foreach(git_odb_backend *_backend, int (*cb)(git_oid *oid, void *data), void *data)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	struct bulk_entry *entry;
+	unsigned int i;
+
+	/* the callback may well write objects, so don't hold the lock across it */
+	for (i = 0; ; ++i) {
+		git_oid id;
+
+		git_mutex_lock(&backend->lock);
+		entry = git_vector_get(&backend->entries, i);
+		if (entry != NULL)
+			git_oid_cpy(&id, &entry->id);
+		git_mutex_unlock(&backend->lock);
+
+		if (entry == NULL)
+			break;
+
+		if (cb(&id, data))
+			return GIT_EUSER;
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ *
+ * COMMITTING
+ *
+ ***********************************************************/
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct bulk_entry *entry_a = a, *entry_b = b;
+	return git_oid_cmp(&entry_a->id, &entry_b->id);
+}
+
+/* Give the pack its real header and its trailer */
+static int finish_pack(git_oid *hash, bulk_backend *backend)
+{
+	struct git_pack_header hdr;
+	git_hash_ctx *ctx;
+	char buffer[64 * 1024];
+	ssize_t read_bytes;
+	int error = 0;
+
+	hdr.hdr_signature = htonl(PACK_SIGNATURE);
+	hdr.hdr_version = htonl(PACK_VERSION);
+	hdr.hdr_entries = htonl(backend->entries.length);
+
+	if (p_lseek(backend->fd, 0, SEEK_SET) < 0 ||
+		write_all(backend, &hdr, sizeof(hdr)) < 0 ||
+		p_lseek(backend->fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	if ((ctx = git_hash_new_ctx()) == NULL)
+		return -1;
+
+	while ((read_bytes = p_read(backend->fd, buffer, sizeof(buffer))) > 0)
+		git_hash_update(ctx, buffer, read_bytes);
+
+	git_hash_final(hash, ctx);
+	git_hash_free_ctx(ctx);
+
+	if (read_bytes < 0) {
+		giterr_set(GITERR_OS, "Failed to read back '%s'", backend->tmp_path.ptr);
+		return -1;
+	}
+
+	if (p_lseek(backend->fd, backend->size, SEEK_SET) < 0 ||
+		write_all(backend, hash->id, GIT_OID_RAWSZ) < 0)
+		error = -1;
+
+	return error;
+}
+
+static int write_index(bulk_backend *backend, const char *path, const git_oid *pack_hash)
+{
+	git_filebuf index_file = GIT_FILEBUF_INIT;
+	struct git_pack_idx_header hdr;
+	struct bulk_entry *entry;
+	uint32_t fanout[256] = {0}, n, long_offsets = 0;
+	git_oid index_hash;
+	unsigned int i;
+
+	git_vector_foreach(&backend->entries, i, entry)
+		fanout[entry->id.id[0]]++;
+
+	for (i = 1; i < 256; ++i)
+		fanout[i] += fanout[i - 1];
+
+	if (git_filebuf_open(&index_file, path, GIT_FILEBUF_HASH_CONTENTS) < 0)
+		return -1;
+
+	hdr.idx_signature = htonl(PACK_IDX_SIGNATURE);
+	hdr.idx_version = htonl(2);
+	git_filebuf_write(&index_file, &hdr, sizeof(hdr));
+
+	for (i = 0; i < 256; ++i) {
+		n = htonl(fanout[i]);
+		git_filebuf_write(&index_file, &n, sizeof(n));
+	}
+
+	git_vector_foreach(&backend->entries, i, entry)
+		git_filebuf_write(&index_file, &entry->id, GIT_OID_RAWSZ);
+
+	git_vector_foreach(&backend->entries, i, entry)
+		git_filebuf_write(&index_file, &entry->crc, sizeof(uint32_t));
+
+	git_vector_foreach(&backend->entries, i, entry) {
+		if (entry->offset > 0x7fffffff)
+			n = htonl(0x80000000 | long_offsets++);
+		else
+			n = htonl((uint32_t)entry->offset);
+
+		git_filebuf_write(&index_file, &n, sizeof(uint32_t));
+	}
+
+	git_vector_foreach(&backend->entries, i, entry) {
+		uint32_t split[2];
+
+		if (entry->offset <= 0x7fffffff)
+			continue;
+
+		split[0] = htonl((uint32_t)((uint64_t)entry->offset >> 32));
+		split[1] = htonl((uint32_t)(entry->offset & 0xffffffff));
+
+		git_filebuf_write(&index_file, &split, sizeof(split));
+	}
+
+	git_filebuf_write(&index_file, pack_hash->id, GIT_OID_RAWSZ);
+
+	if (git_filebuf_hash(&index_hash, &index_file) < 0) {
+		git_filebuf_cleanup(&index_file);
+		return -1;
+	}
+
+	git_filebuf_write(&index_file, index_hash.id, GIT_OID_RAWSZ);
+
+	return git_filebuf_commit(&index_file, GIT_PACK_FILE_MODE);
+}
+
+static void close_tmp_pack(bulk_backend *backend)
+{
+	if (backend->fd < 0)
+		return;
+
+	p_close(backend->fd);
+	backend->fd = -1;
+
+	p_unlink(backend->tmp_path.ptr);
+}
+
+int git_odb__bulk_commit(git_odb_backend *_backend)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+	git_buf path = GIT_BUF_INIT;
+	char hex[GIT_OID_HEXSZ + 1];
+	git_oid hash;
+	size_t base_len;
+	int error = -1;
+
+	git_mutex_lock(&backend->lock);
+
+	/* nothing new, no pack */
+	if (backend->entries.length == 0) {
+		close_tmp_pack(backend);
+		git_mutex_unlock(&backend->lock);
+		return 0;
+	}
+
+	if (finish_pack(&hash, backend) < 0)
+		goto cleanup;
+
+	git_oid_fmt(hex, &hash);
+	hex[GIT_OID_HEXSZ] = '\0';
+
+	git_buf_joinpath(&path, backend->pack_folder, "pack-");
+	git_buf_puts(&path, hex);
+	base_len = path.size;
+	git_buf_puts(&path, ".pack");
+
+	if (git_buf_oom(&path))
+		goto cleanup;
+
+	/* the pack goes in first, so an index never points at nothing */
+	if (p_close(backend->fd) < 0) {
+		backend->fd = -1;
+		giterr_set(GITERR_OS, "Failed to close '%s'", backend->tmp_path.ptr);
+		p_unlink(backend->tmp_path.ptr);
+		goto cleanup;
+	}
+	backend->fd = -1;
+
+	if (p_chmod(backend->tmp_path.ptr, GIT_PACK_FILE_MODE) < 0 ||
+		p_rename(backend->tmp_path.ptr, path.ptr) < 0) {
+		giterr_set(GITERR_OS, "Failed to move '%s' into place", backend->tmp_path.ptr);
+		p_unlink(backend->tmp_path.ptr);
+		goto cleanup;
+	}
+
+	git_vector_sort(&backend->entries);
+
+	git_buf_truncate(&path, base_len);
+	if (git_buf_puts(&path, ".idx") < 0 ||
+		write_index(backend, path.ptr, &hash) < 0) {
+		git_buf_truncate(&path, base_len);
+		git_buf_puts(&path, ".pack");
+		p_unlink(path.ptr);
+		goto cleanup;
+	}
+
+	error = 0;
+
+cleanup:
+	git_mutex_unlock(&backend->lock);
+	git_buf_free(&path);
+	return error;
+}
+
+static void bulk_backend__free(git_odb_backend *_backend)
+{
+	bulk_backend *backend = (bulk_backend *)_backend;
+
+	/* whatever hasn't been committed is thrown away */
+	close_tmp_pack(backend);
+
+	git_oidmap_free(backend->entry_ix);
+	git_vector_free(&backend->entries);
+	git_pool_clear(&backend->entry_pool);
+	git_mutex_free(&backend->lock);
+	git_buf_free(&backend->tmp_path);
+	git__free(backend->pack_folder);
+	git__free(backend);
+}
+
+int git_odb__bulk_backend(git_odb_backend **out, const char *objects_dir)
+{
+	bulk_backend *backend;
+	struct git_pack_header hdr;
+	git_buf path = GIT_BUF_INIT;
+
+	backend = git__calloc(1, sizeof(bulk_backend));
+	GITERR_CHECK_ALLOC(backend);
+
+	backend->fd = -1;
+	git_mutex_init(&backend->lock);
+
+	if (git_pool_init(&backend->entry_pool, sizeof(struct bulk_entry), 0) < 0 ||
+		git_vector_init(&backend->entries, 0, entry_cmp) < 0 ||
+		(backend->entry_ix = git_oidmap_alloc()) == NULL)
+		goto on_error;
+
+	if (git_buf_joinpath(&path, objects_dir, "pack") < 0 ||
+		git_futils_mkdir_r(path.ptr, NULL, GIT_OBJECT_DIR_MODE) < 0)
+		goto on_error;
+
+	backend->pack_folder = git_buf_detach(&path);
+
+	if (git_buf_joinpath(&path, backend->pack_folder, "tmp_bulk") < 0 ||
+		(backend->fd = git_futils_mktmp(&backend->tmp_path, path.ptr)) < 0)
+		goto on_error;
+
+	/* the real object count goes in on commit */
+	memset(&hdr, 0x0, sizeof(hdr));
+	if (write_all(backend, &hdr, sizeof(hdr)) < 0)
+		goto on_error;
+
+	backend->size = sizeof(hdr);
+
+	backend->parent.read = &bulk_backend__read;
+	backend->parent.read_prefix = &bulk_backend__read_prefix;
+	backend->parent.read_header = &bulk_backend__read_header;
+	backend->parent.write = &bulk_backend__write;
+	backend->parent.exists = &bulk_backend__exists;
+	backend->parent.foreach = &bulk_backend__foreach;
+	backend->parent.free = &bulk_backend__free;
+
+	git_buf_free(&path);
+
+	*out = (git_odb_backend *)backend;
+	return 0;
+
+on_error:
+	git_buf_free(&path);
+	bulk_backend__free((git_odb_backend *)backend);
+	return -1;
+}
@@ -28,26 +28,28 @@ typedef struct {
 	git_filebuf fbuf;
 } loose_writestream;
 
+/* The objects found in one fan-out folder (OBJ_DIR/xx/), sorted */
+typedef struct {
+	/* the folder's mtime when we listed it, and when that was */
+	time_t mtime;
+	time_t scanned;
+
+	git_oid *ids;
+	size_t count;
+	size_t alloc;
+} loose_fanout;
+
 typedef struct loose_backend {
 	git_odb_backend parent;
 
 	int object_zlib_level; /** loose object zlib compression level. */
 	int fsync_object_files; /** loose object file fsync flag. */
 	char *objects_dir;
-} loose_backend;
 
-/* State structure for exploring directories,
- * in order to locate objects matching a short oid.
- */
-typedef struct {
-	size_t dir_len;
-	unsigned char short_oid[GIT_OID_HEXSZ]; /* hex formatted oid to match */
-	size_t short_oid_len;
-	int found;				/* number of matching
-						 * objects already found */
-	unsigned char res_oid[GIT_OID_HEXSZ];	/* hex formatted oid of
-						 * the object found */
-} loose_locate_object_state;
+	/* listings of the fan-out folders, for prefix lookups and foreach */
+	git_mutex fanout_lock;
+	loose_fanout fanout[256];
+} loose_backend;
 
 
 /***********************************************************
@@ -465,110 +467,175 @@ static int locate_object(
 	return error;
 }
 
-/* Explore an entry of a directory and see if it matches a short oid */
-static int fn_locate_object_short_oid(void *state, git_buf *pathbuf) {
-	loose_locate_object_state *sstate = (loose_locate_object_state *)state;
+/*
+ * Fan-out listings
+ *
+ * Resolving a short oid, or listing every object, means reading the
+ * fan-out folders. Their listings are kept around, and only read
+ * again once the folder's mtime says something was added or removed.
+ *
+ * The mtime only has a resolution of one second, though: a folder
+ * which changed during the second we listed it is listed again, as we
+ * can't know whether we've seen that change.
+ */
+struct fanout_scan {
+	loose_fanout *fanout;
+	size_t dir_len;
+	unsigned char first;
+};
 
-	if (git_buf_len(pathbuf) - sstate->dir_len != GIT_OID_HEXSZ - 2) {
-		/* Entry cannot be an object. Continue to next entry */
+static int fanout_scan_cb(void *payload, git_buf *path)
+{
+	struct fanout_scan *scan = payload;
+	loose_fanout *fanout = scan->fanout;
+	const char *name = path->ptr + scan->dir_len;
+	git_oid *id;
+	int i, v;
+
+	/* anything but an object file, like a leftover temporary file */
+	if (git_buf_len(path) - scan->dir_len != GIT_OID_HEXSZ - 2)
 		return 0;
-	}
 
-	if (git_path_isdir(pathbuf->ptr) == false) {
-		/* We are already in the directory matching the 2 first hex characters,
-		 * compare the first ncmp characters of the oids */
-		if (!memcmp(sstate->short_oid + 2,
-			(unsigned char *)pathbuf->ptr + sstate->dir_len,
-			sstate->short_oid_len - 2)) {
-
-			if (!sstate->found) {
-				sstate->res_oid[0] = sstate->short_oid[0];
-				sstate->res_oid[1] = sstate->short_oid[1];
-				memcpy(sstate->res_oid+2, pathbuf->ptr+sstate->dir_len, GIT_OID_HEXSZ-2);
-			}
-			sstate->found++;
-		}
+	if (fanout->count == fanout->alloc) {
+		size_t alloc = fanout->alloc * 3 / 2 + 16;
+		git_oid *ids = git__realloc(fanout->ids, alloc * sizeof(git_oid));
+		GITERR_CHECK_ALLOC(ids);
+
+		fanout->ids = ids;
+		fanout->alloc = alloc;
 	}
 
-	if (sstate->found > 1)
-		return git_odb__error_ambiguous("multiple matches in loose objects");
+	id = &fanout->ids[fanout->count];
+	id->id[0] = scan->first;
+
+	for (i = 0; i < GIT_OID_HEXSZ - 2; i += 2) {
+		v = (git__fromhex(name[i]) << 4) | git__fromhex(name[i + 1]);
+		if (v < 0)
+			return 0;
+
+		id->id[1 + i / 2] = (unsigned char)v;
+	}
 
+	fanout->count++;
 	return 0;
 }
 
-/* Locate an object matching a given short oid */
-static int locate_object_short_oid(
-	git_buf *object_location,
-	git_oid *res_oid,
-	loose_backend *backend,
-	const git_oid *short_oid,
-	size_t len)
+static int fanout_oid_cmp(const void *a, const void *b)
 {
-	char *objects_dir = backend->objects_dir;
-	size_t dir_len = strlen(objects_dir);
-	loose_locate_object_state state;
-	int error;
+	return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
 
-	/* prealloc memory for OBJ_DIR/xx/ */
-	if (git_buf_grow(object_location, dir_len + 5) < 0)
-		return -1;
+/* Make sure the listing of OBJ_DIR/xx/ is current. Call with the lock held. */
+static int fanout_refresh(loose_backend *backend, unsigned char first)
+{
+	loose_fanout *fanout = &backend->fanout[first];
+	struct fanout_scan scan;
+	git_buf path = GIT_BUF_INIT;
+	struct stat st;
+	int error;
 
-	git_buf_sets(object_location, objects_dir);
-	git_path_to_dir(object_location);
+	git_buf_sets(&path, backend->objects_dir);
+	git_path_to_dir(&path);
+	git_buf_printf(&path, "%02x/", first);
 
-	/* save adjusted position at end of dir so it can be restored later */
-	dir_len = git_buf_len(object_location);
+	if (git_buf_oom(&path))
+		return -1;
 
-	/* Convert raw oid to hex formatted oid */
-	git_oid_fmt((char *)state.short_oid, short_oid);
+	if (p_stat(path.ptr, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		/* no folder, no objects */
+		fanout->count = 0;
+		fanout->mtime = fanout->scanned = 0;
+		git_buf_free(&path);
+		return 0;
+	}
 
-	/* Explore OBJ_DIR/xx/ where xx is the beginning of hex formatted short oid */
-	if (git_buf_printf(object_location, "%.2s/", state.short_oid) < 0)
-		return -1;
+	if (fanout->scanned != 0 &&
+		st.st_mtime == fanout->mtime &&
+		st.st_mtime < fanout->scanned)
+	{
+		git_buf_free(&path);
+		return 0;
+	}
 
-	/* Check that directory exists */
-	if (git_path_isdir(object_location->ptr) == false)
-		return git_odb__error_notfound("no matching loose object for prefix", short_oid);
+	fanout->count = 0;
+	fanout->mtime = st.st_mtime;
+	fanout->scanned = time(NULL);
 
-	state.dir_len = git_buf_len(object_location);
-	state.short_oid_len = len;
-	state.found = 0;
+	scan.fanout = fanout;
+	scan.dir_len = git_buf_len(&path);
+	scan.first = first;
 
-	/* Explore directory to find a unique object matching short_oid */
-	error = git_path_direach(
-		object_location, fn_locate_object_short_oid, &state);
-	if (error)
-		return error;
+	if ((error = git_path_direach(&path, fanout_scan_cb, &scan)) < 0) {
+		/* make sure we try again next time */
+		fanout->count = 0;
+		fanout->scanned = 0;
+	} else {
+		qsort(fanout->ids, fanout->count, sizeof(git_oid), fanout_oid_cmp);
+	}
 
-	if (!state.found)
-		return git_odb__error_notfound("no matching loose object for prefix", short_oid);
+	git_buf_free(&path);
+	return error;
+}
 
-	/* Convert obtained hex formatted oid to raw */
-	error = git_oid_fromstr(res_oid, (char *)state.res_oid);
-	if (error)
-		return error;
+static void fanout_free(loose_backend *backend)
+{
+	size_t i;
 
-	/* Update the location according to the oid obtained */
+	for (i = 0; i < ARRAY_SIZE(backend->fanout); ++i)
+		git__free(backend->fanout[i].ids);
+}
 
-	git_buf_truncate(object_location, dir_len);
-	if (git_buf_grow(object_location, dir_len + GIT_OID_HEXSZ + 2) < 0)
-		return -1;
+/* Locate an object matching a given short oid */
+static int locate_object_short_oid(
+	git_buf *object_location,
+	git_oid *res_oid,
+	loose_backend *backend,
+	const git_oid *short_oid,
+	size_t len)
+{
+	loose_fanout *fanout;
+	size_t lo, hi, mid;
+	int error;
 
-	git_oid_pathfmt(object_location->ptr + dir_len, res_oid);
+	git_mutex_lock(&backend->fanout_lock);
 
-	object_location->size += GIT_OID_HEXSZ + 1;
-	object_location->ptr[object_location->size] = '\0';
+	if ((error = fanout_refresh(backend, short_oid->id[0])) < 0)
+		goto done;
 
-	return 0;
-}
+	fanout = &backend->fanout[short_oid->id[0]];
 
+	/* the first id which could start with the prefix */
+	lo = 0;
+	hi = fanout->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
 
+		if (git_oid_cmp(&fanout->ids[mid], short_oid) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
+	if (lo == fanout->count || git_oid_ncmp(short_oid, &fanout->ids[lo], len) != 0) {
+		error = git_odb__error_notfound("no matching loose object for prefix", short_oid);
+		goto done;
+	}
 
+	if (lo + 1 < fanout->count && git_oid_ncmp(short_oid, &fanout->ids[lo + 1], len) == 0) {
+		error = git_odb__error_ambiguous("multiple matches in loose objects");
+		goto done;
+	}
 
+	git_oid_cpy(res_oid, &fanout->ids[lo]);
 
+done:
+	git_mutex_unlock(&backend->fanout_lock);
 
+	if (!error)
+		error = object_file_name(object_location, backend->objects_dir, res_oid);
 
+	return error;
+}
 
 /***********************************************************
  *
@@ -676,89 +743,50 @@ static int loose_backend__exists(git_odb_backend *backend, const git_oid *oid)
 	return !error;
 }
 
-struct foreach_state {
-	size_t dir_len;
-	int (*cb)(git_oid *oid, void *data);
-	void *data;
-	int cb_error;
-};
-
-GIT_INLINE(int) filename_to_oid(git_oid *oid, const char *ptr)
-{
-	int v, i = 0;
-	if (strlen(ptr) != 41)
-		return -1;
-
-	if (ptr[2] != '/') {
-		return -1;
-	}
-
-	v = (git__fromhex(ptr[i]) << 4) | git__fromhex(ptr[i+1]);
-	if (v < 0)
-		return -1;
-
-	oid->id[0] = (unsigned char) v;
-
-	ptr += 3;
-	for (i = 0; i < 38; i += 2) {
-		v = (git__fromhex(ptr[i]) << 4) | git__fromhex(ptr[i + 1]);
-		if (v < 0)
-			return -1;
-
-		oid->id[1 + i/2] = (unsigned char) v;
-	}
-
-	return 0;
-}
-
-static int foreach_object_dir_cb(void *_state, git_buf *path)
-{
-	git_oid oid;
-	struct foreach_state *state = (struct foreach_state *) _state;
-
-	if (filename_to_oid(&oid, path->ptr + state->dir_len) < 0)
-		return 0;
-
-	if (state->cb(&oid, state->data)) {
-		state->cb_error = GIT_EUSER;
-		return -1;
-	}
-
-	return 0;
-}
-
-static int foreach_cb(void *_state, git_buf *path)
-{
-	struct foreach_state *state = (struct foreach_state *) _state;
-
-	return git_path_direach(path, foreach_object_dir_cb, state);
-}
-
 static int loose_backend__foreach(git_odb_backend *_backend, int (*cb)(git_oid *oid, void *data), void *data)
 {
-	char *objects_dir;
-	int error;
-	git_buf buf = GIT_BUF_INIT;
-	struct foreach_state state;
 	loose_backend *backend = (loose_backend *) _backend;
+	git_oid *ids = NULL;
+	size_t i, count, alloc = 0;
+	unsigned int first;
+	int error = 0;
 
 	assert(backend && cb);
 
-	objects_dir = backend->objects_dir;
+	for (first = 0; first < ARRAY_SIZE(backend->fanout) && !error; ++first) {
+		loose_fanout *fanout = &backend->fanout[first];
+
+		/* the callback may write objects, so work from a copy */
+		git_mutex_lock(&backend->fanout_lock);
 
-	git_buf_sets(&buf, objects_dir);
-	git_path_to_dir(&buf);
+		if ((error = fanout_refresh(backend, (unsigned char)first)) == 0 &&
+			fanout->count > alloc)
+		{
+			git__free(ids);
+			alloc = fanout->count;
+
+			if ((ids = git__malloc(alloc * sizeof(git_oid))) == NULL) {
+				giterr_set_oom();
+				error = -1;
+			}
+		}
 
-	memset(&state, 0, sizeof(state));
-	state.cb = cb;
-	state.data = data;
-	state.dir_len = git_buf_len(&buf);
+		count = error ? 0 : fanout->count;
+		if (count > 0)
+			memcpy(ids, fanout->ids, count * sizeof(git_oid));
 
-	error = git_path_direach(&buf, foreach_cb, &state);
+		git_mutex_unlock(&backend->fanout_lock);
 
-	git_buf_free(&buf);
+		for (i = 0; i < count; ++i) {
+			if (cb(&ids[i], data)) {
+				error = GIT_EUSER;
+				break;
+			}
+		}
+	}
 
-	return state.cb_error ? state.cb_error : error;
+	git__free(ids);
+	return error;
 }
 
 static int loose_backend__stream_fwrite(git_oid *oid, git_odb_stream *_stream)
@@ -900,6 +928,8 @@ static void loose_backend__free(git_odb_backend *_backend)
 	assert(_backend);
 	backend = (loose_backend *)_backend;
 
+	fanout_free(backend);
+	git_mutex_free(&backend->fanout_lock);
 	git__free(backend->objects_dir);
 	git__free(backend);
 }
@@ -918,6 +948,8 @@ int git_odb_backend_loose(
 	backend->objects_dir = git__strdup(objects_dir);
 	GITERR_CHECK_ALLOC(backend->objects_dir);
 
+	git_mutex_init(&backend->fanout_lock);
+
 	if (compression_level < 0)
 		compression_level = Z_BEST_SPEED;
 
@@ -16,6 +16,7 @@
 #include "sha1_lookup.h"
 #include "mwindow.h"
 #include "pack.h"
+#include "midx.h"
 
 #include "git2/odb_backend.h"
 
@@ -24,6 +25,19 @@ struct pack_backend {
 	git_vector packs;
 	struct git_pack_file *last_found;
 	char *pack_folder;
+
+	/* the folder's mtime when we last scanned it, and when that was */
+	time_t pack_folder_mtime;
+	time_t pack_folder_scanned;
+
+	/* the multi-pack index, if any, and the packs it refers to */
+	git_midx_file *midx;
+	git_vector midx_packs;
+};
+
+struct pack_readstream {
+	git_odb_stream parent;
+	git_packfile_stream stream;
 };
 
 struct pack_writepack {
@@ -237,6 +251,98 @@ static int packfile_load__cb(void *_data, git_buf *path)
 	return git_vector_insert(&backend->packs, pack);
 }
 
+static void midx_unload(struct pack_backend *backend)
+{
+	struct git_pack_file *p;
+	unsigned int i;
+
+	git_vector_foreach(&backend->midx_packs, i, p)
+		p->in_midx = 0;
+
+	git_vector_clear(&backend->midx_packs);
+	git_midx_free(backend->midx);
+	backend->midx = NULL;
+}
+
+static struct git_pack_file *midx_find_pack(
+	struct pack_backend *backend, const char *idx_name)
+{
+	struct git_pack_file *p;
+	size_t name_len = strlen(idx_name) - strlen(".idx");
+	unsigned int i;
+
+	git_vector_foreach(&backend->packs, i, p) {
+		const char *pack_name = strrchr(p->pack_name, '/');
+		pack_name = pack_name ? pack_name + 1 : p->pack_name;
+
+		if (strlen(pack_name) == name_len + strlen(".pack") &&
+			memcmp(pack_name, idx_name, name_len) == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * (Re)load the multi-pack index if it's new or has changed on disk.
+ * A missing or broken index is not an error: we simply fall back to
+ * searching every pack on its own, as git does.
+ */
+static int midx_refresh(struct pack_backend *backend)
+{
+	git_buf path = GIT_BUF_INIT;
+	int error;
+
+	if (backend->midx) {
+		if (!git_midx_needs_refresh(backend->midx))
+			return 0;
+
+		midx_unload(backend);
+	}
+
+	if (git_buf_joinpath(&path, backend->pack_folder, GIT_MIDX_FILE) < 0)
+		return -1;
+
+	error = git_midx_open(&backend->midx, git_buf_cstr(&path));
+	git_buf_free(&path);
+
+	if (error < 0) {
+		giterr_clear();
+		backend->midx = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Point every pack id in the multi-pack index at the pack we have
+ * loaded for it. If any of them is gone, the index is stale.
+ */
+static int midx_load_packs(struct pack_backend *backend)
+{
+	const char *idx_name;
+	struct git_pack_file *p;
+	unsigned int i;
+
+	if (!backend->midx || backend->midx_packs.length > 0)
+		return 0;
+
+	git_vector_foreach(&backend->midx->packfile_names, i, idx_name) {
+		if ((p = midx_find_pack(backend, idx_name)) == NULL) {
+			midx_unload(backend);
+			return 0;
+		}
+
+		if (git_vector_insert(&backend->midx_packs, p) < 0)
+			return -1;
+	}
+
+	git_vector_foreach(&backend->midx_packs, i, p)
+		p->in_midx = 1;
+
+	return 0;
+}
+
 static int packfile_refresh_all(struct pack_backend *backend)
 {
 	int error;
@@ -249,6 +355,22 @@ static int packfile_refresh_all(struct pack_backend *backend)
 	if (p_stat(backend->pack_folder, &st) < 0 || !S_ISDIR(st.st_mode))
 		return git_odb__error_notfound("failed to refresh packfiles", NULL);
 
+	/*
+	 * New packs (and a new multi-pack index) are renamed into place, so
+	 * they always touch the folder. Its mtime only has a resolution of a
+	 * second, though: if it changed during the second we scanned it, we
+	 * can't know whether we've seen that change, so look again.
+	 */
+	if (st.st_mtime == backend->pack_folder_mtime &&
+		st.st_mtime < backend->pack_folder_scanned)
+		return 0;
+
+	backend->pack_folder_mtime = st.st_mtime;
+	backend->pack_folder_scanned = time(NULL);
+
+	if ((error = midx_refresh(backend)) < 0)
+		goto on_error;
+
 	git_buf_sets(&path, backend->pack_folder);
 
 	/* reload all packs */
@@ -257,10 +379,44 @@ static int packfile_refresh_all(struct pack_backend *backend)
 	git_buf_free(&path);
 
 	if (error < 0)
-		return error;
+		goto on_error;
 
 	git_vector_sort(&backend->packs);
 
+	if ((error = midx_load_packs(backend)) < 0)
+		goto on_error;
+
+	return 0;
+
+on_error:
+	/* make sure we try again next time */
+	backend->pack_folder_mtime = 0;
+	return error;
+}
+
+static int pack_entry_find_midx(
+	struct git_pack_entry *e,
+	struct pack_backend *backend,
+	const git_oid *short_oid,
+	size_t len)
+{
+	git_midx_entry midx_entry;
+	struct git_pack_file *p;
+	int error;
+
+	if ((error = git_midx_entry_find(&midx_entry, backend->midx, short_oid, len)) < 0)
+		return error;
+
+	p = git_vector_get(&backend->midx_packs, midx_entry.pack_index);
+
+	if ((error = git_packfile_open(p)) < 0)
+		return error;
+
+	e->offset = midx_entry.offset;
+	e->p = p;
+	git_oid_cpy(&e->sha1, &midx_entry.sha1);
+
+	backend->last_found = p;
 	return 0;
 }
 
@@ -276,11 +432,15 @@ static int pack_entry_find_inner(
 		git_pack_entry_find(e, last_found, oid, GIT_OID_HEXSZ) == 0)
 		return 0;
 
+	if (backend->midx &&
+		pack_entry_find_midx(e, backend, oid, GIT_OID_HEXSZ) == 0)
+		return 0;
+
 	for (i = 0; i < backend->packs.length; ++i) {
 		struct git_pack_file *p;
 
 		p = git_vector_get(&backend->packs, i);
-		if (p == last_found)
+		if (p == last_found || p->in_midx)
 			continue;
 
 		if (git_pack_entry_find(e, p, oid, GIT_OID_HEXSZ) == 0) {
@@ -322,6 +482,10 @@ static unsigned pack_entry_find_prefix_inner(
 	unsigned int i;
 	unsigned found = 0;
 
+	/* packs covered by the multi-pack index are searched through it */
+	if (last_found && last_found->in_midx)
+		last_found = NULL;
+
 	if (last_found) {
 		error = git_pack_entry_find(e, last_found, short_oid, len);
 		if (error == GIT_EAMBIGUOUS)
@@ -330,11 +494,19 @@ static unsigned pack_entry_find_prefix_inner(
 			found = 1;
 	}
 
-	for (i = 0; i < backend->packs.length; ++i) {
+	if (backend->midx) {
+		error = pack_entry_find_midx(e, backend, short_oid, len);
+		if (error == GIT_EAMBIGUOUS)
+			return error;
+		if (!error)
+			found++;
+	}
+
+	for (i = 0; i < backend->packs.length && found <= 1; ++i) {
 		struct git_pack_file *p;
 
 		p = git_vector_get(&backend->packs, i);
-		if (p == last_found)
+		if (p == last_found || p->in_midx)
 			continue;
 
 		error = git_pack_entry_find(e, p, short_oid, len);
@@ -384,19 +556,18 @@ cleanup:
  *
  ***********************************************************/
 
-/*
-int pack_backend__read_header(git_rawobj *obj, git_odb_backend *backend, const git_oid *oid)
+static int pack_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *backend, const git_oid *oid)
 {
-	pack_location location;
+	struct git_pack_entry e;
+	int error;
 
-	assert(obj && backend && oid);
+	assert(len_p && type_p && backend && oid);
 
-	if (locate_packfile(&location, (struct pack_backend *)backend, oid) < 0)
-		return GIT_ENOTFOUND;
+	if ((error = pack_entry_find(&e, (struct pack_backend *)backend, oid)) < 0)
+		return error;
 
-	return read_header_packed(obj, &location);
+	return git_packfile_resolve_header(len_p, type_p, e.p, e.offset);
 }
-*/
 
 static int pack_backend__read(void **buffer_p, size_t *len_p, git_otype *type_p, git_odb_backend *backend, const git_oid *oid)
 {
@@ -415,6 +586,84 @@ static int pack_backend__read(void **buffer_p, size_t *len_p, git_otype *type_p,
 	return 0;
 }
 
+struct read_many_entry {
+	struct git_pack_file *p;
+	git_off_t offset;
+	git_oid id;
+};
+
+static int read_many_entry_cmp(const void *a_, const void *b_)
+{
+	const struct read_many_entry *a = a_, *b = b_;
+
+	if (a->p != b->p)
+		return (a->p < b->p) ? -1 : 1;
+
+	if (a->offset != b->offset)
+		return (a->offset < b->offset) ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Locate every object first, then read them pack by pack in the
+ * order they are stored: the windows are walked forward, and the
+ * delta base cache gets to serve bases shared by neighbouring
+ * objects instead of rebuilding them for each one.
+ */
+static int pack_backend__read_many(
+	git_odb_backend *_backend,
+	const git_oid *ids,
+	size_t count,
+	int (*cb)(const git_oid *id, void *data, size_t len, git_otype type, void *payload),
+	void *payload)
+{
+	struct pack_backend *backend = (struct pack_backend *)_backend;
+	struct read_many_entry *entries;
+	struct git_pack_entry e;
+	git_rawobj raw;
+	size_t i, found = 0;
+	int error = 0;
+
+	assert(backend && ids && cb);
+
+	entries = git__malloc(count * sizeof(struct read_many_entry));
+	GITERR_CHECK_ALLOC(entries);
+
+	for (i = 0; i < count; ++i) {
+		if ((error = pack_entry_find(&e, backend, &ids[i])) < 0) {
+			if (error != GIT_ENOTFOUND)
+				goto cleanup;
+
+			giterr_clear();
+			error = 0;
+			continue;
+		}
+
+		entries[found].p = e.p;
+		entries[found].offset = e.offset;
+		git_oid_cpy(&entries[found].id, &ids[i]);
+		found++;
+	}
+
+	qsort(entries, found, sizeof(struct read_many_entry), read_many_entry_cmp);
+
+	for (i = 0; i < found; ++i) {
+		git_off_t offset = entries[i].offset;
+
+		if ((error = git_packfile_unpack(&raw, entries[i].p, &offset)) < 0)
+			goto cleanup;
+
+		/* the odb tells a failure of its own from the user stopping us */
+		if ((error = cb(&entries[i].id, raw.data, raw.len, raw.type, payload)) != 0)
+			goto cleanup;
+	}
+
+cleanup:
+	git__free(entries);
+	return error;
+}
+
 static int pack_backend__read_prefix(
 	git_oid *out_oid,
 	void **buffer_p,
@@ -452,6 +701,56 @@ static int pack_backend__read_prefix(
 	return error;
 }
 
+static int pack_backend__readstream_read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+	struct pack_readstream *stream = (struct pack_readstream *)_stream;
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	return (int)git_packfile_stream_read(&stream->stream, buffer, len);
+}
+
+static void pack_backend__readstream_free(git_odb_stream *_stream)
+{
+	struct pack_readstream *stream = (struct pack_readstream *)_stream;
+
+	git_packfile_stream_free(&stream->stream);
+	git__free(stream);
+}
+
+static int pack_backend__readstream(git_odb_stream **stream_out, git_odb_backend *backend, const git_oid *oid)
+{
+	struct git_pack_entry e;
+	struct pack_readstream *stream;
+	int error;
+
+	assert(stream_out && backend && oid);
+
+	*stream_out = NULL;
+
+	if ((error = pack_entry_find(&e, (struct pack_backend *)backend, oid)) < 0)
+		return error;
+
+	stream = git__calloc(1, sizeof(struct pack_readstream));
+	GITERR_CHECK_ALLOC(stream);
+
+	if ((error = git_packfile_stream_open(&stream->stream, e.p, e.offset)) < 0) {
+		git__free(stream);
+		return error;
+	}
+
+	stream->parent.backend = backend;
+	stream->parent.mode = GIT_STREAM_RDONLY;
+	stream->parent.read = &pack_backend__readstream_read;
+	stream->parent.write = NULL; /* read only */
+	stream->parent.finalize_write = NULL;
+	stream->parent.free = &pack_backend__readstream_free;
+
+	*stream_out = (git_odb_stream *)stream;
+	return 0;
+}
+
 static int pack_backend__exists(git_odb_backend *backend, const git_oid *oid)
 {
 	struct git_pack_entry e;
@@ -472,7 +771,14 @@ static int pack_backend__foreach(git_odb_backend *_backend, int (*cb)(git_oid *o
 	if ((error = packfile_refresh_all(backend)) < 0)
 		return error;
 
+	if (backend->midx &&
+		(error = git_midx_foreach_entry(backend->midx, cb, data)) < 0)
+		return error;
+
 	git_vector_foreach(&backend->packs, i, p) {
+		if (p->in_midx)
+			continue;
+
 		if ((error = git_pack_foreach_entry(p, cb, data)) < 0)
 			return error;
 	}
@@ -531,6 +837,9 @@ static int pack_backend__writepack(struct git_odb_writepack **out,
 		return -1;
 	}
 
+	/* Fetched packs may be thin; complete them from our objects */
+	git_indexer_stream_set_odb(writepack->indexer_stream, _backend->odb);
+
 	writepack->parent.backend = _backend;
 	writepack->parent.add = pack_backend__writepack_add;
 	writepack->parent.commit = pack_backend__writepack_commit;
@@ -555,6 +864,8 @@ static void pack_backend__free(git_odb_backend *_backend)
 		packfile_free(p);
 	}
 
+	git_midx_free(backend->midx);
+	git_vector_free(&backend->midx_packs);
 	git_vector_free(&backend->packs);
 	git__free(backend->pack_folder);
 	git__free(backend);
@@ -579,7 +890,9 @@ int git_odb_backend_one_pack(git_odb_backend **backend_out, const char *idx)
 
 	backend->parent.read = &pack_backend__read;
 	backend->parent.read_prefix = &pack_backend__read_prefix;
-	backend->parent.read_header = NULL;
+	backend->parent.read_header = &pack_backend__read_header;
+	backend->parent.read_many = &pack_backend__read_many;
+	backend->parent.readstream = &pack_backend__readstream;
 	backend->parent.exists = &pack_backend__exists;
 	backend->parent.foreach = &pack_backend__foreach;
 	backend->parent.free = &pack_backend__free;
@@ -591,7 +904,7 @@ int git_odb_backend_one_pack(git_odb_backend **backend_out, const char *idx)
 on_error:
 	git_vector_free(&backend->packs);
 	git__free(backend);
-	git__free(packfile);
+	packfile_free(packfile);
 	return -1;
 }
 
@@ -604,8 +917,10 @@ int git_odb_backend_pack(git_odb_backend **backend_out, const char *objects_dir)
 	GITERR_CHECK_ALLOC(backend);
 
 	if (git_vector_init(&backend->packs, 8, packfile_sort__cb) < 0 ||
+		git_vector_init(&backend->midx_packs, 0, NULL) < 0 ||
 		git_buf_joinpath(&path, objects_dir, "pack") < 0)
 	{
+		git_vector_free(&backend->packs);
 		git__free(backend);
 		return -1;
 	}
@@ -616,7 +931,9 @@ int git_odb_backend_pack(git_odb_backend **backend_out, const char *objects_dir)
 
 	backend->parent.read = &pack_backend__read;
 	backend->parent.read_prefix = &pack_backend__read_prefix;
-	backend->parent.read_header = NULL;
+	backend->parent.read_header = &pack_backend__read_header;
+	backend->parent.read_many = &pack_backend__read_many;
+	backend->parent.readstream = &pack_backend__readstream;
 	backend->parent.exists = &pack_backend__exists;
 	backend->parent.foreach = &pack_backend__foreach;
 	backend->parent.writepack = &pack_backend__writepack;
@@ -0,0 +1,1024 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "common.h"
+#include "pack-bitmap.h"
+#include "buffer.h"
+#include "filebuf.h"
+#include "fileops.h"
+#include "hash.h"
+#include "path.h"
+#include "repository.h"
+
+#include "git2/commit.h"
+#include "git2/object.h"
+#include "git2/refs.h"
+#include "git2/tag.h"
+#include "git2/tree.h"
+
+GIT__USE_OIDMAP;
+
+#define BITMAP_SIGNATURE "BITM"
+#define BITMAP_VERSION 1
+#define BITMAP_HEADER_SIZE (4 + 2 + 2 + 4 + GIT_OID_RAWSZ)
+#define BITMAP_ENTRY_HEADER_SIZE 6
+#define BITMAP_LOOKUP_ENTRY_SIZE (4 + 8 + 4)
+#define BITMAP_MAX_XOR_OFFSET 160
+
+#define BITMAP_OPT_FULL_DAG 0x1
+#define BITMAP_OPT_HASH_CACHE 0x4
+#define BITMAP_OPT_LOOKUP_TABLE 0x10
+
+static int bitmap_error(const char *message)
+{
+	giterr_set(GITERR_ODB, "Invalid pack bitmap - %s", message);
+	return -1;
+}
+
+GIT_INLINE(uint16_t) get_be16(const unsigned char *p)
+{
+	return (uint16_t)(((uint16_t)p[0] << 8) | p[1]);
+}
+
+GIT_INLINE(uint32_t) get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+GIT_INLINE(void) put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = (unsigned char)(v >> 8);
+	p[1] = (unsigned char)v;
+}
+
+GIT_INLINE(void) put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+/* the checksum of the pack, as recorded in its index */
+static const unsigned char *pack_checksum(struct git_pack_file *p)
+{
+	return (const unsigned char *)p->index_map.data + p->index_map.len - 2 * GIT_OID_RAWSZ;
+}
+
+static int bitmap_path(git_buf *path, struct git_pack_file *p)
+{
+	git_buf_put(path, p->pack_name, strlen(p->pack_name) - strlen(".pack"));
+	git_buf_puts(path, ".bitmap");
+
+	return git_buf_oom(path) ? -1 : 0;
+}
+
+static size_t bitmap_max_bits(struct git_pack_file *p)
+{
+	size_t words = ((size_t)p->num_objects + GIT_EWORD_BITS - 1) / GIT_EWORD_BITS;
+	return words * GIT_EWORD_BITS;
+}
+
+static int bitmap_alloc(git_pack_bitmap **out, struct git_pack_file *p)
+{
+	git_pack_bitmap *b = git__calloc(1, sizeof(git_pack_bitmap));
+	GITERR_CHECK_ALLOC(b);
+
+	b->pack = p;
+	b->entry_ix = git_oidmap_alloc();
+	if (!b->entry_ix) {
+		git__free(b);
+		giterr_set_oom();
+		return -1;
+	}
+
+	*out = b;
+	return 0;
+}
+
+/* Entries point into each other, so they are all allocated at once */
+static int bitmap_alloc_entries(git_pack_bitmap *b, size_t count)
+{
+	b->entries = git__calloc(count ? count : 1, sizeof(git_pack_bitmap_entry));
+	GITERR_CHECK_ALLOC(b->entries);
+
+	return 0;
+}
+
+static int bitmap_add_entry(
+	git_pack_bitmap *b,
+	uint32_t index_pos,
+	uint8_t xor_offset,
+	uint8_t flags,
+	git_ewah *bitmap)
+{
+	git_pack_bitmap_entry *e = &b->entries[b->entries_nr];
+	khiter_t pos;
+	int ret;
+
+	if (git_pack_nth_oid(&e->id, b->pack, index_pos) < 0) {
+		git_ewah_free(bitmap);
+		return -1;
+	}
+
+	pos = kh_put(oid, b->entry_ix, &e->id, &ret);
+	if (ret <= 0) {
+		git_ewah_free(bitmap);
+
+		if (ret < 0) {
+			giterr_set_oom();
+			return -1;
+		}
+
+		return bitmap_error("duplicate commit");
+	}
+
+	e->index_pos = index_pos;
+	e->xor_offset = xor_offset;
+	e->flags = flags;
+	e->bitmap = bitmap;
+	kh_value(b->entry_ix, pos) = e;
+
+	b->entries_nr++;
+	return 0;
+}
+
+static git_pack_bitmap_entry *bitmap_entry(git_pack_bitmap *b, const git_oid *id)
+{
+	khiter_t pos = kh_get(oid, b->entry_ix, id);
+
+	if (pos == kh_end(b->entry_ix))
+		return NULL;
+
+	return kh_value(b->entry_ix, pos);
+}
+
+/*
+ * Add the objects reachable from an entry's commit to `out`. The
+ * stored bitmap may be the difference with an earlier entry's, in
+ * which case the whole chain down to a plain bitmap is XORed.
+ */
+static int bitmap_entry_or(git_bitmap *out, git_pack_bitmap_entry *e)
+{
+	git_bitmap xored = GIT_BITMAP_INIT;
+	int error;
+
+	if (!e->xor_offset)
+		return git_bitmap_or_ewah(out, e->bitmap);
+
+	while ((error = git_bitmap_xor_ewah(&xored, e->bitmap)) == 0 && e->xor_offset)
+		e -= e->xor_offset;
+
+	if (!error)
+		error = git_bitmap_or(out, &xored);
+
+	git_bitmap_free(&xored);
+	return error;
+}
+
+/***********************************************************
+ *
+ * READING
+ *
+ ***********************************************************/
+
+static int bitmap_read_ewah(
+	git_ewah **out,
+	struct git_pack_file *p,
+	const unsigned char *data,
+	size_t *pos,
+	size_t end)
+{
+	size_t read;
+
+	if (git_ewah_read(out, &read, data + *pos, end - *pos, bitmap_max_bits(p)) < 0)
+		return -1;
+
+	*pos += read;
+	return 0;
+}
+
+static int bitmap_parse(git_pack_bitmap *b, const unsigned char *data, size_t size)
+{
+	struct git_pack_file *p = b->pack;
+	size_t pos = BITMAP_HEADER_SIZE, end, extra;
+	uint32_t i, entries;
+	uint16_t options;
+	git_oid checksum;
+
+	if (size < BITMAP_HEADER_SIZE + GIT_OID_RAWSZ)
+		return bitmap_error("file is too short");
+
+	if (memcmp(data, BITMAP_SIGNATURE, 4) != 0 ||
+		get_be16(data + 4) != BITMAP_VERSION)
+		return bitmap_error("unsupported bitmap version");
+
+	options = get_be16(data + 6);
+	entries = get_be32(data + 8);
+
+	if (!(options & BITMAP_OPT_FULL_DAG))
+		return bitmap_error("only full bitmaps are supported");
+	if (entries > p->num_objects)
+		return bitmap_error("more bitmaps than objects");
+
+	end = size - GIT_OID_RAWSZ;
+
+	git_hash_buf(&checksum, data, end);
+	if (memcmp(checksum.id, data + end, GIT_OID_RAWSZ) != 0)
+		return bitmap_error("checksum mismatch");
+
+	/* a leftover from an earlier pack with the same name is no use */
+	if (memcmp(data + 12, pack_checksum(p), GIT_OID_RAWSZ) != 0) {
+		giterr_set(GITERR_ODB, "The bitmap of '%s' is for another pack", p->pack_name);
+		return GIT_ENOTFOUND;
+	}
+
+	/* we have no use for the name-hash cache and the lookup table
+	 * which may come after the bitmaps */
+	extra = 0;
+	if (options & BITMAP_OPT_HASH_CACHE)
+		extra += 4 * (size_t)p->num_objects;
+	if (options & BITMAP_OPT_LOOKUP_TABLE)
+		extra += BITMAP_LOOKUP_ENTRY_SIZE * (size_t)entries;
+
+	if (extra > end - pos)
+		return bitmap_error("file is too short");
+	end -= extra;
+
+	if (bitmap_read_ewah(&b->commits, p, data, &pos, end) < 0 ||
+		bitmap_read_ewah(&b->trees, p, data, &pos, end) < 0 ||
+		bitmap_read_ewah(&b->blobs, p, data, &pos, end) < 0 ||
+		bitmap_read_ewah(&b->tags, p, data, &pos, end) < 0 ||
+		bitmap_alloc_entries(b, entries) < 0)
+		return -1;
+
+	for (i = 0; i < entries; ++i) {
+		uint32_t index_pos;
+		uint8_t xor_offset, flags;
+		git_ewah *bitmap;
+
+		if (end - pos < BITMAP_ENTRY_HEADER_SIZE)
+			return bitmap_error("truncated entry");
+
+		index_pos = get_be32(data + pos);
+		xor_offset = data[pos + 4];
+		flags = data[pos + 5];
+		pos += BITMAP_ENTRY_HEADER_SIZE;
+
+		if (index_pos >= p->num_objects)
+			return bitmap_error("invalid commit position");
+		if (xor_offset > BITMAP_MAX_XOR_OFFSET || xor_offset > i)
+			return bitmap_error("invalid XOR offset");
+
+		if (bitmap_read_ewah(&bitmap, p, data, &pos, end) < 0 ||
+			bitmap_add_entry(b, index_pos, xor_offset, flags, bitmap) < 0)
+			return -1;
+	}
+
+	if (pos != end)
+		return bitmap_error("unexpected data after the bitmaps");
+
+	return 0;
+}
+
+int git_pack_bitmap_open(git_pack_bitmap **out, struct git_pack_file *p)
+{
+	git_pack_bitmap *b;
+	git_buf path = GIT_BUF_INIT;
+	git_file fd;
+	git_map map;
+	struct stat st;
+	int error;
+
+	*out = NULL;
+
+	/* bits are numbered in pack order */
+	if ((error = git_pack_revindex_load(p)) < 0 ||
+		(error = bitmap_path(&path, p)) < 0)
+		return error;
+
+	fd = git_futils_open_ro(git_buf_cstr(&path));
+	git_buf_free(&path);
+
+	if (fd < 0)
+		return fd;
+
+	if (p_fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+		!git__is_sizet(st.st_size)) {
+		p_close(fd);
+		giterr_set(GITERR_OS, "Failed to stat the bitmap of '%s'", p->pack_name);
+		return -1;
+	}
+
+	error = git_futils_mmap_ro(&map, fd, 0, (size_t)st.st_size);
+	p_close(fd);
+
+	if (error < 0)
+		return error;
+
+	if ((error = bitmap_alloc(&b, p)) == 0 &&
+		(error = bitmap_parse(b, map.data, map.len)) < 0)
+		git_pack_bitmap_free(b);
+
+	git_futils_mmap_free(&map);
+
+	if (error == 0)
+		*out = b;
+
+	return error;
+}
+
+static int bitmap_find__cb(void *payload, git_buf *path)
+{
+	git_pack_bitmap **out = payload;
+	git_buf idx_path = GIT_BUF_INIT;
+	struct git_pack_file *p;
+	int error;
+
+	if (*out != NULL || git__suffixcmp(path->ptr, ".bitmap") != 0)
+		return 0;
+
+	git_buf_put(&idx_path, path->ptr, path->size - strlen(".bitmap"));
+	git_buf_puts(&idx_path, ".idx");
+
+	if (git_buf_oom(&idx_path))
+		return -1;
+
+	error = git_packfile_check(&p, git_buf_cstr(&idx_path));
+	git_buf_free(&idx_path);
+
+	if (error == 0 && (error = git_pack_bitmap_open(out, p)) < 0)
+		packfile_free(p);
+
+	/* a bitmap which is stale, broken or without its pack only
+	 * costs us a walk; keep looking */
+	if (error < 0) {
+		giterr_clear();
+		return 0;
+	}
+
+	(*out)->owns_pack = 1;
+	return 0;
+}
+
+int git_pack_bitmap_find(git_pack_bitmap **out, git_repository *repo)
+{
+	git_buf path = GIT_BUF_INIT;
+	int error;
+
+	*out = NULL;
+
+	if (git_buf_joinpath(&path, repo->path_repository, GIT_OBJECTS_DIR "pack") < 0)
+		return -1;
+
+	if (git_path_isdir(git_buf_cstr(&path)))
+		error = git_path_direach(&path, bitmap_find__cb, out);
+	else
+		error = 0;
+
+	git_buf_free(&path);
+
+	if (error < 0) {
+		git_pack_bitmap_free(*out);
+		*out = NULL;
+		return error;
+	}
+
+	if (*out == NULL) {
+		giterr_set(GITERR_ODB, "No pack bitmap found");
+		return GIT_ENOTFOUND;
+	}
+
+	return 0;
+}
+
+void git_pack_bitmap_free(git_pack_bitmap *b)
+{
+	size_t i;
+
+	if (b == NULL)
+		return;
+
+	for (i = 0; i < b->entries_nr; ++i)
+		git_ewah_free(b->entries[i].bitmap);
+
+	git__free(b->entries);
+	git_oidmap_free(b->entry_ix);
+
+	git_ewah_free(b->commits);
+	git_ewah_free(b->trees);
+	git_ewah_free(b->blobs);
+	git_ewah_free(b->tags);
+
+	if (b->owns_pack)
+		packfile_free(b->pack);
+
+	git__free(b);
+}
+
+/***********************************************************
+ *
+ * REACHABILITY
+ *
+ ***********************************************************/
+
+struct walk_item {
+	git_oid id;
+	git_otype type;
+};
+
+struct walk_stack {
+	struct walk_item *items;
+	size_t nr, alloc;
+};
+
+typedef int (*walk_cb)(const git_oid *id, git_otype type, const char *name, void *payload);
+
+static int walk_visit(
+	struct walk_stack *stack,
+	const git_oid *id,
+	git_otype type,
+	const char *name,
+	walk_cb cb,
+	void *payload)
+{
+	int error = cb(id, type, name, payload);
+
+	if (error != 0)
+		return (error < 0) ? error : 0;
+
+	/* blobs have nothing more to show */
+	if (type == GIT_OBJ_BLOB)
+		return 0;
+
+	if (stack->nr == stack->alloc) {
+		struct walk_item *items;
+
+		stack->alloc = (stack->alloc + 64) * 3 / 2;
+		items = git__realloc(stack->items, stack->alloc * sizeof(struct walk_item));
+		GITERR_CHECK_ALLOC(items);
+		stack->items = items;
+	}
+
+	git_oid_cpy(&stack->items[stack->nr].id, id);
+	stack->items[stack->nr].type = type;
+	stack->nr++;
+
+	return 0;
+}
+
+static int walk_children(
+	struct walk_stack *stack,
+	git_object *obj,
+	walk_cb cb,
+	void *payload)
+{
+	unsigned int i, n;
+	int error = 0;
+
+	switch (git_object_type(obj)) {
+	case GIT_OBJ_COMMIT: {
+		git_commit *commit = (git_commit *)obj;
+
+		n = git_commit_parentcount(commit);
+		for (i = 0; i < n && !error; ++i)
+			error = walk_visit(stack, git_commit_parent_oid(commit, i),
+				GIT_OBJ_COMMIT, NULL, cb, payload);
+
+		if (!error)
+			error = walk_visit(stack, git_commit_tree_oid(commit),
+				GIT_OBJ_TREE, NULL, cb, payload);
+		break;
+	}
+
+	case GIT_OBJ_TAG:
+		error = walk_visit(stack, git_tag_target_oid((git_tag *)obj),
+			GIT_OBJ_ANY, NULL, cb, payload);
+		break;
+
+	case GIT_OBJ_TREE: {
+		git_tree *tree = (git_tree *)obj;
+
+		n = git_tree_entrycount(tree);
+		for (i = 0; i < n && !error; ++i) {
+			const git_tree_entry *entry = git_tree_entry_byindex(tree, i);
+			git_otype type = git_tree_entry_type(entry);
+
+			/* submodules live in another repository */
+			if (type == GIT_OBJ_COMMIT)
+				continue;
+
+			error = walk_visit(stack, git_tree_entry_id(entry), type,
+				git_tree_entry_name(entry), cb, payload);
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return error;
+}
+
+int git_pack_walk_reachable(
+	git_repository *repo,
+	const git_oid *tips,
+	size_t tips_len,
+	int (*cb)(const git_oid *id, git_otype type, const char *name, void *payload),
+	void *payload)
+{
+	struct walk_stack stack = {0};
+	struct walk_item item;
+	git_object *obj;
+	size_t i;
+	int error = 0;
+
+	for (i = 0; i < tips_len && !error; ++i)
+		error = walk_visit(&stack, &tips[i], GIT_OBJ_ANY, NULL, cb, payload);
+
+	while (!error && stack.nr > 0) {
+		item = stack.items[--stack.nr];
+
+		if ((error = git_object_lookup(&obj, repo, &item.id, item.type)) < 0)
+			break;
+
+		error = walk_children(&stack, obj, cb, payload);
+		git_object_free(obj);
+	}
+
+	git__free(stack.items);
+	return error;
+}
+
+struct reach_ctx {
+	git_pack_bitmap *b;
+	git_bitmap *out;
+	const git_bitmap *seen;
+};
+
+static int reach__cb(const git_oid *id, git_otype type, const char *name, void *payload)
+{
+	struct reach_ctx *ctx = payload;
+	git_pack_bitmap_entry *e;
+	uint32_t pos;
+	int error;
+
+	GIT_UNUSED(name);
+
+	if ((error = git_pack_oid_to_revindex(&pos, ctx->b->pack, id)) < 0)
+		return error;
+
+	if (git_bitmap_get(ctx->out, pos) ||
+		(ctx->seen && git_bitmap_get(ctx->seen, pos)))
+		return 1;
+
+	/* a commit with a bitmap saves us the rest of its history */
+	if (type != GIT_OBJ_TREE && type != GIT_OBJ_BLOB &&
+		(e = bitmap_entry(ctx->b, id)) != NULL)
+		return (error = bitmap_entry_or(ctx->out, e)) < 0 ? error : 1;
+
+	return git_bitmap_set(ctx->out, pos);
+}
+
+int git_pack_bitmap_reachable(
+	git_bitmap *out,
+	git_pack_bitmap *b,
+	git_repository *repo,
+	const git_oid *tips,
+	size_t tips_len,
+	const git_bitmap *seen)
+{
+	struct reach_ctx ctx;
+
+	ctx.b = b;
+	ctx.out = out;
+	ctx.seen = seen;
+
+	return git_pack_walk_reachable(repo, tips, tips_len, reach__cb, &ctx);
+}
+
+int git_pack_bitmap_foreach(
+	git_pack_bitmap *b,
+	const git_bitmap *objects,
+	int (*cb)(const git_oid *id, git_otype type, void *payload),
+	void *payload)
+{
+	static const git_otype types[] = {
+		GIT_OBJ_COMMIT, GIT_OBJ_TAG, GIT_OBJ_TREE, GIT_OBJ_BLOB
+	};
+	const git_ewah *of_type[4];
+	git_bitmap type_bits = GIT_BITMAP_INIT;
+	size_t t, i, bit, words;
+	git_oid id;
+	int error = 0;
+
+	of_type[0] = b->commits;
+	of_type[1] = b->tags;
+	of_type[2] = b->trees;
+	of_type[3] = b->blobs;
+
+	for (t = 0; t < ARRAY_SIZE(types) && !error; ++t) {
+		git_bitmap_clear(&type_bits);
+
+		if ((error = git_bitmap_or_ewah(&type_bits, of_type[t])) < 0)
+			break;
+
+		words = min(objects->word_alloc, type_bits.word_alloc);
+
+		for (i = 0; i < words && !error; ++i) {
+			git_eword word = objects->words[i] & type_bits.words[i];
+
+			for (bit = 0; word != 0 && !error; ++bit, word >>= 1) {
+				size_t pos = i * GIT_EWORD_BITS + bit;
+
+				if (!(word & 1))
+					continue;
+
+				if (pos >= b->pack->num_objects)
+					error = bitmap_error("object position out of range");
+				else if ((error = git_pack_revindex_oid(&id, b->pack, (uint32_t)pos)) == 0 &&
+					cb(&id, types[t], payload))
+					error = GIT_EUSER;
+			}
+		}
+	}
+
+	git_bitmap_free(&type_bits);
+	return error;
+}
+
+/***********************************************************
+ *
+ * WRITING
+ *
+ ***********************************************************/
+
+struct bitmap_commit {
+	git_oid id;
+	git_time_t time;
+	unsigned int parents;
+	unsigned tip:1;
+};
+
+static int bitmap_commit_oid_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const struct bitmap_commit *)a)->id,
+		&((const struct bitmap_commit *)b)->id);
+}
+
+static int bitmap_commit_time_cmp(const void *a_, const void *b_)
+{
+	const struct bitmap_commit *a = a_, *b = b_;
+
+	/* most recent first */
+	if (a->time != b->time)
+		return (a->time > b->time) ? -1 : 1;
+
+	return git_oid_cmp(&a->id, &b->id);
+}
+
+static int bitmap_build_types(git_pack_bitmap *b, git_bitmap *commits)
+{
+	struct git_pack_file *p = b->pack;
+	git_bitmap trees = GIT_BITMAP_INIT, blobs = GIT_BITMAP_INIT, tags = GIT_BITMAP_INIT;
+	git_bitmap *bits;
+	git_otype type;
+	size_t size;
+	uint32_t pos;
+	int error = 0;
+
+	for (pos = 0; pos < p->num_objects && !error; ++pos) {
+		error = git_packfile_resolve_header(&size, &type, p,
+			git_pack_revindex_offset(p, pos));
+
+		if (error < 0)
+			break;
+
+		switch (type) {
+		case GIT_OBJ_COMMIT: bits = commits; break;
+		case GIT_OBJ_TREE: bits = &trees; break;
+		case GIT_OBJ_BLOB: bits = &blobs; break;
+		case GIT_OBJ_TAG: bits = &tags; break;
+		default:
+			error = bitmap_error("unexpected object type in the pack");
+			continue;
+		}
+
+		error = git_bitmap_set(bits, pos);
+	}
+
+	if (!error &&
+		((b->commits = git_ewah_from_bitmap(commits)) == NULL ||
+		 (b->trees = git_ewah_from_bitmap(&trees)) == NULL ||
+		 (b->blobs = git_ewah_from_bitmap(&blobs)) == NULL ||
+		 (b->tags = git_ewah_from_bitmap(&tags)) == NULL))
+		error = -1;
+
+	git_bitmap_free(&trees);
+	git_bitmap_free(&blobs);
+	git_bitmap_free(&tags);
+	return error;
+}
+
+struct collect_ctx {
+	git_pack_bitmap *b;
+	git_repository *repo;
+	struct bitmap_commit *commits;
+	size_t nr;
+};
+
+static int collect_commit__cb(size_t pos, void *payload)
+{
+	struct collect_ctx *ctx = payload;
+	struct bitmap_commit *c = &ctx->commits[ctx->nr];
+	git_commit *commit;
+
+	if (git_pack_revindex_oid(&c->id, ctx->b->pack, (uint32_t)pos) < 0 ||
+		git_commit_lookup(&commit, ctx->repo, &c->id) < 0)
+		return -1;
+
+	c->time = git_commit_time(commit);
+	c->parents = git_commit_parentcount(commit);
+	git_commit_free(commit);
+
+	ctx->nr++;
+	return 0;
+}
+
+static int mark_tip__cb(const char *refname, void *payload)
+{
+	struct collect_ctx *ctx = payload;
+	struct bitmap_commit key, *c;
+	git_reference *ref;
+	git_object *peeled;
+	int error;
+
+	if ((error = git_reference_lookup(&ref, ctx->repo, refname)) < 0)
+		return error;
+
+	error = git_reference_peel(&peeled, ref, GIT_OBJ_COMMIT);
+	git_reference_free(ref);
+
+	/* refs to trees, blobs and dangling refs don't matter here */
+	if (error < 0) {
+		giterr_clear();
+		return 0;
+	}
+
+	git_oid_cpy(&key.id, git_object_id(peeled));
+	git_object_free(peeled);
+
+	c = bsearch(&key, ctx->commits, ctx->nr, sizeof(key), bitmap_commit_oid_cmp);
+	if (c != NULL)
+		c->tip = 1;
+
+	return 0;
+}
+
+/*
+ * Every commit of the pack, most recent first, with the ones refs
+ * point to marked.
+ */
+static int bitmap_collect_commits(
+	struct collect_ctx *ctx,
+	git_pack_bitmap *b,
+	git_repository *repo,
+	const git_bitmap *commits)
+{
+	memset(ctx, 0x0, sizeof(*ctx));
+	ctx->b = b;
+	ctx->repo = repo;
+
+	ctx->commits = git__calloc(git_bitmap_popcount(commits) + 1, sizeof(struct bitmap_commit));
+	GITERR_CHECK_ALLOC(ctx->commits);
+
+	if (git_bitmap_foreach(commits, collect_commit__cb, ctx) < 0)
+		return -1;
+
+	qsort(ctx->commits, ctx->nr, sizeof(struct bitmap_commit), bitmap_commit_oid_cmp);
+
+	if (git_reference_foreach(repo, GIT_REF_LISTALL, mark_tip__cb, ctx) < 0)
+		return -1;
+
+	qsort(ctx->commits, ctx->nr, sizeof(struct bitmap_commit), bitmap_commit_time_cmp);
+	return 0;
+}
+
+/*
+ * How many commits to skip before picking the next one to give a
+ * bitmap to: every one of the most recent commits, then sparser and
+ * sparser ones further back in history.
+ */
+static size_t next_commit_index(size_t idx)
+{
+	static const size_t MIN_COMMITS = 100;
+	static const size_t MAX_COMMITS = 5000;
+	static const size_t MUST_REGION = 100;
+	static const size_t MIN_REGION = 20000;
+	size_t offset, next;
+
+	if (idx <= MUST_REGION)
+		return 0;
+
+	if (idx <= MIN_REGION) {
+		offset = idx - MUST_REGION;
+		return (offset < MIN_COMMITS) ? offset : MIN_COMMITS;
+	}
+
+	offset = idx - MIN_REGION;
+	next = (offset < MAX_COMMITS) ? offset : MAX_COMMITS;
+
+	return (next < MIN_COMMITS) ? MIN_COMMITS : next;
+}
+
+static size_t bitmap_select_commits(
+	struct bitmap_commit **selected,
+	struct bitmap_commit *commits,
+	size_t nr)
+{
+	size_t i = 0, j, next, selected_nr = 0;
+
+	while (i < nr) {
+		struct bitmap_commit *chosen;
+
+		next = next_commit_index(i);
+		if (i + next >= nr)
+			break;
+
+		/* within the window, prefer ref tips, then merges */
+		chosen = &commits[i + next];
+		for (j = 0; j <= next; ++j) {
+			struct bitmap_commit *c = &commits[i + j];
+
+			if (c->tip) {
+				chosen = c;
+				break;
+			}
+
+			if (c->parents > 1)
+				chosen = c;
+		}
+
+		selected[selected_nr++] = chosen;
+		i += next + 1;
+	}
+
+	return selected_nr;
+}
+
+static int bitmap_write_ewah(git_filebuf *file, git_buf *buf, const git_ewah *e)
+{
+	git_buf_clear(buf);
+
+	if (git_ewah_serialize(buf, e) < 0)
+		return -1;
+
+	return git_filebuf_write(file, buf->ptr, buf->size);
+}
+
+static int bitmap_write_file(git_pack_bitmap *b)
+{
+	git_buf path = GIT_BUF_INIT, buf = GIT_BUF_INIT;
+	git_filebuf file = GIT_FILEBUF_INIT;
+	unsigned char hdr[BITMAP_HEADER_SIZE];
+	git_oid file_hash;
+	size_t i;
+	int error;
+
+	if ((error = bitmap_path(&path, b->pack)) < 0 ||
+		(error = git_filebuf_open(&file, git_buf_cstr(&path), GIT_FILEBUF_HASH_CONTENTS)) < 0)
+		goto cleanup;
+
+	memcpy(hdr, BITMAP_SIGNATURE, 4);
+	put_be16(hdr + 4, BITMAP_VERSION);
+	put_be16(hdr + 6, BITMAP_OPT_FULL_DAG);
+	put_be32(hdr + 8, (uint32_t)b->entries_nr);
+	memcpy(hdr + 12, pack_checksum(b->pack), GIT_OID_RAWSZ);
+
+	error = git_filebuf_write(&file, hdr, sizeof(hdr));
+
+	if (!error)
+		error = bitmap_write_ewah(&file, &buf, b->commits);
+	if (!error)
+		error = bitmap_write_ewah(&file, &buf, b->trees);
+	if (!error)
+		error = bitmap_write_ewah(&file, &buf, b->blobs);
+	if (!error)
+		error = bitmap_write_ewah(&file, &buf, b->tags);
+
+	for (i = 0; i < b->entries_nr && !error; ++i) {
+		git_pack_bitmap_entry *e = &b->entries[i];
+
+		put_be32(hdr, e->index_pos);
+		hdr[4] = e->xor_offset;
+		hdr[5] = e->flags;
+
+		if ((error = git_filebuf_write(&file, hdr, BITMAP_ENTRY_HEADER_SIZE)) == 0)
+			error = bitmap_write_ewah(&file, &buf, e->bitmap);
+	}
+
+	if (!error &&
+		(error = git_filebuf_hash(&file_hash, &file)) == 0 &&
+		(error = git_filebuf_write(&file, &file_hash, sizeof(git_oid))) == 0)
+		error = git_filebuf_commit(&file, GIT_PACK_FILE_MODE);
+
+	if (error < 0)
+		git_filebuf_cleanup(&file);
+
+cleanup:
+	git_buf_free(&path);
+	git_buf_free(&buf);
+	return error;
+}
+
+static int bitmap_compute(git_pack_bitmap *b, git_repository *repo, struct bitmap_commit *c)
+{
+	git_bitmap reach = GIT_BITMAP_INIT;
+	git_ewah *ewah;
+	uint32_t pos;
+	int error;
+
+	error = git_pack_bitmap_reachable(&reach, b, repo, &c->id, 1, NULL);
+
+	if (error == GIT_ENOTFOUND) {
+		giterr_set(GITERR_ODB, "Cannot write a bitmap for '%s': "
+			"the pack is missing objects reachable from its commits",
+			b->pack->pack_name);
+		error = -1;
+	}
+
+	if (!error)
+		error = git_pack_oid_to_revindex(&pos, b->pack, &c->id);
+
+	if (!error) {
+		if ((ewah = git_ewah_from_bitmap(&reach)) == NULL)
+			error = -1;
+		else
+			error = bitmap_add_entry(b, git_pack_revindex_nth(b->pack, pos), 0, 0, ewah);
+	}
+
+	git_bitmap_free(&reach);
+	return error;
+}
+
+int git_pack_write_bitmap(git_repository *repo, const char *idx_path)
+{
+	struct git_pack_file *p;
+	git_pack_bitmap *b;
+	git_bitmap commits = GIT_BITMAP_INIT;
+	struct collect_ctx ctx = {0};
+	struct bitmap_commit **selected = NULL;
+	size_t selected_nr, i;
+	int error;
+
+	assert(repo && idx_path);
+
+	if ((error = git_packfile_check(&p, idx_path)) < 0)
+		return error;
+
+	if ((error = bitmap_alloc(&b, p)) < 0) {
+		packfile_free(p);
+		return error;
+	}
+
+	b->owns_pack = 1;
+
+	if ((error = git_pack_revindex_load(p)) < 0 ||
+		(error = git_packfile_open(p)) < 0 ||
+		(error = bitmap_build_types(b, &commits)) < 0 ||
+		(error = bitmap_collect_commits(&ctx, b, repo, &commits)) < 0)
+		goto cleanup;
+
+	selected = git__calloc(ctx.nr + 1, sizeof(struct bitmap_commit *));
+	if (!selected) {
+		giterr_set_oom();
+		error = -1;
+		goto cleanup;
+	}
+
+	selected_nr = bitmap_select_commits(selected, ctx.commits, ctx.nr);
+
+	if ((error = bitmap_alloc_entries(b, selected_nr)) < 0)
+		goto cleanup;
+
+	/* oldest first, so that the bitmaps of their ancestors
+	 * are there to be reused */
+	for (i = selected_nr; i > 0 && !error; --i)
+		error = bitmap_compute(b, repo, selected[i - 1]);
+
+	if (!error)
+		error = bitmap_write_file(b);
+
+cleanup:
+	git__free(selected);
+	git__free(ctx.commits);
+	git_bitmap_free(&commits);
+	git_pack_bitmap_free(b);
+	return error;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_pack_bitmap_h__
+#define INCLUDE_pack_bitmap_h__
+
+#include "common.h"
+#include "ewah.h"
+#include "oidmap.h"
+#include "pack.h"
+
+#include "git2/oid.h"
+#include "git2/pack.h"
+
+/*
+ * A reachability bitmap index, as stored in the `.bitmap` file next
+ * to a pack by `git repack -b`. Every object of the pack is given a
+ * bit, numbered by its position in the pack; a selection of commits
+ * then get a bitmap of every object reachable from them.
+ *
+ * The pack must be closed under reachability (e.g. the result of a
+ * full repack) for the bitmaps to be of any use.
+ */
+typedef struct {
+	git_oid id;
+
+	/* the commit, by position in the pack index */
+	uint32_t index_pos;
+
+	/* this bitmap is XORed with the one `xor_offset` entries before */
+	uint8_t xor_offset;
+	uint8_t flags;
+
+	git_ewah *bitmap;
+} git_pack_bitmap_entry;
+
+typedef struct {
+	struct git_pack_file *pack;
+	unsigned owns_pack:1;
+
+	/* which objects are of which type */
+	git_ewah *commits;
+	git_ewah *trees;
+	git_ewah *blobs;
+	git_ewah *tags;
+
+	git_pack_bitmap_entry *entries;
+	size_t entries_nr;
+
+	/* commit id -> its entry */
+	git_oidmap *entry_ix;
+} git_pack_bitmap;
+
+/*
+ * Load the bitmap index of a pack. Returns GIT_ENOTFOUND if there is
+ * no `.bitmap` file for it, or if the file is for another version
+ * of the pack.
+ */
+int git_pack_bitmap_open(git_pack_bitmap **out, struct git_pack_file *p);
+
+/*
+ * Find a pack which has a bitmap index in `objects/pack`; bitmaps
+ * which can't be loaded are skipped. The index owns the pack it
+ * returns and frees it with itself.
+ */
+int git_pack_bitmap_find(git_pack_bitmap **out, git_repository *repo);
+
+void git_pack_bitmap_free(git_pack_bitmap *b);
+
+/*
+ * Set in `out` the bits of every object reachable from `tips`. Objects
+ * whose bit is set in `seen` are not walked further; pass the result
+ * for the "haves" of a fetch to skip what the other side already has.
+ *
+ * Returns GIT_ENOTFOUND if any of the objects reached is not in the
+ * pack, in which case the caller should fall back to a plain walk.
+ */
+int git_pack_bitmap_reachable(
+	git_bitmap *out,
+	git_pack_bitmap *b,
+	git_repository *repo,
+	const git_oid *tips,
+	size_t tips_len,
+	const git_bitmap *seen);
+
+/*
+ * Call `cb` with the id and type of every object set in `objects`,
+ * commits first, then tags, trees and blobs, each in pack order.
+ */
+int git_pack_bitmap_foreach(
+	git_pack_bitmap *b,
+	const git_bitmap *objects,
+	int (*cb)(const git_oid *id, git_otype type, void *payload),
+	void *payload);
+
+/*
+ * Walk the objects reachable from `tips`: commits, their parents and
+ * trees, tag targets, and the contents of trees. Submodule entries
+ * are skipped.
+ *
+ * The callback is given the type of the object when it is known
+ * before loading it (GIT_OBJ_ANY for the tips and tag targets) and
+ * the name of the tree entry it was found under, if any. It returns
+ * 0 to descend into the object, a positive value to skip it, or an
+ * error code to stop the walk.
+ */
+int git_pack_walk_reachable(
+	git_repository *repo,
+	const git_oid *tips,
+	size_t tips_len,
+	int (*cb)(const git_oid *id, git_otype type, const char *name, void *payload),
+	void *payload);
+
+#endif
@@ -12,6 +12,8 @@
 #include "iterator.h"
 #include "netops.h"
 #include "pack.h"
+#include "pack-bitmap.h"
+#include "pool.h"
 #include "thread-utils.h"
 #include "tree.h"
 
@@ -1292,6 +1294,143 @@ int git_packbuilder_insert_tree(git_packbuilder *pb, const git_oid *oid)
 	return 0;
 }
 
+static int insert_bitmapped__cb(const git_oid *id, git_otype type, void *payload)
+{
+	GIT_UNUSED(type);
+	return git_packbuilder_insert((git_packbuilder *)payload, id, NULL);
+}
+
+/*
+ * Count the objects with the bitmaps of a pack: what `wants` reach,
+ * minus what `haves` reach. Returns GIT_ENOTFOUND when there is no
+ * bitmap or when it doesn't cover all the objects involved.
+ */
+static int insert_reachable_bitmap(
+	git_packbuilder *pb,
+	const git_oid *wants,
+	size_t wants_len,
+	const git_oid *haves,
+	size_t haves_len)
+{
+	git_pack_bitmap *bitmap;
+	git_bitmap want_bits = GIT_BITMAP_INIT, have_bits = GIT_BITMAP_INIT;
+	int error;
+
+	if ((error = git_pack_bitmap_find(&bitmap, pb->repo)) < 0)
+		return error;
+
+	if ((error = git_pack_bitmap_reachable(&have_bits, bitmap, pb->repo,
+			haves, haves_len, NULL)) < 0 ||
+		(error = git_pack_bitmap_reachable(&want_bits, bitmap, pb->repo,
+			wants, wants_len, &have_bits)) < 0)
+		goto cleanup;
+
+	git_bitmap_and_not(&want_bits, &have_bits);
+
+	error = git_pack_bitmap_foreach(bitmap, &want_bits, insert_bitmapped__cb, pb);
+
+cleanup:
+	git_bitmap_free(&want_bits);
+	git_bitmap_free(&have_bits);
+	git_pack_bitmap_free(bitmap);
+	return error;
+}
+
+struct walk_ctx {
+	git_packbuilder *pb;
+	git_oidmap *seen;
+	git_pool seen_pool;
+	bool insert;
+};
+
+static int insert_walked__cb(const git_oid *id, git_otype type, const char *name, void *payload)
+{
+	struct walk_ctx *ctx = payload;
+	git_oid *key;
+	khiter_t pos;
+	int ret;
+
+	GIT_UNUSED(type);
+
+	if (kh_get(oid, ctx->seen, id) != kh_end(ctx->seen))
+		return 1;
+
+	key = git_pool_malloc(&ctx->seen_pool, 1);
+	GITERR_CHECK_ALLOC(key);
+	git_oid_cpy(key, id);
+
+	pos = kh_put(oid, ctx->seen, key, &ret);
+	if (ret < 0) {
+		giterr_set_oom();
+		return -1;
+	}
+	kh_value(ctx->seen, pos) = key;
+
+	if (ctx->insert)
+		return git_packbuilder_insert(ctx->pb, id, name);
+
+	return 0;
+}
+
+/*
+ * The slow way: mark everything the haves reach, then walk from the
+ * wants and insert whatever wasn't marked.
+ */
+static int insert_reachable_walk(
+	git_packbuilder *pb,
+	const git_oid *wants,
+	size_t wants_len,
+	const git_oid *haves,
+	size_t haves_len)
+{
+	struct walk_ctx ctx;
+	int error;
+
+	ctx.pb = pb;
+	ctx.insert = false;
+
+	if (git_pool_init(&ctx.seen_pool, sizeof(git_oid), 0) < 0)
+		return -1;
+
+	ctx.seen = git_oidmap_alloc();
+	if (!ctx.seen) {
+		git_pool_clear(&ctx.seen_pool);
+		giterr_set_oom();
+		return -1;
+	}
+
+	error = git_pack_walk_reachable(pb->repo, haves, haves_len, insert_walked__cb, &ctx);
+
+	if (!error) {
+		ctx.insert = true;
+		error = git_pack_walk_reachable(pb->repo, wants, wants_len, insert_walked__cb, &ctx);
+	}
+
+	git_oidmap_free(ctx.seen);
+	git_pool_clear(&ctx.seen_pool);
+	return error;
+}
+
+int git_packbuilder_insert_reachable(
+	git_packbuilder *pb,
+	const git_oid *wants,
+	size_t wants_len,
+	const git_oid *haves,
+	size_t haves_len)
+{
+	int error;
+
+	assert(pb && (wants || !wants_len) && (haves || !haves_len));
+
+	error = insert_reachable_bitmap(pb, wants, wants_len, haves, haves_len);
+
+	if (error != GIT_ENOTFOUND)
+		return error;
+
+	giterr_clear();
+	return insert_reachable_walk(pb, wants, wants_len, haves, haves_len);
+}
+
 uint32_t git_packbuilder_object_count(git_packbuilder *pb)
 {
 	return pb->nr_objects;
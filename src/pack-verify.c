@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "common.h"
+#include "pack.h"
+#include "odb.h"
+#include "hash.h"
+#include "vector.h"
+#include "thread-utils.h"
+
+#include "git2/pack.h"
+
+/* how many objects a thread takes on at a time, in pack order */
+#define VERIFY_RANGE 256
+
+struct verify_error {
+	uint32_t pos;
+	char *message;
+};
+
+struct pack_verify {
+	struct git_pack_file *pack;
+
+	git_atomic next_range;
+	git_atomic verified;
+
+	git_mutex lock; /* for the errors */
+	git_vector errors;
+
+	/* the objects are still checked when these don't match */
+	const char *checksum_error;
+};
+
+static int verify_error_cmp(const void *a, const void *b)
+{
+	const struct verify_error *ea = a;
+	const struct verify_error *eb = b;
+
+	if (ea->pos < eb->pos)
+		return -1;
+	return ea->pos > eb->pos;
+}
+
+/* Check that the pack and its index match the checksums they end with */
+static int verify_checksums(struct pack_verify *v)
+{
+	struct git_pack_file *p = v->pack;
+	const unsigned char *idx = p->index_map.data;
+	git_mwindow *w = NULL;
+	git_hash_ctx *ctx;
+	git_off_t offset = 0, end = p->mwf.size - GIT_OID_RAWSZ;
+	unsigned char *data;
+	unsigned int left;
+	git_oid hash;
+
+	git_hash_buf(&hash, idx, p->index_map.len - GIT_OID_RAWSZ);
+	if (memcmp(hash.id, idx + p->index_map.len - GIT_OID_RAWSZ, GIT_OID_RAWSZ) != 0)
+		v->checksum_error = "Index checksum mismatch";
+
+	if ((ctx = git_hash_new_ctx()) == NULL)
+		return -1;
+
+	while (offset < end) {
+		if ((data = git_mwindow_open(&p->mwf, &w, offset, 0, &left)) == NULL)
+			break;
+
+		if ((git_off_t)left > end - offset)
+			left = (unsigned int)(end - offset);
+
+		git_hash_update(ctx, data, left);
+		offset += left;
+	}
+
+	git_mwindow_close(&w);
+	git_hash_final(&hash, ctx);
+	git_hash_free_ctx(ctx);
+
+	if (offset < end)
+		return -1;
+
+	/* the index records the checksum the pack ends with */
+	if (memcmp(hash.id, idx + p->index_map.len - 2 * GIT_OID_RAWSZ, GIT_OID_RAWSZ) != 0)
+		v->checksum_error = "Pack checksum mismatch";
+
+	return 0;
+}
+
+/* Keep what went wrong with an object, to report it once the threads are done */
+static int save_error(struct pack_verify *v, uint32_t pos)
+{
+	const git_error *e = giterr_last();
+	struct verify_error *error;
+	int ret;
+
+	error = git__malloc(sizeof(*error));
+	GITERR_CHECK_ALLOC(error);
+
+	error->pos = pos;
+	error->message = git__strdup(e ? e->message : "Unknown error");
+	if (error->message == NULL) {
+		git__free(error);
+		return -1;
+	}
+
+	giterr_clear();
+
+	git_mutex_lock(&v->lock);
+	ret = git_vector_insert(&v->errors, error);
+	git_mutex_unlock(&v->lock);
+
+	if (ret < 0) {
+		git__free(error->message);
+		git__free(error);
+	}
+
+	return ret;
+}
+
+static int verify_object(struct pack_verify *v, uint32_t pos)
+{
+	struct git_pack_file *p = v->pack;
+	git_off_t offset = git_pack_revindex_offset(p, pos);
+	git_oid expected, actual;
+	git_rawobj obj;
+	int error;
+
+	if ((error = git_pack_revindex_oid(&expected, p, pos)) < 0)
+		return error;
+
+	if ((error = git_pack_revindex_check_crc(p, pos)) == 0 &&
+		(error = git_packfile_unpack(&obj, p, &offset)) == 0) {
+		error = git_odb__hashobj(&actual, &obj);
+		git__free(obj.data);
+
+		if (error == 0 && git_oid_cmp(&expected, &actual) != 0) {
+			giterr_set(GITERR_ODB, "Packed object doesn't match its name");
+			error = -1;
+		}
+	}
+
+	/* a corrupt object doesn't stop the others from being checked */
+	if (error < 0)
+		return save_error(v, pos);
+
+	git_atomic_inc(&v->verified);
+	return 0;
+}
+
+static int verify_ranges(
+	struct pack_verify *v,
+	git_transfer_progress_callback progress_cb,
+	void *payload)
+{
+	git_transfer_progress stats;
+	uint32_t nr = v->pack->num_objects;
+	size_t start, end, pos;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.total_objects = nr;
+
+	while ((start = (size_t)(git_atomic_inc(&v->next_range) - 1) * VERIFY_RANGE) < nr) {
+		end = min(start + VERIFY_RANGE, (size_t)nr);
+
+		for (pos = start; pos < end; ++pos) {
+			if (verify_object(v, (uint32_t)pos) < 0)
+				return -1;
+		}
+
+		/* only the calling thread is given the callback */
+		if (progress_cb) {
+			stats.indexed_objects = git_atomic_get(&v->verified);
+			progress_cb(&stats, payload);
+		}
+	}
+
+	return 0;
+}
+
+#ifdef GIT_THREADS
+
+struct verify_thread {
+	git_thread thread;
+	struct pack_verify *v;
+	int error;
+};
+
+static void *threaded_verify_ranges(void *arg)
+{
+	struct verify_thread *me = arg;
+
+	me->error = verify_ranges(me->v, NULL, NULL);
+	return NULL;
+}
+
+static int verify_ranges_threaded(
+	struct pack_verify *v,
+	unsigned int nr_threads,
+	git_transfer_progress_callback progress_cb,
+	void *payload)
+{
+	struct verify_thread *p;
+	unsigned int i, started = 0;
+	int error;
+
+	if (!nr_threads)
+		nr_threads = git_online_cpus();
+
+	if (nr_threads > v->pack->num_objects / VERIFY_RANGE + 1)
+		nr_threads = v->pack->num_objects / VERIFY_RANGE + 1;
+
+	if (nr_threads <= 1)
+		return verify_ranges(v, progress_cb, payload);
+
+	/* this thread works too, and is the one reporting progress */
+	p = git__calloc(nr_threads - 1, sizeof(*p));
+	GITERR_CHECK_ALLOC(p);
+
+	for (i = 0; i < nr_threads - 1; ++i) {
+		p[i].v = v;
+		if (git_thread_create(&p[i].thread, NULL, threaded_verify_ranges, &p[i]))
+			break;
+		started++;
+	}
+
+	error = verify_ranges(v, progress_cb, payload);
+
+	for (i = 0; i < started; ++i) {
+		git_thread_join(p[i].thread, NULL);
+		if (p[i].error < 0 && !error) {
+			giterr_set(GITERR_ODB, "Failed to verify the packfile");
+			error = -1;
+		}
+	}
+
+	git__free(p);
+	return error;
+}
+
+#else
+
+static int verify_ranges_threaded(
+	struct pack_verify *v,
+	unsigned int nr_threads,
+	git_transfer_progress_callback progress_cb,
+	void *payload)
+{
+	GIT_UNUSED(nr_threads);
+	return verify_ranges(v, progress_cb, payload);
+}
+
+#endif
+
+static int report_errors(
+	struct pack_verify *v, git_pack_verify_cb corrupt_cb, void *payload)
+{
+	struct verify_error *error;
+	unsigned int i;
+	git_oid oid;
+
+	git_vector_sort(&v->errors);
+
+	git_vector_foreach(&v->errors, i, error) {
+		if (git_pack_revindex_oid(&oid, v->pack, error->pos) < 0)
+			return -1;
+
+		if (corrupt_cb(&oid, git_pack_revindex_offset(v->pack, error->pos),
+				error->message, payload))
+			return GIT_EUSER;
+	}
+
+	return 0;
+}
+
+int git_pack_verify(
+	const char *idx_path,
+	unsigned int nr_threads,
+	git_transfer_progress_callback progress_cb,
+	git_pack_verify_cb corrupt_cb,
+	void *payload)
+{
+	struct pack_verify v;
+	struct verify_error *e;
+	unsigned int i;
+	int error;
+
+	assert(idx_path);
+
+	memset(&v, 0, sizeof(v));
+
+	if ((error = git_packfile_check(&v.pack, idx_path)) < 0)
+		return error;
+
+	if ((error = git_vector_init(&v.errors, 0, verify_error_cmp)) < 0) {
+		packfile_free(v.pack);
+		return error;
+	}
+
+	git_mutex_init(&v.lock);
+
+	if ((error = git_pack_revindex_load(v.pack)) < 0 ||
+		(error = git_packfile_open(v.pack)) < 0 ||
+		(error = verify_checksums(&v)) < 0 ||
+		(error = verify_ranges_threaded(&v, nr_threads, progress_cb, payload)) < 0)
+		goto cleanup;
+
+	if (corrupt_cb && (error = report_errors(&v, corrupt_cb, payload)) < 0)
+		goto cleanup;
+
+	if (v.errors.length > 0) {
+		giterr_set(GITERR_ODB, "%u corrupt objects in packfile '%s'",
+			v.errors.length, v.pack->pack_name);
+		error = -1;
+	} else if (v.checksum_error != NULL) {
+		giterr_set(GITERR_ODB, "%s for packfile '%s'",
+			v.checksum_error, v.pack->pack_name);
+		error = -1;
+	}
+
+cleanup:
+	git_vector_foreach(&v.errors, i, e) {
+		git__free(e->message);
+		git__free(e);
+	}
+	git_vector_free(&v.errors);
+	git_mutex_free(&v.lock);
+	packfile_free(v.pack);
+	return error;
+}
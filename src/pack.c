@@ -12,12 +12,26 @@
 #include "sha1_lookup.h"
 #include "mwindow.h"
 #include "fileops.h"
+#include "filebuf.h"
 
 #include "git2/oid.h"
 #include <zlib.h>
 
+GIT__USE_OFFMAP;
+
 static int packfile_open(struct git_pack_file *p);
+static void revindex_free(struct git_pack_file *p);
 static git_off_t nth_packed_object_offset(const struct git_pack_file *p, uint32_t n);
+
+/* Set through GIT_OPT_SET_PACK_CHECK_CRC */
+int git_packfile__check_crc = 0;
+
+static int packfile_inflate(
+		unsigned char *buffer,
+		size_t size,
+		struct git_pack_file *p,
+		git_mwindow **w_curs,
+		git_off_t *curpos);
 int packfile_unpack_compressed(
 		git_rawobj *obj,
 		struct git_pack_file *p,
@@ -46,6 +60,187 @@ static int packfile_error(const char *message)
 	return -1;
 }
 
+/***********************************************************
+ *
+ * DELTA BASE CACHE
+ *
+ ***********************************************************/
+
+static void free_cache_object(git_pack_cache_entry *entry)
+{
+	if (entry != NULL) {
+		assert(entry->refcount.val == 0);
+		git__free(entry->raw.data);
+		git__free(entry);
+	}
+}
+
+int git_pack_cache_init(git_pack_cache *cache)
+{
+	memset(cache, 0, sizeof(git_pack_cache));
+
+	cache->entries = git_offmap_alloc();
+	GITERR_CHECK_ALLOC(cache->entries);
+
+	cache->memory_limit = GIT_PACK_CACHE_MEMORY_LIMIT;
+	git_mutex_init(&cache->lock);
+
+	return 0;
+}
+
+void git_pack_cache_free(git_pack_cache *cache)
+{
+	git_pack_cache_entry *entry;
+
+	if (cache->entries == NULL)
+		return;
+
+	git_offmap_foreach_value(cache->entries, entry, {
+		free_cache_object(entry);
+	});
+
+	git_offmap_free(cache->entries);
+	git_mutex_free(&cache->lock);
+}
+
+static void lru_unlink(git_pack_cache *cache, git_pack_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(git_pack_cache *cache, git_pack_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+
+	cache->lru_head = entry;
+}
+
+static git_pack_cache_entry *cache_get(git_pack_cache *cache, git_off_t offset)
+{
+	khiter_t pos;
+	git_pack_cache_entry *entry = NULL;
+
+	if (cache->entries == NULL)
+		return NULL;
+
+	git_mutex_lock(&cache->lock);
+
+	pos = git_offmap_lookup_index(cache->entries, offset);
+	if (git_offmap_valid_index(cache->entries, pos)) {
+		entry = git_offmap_value_at(cache->entries, pos);
+		git_atomic_inc(&entry->refcount);
+		lru_unlink(cache, entry);
+		lru_push(cache, entry);
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+
+	git_mutex_unlock(&cache->lock);
+
+	return entry;
+}
+
+static void cache_release(git_pack_cache_entry *entry)
+{
+	git_atomic_dec(&entry->refcount);
+}
+
+/*
+ * Evict the least recently used entry which isn't in use; run with
+ * the cache lock held
+ */
+static int cache_evict_lru(git_pack_cache *cache)
+{
+	git_pack_cache_entry *lru;
+	khiter_t pos;
+
+	for (lru = cache->lru_tail; lru != NULL; lru = lru->lru_prev) {
+		if (git_atomic_get(&lru->refcount) == 0)
+			break;
+	}
+
+	if (lru == NULL)
+		return -1;
+
+	pos = git_offmap_lookup_index(cache->entries, lru->offset);
+	assert(git_offmap_valid_index(cache->entries, pos));
+
+	cache->memory_used -= lru->raw.len;
+	git_offmap_delete_at(cache->entries, pos);
+	lru_unlink(cache, lru);
+	free_cache_object(lru);
+
+	return 0;
+}
+
+/*
+ * Try to store a reconstructed base in the cache. On success the
+ * cache takes ownership of `base->data`; otherwise the caller is
+ * still responsible for freeing it.
+ */
+static int cache_add(git_pack_cache *cache, git_rawobj *base, git_off_t offset)
+{
+	git_pack_cache_entry *entry;
+	int error, exists = 0;
+
+	if (cache->entries == NULL ||
+		base->len > GIT_PACK_CACHE_SIZE_LIMIT ||
+		base->len > cache->memory_limit)
+		return -1;
+
+	entry = git__calloc(1, sizeof(git_pack_cache_entry));
+	GITERR_CHECK_ALLOC(entry);
+
+	git_mutex_lock(&cache->lock);
+
+	/* Somebody else may have beaten us to it */
+	if (git_offmap_exists(cache->entries, offset))
+		exists = 1;
+
+	while (!exists && cache->memory_used + base->len > cache->memory_limit)
+		if (cache_evict_lru(cache) < 0)
+			break;
+
+	if (exists || cache->memory_used + base->len > cache->memory_limit) {
+		git_mutex_unlock(&cache->lock);
+		git__free(entry);
+		return -1;
+	}
+
+	memcpy(&entry->raw, base, sizeof(git_rawobj));
+	entry->offset = offset;
+
+	git_offmap_insert(cache->entries, offset, entry, error);
+	if (error < 0) {
+		git_mutex_unlock(&cache->lock);
+		git__free(entry);
+		return -1;
+	}
+
+	lru_push(cache, entry);
+	cache->memory_used += base->len;
+	git_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
 /***********************************************************
  *
  * PACK INDEX METHODS
@@ -54,10 +249,8 @@ static int packfile_error(const char *message)
 
 static void pack_index_free(struct git_pack_file *p)
 {
-	if (p->oids) {
-		git__free(p->oids);
-		p->oids = NULL;
-	}
+	revindex_free(p);
+
 	if (p->index_map.data) {
 		git_futils_mmap_free(&p->index_map);
 		p->index_map.data = NULL;
@@ -277,54 +470,52 @@ int git_packfile_unpack_header(
 	return 0;
 }
 
-static int packfile_unpack_delta(
-		git_rawobj *obj,
-		struct git_pack_file *p,
-		git_mwindow **w_curs,
-		git_off_t *curpos,
-		size_t delta_size,
-		git_otype delta_type,
-		git_off_t obj_offset)
-{
-	git_off_t base_offset;
-	git_rawobj base, delta;
-	int error;
+/*
+ * One link of a delta chain, as collected by `git_packfile_unpack`
+ * before any of the chain gets inflated.
+ */
+struct pack_chain_elem {
+	git_off_t base_key; /* offset of the base this delta applies to */
+	git_off_t offset; /* where the compressed delta data starts */
+	size_t size;
+	git_otype type;
+};
 
-	base_offset = get_delta_base(p, w_curs, curpos, delta_type, obj_offset);
-	git_mwindow_close(w_curs);
-	if (base_offset == 0)
-		return packfile_error("delta offset is zero");
-	if (base_offset < 0) /* must actually be an error code */
-		return (int)base_offset;
+#define SMALL_CHAIN_SIZE 16
 
-	error = git_packfile_unpack(&base, p, &base_offset);
+/*
+ * Make sure `*buf` can hold `size` bytes plus a terminating NUL,
+ * growing it if needed. Used for the ping-pong buffers while a
+ * delta chain is being resolved.
+ */
+static int chain_buffer_grow(unsigned char **buf, size_t *alloc, size_t size)
+{
+	unsigned char *new_buf;
 
-	/*
-	 * TODO: git.git tries to load the base from other packfiles
-	 * or loose objects.
-	 *
-	 * We'll need to do this in order to support thin packs.
-	 */
-	if (error < 0)
-		return error;
+	if (*buf && *alloc > size)
+		return 0;
 
-	error = packfile_unpack_compressed(&delta, p, w_curs, curpos, delta_size, delta_type);
-	git_mwindow_close(w_curs);
-	if (error < 0) {
-		git__free(base.data);
-		return error;
-	}
+	new_buf = git__realloc(*buf, size + 1);
+	GITERR_CHECK_ALLOC(new_buf);
 
-	obj->type = base.type;
-	error = git__delta_apply(obj, base.data, base.len, delta.data, delta.len);
+	*buf = new_buf;
+	*alloc = size + 1;
+	return 0;
+}
 
-	git__free(base.data);
-	git__free(delta.data);
+/*
+ * Check an entry we are about to read against the CRC32 the index
+ * has for it, when asked to through `git_libgit2_opts`.
+ */
+static int packfile_check_crc(struct git_pack_file *p, git_off_t offset)
+{
+	uint32_t pos;
+	int error;
 
-	/* TODO: we might want to cache this shit. eventually */
-	//add_delta_base_cache(p, base_offset, base, base_size, *type);
+	if ((error = git_pack_revindex_find(&pos, p, offset)) < 0)
+		return error;
 
-	return error; /* error set by git__delta_apply */
+	return git_pack_revindex_check_crc(p, pos);
 }
 
 int git_packfile_unpack(
@@ -333,49 +524,168 @@ int git_packfile_unpack(
 	git_off_t *obj_offset)
 {
 	git_mwindow *w_curs = NULL;
-	git_off_t curpos = *obj_offset;
+	git_off_t curpos = *obj_offset, base_offset;
+	struct pack_chain_elem small_chain[SMALL_CHAIN_SIZE], *chain = small_chain, *elem;
+	size_t chain_len = 0, chain_alloc = SMALL_CHAIN_SIZE;
+	git_pack_cache_entry *cached = NULL;
+	git_rawobj base;
+	unsigned char *spare = NULL, *delta = NULL;
+	size_t base_alloc = 0, spare_alloc = 0, delta_alloc = 0;
+	size_t size = 0, base_sz, res_sz;
+	git_otype type;
 	int error;
 
-	size_t size = 0;
-	git_otype type;
+	obj->data = NULL;
+	obj->len = 0;
+	obj->type = GIT_OBJ_BAD;
+	base.data = NULL;
 
 	/*
-	 * TODO: optionally check the CRC on the packfile
+	 * Walk down the delta chain without inflating anything, until
+	 * we hit either a full object or a base that's already cached.
 	 */
+	for (;;) {
+		git_off_t elem_offset = curpos;
 
-	obj->data = NULL;
-	obj->len = 0;
-	obj->type = GIT_OBJ_BAD;
+		error = git_packfile_unpack_header(&size, &type, &p->mwf, &w_curs, &curpos);
+		git_mwindow_close(&w_curs);
 
-	error = git_packfile_unpack_header(&size, &type, &p->mwf, &w_curs, &curpos);
-	git_mwindow_close(&w_curs);
+		if (error == 0 && git_packfile__check_crc)
+			error = packfile_check_crc(p, elem_offset);
 
-	if (error < 0)
-		return error;
+		if (error < 0)
+			goto cleanup;
 
-	switch (type) {
-	case GIT_OBJ_OFS_DELTA:
-	case GIT_OBJ_REF_DELTA:
-		error = packfile_unpack_delta(
-				obj, p, &w_curs, &curpos,
-				size, type, *obj_offset);
-		break;
+		if (type != GIT_OBJ_OFS_DELTA && type != GIT_OBJ_REF_DELTA)
+			break;
 
-	case GIT_OBJ_COMMIT:
-	case GIT_OBJ_TREE:
-	case GIT_OBJ_BLOB:
-	case GIT_OBJ_TAG:
-		error = packfile_unpack_compressed(
-				obj, p, &w_curs, &curpos,
-				size, type);
-		break;
+		base_offset = get_delta_base(p, &w_curs, &curpos, type, elem_offset);
+		git_mwindow_close(&w_curs);
 
-	default:
-		error = packfile_error("invalid packfile type in header");;
-		break;
+		if (base_offset == 0) {
+			error = packfile_error("delta offset is zero");
+			goto cleanup;
+		}
+		if (base_offset < 0) { /* must actually be an error code */
+			error = (int)base_offset;
+			goto cleanup;
+		}
+
+		if (chain_len == chain_alloc) {
+			struct pack_chain_elem *new_chain;
+
+			chain_alloc *= 2;
+			if (chain == small_chain) {
+				new_chain = git__malloc(chain_alloc * sizeof(*chain));
+				if (new_chain != NULL)
+					memcpy(new_chain, small_chain, sizeof(small_chain));
+			} else
+				new_chain = git__realloc(chain, chain_alloc * sizeof(*chain));
+
+			if (new_chain == NULL) {
+				error = -1;
+				goto cleanup;
+			}
+			chain = new_chain;
+		}
+
+		elem = &chain[chain_len++];
+		elem->base_key = base_offset;
+		elem->offset = curpos;
+		elem->size = size;
+		elem->type = type;
+
+		/* Bases shared by many deltas are kept around reconstructed */
+		if ((cached = cache_get(&p->bases, base_offset)) != NULL)
+			break;
+
+		/*
+		 * Thin packs are completed by the indexer before they are
+		 * stored, so the bases of a pack's deltas are all in it.
+		 */
+		curpos = base_offset;
+	}
+
+	/* Get hold of the base at the bottom of the chain */
+	if (cached != NULL) {
+		memcpy(&base, &cached->raw, sizeof(git_rawobj));
+	} else {
+		switch (type) {
+		case GIT_OBJ_COMMIT:
+		case GIT_OBJ_TREE:
+		case GIT_OBJ_BLOB:
+		case GIT_OBJ_TAG:
+			break;
+		default:
+			error = packfile_error("invalid packfile type in header");
+			goto cleanup;
+		}
+
+		if ((error = packfile_unpack_compressed(
+				&base, p, &w_curs, &curpos, size, type)) < 0)
+			goto cleanup;
+
+		base_alloc = size + 1;
+	}
+
+	/*
+	 * Now apply the deltas back up the chain. Every result becomes
+	 * the base for the next delta; bases we're done with are either
+	 * handed over to the base cache or recycled as the next output
+	 * buffer, so we never hold on to more than two reconstructed
+	 * objects at once.
+	 */
+	while (chain_len > 0) {
+		elem = &chain[--chain_len];
+		curpos = elem->offset;
+
+		if ((error = chain_buffer_grow(&delta, &delta_alloc, elem->size)) < 0 ||
+			(error = packfile_inflate(delta, elem->size, p, &w_curs, &curpos)) < 0 ||
+			(error = git__delta_read_header(delta, elem->size, &base_sz, &res_sz)) < 0 ||
+			(error = chain_buffer_grow(&spare, &spare_alloc, res_sz)) < 0 ||
+			(error = git__delta_apply_to(
+				spare, res_sz, base.data, base.len, delta, elem->size)) < 0)
+			goto cleanup;
+
+		/* Retire the base we just consumed */
+		if (cached != NULL) {
+			cache_release(cached);
+			cached = NULL;
+			base.data = NULL;
+		} else if (cache_add(&p->bases, &base, elem->base_key) == 0) {
+			base.data = NULL;
+		}
+
+		/* ...and swap the buffers around */
+		{
+			unsigned char *tmp = base.data;
+			size_t tmp_alloc = base_alloc;
+
+			base.data = spare;
+			base.len = res_sz;
+			base_alloc = spare_alloc;
+
+			spare = tmp;
+			spare_alloc = tmp ? tmp_alloc : 0;
+		}
 	}
 
+	memcpy(obj, &base, sizeof(git_rawobj));
+	base.data = NULL;
 	*obj_offset = curpos;
+
+cleanup:
+	if (cached != NULL)
+		cache_release(cached);
+	else
+		git__free(base.data);
+
+	if (chain != small_chain)
+		git__free(chain);
+
+	git__free(spare);
+	git__free(delta);
+
 	return error;
 }
 
@@ -391,20 +701,20 @@ static void use_git_free(void *opaq, void *ptr)
 	git__free(ptr);
 }
 
-int packfile_unpack_compressed(
-	git_rawobj *obj,
+/*
+ * Inflate exactly `size` bytes of object data starting at `curpos`
+ * into `buffer`, which must have room for at least `size + 1` bytes.
+ */
+static int packfile_inflate(
+	unsigned char *buffer,
+	size_t size,
 	struct git_pack_file *p,
 	git_mwindow **w_curs,
-	git_off_t *curpos,
-	size_t size,
-	git_otype type)
+	git_off_t *curpos)
 {
 	int st;
 	z_stream stream;
-	unsigned char *buffer, *in;
-
-	buffer = git__calloc(1, size + 1);
-	GITERR_CHECK_ALLOC(buffer);
+	unsigned char *in;
 
 	memset(&stream, 0, sizeof(stream));
 	stream.next_out = buffer;
@@ -414,9 +724,7 @@ int packfile_unpack_compressed(
 
 	st = inflateInit(&stream);
 	if (st != Z_OK) {
-		git__free(buffer);
 		giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
-
 		return -1;
 	}
 
@@ -431,7 +739,6 @@ int packfile_unpack_compressed(
 
 		if (st == Z_BUF_ERROR && in == NULL) {
 			inflateEnd(&stream);
-			git__free(buffer);
 			return GIT_EBUFS;
 		}
 
@@ -441,11 +748,33 @@ int packfile_unpack_compressed(
 	inflateEnd(&stream);
 
 	if ((st != Z_STREAM_END) || stream.total_out != size) {
-		git__free(buffer);
 		giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
 		return -1;
 	}
 
+	buffer[size] = '\0';
+	return 0;
+}
+
+int packfile_unpack_compressed(
+	git_rawobj *obj,
+	struct git_pack_file *p,
+	git_mwindow **w_curs,
+	git_off_t *curpos,
+	size_t size,
+	git_otype type)
+{
+	int error;
+	unsigned char *buffer;
+
+	buffer = git__calloc(1, size + 1);
+	GITERR_CHECK_ALLOC(buffer);
+
+	if ((error = packfile_inflate(buffer, size, p, w_curs, curpos)) < 0) {
+		git__free(buffer);
+		return error;
+	}
+
 	obj->type = type;
 	obj->len = size;
 	obj->data = buffer;
@@ -453,49 +782,498 @@ int packfile_unpack_compressed(
 }
 
 /*
- * curpos is where the data starts, delta_obj_offset is the where the
- * header starts
+ * Inflate at most `size` bytes from the start of the zlib stream
+ * at `curpos`; the stream doesn't need to end there. Returns the
+ * number of bytes produced.
  */
-git_off_t get_delta_base(
+static ssize_t packfile_inflate_head(
+	unsigned char *buffer,
+	size_t size,
 	struct git_pack_file *p,
 	git_mwindow **w_curs,
-	git_off_t *curpos,
-	git_otype type,
-	git_off_t delta_obj_offset)
+	git_off_t curpos)
 {
-	unsigned int left = 0;
-	unsigned char *base_info;
-	git_off_t base_offset;
-	git_oid unused;
+	int st;
+	z_stream stream;
+	unsigned char *in;
 
-	base_info = pack_window_open(p, w_curs, *curpos, &left);
-	/* Assumption: the only reason this would fail is because the file is too small */
-	if (base_info == NULL)
-		return GIT_EBUFS;
-	/* pack_window_open() assured us we have [base_info, base_info + 20)
-	 * as a range that we can look at without walking off the
-	 * end of the mapped window. Its actually the hash size
-	 * that is assured. An OFS_DELTA longer than the hash size
-	 * is stupid, as then a REF_DELTA would be smaller to store.
-	 */
-	if (type == GIT_OBJ_OFS_DELTA) {
-		unsigned used = 0;
-		unsigned char c = base_info[used++];
-		base_offset = c & 127;
-		while (c & 128) {
-			if (left <= used)
-				return GIT_EBUFS;
-			base_offset += 1;
-			if (!base_offset || MSB(base_offset, 7))
-				return 0; /* overflow */
-			c = base_info[used++];
-			base_offset = (base_offset << 7) + (c & 127);
-		}
-		base_offset = delta_obj_offset - base_offset;
-		if (base_offset <= 0 || base_offset >= delta_obj_offset)
-			return 0; /* out of bound */
-		*curpos += used;
-	} else if (type == GIT_OBJ_REF_DELTA) {
+	memset(&stream, 0, sizeof(stream));
+	stream.next_out = buffer;
+	stream.avail_out = (uInt)size;
+	stream.zalloc = use_git_alloc;
+	stream.zfree = use_git_free;
+
+	if (inflateInit(&stream) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
+		return -1;
+	}
+
+	do {
+		in = pack_window_open(p, w_curs, curpos, &stream.avail_in);
+		if (in == NULL) {
+			inflateEnd(&stream);
+			return GIT_EBUFS;
+		}
+
+		stream.next_in = in;
+		st = inflate(&stream, Z_SYNC_FLUSH);
+		git_mwindow_close(w_curs);
+
+		curpos += stream.next_in - in;
+	} while (st == Z_OK && stream.avail_out);
+
+	inflateEnd(&stream);
+
+	if (st != Z_OK && st != Z_STREAM_END) {
+		giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
+		return -1;
+	}
+
+	return (ssize_t)(size - stream.avail_out);
+}
+
+/*
+ * Find the size and type of the object at `offset` without
+ * reconstructing it. A delta records the size of its result in
+ * its header, which sits in the first few inflated bytes; the
+ * type is the one of the base at the end of the chain, which we
+ * reach by reading object headers only.
+ */
+int git_packfile_resolve_header(
+	size_t *size_p,
+	git_otype *type_p,
+	struct git_pack_file *p,
+	git_off_t offset)
+{
+	git_mwindow *w_curs = NULL;
+	git_off_t curpos = offset, base_offset;
+	unsigned char delta_head[20];
+	size_t size, base_size;
+	git_otype type;
+	ssize_t len;
+	int error;
+
+	if ((error = git_packfile_unpack_header(&size, &type, &p->mwf, &w_curs, &curpos)) < 0)
+		return error;
+
+	if (type == GIT_OBJ_OFS_DELTA || type == GIT_OBJ_REF_DELTA) {
+		base_offset = get_delta_base(p, &w_curs, &curpos, type, offset);
+		git_mwindow_close(&w_curs);
+
+		if (base_offset == 0)
+			return packfile_error("delta offset is zero");
+		if (base_offset < 0)
+			return (int)base_offset;
+
+		/* two varints; 20 bytes are enough for any sane sizes */
+		if ((len = packfile_inflate_head(delta_head, min(size, sizeof(delta_head)),
+				p, &w_curs, curpos)) < 0)
+			return (int)len;
+
+		if (git__delta_read_header(delta_head, (size_t)len, &base_size, size_p) < 0)
+			return -1;
+
+		while (type == GIT_OBJ_OFS_DELTA || type == GIT_OBJ_REF_DELTA) {
+			git_pack_cache_entry *cached;
+
+			/* a reconstructed base already knows its type */
+			if ((cached = cache_get(&p->bases, base_offset)) != NULL) {
+				type = cached->raw.type;
+				cache_release(cached);
+				break;
+			}
+
+			curpos = base_offset;
+			if ((error = git_packfile_unpack_header(&size, &type, &p->mwf, &w_curs, &curpos)) < 0)
+				return error;
+
+			if (type != GIT_OBJ_OFS_DELTA && type != GIT_OBJ_REF_DELTA)
+				break;
+
+			base_offset = get_delta_base(p, &w_curs, &curpos, type, base_offset);
+			git_mwindow_close(&w_curs);
+
+			if (base_offset == 0)
+				return packfile_error("delta offset is zero");
+			if (base_offset < 0)
+				return (int)base_offset;
+		}
+	} else {
+		*size_p = size;
+	}
+
+	switch (type) {
+	case GIT_OBJ_COMMIT:
+	case GIT_OBJ_TREE:
+	case GIT_OBJ_BLOB:
+	case GIT_OBJ_TAG:
+		*type_p = type;
+		return 0;
+
+	default:
+		return packfile_error("invalid packfile type in header");
+	}
+}
+
+/***********************************************************
+ *
+ * PACKFILE STREAMS
+ *
+ ***********************************************************/
+
+/*
+ * Inflate up to `len` bytes of the current zlib stream into
+ * `buffer`, going through as many pack windows as needed.
+ */
+static ssize_t stream_inflate(git_packfile_stream *obj, unsigned char *buffer, size_t len)
+{
+	unsigned char *in;
+	size_t total = 0;
+	int st;
+
+	while (total < len && !obj->done) {
+		obj->zstream.next_out = buffer + total;
+		obj->zstream.avail_out = (uInt)min(len - total, (size_t)UINT_MAX);
+
+		in = pack_window_open(obj->p, &obj->mw, obj->curpos, &obj->zstream.avail_in);
+		if (in == NULL)
+			return GIT_EBUFS;
+
+		obj->zstream.next_in = in;
+		st = inflate(&obj->zstream, Z_SYNC_FLUSH);
+		git_mwindow_close(&obj->mw);
+
+		obj->curpos += obj->zstream.next_in - in;
+		total = obj->zstream.next_out - buffer;
+
+		if (st == Z_STREAM_END)
+			obj->done = 1;
+		else if (st != Z_OK) {
+			giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
+			return -1;
+		}
+	}
+
+	return (ssize_t)total;
+}
+
+/*
+ * Slide what's left of the delta window to the front and top it up
+ * from the zlib stream. Returns the number of bytes available.
+ */
+static ssize_t stream_fill_delta(git_packfile_stream *obj)
+{
+	size_t avail = obj->delta_end - obj->delta_start;
+	ssize_t read;
+
+	if (obj->delta_start > 0) {
+		memmove(obj->delta_buf, obj->delta_buf + obj->delta_start, avail);
+		obj->delta_start = 0;
+		obj->delta_end = avail;
+	}
+
+	read = stream_inflate(obj, obj->delta_buf + avail, sizeof(obj->delta_buf) - avail);
+	if (read < 0)
+		return read;
+
+	obj->delta_end += read;
+	return (ssize_t)(obj->delta_end - obj->delta_start);
+}
+
+static int stream_delta_varint(size_t *out, git_packfile_stream *obj)
+{
+	const unsigned char *d = obj->delta_buf + obj->delta_start;
+	const unsigned char *end = obj->delta_buf + obj->delta_end;
+	size_t r = 0;
+	unsigned char c;
+	unsigned shift = 0;
+
+	do {
+		if (d == end || shift >= sizeof(size_t) * 8)
+			return -1;
+		c = *d++;
+		r |= ((size_t)(c & 0x7f)) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	obj->delta_start = d - obj->delta_buf;
+	*out = r;
+	return 0;
+}
+
+static int stream_delta_header(git_packfile_stream *obj)
+{
+	size_t base_sz, res_sz;
+
+	if (stream_fill_delta(obj) < 0)
+		return -1;
+
+	if (stream_delta_varint(&base_sz, obj) < 0 ||
+		stream_delta_varint(&res_sz, obj) < 0 ||
+		base_sz != obj->base.len) {
+		giterr_set(GITERR_INVALID, "Failed to apply delta. Base size does not match given data");
+		return -1;
+	}
+
+	obj->size = res_sz;
+	obj->type = obj->base.type;
+	return 0;
+}
+
+/*
+ * Decode the next delta instruction into `copy_offset`/`copy_len`
+ * or `insert_len`. Returns 0 when the delta is exhausted, 1 when
+ * an instruction was decoded.
+ */
+static int stream_delta_next(git_packfile_stream *obj)
+{
+	const unsigned char *d;
+	unsigned char cmd;
+	size_t off = 0, len = 0;
+	ssize_t avail = obj->delta_end - obj->delta_start;
+
+	/* the longest copy instruction is 8 bytes */
+	if (avail < 8 && !obj->done && (avail = stream_fill_delta(obj)) < 0)
+		return -1;
+
+	if (avail == 0)
+		return 0;
+
+	d = obj->delta_buf + obj->delta_start;
+	cmd = *d++;
+
+	if (cmd & 0x80) {
+		/* cmd is a copy instruction; copy from the base */
+#define ADD_DELTA(o, shift) { \
+		if (d - (obj->delta_buf + obj->delta_start) >= avail) \
+			goto fail; \
+		(o) |= ((size_t) *d++) << shift; }
+		if (cmd & 0x01) ADD_DELTA(off, 0UL);
+		if (cmd & 0x02) ADD_DELTA(off, 8UL);
+		if (cmd & 0x04) ADD_DELTA(off, 16UL);
+		if (cmd & 0x08) ADD_DELTA(off, 24UL);
+
+		if (cmd & 0x10) ADD_DELTA(len, 0UL);
+		if (cmd & 0x20) ADD_DELTA(len, 8UL);
+		if (cmd & 0x40) ADD_DELTA(len, 16UL);
+#undef ADD_DELTA
+
+		if (!len)
+			len = 0x10000;
+
+		if (off + len < off || off + len > obj->base.len)
+			goto fail;
+
+		obj->copy_offset = off;
+		obj->copy_len = len;
+	} else if (cmd) {
+		/* cmd is a literal insert instruction; the data follows */
+		obj->insert_len = cmd;
+	} else {
+		/* cmd == 0 is reserved for future encodings */
+		goto fail;
+	}
+
+	obj->delta_start = d - obj->delta_buf;
+	return 1;
+
+fail:
+	giterr_set(GITERR_INVALID, "Failed to apply delta");
+	return -1;
+}
+
+static ssize_t stream_delta_read(git_packfile_stream *obj, unsigned char *buffer, size_t len)
+{
+	size_t total = 0, n;
+	ssize_t avail;
+	int error;
+
+	while (total < len) {
+		if (obj->copy_len) {
+			n = min(len - total, obj->copy_len);
+			memcpy(buffer + total, (unsigned char *)obj->base.data + obj->copy_offset, n);
+			obj->copy_offset += n;
+			obj->copy_len -= n;
+		} else if (obj->insert_len) {
+			avail = obj->delta_end - obj->delta_start;
+
+			if (!avail && (avail = stream_fill_delta(obj)) <= 0) {
+				if (avail == 0)
+					giterr_set(GITERR_INVALID, "Failed to apply delta");
+				return -1;
+			}
+
+			n = min(len - total, min(obj->insert_len, (size_t)avail));
+			memcpy(buffer + total, obj->delta_buf + obj->delta_start, n);
+			obj->delta_start += n;
+			obj->insert_len -= n;
+		} else {
+			if ((error = stream_delta_next(obj)) < 0)
+				return error;
+			if (error == 0)
+				break;
+			continue;
+		}
+
+		total += n;
+		obj->written += n;
+
+		if (obj->written > obj->size) {
+			giterr_set(GITERR_INVALID, "Failed to apply delta");
+			return -1;
+		}
+	}
+
+	if (total == 0 && obj->written != obj->size) {
+		giterr_set(GITERR_INVALID, "Failed to apply delta. Result size does not match");
+		return -1;
+	}
+
+	return (ssize_t)total;
+}
+
+int git_packfile_stream_open(git_packfile_stream *obj, struct git_pack_file *p, git_off_t curpos)
+{
+	git_off_t obj_offset = curpos, base_offset;
+	git_otype type;
+	size_t size;
+	int error;
+
+	memset(obj, 0, sizeof(git_packfile_stream));
+	obj->p = p;
+
+	if ((error = git_packfile_unpack_header(&size, &type, &p->mwf, &obj->mw, &curpos)) < 0)
+		return error;
+
+	switch (type) {
+	case GIT_OBJ_COMMIT:
+	case GIT_OBJ_TREE:
+	case GIT_OBJ_BLOB:
+	case GIT_OBJ_TAG:
+		obj->type = type;
+		obj->size = size;
+		break;
+
+	case GIT_OBJ_OFS_DELTA:
+	case GIT_OBJ_REF_DELTA:
+		/*
+		 * The copy instructions may point anywhere in the base, so
+		 * that needs to be at hand. The delta and the result are
+		 * streamed through a small window.
+		 */
+		base_offset = get_delta_base(p, &obj->mw, &curpos, type, obj_offset);
+		git_mwindow_close(&obj->mw);
+
+		if (base_offset == 0)
+			return packfile_error("delta offset is zero");
+		if (base_offset < 0)
+			return (int)base_offset;
+
+		if ((error = git_packfile_unpack(&obj->base, p, &base_offset)) < 0)
+			return error;
+		break;
+
+	default:
+		return packfile_error("invalid packfile type in header");
+	}
+
+	obj->curpos = curpos;
+	obj->zstream.zalloc = use_git_alloc;
+	obj->zstream.zfree = use_git_free;
+
+	if (inflateInit(&obj->zstream) != Z_OK) {
+		git__free(obj->base.data);
+		obj->base.data = NULL;
+		giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
+		return -1;
+	}
+
+	obj->zstream_open = 1;
+
+	if (obj->base.data && stream_delta_header(obj) < 0) {
+		git_packfile_stream_free(obj);
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t git_packfile_stream_read(git_packfile_stream *obj, void *buffer, size_t len)
+{
+	ssize_t read;
+
+	if (obj->base.data)
+		return stream_delta_read(obj, buffer, len);
+
+	if ((read = stream_inflate(obj, buffer, len)) < 0)
+		return read;
+
+	obj->written += read;
+
+	if (obj->written > obj->size || (obj->done && obj->written != obj->size)) {
+		giterr_set(GITERR_ZLIB, "Failed to inflate packfile");
+		return -1;
+	}
+
+	return read;
+}
+
+void git_packfile_stream_free(git_packfile_stream *obj)
+{
+	if (obj->zstream_open)
+		inflateEnd(&obj->zstream);
+
+	git_mwindow_close(&obj->mw);
+	git__free(obj->base.data);
+
+	obj->zstream_open = 0;
+	obj->base.data = NULL;
+}
+
+/*
+ * curpos is where the data starts, delta_obj_offset is the where the
+ * header starts
+ */
+git_off_t get_delta_base(
+	struct git_pack_file *p,
+	git_mwindow **w_curs,
+	git_off_t *curpos,
+	git_otype type,
+	git_off_t delta_obj_offset)
+{
+	unsigned int left = 0;
+	unsigned char *base_info;
+	git_off_t base_offset;
+	git_oid unused;
+
+	base_info = pack_window_open(p, w_curs, *curpos, &left);
+	/* Assumption: the only reason this would fail is because the file is too small */
+	if (base_info == NULL)
+		return GIT_EBUFS;
+	/* pack_window_open() assured us we have [base_info, base_info + 20)
+	 * as a range that we can look at without walking off the
+	 * end of the mapped window. Its actually the hash size
+	 * that is assured. An OFS_DELTA longer than the hash size
+	 * is stupid, as then a REF_DELTA would be smaller to store.
+	 */
+	if (type == GIT_OBJ_OFS_DELTA) {
+		unsigned used = 0;
+		unsigned char c = base_info[used++];
+		base_offset = c & 127;
+		while (c & 128) {
+			if (left <= used)
+				return GIT_EBUFS;
+			base_offset += 1;
+			if (!base_offset || MSB(base_offset, 7))
+				return 0; /* overflow */
+			c = base_info[used++];
+			base_offset = (base_offset << 7) + (c & 127);
+		}
+		base_offset = delta_obj_offset - base_offset;
+		if (base_offset <= 0 || base_offset >= delta_obj_offset)
+			return 0; /* out of bound */
+		*curpos += used;
+	} else if (type == GIT_OBJ_REF_DELTA) {
 		/* If we have the cooperative cache, search in it first */
 		if (p->has_cache) {
 			int pos;
@@ -524,11 +1302,16 @@ git_off_t get_delta_base(
  *
  ***********************************************************/
 
+static int packfile_reopen(git_mwindow_file *mwf);
+
 static struct git_pack_file *packfile_alloc(size_t extra)
 {
 	struct git_pack_file *p = git__calloc(1, sizeof(*p) + extra);
-	if (p != NULL)
+	if (p != NULL) {
 		p->mwf.fd = -1;
+		p->mwf.reopen = packfile_reopen;
+		git_mwindow_file_init(&p->mwf);
+	}
 	return p;
 }
 
@@ -537,20 +1320,22 @@ void packfile_free(struct git_pack_file *p)
 {
 	assert(p);
 
-	/* clear_delta_base_cache(); */
+	git_pack_cache_free(&p->bases);
+	/* this takes the file off the list of open ones as well */
 	git_mwindow_free_all(&p->mwf);
-	git_mwindow_file_deregister(&p->mwf);
 
 	if (p->mwf.fd != -1)
 		p_close(p->mwf.fd);
 
+	git_mwindow_file_free(&p->mwf);
 	pack_index_free(p);
 
 	git__free(p->bad_object_sha1);
 	git__free(p);
 }
 
-static int packfile_open(struct git_pack_file *p)
+/* Called with the lock of the pack's window file held */
+static int packfile_open_locked(struct git_pack_file *p)
 {
 	struct stat st;
 	struct git_pack_header hdr;
@@ -616,6 +1401,47 @@ cleanup:
 	return -1;
 }
 
+static int packfile_open(struct git_pack_file *p)
+{
+	int error = 0;
+
+	git_mutex_lock(&p->mwf.lock);
+
+	/* someone may have beaten us to it */
+	if (p->mwf.fd == -1)
+		error = packfile_open_locked(p);
+
+	git_mutex_unlock(&p->mwf.lock);
+	return error;
+}
+
+/*
+ * The window code closes our descriptor when there are too many
+ * files open, and asks us to open it again when it needs it.
+ */
+static int packfile_reopen(git_mwindow_file *mwf)
+{
+	return packfile_open_locked((struct git_pack_file *)mwf);
+}
+
+/*
+ * Make sure both the index and the pack are open, for callers
+ * which found an object's offset through some other means than
+ * the pack index (e.g. a multi-pack index).
+ */
+int git_packfile_open(struct git_pack_file *p)
+{
+	int error;
+
+	if (p->mwf.fd != -1)
+		return 0;
+
+	if ((error = pack_index_open(p)) < 0)
+		return error;
+
+	return packfile_open(p);
+}
+
 int git_packfile_check(struct git_pack_file **pack_out, const char *path)
 {
 	struct stat st;
@@ -633,6 +1459,7 @@ int git_packfile_check(struct git_pack_file **pack_out, const char *path)
 	 */
 	path_len -= strlen(".idx");
 	if (path_len < 1) {
+		git_mwindow_file_free(&p->mwf);
 		git__free(p);
 		return git_odb__error_notfound("invalid packfile path", NULL);
 	}
@@ -645,6 +1472,7 @@ int git_packfile_check(struct git_pack_file **pack_out, const char *path)
 
 	strcpy(p->pack_name + path_len, ".pack");
 	if (p_stat(p->pack_name, &st) < 0 || !S_ISREG(st.st_mode)) {
+		git_mwindow_file_free(&p->mwf);
 		git__free(p);
 		return git_odb__error_notfound("packfile not found", NULL);
 	}
@@ -661,6 +1489,12 @@ int git_packfile_check(struct git_pack_file **pack_out, const char *path)
 		git_oid_fromstr(&p->sha1, path + path_len - GIT_OID_HEXSZ) < 0)
 		memset(&p->sha1, 0x0, GIT_OID_RAWSZ);
 
+	if (git_pack_cache_init(&p->bases) < 0) {
+		git_mwindow_file_free(&p->mwf);
+		git__free(p);
+		return -1;
+	}
+
 	*pack_out = p;
 
 	return 0;
@@ -690,65 +1524,405 @@ static git_off_t nth_packed_object_offset(const struct git_pack_file *p, uint32_
 	}
 }
 
-static int git__memcmp4(const void *a, const void *b) {
-	return memcmp(a, b, 4);
+static const unsigned char *nth_packed_object_sha1(const struct git_pack_file *p, uint32_t n)
+{
+	const unsigned char *index = p->index_map.data;
+	index += 4 * 256;
+	if (p->index_version == 1)
+		return index + 24 * n + 4;
+	else
+		return index + 8 + 20 * n;
 }
 
-int git_pack_foreach_entry(
-	struct git_pack_file *p,
-	int (*cb)(git_oid *oid, void *data),
-	void *data)
+static uint32_t nth_packed_object_crc(const struct git_pack_file *p, uint32_t n)
 {
-	const unsigned char *index = p->index_map.data, *current;
-	uint32_t i;
+	const unsigned char *index = p->index_map.data;
+	index += 4 * 256 + 8 + p->num_objects * 20;
+	return ntohl(*((uint32_t *)(index + 4 * n)));
+}
 
-	if (index == NULL) {
-		int error;
+/***********************************************************
+ *
+ * REVERSE INDEX
+ *
+ ***********************************************************/
 
-		if ((error = pack_index_open(p)) < 0)
-			return error;
+#define PACK_REV_SIGNATURE 0x52494458 /* "RIDX" */
+#define PACK_REV_VERSION 1
+#define PACK_REV_HASH_SHA1 1
+#define PACK_REV_HEADER_SIZE 12
 
-		assert(p->index_map.data);
+struct revindex_entry {
+	git_off_t offset;
+	uint32_t nr;
+};
 
-		index = p->index_map.data;
+GIT_INLINE(uint32_t) revindex_nth(const struct git_pack_file *p, uint32_t n)
+{
+	/* a mapped `.rev` file is in network order */
+	return p->revindex_map.data ? ntohl(p->revindex[n]) : p->revindex[n];
+}
+
+static int revindex_path(git_buf *path, struct git_pack_file *p)
+{
+	git_buf_put(path, p->pack_name, strlen(p->pack_name) - strlen(".pack"));
+	git_buf_puts(path, ".rev");
+
+	return git_buf_oom(path) ? -1 : 0;
+}
+
+/*
+ * Use the `.rev` file next to the index if there is one. Anything
+ * wrong with it just means we build the reverse index ourselves.
+ */
+static int revindex_load_file(struct git_pack_file *p)
+{
+	git_buf path = GIT_BUF_INIT;
+	const unsigned char *data, *idx_trailer;
+	git_file fd;
+	struct stat st;
+	git_map map;
+	size_t expected;
+
+	if (revindex_path(&path, p) < 0)
+		return -1;
+
+	fd = git_futils_open_ro(git_buf_cstr(&path));
+	git_buf_free(&path);
+
+	if (fd < 0) {
+		giterr_clear();
+		return GIT_ENOTFOUND;
 	}
 
-	if (p->index_version > 1) {
-		index += 8;
+	expected = PACK_REV_HEADER_SIZE + 4 * (size_t)p->num_objects + 2 * GIT_OID_RAWSZ;
+
+	if (p_fstat(fd, &st) < 0 || (size_t)st.st_size != expected ||
+		git_futils_mmap_ro(&map, fd, 0, expected) < 0) {
+		p_close(fd);
+		giterr_clear();
+		return GIT_ENOTFOUND;
 	}
 
-	index += 4 * 256;
+	p_close(fd);
 
-	if (p->oids == NULL) {
-		git_vector offsets, oids;
-		int error;
+	data = map.data;
+	idx_trailer = (const unsigned char *)p->index_map.data + p->index_map.len - 2 * GIT_OID_RAWSZ;
 
-		if ((error = git_vector_init(&oids, p->num_objects, NULL)))
-			return error;
+	/* the file must describe this very pack */
+	if (ntohl(*(uint32_t *)(data + 0)) != PACK_REV_SIGNATURE ||
+		ntohl(*(uint32_t *)(data + 4)) != PACK_REV_VERSION ||
+		ntohl(*(uint32_t *)(data + 8)) != PACK_REV_HASH_SHA1 ||
+		memcmp(data + expected - 2 * GIT_OID_RAWSZ, idx_trailer, GIT_OID_RAWSZ) != 0) {
+		git_futils_mmap_free(&map);
+		return GIT_ENOTFOUND;
+	}
 
-		if ((error = git_vector_init(&offsets, p->num_objects, git__memcmp4)))
-			return error;
+	p->revindex_map = map;
+	p->revindex = (const uint32_t *)(data + PACK_REV_HEADER_SIZE);
+	return 0;
+}
 
-		if (p->index_version > 1) {
-			const unsigned char *off = index + 24 * p->num_objects;
-			for (i = 0; i < p->num_objects; i++)
-				git_vector_insert(&offsets, (void*)&off[4 * i]);
-			git_vector_sort(&offsets);
-			git_vector_foreach(&offsets, i, current)
-				git_vector_insert(&oids, (void*)&index[5 * (current - off)]);
-		} else {
-			for (i = 0; i < p->num_objects; i++)
-				git_vector_insert(&offsets, (void*)&index[24 * i]);
-			git_vector_sort(&offsets);
-			git_vector_foreach(&offsets, i, current)
-				git_vector_insert(&oids, (void*)&current[4]);
+static int revindex_entry_cmp(const void *a_, const void *b_)
+{
+	const struct revindex_entry *a = a_, *b = b_;
+
+	if (a->offset < b->offset)
+		return -1;
+
+	return (a->offset > b->offset) ? 1 : 0;
+}
+
+static int revindex_build(struct git_pack_file *p)
+{
+	struct revindex_entry *entries;
+	uint32_t *revindex, i;
+
+	entries = git__malloc(p->num_objects * sizeof(struct revindex_entry));
+	GITERR_CHECK_ALLOC(entries);
+
+	revindex = git__malloc(p->num_objects * sizeof(uint32_t));
+	if (!revindex) {
+		git__free(entries);
+		giterr_set_oom();
+		return -1;
+	}
+
+	for (i = 0; i < p->num_objects; i++) {
+		entries[i].offset = nth_packed_object_offset(p, i);
+		entries[i].nr = i;
+	}
+
+	qsort(entries, p->num_objects, sizeof(struct revindex_entry), revindex_entry_cmp);
+
+	for (i = 0; i < p->num_objects; i++)
+		revindex[i] = entries[i].nr;
+
+	git__free(entries);
+
+	p->revindex = revindex;
+	return 0;
+}
+
+static void revindex_free(struct git_pack_file *p)
+{
+	if (p->revindex_map.data) {
+		git_futils_mmap_free(&p->revindex_map);
+		p->revindex_map.data = NULL;
+	} else {
+		git__free((void *)p->revindex);
+	}
+
+	p->revindex = NULL;
+	git_atomic_set(&p->revindex_loaded, 0);
+}
+
+/*
+ * Packs are shared between threads through the odb, so the first
+ * caller builds the reverse index under the pack's lock, and only
+ * then lets the others see it.
+ */
+int git_pack_revindex_load(struct git_pack_file *p)
+{
+	int error = 0;
+
+	if (git_atomic_get(&p->revindex_loaded))
+		return 0;
+
+	git_mutex_lock(&p->mwf.lock);
+
+	/* someone may have beaten us to it */
+	if (!p->revindex) {
+		if ((error = pack_index_open(p)) == 0 &&
+			(error = revindex_load_file(p)) == GIT_ENOTFOUND)
+			error = revindex_build(p);
+
+		if (!error)
+			git_atomic_inc(&p->revindex_loaded);
+	}
+
+	git_mutex_unlock(&p->mwf.lock);
+	return error;
+}
+
+/*
+ * The offset of the `pos`-th object in pack order. One past the
+ * last object gives the end of the object data, where the
+ * trailing checksum starts.
+ */
+static git_off_t revindex_offset(struct git_pack_file *p, uint32_t pos)
+{
+	if (pos >= p->num_objects)
+		return p->mwf.size - GIT_OID_RAWSZ;
+
+	return nth_packed_object_offset(p, revindex_nth(p, pos));
+}
+
+int git_pack_revindex_find(uint32_t *pos_out, struct git_pack_file *p, git_off_t offset)
+{
+	uint32_t lo = 0, hi;
+	int error;
+
+	if ((error = git_pack_revindex_load(p)) < 0)
+		return error;
+
+	hi = p->num_objects;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		git_off_t current = revindex_offset(p, mi);
+
+		if (current == offset) {
+			*pos_out = mi;
+			return 0;
 		}
-		git_vector_free(&offsets);
-		p->oids = (git_oid **)oids.contents;
+
+		if (current < offset)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+
+	giterr_set(GITERR_ODB, "No object starts at offset %"PRIuZ" in the packfile",
+		(size_t)offset);
+	return GIT_ENOTFOUND;
+}
+
+int git_pack_offset_to_oid(git_oid *out, struct git_pack_file *p, git_off_t offset)
+{
+	uint32_t pos;
+	int error;
+
+	if ((error = git_pack_revindex_find(&pos, p, offset)) < 0)
+		return error;
+
+	git_oid_fromraw(out, nth_packed_object_sha1(p, revindex_nth(p, pos)));
+	return 0;
+}
+
+int git_pack_revindex_oid(git_oid *out, struct git_pack_file *p, uint32_t pos)
+{
+	int error;
+
+	if ((error = git_pack_revindex_load(p)) < 0)
+		return error;
+
+	assert(pos < p->num_objects);
+
+	git_oid_fromraw(out, nth_packed_object_sha1(p, revindex_nth(p, pos)));
+	return 0;
+}
+
+uint32_t git_pack_revindex_nth(struct git_pack_file *p, uint32_t pos)
+{
+	assert(p->revindex && pos < p->num_objects);
+	return revindex_nth(p, pos);
+}
+
+git_off_t git_pack_revindex_offset(struct git_pack_file *p, uint32_t pos)
+{
+	assert(p->revindex);
+	return revindex_offset(p, pos);
+}
+
+int git_pack_oid_to_revindex(uint32_t *pos_out, struct git_pack_file *p, const git_oid *oid)
+{
+	struct git_pack_entry e;
+	int error;
+
+	if ((error = git_pack_entry_find(&e, p, oid, GIT_OID_HEXSZ)) < 0)
+		return error;
+
+	return git_pack_revindex_find(pos_out, p, e.offset);
+}
+
+int git_pack_nth_oid(git_oid *out, struct git_pack_file *p, uint32_t n)
+{
+	int error;
+
+	if ((error = pack_index_open(p)) < 0)
+		return error;
+
+	if (n >= p->num_objects) {
+		giterr_set(GITERR_ODB, "Object %u is out of the bounds of the pack index", n);
+		return -1;
 	}
 
+	git_oid_fromraw(out, nth_packed_object_sha1(p, n));
+	return 0;
+}
+
+int git_pack_object_disk_size(git_off_t *size_out, struct git_pack_file *p, git_off_t offset)
+{
+	uint32_t pos;
+	int error;
+
+	if ((error = git_pack_revindex_find(&pos, p, offset)) < 0)
+		return error;
+
+	*size_out = revindex_offset(p, pos + 1) - offset;
+	return 0;
+}
+
+int git_pack_revindex_check_crc(struct git_pack_file *p, uint32_t pos)
+{
+	git_mwindow *w = NULL;
+	git_off_t start, offset, end;
+	unsigned char *data;
+	unsigned int left;
+	uLong crc;
+
+	/* version 1 indices don't record any */
+	if (p->index_version == 1)
+		return 0;
+
+	start = offset = revindex_offset(p, pos);
+	end = revindex_offset(p, pos + 1);
+	crc = crc32(0L, Z_NULL, 0);
+
+	while (offset < end) {
+		data = git_mwindow_open(&p->mwf, &w, offset, 0, &left);
+		if (data == NULL) {
+			git_mwindow_close(&w);
+			return -1;
+		}
+
+		if ((git_off_t)left > end - offset)
+			left = (unsigned int)(end - offset);
+
+		crc = crc32(crc, data, left);
+		offset += left;
+	}
+
+	git_mwindow_close(&w);
+
+	if ((uint32_t)crc != nth_packed_object_crc(p, revindex_nth(p, pos))) {
+		giterr_set(GITERR_ODB, "Packed object at offset %"PRIuZ" doesn't match its CRC32",
+			(size_t)start);
+		return -1;
+	}
+
+	return 0;
+}
+
+int git_pack_revindex_write(struct git_pack_file *p)
+{
+	git_buf path = GIT_BUF_INIT;
+	git_filebuf file = GIT_FILEBUF_INIT;
+	git_oid file_hash;
+	uint32_t hdr[3], nr, i;
+	int error;
+
+	if ((error = git_pack_revindex_load(p)) < 0 ||
+		(error = revindex_path(&path, p)) < 0)
+		goto cleanup;
+
+	if ((error = git_filebuf_open(&file, git_buf_cstr(&path), GIT_FILEBUF_HASH_CONTENTS)) < 0)
+		goto cleanup;
+
+	hdr[0] = htonl(PACK_REV_SIGNATURE);
+	hdr[1] = htonl(PACK_REV_VERSION);
+	hdr[2] = htonl(PACK_REV_HASH_SHA1);
+	git_filebuf_write(&file, hdr, sizeof(hdr));
+
+	for (i = 0; i < p->num_objects; i++) {
+		nr = htonl(revindex_nth(p, i));
+		git_filebuf_write(&file, &nr, sizeof(nr));
+	}
+
+	/* the checksum of the pack, as recorded in the index */
+	git_filebuf_write(&file,
+		(const unsigned char *)p->index_map.data + p->index_map.len - 2 * GIT_OID_RAWSZ,
+		GIT_OID_RAWSZ);
+
+	if ((error = git_filebuf_hash(&file_hash, &file)) < 0 ||
+		(error = git_filebuf_write(&file, &file_hash, sizeof(git_oid))) < 0) {
+		git_filebuf_cleanup(&file);
+		goto cleanup;
+	}
+
+	error = git_filebuf_commit(&file, GIT_PACK_FILE_MODE);
+
+cleanup:
+	git_buf_free(&path);
+	return error;
+}
+
+int git_pack_foreach_entry(
+	struct git_pack_file *p,
+	int (*cb)(git_oid *oid, void *data),
+	void *data)
+{
+	uint32_t i;
+	int error;
+
+	/* walk the objects in pack order, which is friendlier to
+	 * callers which go on to read them */
+	if ((error = git_pack_revindex_load(p)) < 0)
+		return error;
+
 	for (i = 0; i < p->num_objects; i++)
-		if (cb(p->oids[i], data))
+		if (cb((git_oid *)nth_packed_object_sha1(p, revindex_nth(p, i)), data))
 			return GIT_EUSER;
 
 	return 0;
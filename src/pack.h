@@ -9,11 +9,13 @@
 #define INCLUDE_pack_h__
 
 #include "git2/oid.h"
+#include <zlib.h>
 
 #include "common.h"
 #include "map.h"
 #include "mwindow.h"
 #include "odb.h"
+#include "offmap.h"
 
 #define GIT_PACK_FILE_MODE 0444
 
@@ -51,6 +53,33 @@ struct git_pack_idx_header {
 	uint32_t idx_version;
 };
 
+#define GIT_PACK_CACHE_MEMORY_LIMIT (16 * 1024 * 1024)
+#define GIT_PACK_CACHE_SIZE_LIMIT (1024 * 1024) /* don't bother caching anything over 1MB */
+
+/*
+ * A reconstructed delta base, as stored in the per-pack
+ * delta base cache. Entries which are in use (refcount > 0)
+ * are never evicted.
+ */
+typedef struct git_pack_cache_entry {
+	git_off_t offset;
+	git_atomic refcount;
+	git_rawobj raw;
+
+	/* the cache's LRU list, most recently used first */
+	struct git_pack_cache_entry *lru_prev, *lru_next;
+} git_pack_cache_entry;
+
+typedef struct {
+	size_t memory_used;
+	size_t memory_limit;
+	size_t hits;
+	size_t misses;
+	git_mutex lock;
+	git_offmap *entries;
+	git_pack_cache_entry *lru_head, *lru_tail;
+} git_pack_cache;
+
 struct git_pack_file {
 	git_mwindow_file mwf;
 	git_map index_map;
@@ -61,10 +90,17 @@ struct git_pack_file {
 
 	int index_version;
 	git_time_t mtime;
-	unsigned pack_local:1, pack_keep:1, has_cache:1;
+	unsigned pack_local:1, pack_keep:1, has_cache:1, in_midx:1;
 	git_oid sha1;
 	git_vector cache;
-	git_oid **oids;
+	git_pack_cache bases; /* delta base cache */
+
+	/* index positions sorted by pack offset, built on demand
+	 * or mapped from a `.rev` file; `revindex_loaded` is set once
+	 * both are there for other threads to see */
+	const uint32_t *revindex;
+	git_map revindex_map;
+	git_atomic revindex_loaded;
 
 	/* something like ".git/objects/pack/xxxxx.pack" */
 	char pack_name[GIT_FLEX_ARRAY]; /* more */
@@ -76,6 +112,35 @@ struct git_pack_entry {
 	struct git_pack_file *p;
 };
 
+#define GIT_PACKFILE_STREAM_WINDOW 4096
+
+/*
+ * Incremental reader for a packed object. Full objects are inflated
+ * straight from the pack windows; for deltified objects only the base
+ * is reconstructed in memory, and the result is produced by running
+ * the delta through a small window.
+ */
+typedef struct {
+	struct git_pack_file *p;
+	git_mwindow *mw;
+	git_off_t curpos;
+	z_stream zstream;
+	unsigned zstream_open:1, done:1;
+
+	git_otype type;
+	size_t size; /* of the object being read */
+	size_t written;
+
+	git_rawobj base;
+	unsigned char delta_buf[GIT_PACKFILE_STREAM_WINDOW];
+	size_t delta_start, delta_end;
+	size_t copy_offset, copy_len, insert_len;
+} git_packfile_stream;
+
+int git_packfile_stream_open(git_packfile_stream *obj, struct git_pack_file *p, git_off_t curpos);
+ssize_t git_packfile_stream_read(git_packfile_stream *obj, void *buffer, size_t len);
+void git_packfile_stream_free(git_packfile_stream *obj);
+
 int git_packfile_unpack_header(
 		size_t *size_p,
 		git_otype *type_p,
@@ -83,6 +148,12 @@ int git_packfile_unpack_header(
 		git_mwindow **w_curs,
 		git_off_t *curpos);
 
+int git_packfile_resolve_header(
+		size_t *size_p,
+		git_otype *type_p,
+		struct git_pack_file *p,
+		git_off_t offset);
+
 int git_packfile_unpack(git_rawobj *obj, struct git_pack_file *p, git_off_t *obj_offset);
 int packfile_unpack_compressed(
 	git_rawobj *obj,
@@ -96,13 +167,51 @@ git_off_t get_delta_base(struct git_pack_file *p, git_mwindow **w_curs,
 		git_off_t *curpos, git_otype type,
 		git_off_t delta_obj_offset);
 
+int git_pack_cache_init(git_pack_cache *cache);
+void git_pack_cache_free(git_pack_cache *cache);
+
 void packfile_free(struct git_pack_file *p);
+int git_packfile_open(struct git_pack_file *p);
 int git_packfile_check(struct git_pack_file **pack_out, const char *path);
 int git_pack_entry_find(
 		struct git_pack_entry *e,
 		struct git_pack_file *p,
 		const git_oid *short_oid,
 		size_t len);
+/*
+ * The reverse index maps pack offsets back to objects: it lists the
+ * objects in the order they appear in the pack.
+ */
+int git_pack_revindex_load(struct git_pack_file *p);
+int git_pack_revindex_write(struct git_pack_file *p);
+int git_pack_revindex_find(uint32_t *pos_out, struct git_pack_file *p, git_off_t offset);
+int git_pack_offset_to_oid(git_oid *out, struct git_pack_file *p, git_off_t offset);
+/*
+ * Positions in the reverse index ("pack order") are what `.bitmap`
+ * files use to number objects. The functions taking a position
+ * expect the reverse index to be loaded already.
+ */
+int git_pack_revindex_oid(git_oid *out, struct git_pack_file *p, uint32_t pos);
+uint32_t git_pack_revindex_nth(struct git_pack_file *p, uint32_t pos);
+git_off_t git_pack_revindex_offset(struct git_pack_file *p, uint32_t pos);
+int git_pack_oid_to_revindex(uint32_t *pos_out, struct git_pack_file *p, const git_oid *oid);
+/*
+ * Check the `pos`-th object in pack order against the CRC32 its
+ * index records; entries of version 1 indices, which have none,
+ * always pass.
+ */
+int git_pack_revindex_check_crc(struct git_pack_file *p, uint32_t pos);
+
+/*
+ * When set, `git_packfile_unpack` checks the CRC32 of every entry
+ * it reads from the pack.
+ */
+extern int git_packfile__check_crc;
+
+/* The `n`-th object in index (i.e. name) order */
+int git_pack_nth_oid(git_oid *out, struct git_pack_file *p, uint32_t n);
+int git_pack_object_disk_size(git_off_t *size_out, struct git_pack_file *p, git_off_t offset);
+
 int git_pack_foreach_entry(
 		struct git_pack_file *p,
 		int (*cb)(git_oid *oid, void *data),
@@ -108,7 +108,7 @@ static git_repository *repository_alloc(void)
 
 	memset(repo, 0x0, sizeof(git_repository));
 
-	if (git_cache_init(&repo->objects, GIT_DEFAULT_CACHE_SIZE, &git_object__free) < 0) {
+	if (git_cache_init(&repo->objects, &git_object__free) < 0) {
 		git__free(repo);
 		return NULL;
 	}
@@ -579,6 +579,12 @@ int git_repository_odb(git_odb **out, git_repository *repo)
 	return 0;
 }
 
+void git_repository_cache_stats(git_cache_stats *stats, git_repository *repo)
+{
+	assert(stats && repo);
+	git_cache_get_stats(stats, &repo->objects);
+}
+
 void git_repository_set_odb(git_repository *repo, git_odb *odb)
 {
 	assert(repo && odb);
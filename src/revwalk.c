@@ -11,9 +11,12 @@
 #include "pqueue.h"
 #include "pool.h"
 #include "oidmap.h"
+#include "commit_graph.h"
 
 #include "git2/revwalk.h"
 #include "git2/merge.h"
+#include "git2/graph.h"
+#include "git2/tree.h"
 
 #include <regex.h>
 
@@ -26,16 +29,27 @@ GIT__USE_OIDMAP;
 
 typedef struct commit_object {
 	git_oid oid;
+	git_oid tree;
 	uint32_t time;
+
+	/* 0 until known, from the commit-graph or `commit_generation` */
+	uint32_t generation;
+
 	unsigned int seen:1,
 			 uninteresting:1,
 			 topo_delay:1,
 			 parsed:1,
+			 generating:1,
+			 simplified:1,
+			 treesame:1,
 			 flags : 4;
 
 	unsigned short in_degree;
 	unsigned short out_degree;
 
+	/* with a pathspec, 1 + the only parent worth following, or 0 */
+	unsigned short treesame_parent;
+
 	struct commit_object **parents;
 } commit_object;
 
@@ -48,6 +62,9 @@ struct git_revwalk {
 	git_repository *repo;
 	git_odb *odb;
 
+	/* parents and times without parsing, when the odb has a graph */
+	git_commit_graph_file *cgraph;
+
 	git_oidmap *commits;
 	git_pool commit_pool;
 
@@ -56,6 +73,12 @@ struct git_revwalk {
 	commit_list *iterator_reverse;
 	git_pqueue iterator_time;
 
+	/* incremental topological sorting: the commits whose parents are
+	 * still to be counted, highest generation first, and the lowest
+	 * generation down to which every commit has been counted */
+	git_pqueue iterator_indegree;
+	uint32_t topo_min_generation;
+
 	int (*get_next)(commit_object **, git_revwalk *);
 	int (*enqueue)(git_revwalk *, commit_object *);
 
@@ -65,8 +88,28 @@ struct git_revwalk {
 	/* merge base calculation */
 	commit_object *one;
 	git_vector twos;
+
+	/* only show the commits changing these paths */
+	git_vector pathspec;
+
+	/* limits: follow first parents only, stop after `max_count`
+	 * commits, only show those committed between `since` and `until` */
+	unsigned first_parent:1;
+	size_t max_count;
+	size_t shown;
+	git_time_t since;
+	git_time_t until;
+
+	/* the filter keys of each path, when the graph has filters */
+	git_vector pathspec_keys;
 };
 
+/* The keys of a path and of each folder leading to it */
+typedef struct {
+	size_t len;
+	git_commit_graph_bloom_key keys[GIT_FLEX_ARRAY];
+} pathspec_keys;
+
 static int commit_time_cmp(void *a, void *b)
 {
 	commit_object *commit_a = (commit_object *)a;
@@ -75,6 +118,17 @@ static int commit_time_cmp(void *a, void *b)
 	return (commit_a->time < commit_b->time);
 }
 
+static int commit_generation_cmp(void *a, void *b)
+{
+	commit_object *commit_a = (commit_object *)a;
+	commit_object *commit_b = (commit_object *)b;
+
+	if (commit_a->generation != commit_b->generation)
+		return (commit_a->generation < commit_b->generation);
+
+	return (commit_a->time < commit_b->time);
+}
+
 static commit_list *commit_list_insert(commit_object *item, commit_list **list_p)
 {
 	commit_list *new_list = git__malloc(sizeof(commit_list));
@@ -192,6 +246,10 @@ static int commit_quick_parse(git_revwalk *walk, commit_object *commit, git_rawo
 	int i, parents = 0;
 	int commit_time;
 
+	if (raw->len < strlen("tree ") + GIT_OID_HEXSZ + 1 ||
+		git_oid_fromstr(&commit->tree, (char *)buffer + strlen("tree ")) < 0)
+		return commit_error(commit, "object is corrupted");
+
 	buffer += strlen("tree ") + GIT_OID_HEXSZ + 1;
 
 	parents_start = buffer;
@@ -254,14 +312,45 @@ static int commit_quick_parse(git_revwalk *walk, commit_object *commit, git_rawo
 	return 0;
 }
 
+static int commit_graph_parse(
+	git_revwalk *walk, commit_object *commit, git_commit_graph_entry *entry)
+{
+	git_commit_graph_entry parent;
+	size_t i;
+
+	commit->parents = alloc_parents(walk, commit, entry->parent_count);
+	GITERR_CHECK_ALLOC(commit->parents);
+
+	for (i = 0; i < entry->parent_count; ++i) {
+		if (git_commit_graph_entry_parent(&parent, walk->cgraph, entry, i) < 0)
+			return -1;
+
+		commit->parents[i] = commit_lookup(walk, &parent.sha1);
+		if (commit->parents[i] == NULL)
+			return -1;
+	}
+
+	commit->out_degree = (unsigned short)entry->parent_count;
+	git_oid_cpy(&commit->tree, &entry->tree_oid);
+	commit->time = (uint32_t)entry->commit_time;
+	commit->generation = entry->generation;
+	commit->parsed = 1;
+	return 0;
+}
+
 static int commit_parse(git_revwalk *walk, commit_object *commit)
 {
+	git_commit_graph_entry entry;
 	git_odb_object *obj;
 	int error;
 
 	if (commit->parsed)
 		return 0;
 
+	if (walk->cgraph != NULL &&
+		!git_commit_graph_entry_find(&entry, walk->cgraph, &commit->oid, GIT_OID_HEXSZ))
+		return commit_graph_parse(walk, commit, &entry);
+
 	if ((error = git_odb_read(&obj, walk->odb, &commit->oid)) < 0)
 		return error;
 	assert(obj->raw.type == GIT_OBJ_COMMIT);
@@ -271,6 +360,106 @@ static int commit_parse(git_revwalk *walk, commit_object *commit)
 	return error;
 }
 
+/* Parse a commit, and pick up its generation number if it's known */
+static int generation_lookup(git_revwalk *walk, commit_object *commit)
+{
+	int error;
+
+	if ((error = commit_parse(walk, commit)) < 0)
+		return error;
+
+	if (!commit->generation)
+		git_odb__generation(&commit->generation, walk->odb, &commit->oid);
+
+	return 0;
+}
+
+struct generation_frame {
+	commit_object *commit;
+	unsigned short parent;
+};
+
+/*
+ * The generation number of a commit is one more than the highest one
+ * of its parents, so a commit can't reach anything with a generation
+ * at least as high as its own. When neither the commit-graph nor the
+ * odb knows it, we work it out depth-first, without recursing, and
+ * have the odb remember what we found.
+ */
+static int commit_generation(uint32_t *out, git_revwalk *walk, commit_object *commit)
+{
+	struct generation_frame *stack = NULL, *frame;
+	size_t depth = 0, alloc = 0, i;
+	commit_object *c, *p;
+	uint32_t generation;
+	int error;
+
+	if ((error = generation_lookup(walk, commit)) < 0)
+		return error;
+
+	for (c = commit; c != NULL; ) {
+		if (depth == alloc) {
+			alloc = alloc ? alloc * 2 : 32;
+			frame = git__realloc(stack, alloc * sizeof(struct generation_frame));
+			if (frame == NULL) {
+				error = -1;
+				goto cleanup;
+			}
+			stack = frame;
+		}
+
+		if (!c->generation) {
+			stack[depth].commit = c;
+			stack[depth].parent = 0;
+			depth++;
+			c->generating = 1;
+		}
+
+		for (c = NULL; depth > 0 && c == NULL; ) {
+			frame = &stack[depth - 1];
+
+			if (frame->parent < frame->commit->out_degree) {
+				p = frame->commit->parents[frame->parent++];
+
+				if ((error = generation_lookup(walk, p)) < 0)
+					goto cleanup;
+
+				if (p->generating) {
+					error = commit_error(p, "the history has a cycle");
+					goto cleanup;
+				}
+
+				if (!p->generation)
+					c = p;
+				continue;
+			}
+
+			generation = 0;
+			for (i = 0; i < frame->commit->out_degree; ++i) {
+				if (frame->commit->parents[i]->generation > generation)
+					generation = frame->commit->parents[i]->generation;
+			}
+
+			if (generation < GIT_COMMIT_GRAPH_GENERATION_MAX)
+				generation++;
+
+			frame->commit->generation = generation;
+			frame->commit->generating = 0;
+			git_odb__set_generation(walk->odb, &frame->commit->oid, generation);
+			depth--;
+		}
+	}
+
+	*out = commit->generation;
+
+cleanup:
+	for (i = 0; i < depth; ++i)
+		stack[i].commit->generating = 0;
+
+	git__free(stack);
+	return error;
+}
+
 static int interesting(git_pqueue *list)
 {
 	unsigned int i;
@@ -284,7 +473,18 @@ static int interesting(git_pqueue *list)
 	return 0;
 }
 
-static int merge_bases_many(commit_list **out, git_revwalk *walk, commit_object *one, git_vector *twos)
+/*
+ * Paint down from `one` and the `twos` until only stale commits are
+ * left. When `min_generation` is set, the walk doesn't go below it:
+ * we only want to know whether a commit of that generation is a
+ * merge base, and nothing lower can lead to it.
+ */
+static int merge_bases_many(
+	commit_list **out,
+	git_revwalk *walk,
+	commit_object *one,
+	git_vector *twos,
+	uint32_t min_generation)
 {
 	int error;
 	unsigned int i;
@@ -301,15 +501,21 @@ static int merge_bases_many(commit_list **out, git_revwalk *walk, commit_object
 	if (git_pqueue_init(&list, twos->length * 2, commit_time_cmp) < 0)
 		return -1;
 
-	if (commit_parse(walk, one) < 0)
-	    return -1;
+	if ((error = commit_parse(walk, one)) < 0) {
+		git_pqueue_free(&list);
+		return error;
+	}
 
 	one->flags |= PARENT1;
 	if (git_pqueue_insert(&list, one) < 0)
 		return -1;
 
 	git_vector_foreach(twos, i, two) {
-		commit_parse(walk, two);
+		if ((error = commit_parse(walk, two)) < 0) {
+			git_pqueue_free(&list);
+			return error;
+		}
+
 		two->flags |= PARENT2;
 		if (git_pqueue_insert(&list, two) < 0)
 			return -1;
@@ -333,6 +539,16 @@ static int merge_bases_many(commit_list **out, git_revwalk *walk, commit_object
 			flags |= STALE;
 		}
 
+		if (min_generation) {
+			uint32_t generation;
+
+			if ((error = commit_generation(&generation, walk, commit)) < 0)
+				return error;
+
+			if (generation < min_generation)
+				continue;
+		}
+
 		for (i = 0; i < commit->out_degree; i++) {
 			commit_object *p = commit->parents[i];
 			if ((p->flags & flags) == flags)
@@ -401,7 +617,7 @@ int git_merge_base_many(git_oid *out, git_repository *repo, const git_oid input_
 	if (commit == NULL)
 		goto cleanup;
 
-	if (merge_bases_many(&result, walk, commit, &list) < 0)
+	if (merge_bases_many(&result, walk, commit, &list, 0) < 0)
 		goto cleanup;
 
 	if (!result) {
@@ -445,7 +661,7 @@ int git_merge_base(git_oid *out, git_repository *repo, const git_oid *one, const
 	if (commit == NULL)
 		goto on_error;
 
-	if (merge_bases_many(&result, walk, commit, &list) < 0)
+	if (merge_bases_many(&result, walk, commit, &list, 0) < 0)
 		goto on_error;
 
 	if (!result) {
@@ -465,6 +681,183 @@ on_error:
 	return -1;
 }
 
+int git_graph_descendant_of(git_repository *repo, const git_oid *commit, const git_oid *ancestor)
+{
+	git_revwalk *walk;
+	git_vector list;
+	commit_list *result = NULL, *l;
+	commit_object *one, *two;
+	uint32_t one_generation, two_generation;
+	void *contents[1];
+	int error;
+
+	assert(repo && commit && ancestor);
+
+	if (git_oid_cmp(commit, ancestor) == 0)
+		return 0;
+
+	if (git_revwalk_new(&walk, repo) < 0)
+		return -1;
+
+	if ((one = commit_lookup(walk, commit)) == NULL ||
+		(two = commit_lookup(walk, ancestor)) == NULL) {
+		error = -1;
+		goto cleanup;
+	}
+
+	if ((error = commit_generation(&one_generation, walk, one)) < 0 ||
+		(error = commit_generation(&two_generation, walk, two)) < 0)
+		goto cleanup;
+
+	/* a descendant is always of a higher generation */
+	if (one_generation <= two_generation)
+		goto cleanup;
+
+	memset(&list, 0x0, sizeof(git_vector));
+	contents[0] = two;
+	list.length = 1;
+	list.contents = contents;
+
+	if ((error = merge_bases_many(&result, walk, one, &list, two_generation)) < 0)
+		goto cleanup;
+
+	/* the ancestor is a merge base exactly when it's reachable */
+	for (l = result; l != NULL; l = l->next) {
+		if (l->item == two) {
+			error = 1;
+			break;
+		}
+	}
+
+cleanup:
+	commit_list_free(&result);
+	git_revwalk_free(walk);
+	return error;
+}
+
+/*
+ * Count the commits only `one` or only `two` can reach, once the
+ * merge-base walk has painted them: every commit with a single one
+ * of PARENT1 and PARENT2 has been parsed, and its parents painted.
+ * RESULT marks what has been counted.
+ */
+static int ahead_behind(
+	size_t *ahead, size_t *behind,
+	git_revwalk *walk, commit_object *one, commit_object *two)
+{
+	commit_list *result = NULL, *stack = NULL;
+	commit_object *commit;
+	git_vector list;
+	void *contents[1];
+	unsigned short i;
+	int error;
+
+	*ahead = *behind = 0;
+
+	if (one == two)
+		return 0;
+
+	memset(&list, 0x0, sizeof(git_vector));
+	contents[0] = two;
+	list.length = 1;
+	list.contents = contents;
+
+	if ((error = merge_bases_many(&result, walk, one, &list, 0)) < 0)
+		return error;
+
+	commit_list_free(&result);
+
+	if (commit_list_insert(one, &stack) == NULL ||
+		commit_list_insert(two, &stack) == NULL)
+		goto on_error;
+
+	while ((commit = commit_list_pop(&stack)) != NULL) {
+		if ((commit->flags & RESULT) ||
+			(commit->flags & (PARENT1 | PARENT2)) == (PARENT1 | PARENT2))
+			continue;
+
+		commit->flags |= RESULT;
+
+		if (commit->flags & PARENT1)
+			(*ahead)++;
+		else
+			(*behind)++;
+
+		for (i = 0; i < commit->out_degree; i++) {
+			if (!(commit->parents[i]->flags & RESULT) &&
+				commit_list_insert(commit->parents[i], &stack) == NULL)
+				goto on_error;
+		}
+	}
+
+	return 0;
+
+on_error:
+	commit_list_free(&stack);
+	return -1;
+}
+
+static void clear_flags(git_revwalk *walk)
+{
+	commit_object *commit;
+
+	kh_foreach_value(walk->commits, commit, {
+		commit->flags = 0;
+	});
+}
+
+int git_graph_ahead_behind(
+	size_t *ahead,
+	size_t *behind,
+	git_repository *repo,
+	const git_oid *local,
+	const git_oid *upstream)
+{
+	return git_graph_ahead_behind_many(ahead, behind, repo, upstream, local, 1);
+}
+
+int git_graph_ahead_behind_many(
+	size_t *ahead,
+	size_t *behind,
+	git_repository *repo,
+	const git_oid *upstream,
+	const git_oid locals[],
+	size_t count)
+{
+	git_revwalk *walk;
+	commit_object *one, *two;
+	size_t i;
+	int error = 0;
+
+	assert(ahead && behind && repo && upstream && (locals || !count));
+
+	if (git_revwalk_new(&walk, repo) < 0)
+		return -1;
+
+	if ((two = commit_lookup(walk, upstream)) == NULL) {
+		error = -1;
+		goto cleanup;
+	}
+
+	/* the commits parsed for one pair are there for the next */
+	for (i = 0; i < count; ++i) {
+		if ((one = commit_lookup(walk, &locals[i])) == NULL) {
+			error = -1;
+			goto cleanup;
+		}
+
+		if (i > 0)
+			clear_flags(walk);
+
+		if ((error = ahead_behind(&ahead[i], &behind[i], walk, one, two)) < 0)
+			goto cleanup;
+	}
+
+cleanup:
+	git_revwalk_free(walk);
+	return error;
+}
+
 static void mark_uninteresting(commit_object *commit)
 {
 	unsigned short i;
@@ -481,6 +874,230 @@ static void mark_uninteresting(commit_object *commit)
 			mark_uninteresting(commit->parents[i]);
 }
 
+/*
+ * Whether `path` differs between two trees, either of which
+ * can be NULL for the empty tree. We go down one path component at a
+ * time, so whole subtrees which are the same are never opened.
+ */
+static int path_changed(
+	int *changed, git_repository *repo,
+	const git_oid *a, const git_oid *b, const char *path)
+{
+	git_tree *tree_a = NULL, *tree_b = NULL;
+	const git_tree_entry *entry_a, *entry_b;
+	git_oid next_a, next_b;
+	git_buf name = GIT_BUF_INIT;
+	const char *slash;
+	int error = 0;
+
+	for (;;) {
+		if ((a == NULL && b == NULL) || (a != NULL && b != NULL && !git_oid_cmp(a, b))) {
+			*changed = 0;
+			break;
+		}
+
+		if (*path == '\0') {
+			*changed = 1;
+			break;
+		}
+
+		slash = strchr(path, '/');
+		git_buf_clear(&name);
+		if ((error = git_buf_put(&name, path, slash ? (size_t)(slash - path) : strlen(path))) < 0)
+			break;
+
+		if ((a != NULL && (error = git_tree_lookup(&tree_a, repo, a)) < 0) ||
+			(b != NULL && (error = git_tree_lookup(&tree_b, repo, b)) < 0))
+			break;
+
+		entry_a = tree_a ? git_tree_entry_byname(tree_a, name.ptr) : NULL;
+		entry_b = tree_b ? git_tree_entry_byname(tree_b, name.ptr) : NULL;
+
+		if (slash == NULL) {
+			/* the last component: anything different is a change */
+			*changed = (entry_a == NULL) != (entry_b == NULL) ||
+				(entry_a != NULL &&
+				 (git_oid_cmp(git_tree_entry_id(entry_a), git_tree_entry_id(entry_b)) != 0 ||
+				  git_tree_entry_filemode(entry_a) != git_tree_entry_filemode(entry_b)));
+			break;
+		}
+
+		/* on the way down, only trees can hold the rest of the path */
+		if (entry_a != NULL && git_tree_entry_type(entry_a) == GIT_OBJ_TREE) {
+			git_oid_cpy(&next_a, git_tree_entry_id(entry_a));
+			a = &next_a;
+		} else {
+			a = NULL;
+		}
+
+		if (entry_b != NULL && git_tree_entry_type(entry_b) == GIT_OBJ_TREE) {
+			git_oid_cpy(&next_b, git_tree_entry_id(entry_b));
+			b = &next_b;
+		} else {
+			b = NULL;
+		}
+
+		git_tree_free(tree_a);
+		git_tree_free(tree_b);
+		tree_a = tree_b = NULL;
+
+		path = slash + 1;
+	}
+
+	git_tree_free(tree_a);
+	git_tree_free(tree_b);
+	git_buf_free(&name);
+	return error;
+}
+
+static int pathspec_changed(
+	int *changed, git_revwalk *walk, const git_oid *a, const git_oid *b)
+{
+	unsigned int i;
+	const char *path;
+	int error = 0;
+
+	*changed = 0;
+
+	git_vector_foreach(&walk->pathspec, i, path) {
+		if ((error = path_changed(changed, walk->repo, a, b, path)) < 0 || *changed)
+			break;
+	}
+
+	return error;
+}
+
+/*
+ * Whether the changed-path filters show that a commit leaves all the
+ * paths as its first parent had them, so there's no need to compare
+ * any trees. Filters can be wrong the other way round, so "maybe" is
+ * all they can say about a commit that did change something.
+ */
+static bool pathspec_unchanged_in_filters(git_revwalk *walk, commit_object *commit)
+{
+	unsigned int i;
+	pathspec_keys *keys;
+
+	if (walk->pathspec_keys.length == 0)
+		return false;
+
+	git_vector_foreach(&walk->pathspec_keys, i, keys) {
+		/* the whole tree isn't in any filter */
+		if (keys->len == 0 ||
+			git_commit_graph_bloom_maybe_changed(walk->cgraph,
+				&commit->oid, keys->keys, keys->len) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+GIT_INLINE(bool) commit_too_old(git_revwalk *walk, commit_object *commit)
+{
+	return walk->since && (git_time_t)commit->time < walk->since;
+}
+
+/*
+ * History simplification, as `git log -- <paths>` does it by default:
+ * a commit which leaves the paths as one of its parents had them isn't
+ * shown, and only that parent's history is followed.
+ */
+static int commit_simplify(git_revwalk *walk, commit_object *commit)
+{
+	unsigned short i, end;
+	int changed, error;
+
+	/* too old to be shown or walked past, so there's nothing to do */
+	if (commit->simplified || commit_too_old(walk, commit))
+		return 0;
+
+	/* when following first parents, those are all we compare with */
+	end = walk->first_parent ? (commit->out_degree > 0) : commit->out_degree;
+
+	if (commit->out_degree == 0) {
+		if (pathspec_unchanged_in_filters(walk, commit))
+			changed = 0;
+		else if ((error = pathspec_changed(&changed, walk, &commit->tree, NULL)) < 0)
+			return error;
+
+		commit->treesame = !changed;
+	}
+
+	for (i = 0; i < end; ++i) {
+		commit_object *parent = commit->parents[i];
+
+		if ((error = commit_parse(walk, parent)) < 0)
+			return error;
+
+		/* the filters are against the first parent only */
+		if (i == 0 && pathspec_unchanged_in_filters(walk, commit))
+			changed = 0;
+		else if ((error = pathspec_changed(&changed, walk, &commit->tree, &parent->tree)) < 0)
+			return error;
+
+		if (!changed) {
+			commit->treesame = 1;
+			commit->treesame_parent = i + 1;
+			break;
+		}
+	}
+
+	commit->simplified = 1;
+	return 0;
+}
+
+/*
+ * The parents the walk goes on to: all of them, the simplified one,
+ * or the first one; none for commits older than anything we show.
+ * What's hidden has to be marked all the way down, so the limits
+ * don't apply to it.
+ */
+GIT_INLINE(void) commit_followed_parents(
+	unsigned short *from, unsigned short *to,
+	git_revwalk *walk, commit_object *commit)
+{
+	*from = 0;
+	*to = commit->out_degree;
+
+	if (commit->uninteresting)
+		return;
+
+	if (commit->treesame_parent) {
+		*from = commit->treesame_parent - 1;
+		*to = commit->treesame_parent;
+	} else if (walk->first_parent && *to > 1) {
+		*to = 1;
+	}
+
+	if (commit_too_old(walk, commit))
+		*from = *to = 0;
+}
+
+/* Whether a commit the walk comes to is one to return */
+GIT_INLINE(bool) commit_shown(git_revwalk *walk, commit_object *commit)
+{
+	return !commit->treesame && !commit_too_old(walk, commit) &&
+		(!walk->until || (git_time_t)commit->time <= walk->until);
+}
+
+/* The next commit to return, if we haven't returned enough of them */
+static int next_shown(commit_object **object_out, git_revwalk *walk)
+{
+	int error;
+
+	if (walk->max_count && walk->shown >= walk->max_count)
+		return GIT_ITEROVER;
+
+	do {
+		error = walk->get_next(object_out, walk);
+	} while (!error && !commit_shown(walk, *object_out));
+
+	if (!error)
+		walk->shown++;
+
+	return error;
+}
+
 static int process_commit(git_revwalk *walk, commit_object *commit, int hide)
 {
 	int error;
@@ -501,10 +1118,17 @@ static int process_commit(git_revwalk *walk, commit_object *commit, int hide)
 
 static int process_commit_parents(git_revwalk *walk, commit_object *commit)
 {
-	unsigned short i;
+	unsigned short i, end;
 	int error = 0;
 
-	for (i = 0; i < commit->out_degree && !error; ++i)
+	/* what's hidden has to be marked all the way down */
+	if (walk->pathspec.length > 0 && !commit->uninteresting &&
+		(error = commit_simplify(walk, commit)) < 0)
+		return error;
+
+	commit_followed_parents(&i, &end, walk, commit);
+
+	for (; i < end && !error; ++i)
 		error = process_commit(walk, commit->parents[i], commit->uninteresting);
 
 	return error;
@@ -512,19 +1136,24 @@ static int process_commit_parents(git_revwalk *walk, commit_object *commit)
 
 static int push_commit(git_revwalk *walk, const git_oid *oid, int uninteresting)
 {
+	git_commit_graph_entry entry;
 	git_object *obj;
 	git_otype type;
 	commit_object *commit;
 
-	if (git_object_lookup(&obj, walk->repo, oid, GIT_OBJ_ANY) < 0)
-		return -1;
+	/* anything in the commit-graph is known to be a commit */
+	if (walk->cgraph == NULL ||
+		git_commit_graph_entry_find(&entry, walk->cgraph, oid, GIT_OID_HEXSZ) < 0) {
+		if (git_object_lookup(&obj, walk->repo, oid, GIT_OBJ_ANY) < 0)
+			return -1;
 
-	type = git_object_type(obj);
-	git_object_free(obj);
+		type = git_object_type(obj);
+		git_object_free(obj);
 
-	if (type != GIT_OBJ_COMMIT) {
-		giterr_set(GITERR_INVALID, "Object is no commit object");
-		return -1;
+		if (type != GIT_OBJ_COMMIT) {
+			giterr_set(GITERR_INVALID, "Object is no commit object");
+			return -1;
+		}
 	}
 
 	commit = commit_lookup(walk, oid);
@@ -710,7 +1339,7 @@ static int revwalk_next_unsorted(commit_object **object_out, git_revwalk *walk)
 static int revwalk_next_toposort(commit_object **object_out, git_revwalk *walk)
 {
 	commit_object *next;
-	unsigned short i;
+	unsigned short i, end;
 
 	for (;;) {
 		next = commit_list_pop(&walk->iterator_topo);
@@ -724,7 +1353,9 @@ static int revwalk_next_toposort(commit_object **object_out, git_revwalk *walk)
 			continue;
 		}
 
-		for (i = 0; i < next->out_degree; ++i) {
+		commit_followed_parents(&i, &end, walk, next);
+
+		for (; i < end; ++i) {
 			commit_object *parent = next->parents[i];
 
 			if (--parent->in_degree == 0 && parent->topo_delay) {
@@ -739,6 +1370,146 @@ static int revwalk_next_toposort(commit_object **object_out, git_revwalk *walk)
 	}
 }
 
+/*
+ * Incremental topological sorting. A commit can only be shown once all
+ * of its children have been, so we need to know how many it has; but a
+ * child always has a higher generation number than its parents, so
+ * counting the parents of every commit down to a generation is enough
+ * to have the counts of all the commits at that generation right.
+ * We only go as deep as the commits we are about to show, and the
+ * cost of a walk is in proportion to what it returns, not to the
+ * size of the history.
+ *
+ * `in_degree` is 0 for commits we haven't come to yet, and one more
+ * than the children counted so far otherwise, so 1 means ready.
+ */
+static int topo_count_to_generation(git_revwalk *walk, uint32_t generation)
+{
+	commit_object *next, *parent;
+	unsigned short i, end;
+	uint32_t parent_generation;
+	int error;
+
+	while ((next = git_pqueue_peek(&walk->iterator_indegree)) != NULL &&
+		next->generation >= generation) {
+		git_pqueue_pop(&walk->iterator_indegree);
+
+		if (walk->pathspec.length > 0 && (error = commit_simplify(walk, next)) < 0)
+			return error;
+
+		commit_followed_parents(&i, &end, walk, next);
+
+		for (; i < end; ++i) {
+			parent = next->parents[i];
+
+			if ((error = commit_generation(&parent_generation, walk, parent)) < 0)
+				return error;
+
+			if (parent->in_degree == 0) {
+				parent->in_degree = 2;
+				if (git_pqueue_insert(&walk->iterator_indegree, parent) < 0)
+					return -1;
+			} else {
+				parent->in_degree++;
+			}
+		}
+	}
+
+	if (generation < walk->topo_min_generation)
+		walk->topo_min_generation = generation;
+
+	return 0;
+}
+
+static int topo_enqueue(git_revwalk *walk, commit_object *commit)
+{
+	/* `seen` marks what's been queued to be shown */
+	if (commit->seen)
+		return 0;
+
+	commit->seen = 1;
+
+	if (walk->sorting & GIT_SORT_TIME)
+		return git_pqueue_insert(&walk->iterator_time, commit);
+
+	return commit_list_insert(commit, &walk->iterator_topo) ? 0 : -1;
+}
+
+static int revwalk_next_toposort_incremental(commit_object **object_out, git_revwalk *walk)
+{
+	commit_object *next, *parent;
+	unsigned short i, end;
+	int error;
+
+	if (walk->sorting & GIT_SORT_TIME)
+		next = git_pqueue_pop(&walk->iterator_time);
+	else
+		next = commit_list_pop(&walk->iterator_topo);
+
+	if (next == NULL) {
+		giterr_clear();
+		return GIT_ITEROVER;
+	}
+
+	/* it was simplified when its parents were counted */
+	commit_followed_parents(&i, &end, walk, next);
+
+	for (; i < end; ++i) {
+		parent = next->parents[i];
+
+		if (parent->generation < walk->topo_min_generation &&
+			(error = topo_count_to_generation(walk, parent->generation)) < 0)
+			return error;
+
+		if (--parent->in_degree == 1 && (error = topo_enqueue(walk, parent)) < 0)
+			return error;
+	}
+
+	*object_out = next;
+	return 0;
+}
+
+static int prepare_topo_walk_incremental(git_revwalk *walk)
+{
+	commit_object *start;
+	uint32_t generation, min_generation = UINT32_MAX;
+	unsigned int i;
+	int error;
+
+	walk->topo_min_generation = UINT32_MAX;
+
+	for (i = 0; i <= walk->twos.length; ++i) {
+		start = i ? git_vector_get(&walk->twos, i - 1) : walk->one;
+
+		if ((error = commit_generation(&generation, walk, start)) < 0)
+			return error;
+
+		if (generation < min_generation)
+			min_generation = generation;
+
+		if (start->in_degree == 0) {
+			start->in_degree = 1;
+			if (git_pqueue_insert(&walk->iterator_indegree, start) < 0)
+				return -1;
+		}
+	}
+
+	if ((error = topo_count_to_generation(walk, min_generation)) < 0)
+		return error;
+
+	/* the tips which aren't in the history of any other */
+	for (i = 0; i <= walk->twos.length; ++i) {
+		start = i ? git_vector_get(&walk->twos, i - 1) : walk->one;
+
+		if (start->in_degree == 1 && (error = topo_enqueue(walk, start)) < 0)
+			return error;
+	}
+
+	walk->get_next = &revwalk_next_toposort_incremental;
+	walk->walking = 1;
+	return 0;
+}
+
 static int revwalk_next_reverse(commit_object **object_out, git_revwalk *walk)
 {
 	*object_out = commit_list_pop(&walk->iterator_reverse);
@@ -762,8 +1533,23 @@ static int prepare_walk(git_revwalk *walk)
 		return GIT_ITEROVER;
 	}
 
+	/*
+	 * Topological walks can be streamed, unless everything has to be
+	 * known up front anyway: to reverse it, or to be sure that what's
+	 * hidden was marked before its history is shown.
+	 */
+	if ((walk->sorting & GIT_SORT_TOPOLOGICAL) && !(walk->sorting & GIT_SORT_REVERSE)) {
+		bool hiding = false;
+
+		git_vector_foreach(&walk->twos, i, two)
+			hiding = hiding || two->uninteresting;
+
+		if (!hiding)
+			return prepare_topo_walk_incremental(walk);
+	}
+
 	/* first figure out what the merge bases are */
-	if (merge_bases_many(&bases, walk, walk->one, &walk->twos) < 0)
+	if (merge_bases_many(&bases, walk, walk->one, &walk->twos, 0) < 0)
 		return -1;
 
 	commit_list_free(&bases);
@@ -776,10 +1562,12 @@ static int prepare_walk(git_revwalk *walk)
 	}
 
 	if (walk->sorting & GIT_SORT_TOPOLOGICAL) {
-		unsigned short i;
+		unsigned short i, end;
 
 		while ((error = walk->get_next(&next, walk)) == 0) {
-			for (i = 0; i < next->out_degree; ++i) {
+			commit_followed_parents(&i, &end, walk, next);
+
+			for (; i < end; ++i) {
 				commit_object *parent = next->parents[i];
 				parent->in_degree++;
 			}
@@ -796,7 +1584,8 @@ static int prepare_walk(git_revwalk *walk)
 
 	if (walk->sorting & GIT_SORT_REVERSE) {
 
-		while ((error = walk->get_next(&next, walk)) == 0)
+		/* the limits are on what's reversed, like `git log --reverse` */
+		while ((error = next_shown(&next, walk)) == 0)
 			if (commit_list_insert(next, &walk->iterator_reverse) == NULL)
 				return -1;
 
@@ -804,6 +1593,7 @@ static int prepare_walk(git_revwalk *walk)
 			return error;
 
 		walk->get_next = &revwalk_next_reverse;
+		walk->shown = 0;
 	}
 
 	walk->walking = 1;
@@ -827,7 +1617,10 @@ int git_revwalk_new(git_revwalk **revwalk_out, git_repository *repo)
 	GITERR_CHECK_ALLOC(walk->commits);
 
 	if (git_pqueue_init(&walk->iterator_time, 8, commit_time_cmp) < 0 ||
+		git_pqueue_init(&walk->iterator_indegree, 8, commit_generation_cmp) < 0 ||
 		git_vector_init(&walk->twos, 4, NULL) < 0 ||
+		git_vector_init(&walk->pathspec, 0, NULL) < 0 ||
+		git_vector_init(&walk->pathspec_keys, 0, NULL) < 0 ||
 		git_pool_init(&walk->commit_pool, 1,
 			git_pool__suggest_items_per_page(COMMIT_ALLOC) * COMMIT_ALLOC) < 0)
 		return -1;
@@ -837,7 +1630,8 @@ int git_revwalk_new(git_revwalk **revwalk_out, git_repository *repo)
 
 	walk->repo = repo;
 
-	if (git_repository_odb(&walk->odb, repo) < 0) {
+	if (git_repository_odb(&walk->odb, repo) < 0 ||
+		git_odb__commit_graph(&walk->cgraph, walk->odb) < 0) {
 		git_revwalk_free(walk);
 		return -1;
 	}
@@ -846,18 +1640,65 @@ int git_revwalk_new(git_revwalk **revwalk_out, git_repository *repo)
 	return 0;
 }
 
+static void clear_pathspec(git_revwalk *walk)
+{
+	unsigned int i;
+	char *path;
+	pathspec_keys *keys;
+
+	git_vector_foreach(&walk->pathspec, i, path)
+		git__free(path);
+
+	git_vector_foreach(&walk->pathspec_keys, i, keys)
+		git__free(keys);
+
+	git_vector_clear(&walk->pathspec);
+	git_vector_clear(&walk->pathspec_keys);
+}
+
+static int add_pathspec_keys(git_revwalk *walk, const char *path)
+{
+	pathspec_keys *keys;
+	size_t i, len = *path ? 1 : 0;
+
+	for (i = 0; path[i]; ++i)
+		len += (path[i] == '/');
+
+	keys = git__malloc(sizeof(pathspec_keys) + len * sizeof(git_commit_graph_bloom_key));
+	GITERR_CHECK_ALLOC(keys);
+
+	/* the path itself, then each of its folders */
+	keys->len = 0;
+	for (i = strlen(path); i > 0; --i) {
+		if (path[i] == '/' || path[i] == '\0')
+			git_commit_graph_bloom_key_init(&keys->keys[keys->len++], walk->cgraph, path, i);
+	}
+
+	if (git_vector_insert(&walk->pathspec_keys, keys) < 0) {
+		git__free(keys);
+		return -1;
+	}
+
+	return 0;
+}
+
 void git_revwalk_free(git_revwalk *walk)
 {
 	if (walk == NULL)
 		return;
 
 	git_revwalk_reset(walk);
+	git_commit_graph_free(walk->cgraph);
 	git_odb_free(walk->odb);
 
 	git_oidmap_free(walk->commits);
 	git_pool_clear(&walk->commit_pool);
 	git_pqueue_free(&walk->iterator_time);
+	git_pqueue_free(&walk->iterator_indegree);
 	git_vector_free(&walk->twos);
+	clear_pathspec(walk);
+	git_vector_free(&walk->pathspec);
+	git_vector_free(&walk->pathspec_keys);
 	git__free(walk);
 }
 
@@ -867,15 +1708,96 @@ git_repository *git_revwalk_repository(git_revwalk *walk)
 	return walk->repo;
 }
 
-void git_revwalk_sorting(git_revwalk *walk, unsigned int sort_mode)
+static void clear_simplification(git_revwalk *walk)
+{
+	commit_object *commit;
+
+	kh_foreach_value(walk->commits, commit, {
+		commit->simplified = 0;
+		commit->treesame = 0;
+		commit->treesame_parent = 0;
+	});
+}
+
+int git_revwalk_set_pathspec(git_revwalk *walk, const git_strarray *pathspec)
 {
+	size_t i, len;
+	char *path;
+
 	assert(walk);
 
 	if (walk->walking)
 		git_revwalk_reset(walk);
 
-	walk->sorting = sort_mode;
+	clear_pathspec(walk);
+
+	/* what was simplified was for the old paths */
+	clear_simplification(walk);
+
+	for (i = 0; pathspec != NULL && i < pathspec->count; ++i) {
+		const char *p = pathspec->strings[i];
+
+		while (*p == '/')
+			p++;
+
+		len = strlen(p);
+		while (len > 0 && p[len - 1] == '/')
+			len--;
+
+		if ((path = git__strndup(p, len)) == NULL ||
+			git_vector_insert(&walk->pathspec, path) < 0) {
+			git__free(path);
+			clear_pathspec(walk);
+			return -1;
+		}
+
+		if (walk->cgraph != NULL && walk->cgraph->bloom_data != NULL &&
+			add_pathspec_keys(walk, path) < 0) {
+			clear_pathspec(walk);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void git_revwalk_set_first_parent(git_revwalk *walk, int enabled)
+{
+	assert(walk);
+
+	if (walk->walking)
+		git_revwalk_reset(walk);
+
+	/* merges were simplified against all of their parents */
+	if (walk->first_parent != !!enabled)
+		clear_simplification(walk);
+
+	walk->first_parent = !!enabled;
+}
+
+void git_revwalk_set_max_count(git_revwalk *walk, size_t max_count)
+{
+	assert(walk);
+
+	if (walk->walking)
+		git_revwalk_reset(walk);
+
+	walk->max_count = max_count;
+}
+
+void git_revwalk_set_time_range(git_revwalk *walk, git_time_t since, git_time_t until)
+{
+	assert(walk);
+
+	if (walk->walking)
+		git_revwalk_reset(walk);
 
+	walk->since = since;
+	walk->until = until;
+}
+
+static void set_sorting_callbacks(git_revwalk *walk)
+{
 	if (walk->sorting & GIT_SORT_TIME) {
 		walk->get_next = &revwalk_next_timesort;
 		walk->enqueue = &revwalk_enqueue_timesort;
@@ -885,6 +1807,17 @@ void git_revwalk_sorting(git_revwalk *walk, unsigned int sort_mode)
 	}
 }
 
+void git_revwalk_sorting(git_revwalk *walk, unsigned int sort_mode)
+{
+	assert(walk);
+
+	if (walk->walking)
+		git_revwalk_reset(walk);
+
+	walk->sorting = sort_mode;
+	set_sorting_callbacks(walk);
+}
+
 int git_revwalk_next(git_oid *oid, git_revwalk *walk)
 {
 	int error;
@@ -897,7 +1830,9 @@ int git_revwalk_next(git_oid *oid, git_revwalk *walk)
 			return error;
 	}
 
-	error = walk->get_next(&next, walk);
+	/* commits which leave the paths alone, or fall out of the time
+	 * range, are walked but not shown */
+	error = next_shown(&next, walk);
 
 	if (error == GIT_ITEROVER) {
 		git_revwalk_reset(walk);
@@ -925,10 +1860,15 @@ void git_revwalk_reset(git_revwalk *walk)
 		});
 
 	git_pqueue_clear(&walk->iterator_time);
+	git_pqueue_clear(&walk->iterator_indegree);
 	commit_list_free(&walk->iterator_topo);
 	commit_list_free(&walk->iterator_rand);
 	commit_list_free(&walk->iterator_reverse);
 	walk->walking = 0;
+	walk->shown = 0;
+
+	/* preparing a walk swaps in the getters for the sorting it needs */
+	set_sorting_callbacks(walk);
 
 	walk->one = NULL;
 	git_vector_clear(&walk->twos);
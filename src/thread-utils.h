@@ -35,6 +35,7 @@ GIT_INLINE(void) git_atomic_set(git_atomic *a, int val)
 #define git_mutex pthread_mutex_t
 #define git_mutex_init(a)	pthread_mutex_init(a, NULL)
 #define git_mutex_lock(a)	pthread_mutex_lock(a)
+#define git_mutex_trylock(a)	pthread_mutex_trylock(a)
 #define git_mutex_unlock(a) pthread_mutex_unlock(a)
 #define git_mutex_free(a)	pthread_mutex_destroy(a)
 
@@ -68,6 +69,17 @@ GIT_INLINE(int) git_atomic_dec(git_atomic *a)
 #endif
 }
 
+GIT_INLINE(int) git_atomic_get(git_atomic *a)
+{
+#if defined(GIT_WIN32)
+	return InterlockedCompareExchange(&a->val, 0, 0);
+#elif defined(__GNUC__)
+	return __sync_val_compare_and_swap(&a->val, 0, 0);
+#else
+#	error "Unsupported architecture for atomic operations"
+#endif
+}
+
 #else
 
 #define git_thread unsigned int
@@ -80,6 +92,7 @@ GIT_INLINE(int) git_atomic_dec(git_atomic *a)
 #define git_mutex unsigned int
 #define git_mutex_init(a) (void)0
 #define git_mutex_lock(a) (void)0
+#define git_mutex_trylock(a) 0
 #define git_mutex_unlock(a) (void)0
 #define git_mutex_free(a) (void)0
 
@@ -101,6 +114,11 @@ GIT_INLINE(int) git_atomic_dec(git_atomic *a)
 	return --a->val;
 }
 
+GIT_INLINE(int) git_atomic_get(git_atomic *a)
+{
+	return a->val;
+}
+
 #endif
 
 extern int git_online_cpus(void);
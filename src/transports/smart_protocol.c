@@ -89,6 +89,12 @@ int git_smart__detect_caps(git_pkt_ref *pkt, transport_smart_caps *caps)
 			continue;
 		}
 
+		if(!git__prefixcmp(ptr, GIT_CAP_THIN_PACK)) {
+			caps->common = caps->thin_pack = 1;
+			ptr += strlen(GIT_CAP_THIN_PACK);
+			continue;
+		}
+
 		/* Keep side-band check after side-band-64k */
 		if(!git__prefixcmp(ptr, GIT_CAP_SIDE_BAND_64K)) {
 			caps->common = caps->side_band_64k = 1;
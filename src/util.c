@@ -10,6 +10,10 @@
 #include <stdio.h>
 #include <ctype.h>
 #include "posix.h"
+#include "cache.h"
+#include "odb.h"
+#include "mwindow.h"
+#include "pack.h"
 
 #ifdef _MSC_VER
 # include <Shlwapi.h>
@@ -34,6 +38,87 @@ int git_libgit2_capabilities()
 	;
 }
 
+int git_libgit2_opts(int key, ...)
+{
+	int error = 0;
+	va_list ap;
+
+	va_start(ap, key);
+
+	switch (key) {
+	case GIT_OPT_SET_CACHE_MAX_SIZE:
+		git_cache__max_storage = va_arg(ap, size_t);
+		break;
+
+	case GIT_OPT_GET_CACHE_MAX_SIZE:
+		*(va_arg(ap, size_t *)) = git_cache__max_storage;
+		break;
+
+	case GIT_OPT_SET_CACHE_OBJECT_LIMIT:
+		{
+			git_otype type = (git_otype)va_arg(ap, int);
+			size_t size = va_arg(ap, size_t);
+			error = git_cache_set_max_object_size(type, size);
+		}
+		break;
+
+	case GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL:
+		git_odb__negative_cache_ttl = va_arg(ap, int);
+		break;
+
+	case GIT_OPT_GET_ODB_NEGATIVE_CACHE_TTL:
+		*(va_arg(ap, int *)) = git_odb__negative_cache_ttl;
+		break;
+
+	case GIT_OPT_SET_MWINDOW_SIZE:
+		error = git_mwindow_set_window_size(va_arg(ap, size_t));
+		break;
+
+	case GIT_OPT_GET_MWINDOW_SIZE:
+		*(va_arg(ap, size_t *)) = git_mwindow__window_size;
+		break;
+
+	case GIT_OPT_SET_MWINDOW_MAPPED_LIMIT:
+		git_mwindow__mapped_limit = va_arg(ap, size_t);
+		break;
+
+	case GIT_OPT_GET_MWINDOW_MAPPED_LIMIT:
+		*(va_arg(ap, size_t *)) = git_mwindow__mapped_limit;
+		break;
+
+	case GIT_OPT_SET_MWINDOW_FILE_LIMIT:
+		git_mwindow__file_limit = va_arg(ap, size_t);
+		break;
+
+	case GIT_OPT_GET_MWINDOW_FILE_LIMIT:
+		*(va_arg(ap, size_t *)) = git_mwindow__file_limit;
+		break;
+
+	case GIT_OPT_SET_MWINDOW_MAP_WHOLE_FILES:
+		git_mwindow__map_whole_files = va_arg(ap, int);
+		break;
+
+	case GIT_OPT_GET_MWINDOW_MAP_WHOLE_FILES:
+		*(va_arg(ap, int *)) = git_mwindow__map_whole_files;
+		break;
+
+	case GIT_OPT_SET_PACK_CHECK_CRC:
+		git_packfile__check_crc = va_arg(ap, int);
+		break;
+
+	case GIT_OPT_GET_PACK_CHECK_CRC:
+		*(va_arg(ap, int *)) = git_packfile__check_crc;
+		break;
+
+	default:
+		giterr_set(GITERR_INVALID, "Invalid option key");
+		error = -1;
+	}
+
+	va_end(ap);
+	return error;
+}
+
 void git_strarray_free(git_strarray *array)
 {
 	size_t i;
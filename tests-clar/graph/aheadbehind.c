@@ -0,0 +1,88 @@
+#include "clar_libgit2.h"
+
+/*
+	$ git log --oneline --graph --decorate
+	*   a4a7dce (HEAD, br2) Merge branch 'master' into br2
+	|\
+	| * 9fd738e (master) a fourth commit
+	| * 4a202b3 a third commit
+	* | c47800c branch commit one
+	|/
+	* 5b5b025 another commit
+	* 8496071 testing
+*/
+static git_repository *_repo;
+static git_oid _merge, _fourth, _branch, _root, _unrelated;
+
+void test_graph_aheadbehind__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+
+	cl_git_pass(git_oid_fromstr(&_merge, "a4a7dce85cf63874e984719f4fdd239f5145052f"));
+	cl_git_pass(git_oid_fromstr(&_fourth, "9fd738e8f7967c078dceed8190330fc8648ee56a"));
+	cl_git_pass(git_oid_fromstr(&_branch, "c47800c7266a2be04c571c04d5a6614691ea99bd"));
+	cl_git_pass(git_oid_fromstr(&_root, "8496071c1b46c854b31185ea97743be6a8774479"));
+
+	/* refs/heads/packed, with a history of its own of 2 commits */
+	cl_git_pass(git_oid_fromstr(&_unrelated, "41bc8c69075bbdb46c5c6f0566cc8cc5b46e8bd9"));
+}
+
+void test_graph_aheadbehind__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+static void check(const git_oid *local, const git_oid *upstream, size_t ahead, size_t behind)
+{
+	size_t a, b;
+
+	cl_git_pass(git_graph_ahead_behind(&a, &b, _repo, local, upstream));
+	cl_assert_equal_i(ahead, a);
+	cl_assert_equal_i(behind, b);
+}
+
+void test_graph_aheadbehind__counts_unique_commits(void)
+{
+	check(&_merge, &_merge, 0, 0);
+	check(&_merge, &_fourth, 2, 0);
+	check(&_fourth, &_merge, 0, 2);
+	check(&_branch, &_fourth, 1, 2);
+	check(&_fourth, &_branch, 2, 1);
+	check(&_merge, &_root, 5, 0);
+	check(&_merge, &_unrelated, 6, 2);
+}
+
+void test_graph_aheadbehind__many_locals_share_an_upstream(void)
+{
+	git_oid locals[5];
+	size_t ahead[5], behind[5], a, b, i;
+
+	git_oid_cpy(&locals[0], &_branch);
+	git_oid_cpy(&locals[1], &_merge);
+	git_oid_cpy(&locals[2], &_root);
+	git_oid_cpy(&locals[3], &_unrelated);
+	git_oid_cpy(&locals[4], &_fourth);
+
+	cl_git_pass(git_graph_ahead_behind_many(ahead, behind, _repo, &_fourth, locals, 5));
+
+	for (i = 0; i < 5; ++i) {
+		cl_git_pass(git_graph_ahead_behind(&a, &b, _repo, &locals[i], &_fourth));
+		cl_assert_equal_i(a, ahead[i]);
+		cl_assert_equal_i(b, behind[i]);
+	}
+
+	cl_assert_equal_i(1, ahead[0]);
+	cl_assert_equal_i(2, behind[0]);
+	cl_assert_equal_i(0, ahead[4]);
+	cl_assert_equal_i(0, behind[4]);
+}
+
+void test_graph_aheadbehind__missing_commits(void)
+{
+	git_oid missing;
+	size_t a, b;
+
+	cl_git_pass(git_oid_fromstr(&missing, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_graph_ahead_behind(&a, &b, _repo, &_merge, &missing));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_graph_ahead_behind(&a, &b, _repo, &missing, &_merge));
+}
@@ -0,0 +1,103 @@
+#include "clar_libgit2.h"
+#include "git2/commit_graph.h"
+#include "odb.h"
+
+/*
+	$ git log --oneline --graph --decorate
+	*   a4a7dce (HEAD, br2) Merge branch 'master' into br2
+	|\
+	| * 9fd738e (master) a fourth commit
+	| * 4a202b3 a third commit
+	* | c47800c branch commit one
+	|/
+	* 5b5b025 another commit
+	* 8496071 testing
+*/
+static git_repository *_repo;
+static git_oid _merge, _fourth, _third, _branch, _another, _root, _unrelated;
+
+void test_graph_descendantof__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+
+	cl_git_pass(git_oid_fromstr(&_merge, "a4a7dce85cf63874e984719f4fdd239f5145052f"));
+	cl_git_pass(git_oid_fromstr(&_fourth, "9fd738e8f7967c078dceed8190330fc8648ee56a"));
+	cl_git_pass(git_oid_fromstr(&_third, "4a202b346bb0fb0db7eff3cffeb3c70babbd2045"));
+	cl_git_pass(git_oid_fromstr(&_branch, "c47800c7266a2be04c571c04d5a6614691ea99bd"));
+	cl_git_pass(git_oid_fromstr(&_another, "5b5b025afb0b4c913b4c338a42934a3863bf3644"));
+	cl_git_pass(git_oid_fromstr(&_root, "8496071c1b46c854b31185ea97743be6a8774479"));
+
+	/* refs/heads/packed has a history of its own */
+	cl_git_pass(git_oid_fromstr(&_unrelated, "41bc8c69075bbdb46c5c6f0566cc8cc5b46e8bd9"));
+}
+
+void test_graph_descendantof__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+static void check_descendants(void)
+{
+	cl_assert_equal_i(1, git_graph_descendant_of(_repo, &_merge, &_root));
+	cl_assert_equal_i(1, git_graph_descendant_of(_repo, &_merge, &_third));
+	cl_assert_equal_i(1, git_graph_descendant_of(_repo, &_merge, &_branch));
+	cl_assert_equal_i(1, git_graph_descendant_of(_repo, &_fourth, &_another));
+
+	cl_assert_equal_i(0, git_graph_descendant_of(_repo, &_root, &_merge));
+	cl_assert_equal_i(0, git_graph_descendant_of(_repo, &_fourth, &_branch));
+	cl_assert_equal_i(0, git_graph_descendant_of(_repo, &_branch, &_fourth));
+	cl_assert_equal_i(0, git_graph_descendant_of(_repo, &_merge, &_merge));
+	cl_assert_equal_i(0, git_graph_descendant_of(_repo, &_merge, &_unrelated));
+	cl_assert_equal_i(0, git_graph_descendant_of(_repo, &_unrelated, &_merge));
+}
+
+void test_graph_descendantof__computes_generations(void)
+{
+	git_odb *odb;
+	uint32_t generation;
+
+	check_descendants();
+
+	/* what we worked out is remembered */
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb__generation(&generation, odb, &_root));
+	cl_assert_equal_i(1, generation);
+	cl_git_pass(git_odb__generation(&generation, odb, &_merge));
+	cl_assert_equal_i(5, generation);
+	git_odb_free(odb);
+
+	/* and used the second time around */
+	check_descendants();
+}
+
+void test_graph_descendantof__uses_the_commit_graph(void)
+{
+	git_commit_graph_writer *w;
+	git_revwalk *walk;
+	git_odb *odb;
+	uint32_t generation;
+
+	cl_git_pass(git_revwalk_new(&walk, _repo));
+	cl_git_pass(git_revwalk_push_glob(walk, "heads"));
+	cl_git_pass(git_commit_graph_writer_new(&w, "testrepo.git/objects/info"));
+	cl_git_pass(git_commit_graph_writer_add_revwalk(w, walk));
+	cl_git_pass(git_commit_graph_writer_commit(w));
+	git_commit_graph_writer_free(w);
+	git_revwalk_free(walk);
+
+	check_descendants();
+
+	/* nothing needed working out */
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_odb__generation(&generation, odb, &_merge));
+	git_odb_free(odb);
+}
+
+void test_graph_descendantof__missing_commits(void)
+{
+	git_oid missing;
+
+	cl_git_pass(git_oid_fromstr(&missing, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_graph_descendant_of(_repo, &_merge, &missing));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_graph_descendant_of(_repo, &missing, &_merge));
+}
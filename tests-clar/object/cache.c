@@ -0,0 +1,120 @@
+#include "clar_libgit2.h"
+#include "repository.h"
+#include "cache.h"
+
+static git_repository *g_repo;
+static size_t g_max_storage;
+
+void test_object_cache__initialize(void)
+{
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_CACHE_MAX_SIZE, &g_max_storage));
+	cl_git_pass(git_repository_open(&g_repo, cl_fixture("testrepo.git")));
+}
+
+void test_object_cache__cleanup(void)
+{
+	git_repository_free(g_repo);
+	g_repo = NULL;
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, g_max_storage));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_BLOB, (size_t)GIT_CACHE_MAX_BLOB_SIZE));
+}
+
+static int walk_commits(void)
+{
+	git_revwalk *walk;
+	git_commit *commit;
+	git_oid oid;
+	int count = 0;
+
+	cl_git_pass(git_revwalk_new(&walk, g_repo));
+	cl_git_pass(git_revwalk_push_glob(walk, "refs/heads/*"));
+
+	while (git_revwalk_next(&oid, walk) == 0) {
+		cl_git_pass(git_commit_lookup(&commit, g_repo, &oid));
+		git_commit_free(commit);
+		count++;
+	}
+
+	git_revwalk_free(walk);
+	return count;
+}
+
+void test_object_cache__lookups_hit_the_cache(void)
+{
+	git_cache_stats before, after;
+	int count;
+
+	count = walk_commits();
+	git_repository_cache_stats(&before, g_repo);
+	cl_assert(before.misses >= (size_t)count);
+	cl_assert(before.objects >= (size_t)count);
+	cl_assert(before.memory_used > 0);
+
+	walk_commits();
+	git_repository_cache_stats(&after, g_repo);
+	cl_assert(after.hits >= before.hits + count);
+	cl_assert_equal_i(before.misses, after.misses);
+	cl_assert_equal_i(0, after.evictions);
+}
+
+void test_object_cache__cached_objects_are_shared(void)
+{
+	git_object *a, *b;
+	git_oid oid;
+
+	cl_git_pass(git_oid_fromstr(&oid, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"));
+	cl_git_pass(git_object_lookup(&a, g_repo, &oid, GIT_OBJ_COMMIT));
+	cl_git_pass(git_object_lookup(&b, g_repo, &oid, GIT_OBJ_COMMIT));
+	cl_assert(a == b);
+
+	git_object_free(a);
+	git_object_free(b);
+}
+
+void test_object_cache__blobs_above_the_limit_are_not_cached(void)
+{
+	git_cache_stats stats;
+	git_blob *a, *b;
+	git_oid oid;
+
+	/* README in testrepo is 10 bytes */
+	cl_git_pass(git_oid_fromstr(&oid, "a8233120f6ad708f843d861ce2b7228ec4e3dec6"));
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_BLOB, (size_t)0));
+	cl_git_pass(git_blob_lookup(&a, g_repo, &oid));
+	cl_git_pass(git_blob_lookup(&b, g_repo, &oid));
+	cl_assert(a != b);
+	git_repository_cache_stats(&stats, g_repo);
+	cl_assert_equal_i(0, stats.objects);
+	git_blob_free(a);
+	git_blob_free(b);
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_BLOB, (size_t)10));
+	cl_git_pass(git_blob_lookup(&a, g_repo, &oid));
+	cl_git_pass(git_blob_lookup(&b, g_repo, &oid));
+	cl_assert(a == b);
+	git_repository_cache_stats(&stats, g_repo);
+	cl_assert_equal_i(1, stats.objects);
+	git_blob_free(a);
+	git_blob_free(b);
+
+	cl_git_fail(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, (git_otype)42, (size_t)10));
+}
+
+void test_object_cache__memory_budget_is_respected(void)
+{
+	git_cache_stats stats;
+	int count;
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (size_t)(GIT_CACHE_SHARDS * 512)));
+
+	count = walk_commits();
+	git_repository_cache_stats(&stats, g_repo);
+	cl_assert(stats.memory_used <= GIT_CACHE_SHARDS * 512);
+	cl_assert(stats.evictions > 0);
+	cl_assert(stats.objects < (size_t)count);
+
+	/* evicted objects can still be looked up */
+	cl_assert_equal_i(count, walk_commits());
+}
@@ -0,0 +1,260 @@
+#include "clar_libgit2.h"
+#include "git2/odb_backend.h"
+#include "odb.h"
+#include "fileops.h"
+
+#define PACK_DIR "testrepo.git/objects/pack"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+void test_odb_bulk__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_odb_bulk__cleanup(void)
+{
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL, 0));
+
+	git_odb_free(_odb);
+	_odb = NULL;
+	cl_git_sandbox_cleanup();
+}
+
+static int count_cb(void *payload, git_buf *path)
+{
+	size_t *counts = payload;
+
+	if (!git__suffixcmp(path->ptr, ".idx"))
+		counts[0]++;
+	else if (!git__suffixcmp(path->ptr, ".pack"))
+		counts[1]++;
+	else
+		counts[2]++;
+
+	return 0;
+}
+
+/* idx, pack and other files in the pack folder */
+static void count_pack_folder(size_t counts[3])
+{
+	git_buf path = GIT_BUF_INIT;
+
+	counts[0] = counts[1] = counts[2] = 0;
+
+	cl_git_pass(git_buf_sets(&path, PACK_DIR));
+	cl_git_pass(git_path_direach(&path, count_cb, counts));
+	git_buf_free(&path);
+}
+
+static int find_new_idx_cb(void *payload, git_buf *path)
+{
+	git_buf *found = payload;
+
+	if (!git__suffixcmp(path->ptr, ".idx") &&
+		strstr(path->ptr, "d85f5d483273108c9d8dd0e4728ccf0b2982423a") == NULL &&
+		strstr(path->ptr, "a81e489679b7d3418f9ab594bda8ceb37dd4c695") == NULL &&
+		strstr(path->ptr, "d7c6adf9f61318f041845b01440d09aa7a91e1b5") == NULL)
+		return git_buf_sets(found, path->ptr);
+
+	return 0;
+}
+
+static bool is_loose(const git_oid *id)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	git_buf path = GIT_BUF_INIT;
+	bool exists;
+
+	git_oid_fmt(hex, id);
+	hex[GIT_OID_HEXSZ] = '\0';
+
+	cl_git_pass(git_buf_printf(&path, "testrepo.git/objects/%.2s/%s", hex, hex + 2));
+	exists = git_path_exists(path.ptr);
+	git_buf_free(&path);
+
+	return exists;
+}
+
+static void write_blob(git_oid *id, int n)
+{
+	char content[64];
+
+	p_snprintf(content, sizeof(content), "bulk blob number %d\n", n);
+	cl_git_pass(git_odb_write(id, _odb, content, strlen(content), GIT_OBJ_BLOB));
+}
+
+static void check_blob(git_odb *odb, const git_oid *id, int n)
+{
+	git_odb_object *obj;
+	char content[64];
+
+	p_snprintf(content, sizeof(content), "bulk blob number %d\n", n);
+
+	cl_git_pass(git_odb_read(&obj, odb, id));
+	cl_assert_equal_i(GIT_OBJ_BLOB, git_odb_object_type(obj));
+	cl_assert_equal_i(strlen(content), git_odb_object_size(obj));
+	cl_assert(memcmp(content, git_odb_object_data(obj), strlen(content)) == 0);
+	git_odb_object_free(obj);
+}
+
+void test_odb_bulk__writes_one_pack(void)
+{
+	git_oid ids[50], id;
+	git_odb *fresh;
+	git_odb_object *obj;
+	git_odb_stream *stream;
+	size_t before[3], after[3], len;
+	git_otype type;
+	int i;
+
+	count_pack_folder(before);
+
+	cl_git_pass(git_odb_bulk_begin(_odb));
+	cl_git_fail(git_odb_bulk_begin(_odb));
+
+	for (i = 0; i < 50; ++i) {
+		write_blob(&ids[i], i);
+		cl_assert(!is_loose(&ids[i]));
+	}
+
+	/* streams end up in the pack as well */
+	cl_git_pass(git_odb_open_wstream(&stream, _odb, 9, GIT_OBJ_BLOB));
+	cl_git_pass(stream->write(stream, "streamed\n", 9));
+	cl_git_pass(stream->finalize_write(&id, stream));
+	stream->free(stream);
+	cl_assert(!is_loose(&id));
+
+	/* what we wrote is there to be read before the commit */
+	for (i = 0; i < 50; ++i) {
+		cl_assert(git_odb_exists(_odb, &ids[i]));
+		check_blob(_odb, &ids[i], i);
+	}
+
+	cl_git_pass(git_odb_read_header(&len, &type, _odb, &id));
+	cl_assert_equal_i(9, len);
+	cl_assert_equal_i(GIT_OBJ_BLOB, type);
+
+	cl_git_pass(git_odb_read_prefix(&obj, _odb, &id, GIT_OID_HEXSZ - 4));
+	cl_assert(git_oid_cmp(&id, git_odb_object_id(obj)) == 0);
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_odb_bulk_commit(_odb));
+	cl_git_fail(git_odb_bulk_commit(_odb));
+
+	count_pack_folder(after);
+	cl_assert_equal_i(before[0] + 1, after[0]);
+	cl_assert_equal_i(before[1] + 1, after[1]);
+	cl_assert_equal_i(before[2], after[2]);
+
+	/* still visible, now from the pack */
+	check_blob(_odb, &ids[10], 10);
+
+	cl_git_pass(git_odb_open(&fresh, "testrepo.git/objects"));
+	for (i = 0; i < 50; ++i)
+		check_blob(fresh, &ids[i], i);
+	cl_assert(git_odb_exists(fresh, &id));
+	git_odb_free(fresh);
+}
+
+void test_odb_bulk__skips_what_we_have(void)
+{
+	git_oid head, written, ids[2];
+	git_odb_object *commit;
+	git_buf idx = GIT_BUF_INIT, folder = GIT_BUF_INIT;
+	size_t before[3], after[3];
+	struct stat st;
+
+	cl_git_pass(git_reference_name_to_oid(&head, _repo, "refs/heads/master"));
+	cl_git_pass(git_odb_read(&commit, _odb, &head));
+
+	count_pack_folder(before);
+
+	/* nothing new, nothing written */
+	cl_git_pass(git_odb_bulk_begin(_odb));
+	cl_git_pass(git_odb_write(&written, _odb,
+		git_odb_object_data(commit), git_odb_object_size(commit), GIT_OBJ_COMMIT));
+	cl_assert(git_oid_cmp(&head, &written) == 0);
+	cl_git_pass(git_odb_bulk_commit(_odb));
+
+	count_pack_folder(after);
+	cl_assert(memcmp(before, after, sizeof(before)) == 0);
+
+	/* the same new object twice, alongside one we have: one object */
+	cl_git_pass(git_odb_bulk_begin(_odb));
+	write_blob(&ids[0], 1);
+	write_blob(&ids[1], 1);
+	cl_git_pass(git_odb_write(&written, _odb,
+		git_odb_object_data(commit), git_odb_object_size(commit), GIT_OBJ_COMMIT));
+	cl_git_pass(git_odb_bulk_commit(_odb));
+
+	cl_assert(git_oid_cmp(&ids[0], &ids[1]) == 0);
+
+	cl_git_pass(git_buf_sets(&folder, PACK_DIR));
+	cl_git_pass(git_path_direach(&folder, find_new_idx_cb, &idx));
+	cl_assert(idx.size > 0);
+
+	/* header, fanout, one name, crc and offset, and the two checksums */
+	cl_git_pass(p_stat(idx.ptr, &st));
+	cl_assert_equal_i(8 + 256 * 4 + 20 + 4 + 4 + 20 + 20, st.st_size);
+
+	git_odb_object_free(commit);
+	git_buf_free(&idx);
+	git_buf_free(&folder);
+}
+
+void test_odb_bulk__written_objects_exist_with_negative_caching(void)
+{
+	git_oid id;
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL, 60));
+
+	cl_git_pass(git_odb_bulk_begin(_odb));
+	write_blob(&id, 1);
+	cl_assert(git_odb_exists(_odb, &id));
+	check_blob(_odb, &id, 1);
+	cl_git_pass(git_odb_bulk_commit(_odb));
+
+	cl_assert(git_odb_exists(_odb, &id));
+	check_blob(_odb, &id, 1);
+}
+
+void test_odb_bulk__rollback_leaves_nothing(void)
+{
+	git_odb *odb;
+	git_oid id;
+	size_t before[3], after[3];
+
+	count_pack_folder(before);
+
+	cl_git_pass(git_odb_bulk_begin(_odb));
+	write_blob(&id, 1);
+	check_blob(_odb, &id, 1);
+	git_odb_bulk_rollback(_odb);
+
+	count_pack_folder(after);
+	cl_assert(memcmp(before, after, sizeof(before)) == 0);
+
+	cl_assert(!git_odb_exists(_odb, &id));
+	cl_assert(!is_loose(&id));
+
+	/* an open transaction goes away with its database */
+	cl_git_pass(git_odb_open(&odb, "testrepo.git/objects"));
+	cl_git_pass(git_odb_bulk_begin(odb));
+	cl_git_pass(git_odb_write(&id, odb, "dropped\n", 8, GIT_OBJ_BLOB));
+	git_odb_free(odb);
+
+	count_pack_folder(after);
+	cl_assert(memcmp(before, after, sizeof(before)) == 0);
+}
+
+void test_odb_bulk__needs_a_folder(void)
+{
+	git_odb *odb;
+
+	cl_git_pass(git_odb_new(&odb));
+	cl_git_fail(git_odb_bulk_begin(odb));
+	git_odb_free(odb);
+}
@@ -0,0 +1,101 @@
+#include "clar_libgit2.h"
+#include "git2/odb_backend.h"
+#include "odb.h"
+
+#define PACK_NAME "pack-d85f5d483273108c9d8dd0e4728ccf0b2982423a"
+#define PACKED_ONLY "0266163a49e280c4f5ed1e08facd36a2bd716bcf"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+void test_odb_exists__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_odb_exists__cleanup(void)
+{
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL, 0));
+
+	git_odb_free(_odb);
+	_odb = NULL;
+	cl_git_sandbox_cleanup();
+}
+
+typedef struct {
+	git_odb_backend base;
+	int exists_calls;
+} counting_backend;
+
+static int counting_exists(git_odb_backend *backend, const git_oid *oid)
+{
+	GIT_UNUSED(oid);
+	((counting_backend *)backend)->exists_calls++;
+	return 0;
+}
+
+void test_odb_exists__negative_lookups_are_cached(void)
+{
+	counting_backend *backend;
+	git_oid id;
+	int ttl;
+
+	backend = git__calloc(1, sizeof(counting_backend));
+	cl_assert(backend);
+	backend->base.exists = counting_exists;
+	cl_git_pass(git_odb_add_backend(_odb, (git_odb_backend *)backend, 10));
+
+	cl_git_pass(git_oid_fromstr(&id, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+
+	/* disabled by default */
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_ODB_NEGATIVE_CACHE_TTL, &ttl));
+	cl_assert_equal_i(0, ttl);
+
+	cl_assert(!git_odb_exists(_odb, &id));
+	cl_assert(!git_odb_exists(_odb, &id));
+	cl_assert_equal_i(2, backend->exists_calls);
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL, 60));
+
+	cl_assert(!git_odb_exists(_odb, &id));
+	cl_assert(!git_odb_exists(_odb, &id));
+	cl_assert(!git_odb_exists(_odb, &id));
+	cl_assert_equal_i(3, backend->exists_calls);
+}
+
+void test_odb_exists__writing_forgets_negative_lookups(void)
+{
+	const char *content = "not in the repository yet\n";
+	git_oid id, written;
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_ODB_NEGATIVE_CACHE_TTL, 60));
+
+	cl_git_pass(git_odb_hash(&id, content, strlen(content), GIT_OBJ_BLOB));
+	cl_assert(!git_odb_exists(_odb, &id));
+
+	cl_git_pass(git_odb_write(&written, _odb, content, strlen(content), GIT_OBJ_BLOB));
+	cl_assert(git_oid_cmp(&id, &written) == 0);
+	cl_assert(git_odb_exists(_odb, &id));
+}
+
+void test_odb_exists__finds_packs_added_later(void)
+{
+	git_oid id;
+
+	cl_git_pass(git_oid_fromstr(&id, PACKED_ONLY));
+
+	git_odb_free(_odb);
+	cl_git_pass(p_rename("testrepo.git/objects/pack/" PACK_NAME ".pack", PACK_NAME ".pack"));
+	cl_git_pass(p_rename("testrepo.git/objects/pack/" PACK_NAME ".idx", PACK_NAME ".idx"));
+	cl_git_pass(git_odb_open(&_odb, "testrepo.git/objects"));
+
+	cl_assert(!git_odb_exists(_odb, &id));
+	/* the folder hasn't changed, nothing to see */
+	cl_assert(!git_odb_exists(_odb, &id));
+
+	cl_git_pass(p_rename(PACK_NAME ".pack", "testrepo.git/objects/pack/" PACK_NAME ".pack"));
+	cl_git_pass(p_rename(PACK_NAME ".idx", "testrepo.git/objects/pack/" PACK_NAME ".idx"));
+
+	cl_assert(git_odb_exists(_odb, &id));
+}
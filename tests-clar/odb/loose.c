@@ -82,3 +82,58 @@ void test_odb_loose__simple_reads(void)
 	test_read_object(&two);
 	test_read_object(&some);
 }
+
+static int count_cb(git_oid *oid, void *payload)
+{
+	GIT_UNUSED(oid);
+	(*(int *)payload)++;
+	return 0;
+}
+
+void test_odb_loose__prefix_lookups_see_new_objects(void)
+{
+	git_oid id, short_id;
+	git_odb_object *obj;
+	git_odb *odb;
+	int count = 0;
+
+	write_object_files(&one);
+	cl_git_pass(git_odb_open(&odb, "test-objects"));
+
+	cl_git_pass(git_oid_fromstrn(&short_id, one.id, 8));
+	cl_git_pass(git_odb_read_prefix(&obj, odb, &short_id, 8));
+	cl_git_pass(git_oid_fromstr(&id, one.id));
+	cl_assert(git_oid_cmp(&id, git_odb_object_id(obj)) == 0);
+	git_odb_object_free(obj);
+
+	/* in a folder we've listed before, and one we haven't */
+	cl_git_pass(git_oid_fromstrn(&short_id, "8b137891791fe96927ad78e64b0aad7bded08baa", 39));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_odb_read_prefix(&obj, odb, &short_id, 39));
+	cl_git_pass(git_oid_fromstrn(&short_id, commit.id, 8));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_odb_read_prefix(&obj, odb, &short_id, 8));
+
+	write_object_files(&commit);
+	write_object_files(&tree);
+
+	cl_git_pass(git_odb_read_prefix(&obj, odb, &short_id, 8));
+	cl_git_pass(git_oid_fromstr(&id, commit.id));
+	cl_assert(git_oid_cmp(&id, git_odb_object_id(obj)) == 0);
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_odb_foreach(odb, count_cb, &count));
+	cl_assert_equal_i(3, count);
+
+	/* two objects sharing a prefix */
+	cl_git_rewritefile("test-objects/8b/137891791fe96927ad78e64b0aad7bded08baa", "");
+	cl_git_pass(git_oid_fromstrn(&short_id, one.id, 8));
+	cl_assert_equal_i(GIT_EAMBIGUOUS, git_odb_read_prefix(&obj, odb, &short_id, 8));
+	cl_git_pass(git_oid_fromstrn(&short_id, one.id, 39));
+	cl_git_pass(git_odb_read_prefix(&obj, odb, &short_id, 39));
+	git_odb_object_free(obj);
+
+	count = 0;
+	cl_git_pass(git_odb_foreach(odb, count_cb, &count));
+	cl_assert_equal_i(4, count);
+
+	git_odb_free(odb);
+}
@@ -56,3 +56,41 @@ void test_odb_packed_one__read_header_0(void)
 		git_odb_object_free(obj);
 	}
 }
+
+static int header_cb(git_oid *oid, void *payload)
+{
+	git_odb_object *obj;
+	size_t len;
+	git_otype type;
+
+	GIT_UNUSED(payload);
+
+	/* headers first, so they don't come out of the object cache */
+	cl_git_pass(git_odb_read_header(&len, &type, _odb, oid));
+	cl_git_pass(git_odb_read(&obj, _odb, oid));
+
+	cl_assert(obj->raw.len == len);
+	cl_assert(obj->raw.type == type);
+
+	git_odb_object_free(obj);
+	return 0;
+}
+
+void test_odb_packed_one__read_header_of_deltas(void)
+{
+	git_cache_stats stats;
+	git_oid id;
+	size_t len;
+	git_otype type;
+
+	cl_git_pass(git_odb_foreach(_odb, header_cb, NULL));
+
+	/* header reads don't go through (or fill) the object cache */
+	git_odb_free(_odb);
+	test_odb_packed_one__initialize();
+
+	cl_git_pass(git_oid_fromstr(&id, packed_objects_one[0]));
+	cl_git_pass(git_odb_read_header(&len, &type, _odb, &id));
+	git_odb_cache_stats(&stats, _odb);
+	cl_assert_equal_i(0, stats.objects);
+}
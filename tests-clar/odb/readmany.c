@@ -0,0 +1,114 @@
+#include "clar_libgit2.h"
+#include "odb.h"
+#include "pack_data.h"
+
+static git_odb *_odb;
+
+void test_odb_readmany__initialize(void)
+{
+	cl_git_pass(git_odb_open(&_odb, cl_fixture("testrepo.git/objects")));
+}
+
+void test_odb_readmany__cleanup(void)
+{
+	git_odb_free(_odb);
+	_odb = NULL;
+}
+
+struct read_data {
+	git_oid *ids;
+	int *seen;
+	size_t count;
+	int delivered;
+	int stop_after;
+};
+
+static int read_cb(git_odb_object *object, void *payload)
+{
+	struct read_data *data = payload;
+	git_rawobj raw;
+	git_oid hashed;
+	size_t i;
+
+	raw.data = (void *)git_odb_object_data(object);
+	raw.len = git_odb_object_size(object);
+	raw.type = git_odb_object_type(object);
+
+	cl_git_pass(git_odb__hashobj(&hashed, &raw));
+	cl_assert(git_oid_cmp(&hashed, git_odb_object_id(object)) == 0);
+
+	for (i = 0; i < data->count; ++i) {
+		if (git_oid_cmp(&data->ids[i], &hashed) == 0)
+			data->seen[i]++;
+	}
+
+	git_odb_object_free(object);
+
+	return (++data->delivered == data->stop_after);
+}
+
+static size_t load_ids(git_oid **out)
+{
+	size_t packed = ARRAY_SIZE(packed_objects), loose = ARRAY_SIZE(loose_objects);
+	size_t i, count = packed + loose + 1;
+	git_oid *ids;
+
+	ids = git__calloc(count, sizeof(git_oid));
+	cl_assert(ids);
+
+	for (i = 0; i < packed; ++i)
+		cl_git_pass(git_oid_fromstr(&ids[i], packed_objects[i]));
+	for (i = 0; i < loose; ++i)
+		cl_git_pass(git_oid_fromstr(&ids[packed + i], loose_objects[i]));
+
+	/* ask for one of them twice */
+	git_oid_cpy(&ids[count - 1], &ids[0]);
+
+	*out = ids;
+	return count;
+}
+
+void test_odb_readmany__reads_packed_and_loose_objects(void)
+{
+	struct read_data data = {0};
+	size_t i;
+
+	data.count = load_ids(&data.ids);
+	data.seen = git__calloc(data.count, sizeof(int));
+
+	cl_git_pass(git_odb_read_many(_odb, data.ids, data.count, read_cb, &data));
+
+	/* the duplicate is only delivered once */
+	cl_assert_equal_i(data.count - 1, data.delivered);
+	for (i = 0; i < data.count; ++i)
+		cl_assert_equal_i(1, data.seen[i]);
+
+	git__free(data.ids);
+	git__free(data.seen);
+}
+
+void test_odb_readmany__missing_object(void)
+{
+	struct read_data data = {0};
+	git_oid ids[2];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], packed_objects[0]));
+	cl_git_pass(git_oid_fromstr(&ids[1], "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+
+	cl_assert_equal_i(GIT_ENOTFOUND, git_odb_read_many(_odb, ids, 2, read_cb, &data));
+	cl_assert_equal_i(1, data.delivered);
+}
+
+void test_odb_readmany__callback_can_stop_the_read(void)
+{
+	struct read_data data = {0};
+	size_t count;
+
+	count = load_ids(&data.ids);
+	data.stop_after = 3;
+
+	cl_assert_equal_i(GIT_EUSER, git_odb_read_many(_odb, data.ids, count, read_cb, &data));
+	cl_assert_equal_i(3, data.delivered);
+
+	git__free(data.ids);
+}
@@ -0,0 +1,89 @@
+#include "clar_libgit2.h"
+#include "odb.h"
+#include "git2/odb_backend.h"
+#include "buffer.h"
+
+static git_odb *_odb;
+
+void test_odb_stream__initialize(void)
+{
+	git_odb_backend *backend;
+
+	/* this pack has long delta chains */
+	cl_git_pass(git_odb_new(&_odb));
+	cl_git_pass(git_odb_backend_one_pack(&backend, cl_fixture("testrepo.git/objects/pack/pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695.idx")));
+	cl_git_pass(git_odb_add_backend(_odb, backend, 1));
+}
+
+void test_odb_stream__cleanup(void)
+{
+	git_odb_free(_odb);
+	_odb = NULL;
+}
+
+static void stream_object(git_buf *out, const git_oid *oid, size_t chunk_size)
+{
+	git_odb_stream *stream;
+	char buffer[1024];
+	int read;
+
+	cl_assert(chunk_size <= sizeof(buffer));
+
+	cl_git_pass(git_odb_open_rstream(&stream, _odb, oid));
+	cl_assert_equal_i(GIT_STREAM_RDONLY, stream->mode);
+
+	while ((read = stream->read(stream, buffer, chunk_size)) > 0)
+		cl_git_pass(git_buf_put(out, buffer, read));
+
+	cl_assert_equal_i(0, read);
+	stream->free(stream);
+}
+
+struct compare_data {
+	size_t chunk_size;
+	int count;
+};
+
+static int compare_cb(git_oid *oid, void *payload)
+{
+	struct compare_data *data = payload;
+	git_buf streamed = GIT_BUF_INIT;
+	git_odb_object *obj;
+
+	cl_git_pass(git_odb_read(&obj, _odb, oid));
+	stream_object(&streamed, oid, data->chunk_size);
+
+	cl_assert_equal_i(git_odb_object_size(obj), streamed.size);
+	cl_assert(memcmp(git_odb_object_data(obj), streamed.ptr, streamed.size) == 0);
+
+	git_odb_object_free(obj);
+	git_buf_free(&streamed);
+
+	data->count++;
+	return 0;
+}
+
+void test_odb_stream__matches_read_in_small_chunks(void)
+{
+	struct compare_data data = { 7, 0 };
+
+	cl_git_pass(git_odb_foreach(_odb, compare_cb, &data));
+	cl_assert_equal_i(1628, data.count);
+}
+
+void test_odb_stream__matches_read_in_large_chunks(void)
+{
+	struct compare_data data = { 1024, 0 };
+
+	cl_git_pass(git_odb_foreach(_odb, compare_cb, &data));
+	cl_assert_equal_i(1628, data.count);
+}
+
+void test_odb_stream__missing_object(void)
+{
+	git_odb_stream *stream;
+	git_oid oid;
+
+	cl_git_pass(git_oid_fromstr(&oid, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_odb_open_rstream(&stream, _odb, &oid));
+}
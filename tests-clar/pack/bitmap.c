@@ -0,0 +1,217 @@
+#include "clar_libgit2.h"
+#include "ewah.h"
+#include "pack.h"
+#include "pack-bitmap.h"
+#include "pack-objects.h"
+#include "buffer.h"
+
+static git_repository *_repo;
+static git_buf _idx_path;
+static git_oid *_tips;
+static size_t _tips_len;
+
+void test_pack_bitmap__initialize(void)
+{
+	git_strarray refs;
+	size_t i;
+
+	_repo = cl_git_sandbox_init("testrepo.git");
+
+	cl_git_pass(git_reference_list(&refs, _repo, GIT_REF_LISTALL));
+
+	_tips = git__calloc(refs.count, sizeof(git_oid));
+	cl_assert(_tips != NULL);
+
+	for (i = 0; i < refs.count; ++i)
+		cl_git_pass(git_reference_name_to_oid(&_tips[i], _repo, refs.strings[i]));
+	_tips_len = refs.count;
+
+	git_strarray_free(&refs);
+}
+
+void test_pack_bitmap__cleanup(void)
+{
+	git__free(_tips);
+	_tips = NULL;
+
+	git_buf_free(&_idx_path);
+	cl_git_sandbox_cleanup();
+}
+
+static git_transfer_progress _stats;
+
+static int index_cb(void *buf, size_t len, void *payload)
+{
+	return git_indexer_stream_add((git_indexer_stream *)payload, buf, len, &_stats);
+}
+
+/* Repack everything the refs reach into one pack, and index it */
+static void write_full_pack(void)
+{
+	git_packbuilder *pb;
+	git_indexer_stream *idx;
+	git_buf pack_dir = GIT_BUF_INIT;
+	char hash[GIT_OID_HEXSZ + 1] = {0};
+
+	cl_git_pass(git_buf_joinpath(&pack_dir, git_repository_path(_repo), "objects/pack"));
+
+	cl_git_pass(git_packbuilder_new(&pb, _repo));
+	cl_git_pass(git_packbuilder_insert_reachable(pb, _tips, _tips_len, NULL, 0));
+
+	cl_git_pass(git_indexer_stream_new(&idx, git_buf_cstr(&pack_dir), NULL, NULL));
+	cl_git_pass(git_packbuilder_foreach(pb, index_cb, idx));
+	cl_git_pass(git_indexer_stream_finalize(idx, &_stats));
+
+	git_oid_fmt(hash, git_indexer_stream_hash(idx));
+	cl_git_pass(git_buf_printf(&_idx_path, "%s/pack-%s.idx", git_buf_cstr(&pack_dir), hash));
+
+	git_indexer_stream_free(idx);
+	git_packbuilder_free(pb);
+	git_buf_free(&pack_dir);
+}
+
+/* The objects a packbuilder was given, sorted */
+static size_t inserted_objects(git_oid **out, git_packbuilder *pb)
+{
+	uint32_t i;
+
+	*out = git__calloc(pb->nr_objects + 1, sizeof(git_oid));
+	cl_assert(*out != NULL);
+
+	for (i = 0; i < pb->nr_objects; ++i)
+		git_oid_cpy(&(*out)[i], &pb->object_list[i].id);
+
+	qsort(*out, pb->nr_objects, sizeof(git_oid), (int (*)(const void *, const void *))git_oid_cmp);
+	return pb->nr_objects;
+}
+
+static size_t count_reachable(
+	git_oid **out,
+	const git_oid *wants, size_t wants_len,
+	const git_oid *haves, size_t haves_len)
+{
+	git_packbuilder *pb;
+	size_t count;
+
+	cl_git_pass(git_packbuilder_new(&pb, _repo));
+	cl_git_pass(git_packbuilder_insert_reachable(pb, wants, wants_len, haves, haves_len));
+	count = inserted_objects(out, pb);
+	git_packbuilder_free(pb);
+
+	return count;
+}
+
+void test_pack_bitmap__ewah_roundtrip(void)
+{
+	git_bitmap bits = GIT_BITMAP_INIT, read_back = GIT_BITMAP_INIT;
+	git_ewah *ewah, *parsed;
+	git_buf buf = GIT_BUF_INIT;
+	size_t i, read, count = 0;
+
+	/* sparse bits, a run of ones, and a long gap of zeroes */
+	for (i = 0; i < 300; i += 7, count++)
+		cl_git_pass(git_bitmap_set(&bits, i));
+	for (i = 320; i < 1000; ++i, count++)
+		cl_git_pass(git_bitmap_set(&bits, i));
+	cl_git_pass(git_bitmap_set(&bits, 100000));
+	count++;
+
+	cl_assert_equal_i(count, git_bitmap_popcount(&bits));
+	cl_assert(git_bitmap_get(&bits, 7));
+	cl_assert(!git_bitmap_get(&bits, 8));
+	cl_assert(!git_bitmap_get(&bits, 200000));
+
+	cl_assert((ewah = git_ewah_from_bitmap(&bits)) != NULL);
+	cl_assert(ewah->buffer_size < 32);
+
+	cl_git_pass(git_ewah_serialize(&buf, ewah));
+	cl_git_pass(git_ewah_read(&parsed, &read, (unsigned char *)buf.ptr, buf.size, 100032));
+	cl_assert_equal_i(buf.size, read);
+
+	cl_git_pass(git_bitmap_or_ewah(&read_back, parsed));
+	cl_assert_equal_i(count, git_bitmap_popcount(&read_back));
+	for (i = 0; i < 100064; ++i)
+		cl_assert_equal_i(git_bitmap_get(&bits, i), git_bitmap_get(&read_back, i));
+
+	/* XORing the same bitmap again clears everything */
+	cl_git_pass(git_bitmap_xor_ewah(&read_back, ewah));
+	cl_assert_equal_i(0, git_bitmap_popcount(&read_back));
+
+	/* bitmaps larger than the pack they're for are rejected */
+	cl_git_fail(git_ewah_read(&parsed, &read, (unsigned char *)buf.ptr, buf.size, 1024));
+	cl_git_fail(git_ewah_read(&parsed, &read, (unsigned char *)buf.ptr, buf.size - 1, 100032));
+
+	git_ewah_free(ewah);
+	git_ewah_free(parsed);
+	git_bitmap_free(&bits);
+	git_bitmap_free(&read_back);
+	git_buf_free(&buf);
+}
+
+void test_pack_bitmap__counts_like_a_walk(void)
+{
+	git_pack_bitmap *bitmap;
+	git_bitmap reach = GIT_BITMAP_INIT;
+	git_oid *walked, *counted;
+	size_t walked_len, counted_len;
+
+	write_full_pack();
+
+	/* no bitmap yet, so this is a plain walk */
+	walked_len = count_reachable(&walked, _tips, _tips_len, NULL, 0);
+
+	cl_git_pass(git_pack_write_bitmap(_repo, git_buf_cstr(&_idx_path)));
+
+	cl_git_pass(git_pack_bitmap_find(&bitmap, _repo));
+	cl_assert(bitmap->entries_nr > 0);
+	cl_git_pass(git_pack_bitmap_reachable(&reach, bitmap, _repo, _tips, _tips_len, NULL));
+	cl_assert_equal_i(walked_len, git_bitmap_popcount(&reach));
+	git_bitmap_free(&reach);
+	git_pack_bitmap_free(bitmap);
+
+	counted_len = count_reachable(&counted, _tips, _tips_len, NULL, 0);
+
+	cl_assert_equal_i(walked_len, counted_len);
+	cl_assert(memcmp(walked, counted, walked_len * sizeof(git_oid)) == 0);
+
+	git__free(walked);
+	git__free(counted);
+}
+
+void test_pack_bitmap__excludes_haves(void)
+{
+	git_oid *walked, *counted;
+	size_t walked_len, counted_len;
+	git_oid want, have;
+	git_buf bitmap_path = GIT_BUF_INIT;
+
+	/* master, minus what its grandparent's history already has */
+	cl_git_pass(git_reference_name_to_oid(&want, _repo, "refs/heads/master"));
+	cl_git_pass(git_oid_fromstr(&have, "9fd738e8f7967c078dceed8190330fc8648ee56a"));
+
+	write_full_pack();
+	walked_len = count_reachable(&walked, &want, 1, &have, 1);
+
+	cl_git_pass(git_pack_write_bitmap(_repo, git_buf_cstr(&_idx_path)));
+	counted_len = count_reachable(&counted, &want, 1, &have, 1);
+
+	cl_assert(walked_len > 0);
+	cl_assert_equal_i(walked_len, counted_len);
+	cl_assert(memcmp(walked, counted, walked_len * sizeof(git_oid)) == 0);
+
+	/* a broken bitmap is ignored, and we walk instead */
+	git__free(counted);
+	cl_git_pass(git_buf_sets(&bitmap_path, git_buf_cstr(&_idx_path)));
+	git_buf_truncate(&bitmap_path, bitmap_path.size - strlen(".idx"));
+	cl_git_pass(git_buf_puts(&bitmap_path, ".bitmap"));
+	cl_git_pass(p_chmod(git_buf_cstr(&bitmap_path), 0644));
+	cl_git_rewritefile(git_buf_cstr(&bitmap_path), "BITM");
+
+	counted_len = count_reachable(&counted, &want, 1, &have, 1);
+	cl_assert_equal_i(walked_len, counted_len);
+	cl_assert(memcmp(walked, counted, walked_len * sizeof(git_oid)) == 0);
+
+	git_buf_free(&bitmap_path);
+	git__free(walked);
+	git__free(counted);
+}
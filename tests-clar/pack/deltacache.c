@@ -0,0 +1,80 @@
+#include "clar_libgit2.h"
+#include "pack.h"
+
+static struct git_pack_file *_pack;
+static git_vector _oids;
+
+#define PACK_IDX "testrepo.git/objects/pack/pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695.idx"
+
+static int collect_oid(git_oid *oid, void *data)
+{
+	GIT_UNUSED(data);
+	return git_vector_insert(&_oids, oid);
+}
+
+void test_pack_deltacache__initialize(void)
+{
+	cl_git_pass(git_packfile_check(&_pack, cl_fixture(PACK_IDX)));
+	cl_git_pass(git_vector_init(&_oids, 0, NULL));
+	cl_git_pass(git_pack_foreach_entry(_pack, collect_oid, NULL));
+}
+
+void test_pack_deltacache__cleanup(void)
+{
+	git_vector_free(&_oids);
+	packfile_free(_pack);
+	_pack = NULL;
+}
+
+static void read_all_objects(void)
+{
+	unsigned int i;
+	git_oid *oid;
+
+	git_vector_foreach(&_oids, i, oid) {
+		struct git_pack_entry e;
+		git_rawobj raw;
+		git_oid hashed;
+
+		cl_git_pass(git_pack_entry_find(&e, _pack, oid, GIT_OID_HEXSZ));
+		cl_git_pass(git_packfile_unpack(&raw, _pack, &e.offset));
+		cl_git_pass(git_odb__hashobj(&hashed, &raw));
+		cl_assert(git_oid_cmp(oid, &hashed) == 0);
+
+		git__free(raw.data);
+	}
+}
+
+void test_pack_deltacache__bases_are_reused(void)
+{
+	size_t misses;
+
+	read_all_objects();
+	cl_assert(_pack->bases.misses > 0);
+	cl_assert(_pack->bases.memory_used <= _pack->bases.memory_limit);
+
+	misses = _pack->bases.misses;
+	read_all_objects();
+	cl_assert(_pack->bases.hits > 0);
+	cl_assert_equal_i(misses, _pack->bases.misses);
+}
+
+void test_pack_deltacache__respects_memory_limit(void)
+{
+	_pack->bases.memory_limit = 512;
+
+	read_all_objects();
+	cl_assert(_pack->bases.memory_used <= 512);
+
+	read_all_objects();
+	cl_assert(_pack->bases.memory_used <= 512);
+}
+
+void test_pack_deltacache__resolves_chains_without_cache(void)
+{
+	_pack->bases.memory_limit = 0;
+
+	read_all_objects();
+	cl_assert_equal_i(0, _pack->bases.memory_used);
+	cl_assert_equal_i(0, _pack->bases.hits);
+}
@@ -0,0 +1,373 @@
+#include "clar_libgit2.h"
+#include "git2/indexer.h"
+#include "buffer.h"
+#include "fileops.h"
+#include "pack.h"
+#include "hash.h"
+#include "compress.h"
+
+#define PACK_NAME "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695"
+#define PACK_PATH "testrepo.git/objects/pack/" PACK_NAME
+
+static unsigned int progress_calls;
+
+static void count_progress(const git_transfer_progress *stats, void *payload)
+{
+	GIT_UNUSED(stats);
+	GIT_UNUSED(payload);
+	progress_calls++;
+}
+
+void test_pack_indexer__cleanup(void)
+{
+	cl_fixture_cleanup("indexed");
+	cl_git_sandbox_cleanup();
+}
+
+static void stream_pack(
+	git_indexer_stream *idx, git_transfer_progress *stats,
+	const char *path, size_t chunk)
+{
+	git_buf pack = GIT_BUF_INIT;
+	size_t off;
+
+	cl_git_pass(git_futils_readbuffer(&pack, cl_fixture(path)));
+
+	for (off = 0; off < pack.size; off += chunk) {
+		size_t len = min(chunk, pack.size - off);
+		cl_git_pass(git_indexer_stream_add(idx, pack.ptr + off, len, stats));
+	}
+
+	git_buf_free(&pack);
+}
+
+/*
+ * Feed the pack to the indexer a few bytes at a time, and check that
+ * the index it writes is the one git wrote.
+ */
+static void index_in_chunks(unsigned int threads, size_t chunk)
+{
+	git_indexer_stream *idx;
+	git_transfer_progress stats;
+	git_buf expected = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+	char hash[GIT_OID_HEXSZ + 1];
+
+	memset(&stats, 0, sizeof(stats));
+	progress_calls = 0;
+
+	cl_git_pass(git_futils_readbuffer(&expected, cl_fixture(PACK_PATH ".idx")));
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&idx, "indexed", count_progress, NULL));
+	git_indexer_stream_set_threads(idx, threads);
+
+	stream_pack(idx, &stats, PACK_PATH ".pack", chunk);
+	cl_git_pass(git_indexer_stream_finalize(idx, &stats));
+	cl_assert_equal_i(stats.total_objects, stats.indexed_objects);
+	cl_assert(progress_calls > 0);
+
+	git_oid_fmt(hash, git_indexer_stream_hash(idx));
+	hash[GIT_OID_HEXSZ] = '\0';
+	cl_assert_equal_s(PACK_NAME + strlen("pack-"), hash);
+
+	cl_git_pass(git_futils_readbuffer(&actual, "indexed/" PACK_NAME ".idx"));
+	cl_assert_equal_i(expected.size, actual.size);
+	cl_assert(memcmp(expected.ptr, actual.ptr, expected.size) == 0);
+
+	git_indexer_stream_free(idx);
+	git_buf_free(&expected);
+	git_buf_free(&actual);
+}
+
+void test_pack_indexer__resolves_delta_chains(void)
+{
+	index_in_chunks(1, 4096);
+}
+
+void test_pack_indexer__parses_entries_split_anywhere(void)
+{
+	index_in_chunks(1, 7);
+}
+
+void test_pack_indexer__resolves_deltas_in_threads(void)
+{
+	index_in_chunks(4, 4096);
+	cl_fixture_cleanup("indexed");
+	index_in_chunks(0, 65536);
+}
+
+/*
+ * thin.pack holds a commit, its tree and a blob; the blob is a delta
+ * against c36f4cf, which is only in testrepo.git.
+ */
+#define THIN_BLOB "9f4ad839fdb26715252634eccb5abc7c5c9f6978"
+#define THIN_BASE "c36f4cf1e38ec1bb9d9ad146ed572b89ecfc9f18"
+
+void test_pack_indexer__checks_the_pack_checksum(void)
+{
+	git_indexer_stream *idx;
+	git_transfer_progress stats;
+	git_buf pack = GIT_BUF_INIT;
+
+	memset(&stats, 0, sizeof(stats));
+
+	cl_git_pass(git_futils_readbuffer(&pack, cl_fixture("thin.pack")));
+	pack.ptr[pack.size - 1] ^= 0xff;
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&idx, "indexed", NULL, NULL));
+	cl_git_pass(git_indexer_stream_add(idx, pack.ptr, pack.size, &stats));
+	cl_git_fail(git_indexer_stream_finalize(idx, &stats));
+	cl_assert(strstr(giterr_last()->message, "checksum") != NULL);
+
+	git_indexer_stream_free(idx);
+	git_buf_free(&pack);
+}
+
+/* The object count comes from the other end: nothing is set aside for it */
+void test_pack_indexer__doesnt_trust_the_object_count(void)
+{
+	git_indexer_stream *idx;
+	git_transfer_progress stats;
+	struct git_pack_header hdr;
+
+	memset(&stats, 0, sizeof(stats));
+
+	hdr.hdr_signature = htonl(PACK_SIGNATURE);
+	hdr.hdr_version = htonl(2);
+	hdr.hdr_entries = htonl(0xfffffff0);
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&idx, "indexed", NULL, NULL));
+	cl_git_pass(git_indexer_stream_add(idx, &hdr, sizeof(hdr), &stats));
+	cl_assert_equal_i(0xfffffff0, stats.total_objects);
+	cl_git_fail(git_indexer_stream_finalize(idx, &stats));
+	cl_assert(strstr(giterr_last()->message, "early EOF") != NULL);
+
+	git_indexer_stream_free(idx);
+}
+
+void test_pack_indexer__thin_packs_need_an_odb(void)
+{
+	git_indexer_stream *idx;
+	git_transfer_progress stats;
+
+	memset(&stats, 0, sizeof(stats));
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&idx, "indexed", NULL, NULL));
+	stream_pack(idx, &stats, "thin.pack", 64);
+	cl_git_fail(git_indexer_stream_finalize(idx, &stats));
+
+	git_indexer_stream_free(idx);
+}
+
+/*
+ * A pack with one blob and a chain of CHAIN_DEPTH deltas on top of it,
+ * each changing the last few bytes of the one before. Every 1000 levels
+ * a REF delta is also made against the object there, so its base is
+ * needed again once everything above it is done.
+ */
+#define CHAIN_DEPTH 30000
+#define CHAIN_SIZE 1024
+#define CHAIN_LEAVES (CHAIN_DEPTH / 1000)
+
+static void chain_object(char *out, const char *tail)
+{
+	memset(out, 'x', CHAIN_SIZE - 8);
+	memcpy(out + CHAIN_SIZE - 8, tail, 8);
+}
+
+static void put_object_header(git_buf *pack, git_otype type, size_t size)
+{
+	unsigned char c = (unsigned char)((type << 4) | (size & 15));
+
+	for (size >>= 4; size; size >>= 7) {
+		cl_git_pass(git_buf_putc(pack, (char)(c | 0x80)));
+		c = size & 0x7f;
+	}
+	cl_git_pass(git_buf_putc(pack, (char)c));
+}
+
+/*
+ * Copy all but the last 8 bytes of the base, and add `tail`; the base
+ * is `base_ofs` bytes back for an OFS delta, or named by `base_oid`.
+ */
+static void put_delta(
+	git_buf *pack, size_t base_ofs, const git_oid *base_oid, const char *tail)
+{
+	unsigned char delta[] = {
+		0x80, 0x08, 0x80, 0x08, /* base and result sizes */
+		0x80 | 0x10 | 0x20, (CHAIN_SIZE - 8) & 0xff, (CHAIN_SIZE - 8) >> 8,
+		8, 0, 0, 0, 0, 0, 0, 0, 0
+	};
+	unsigned char ofs[16];
+	size_t pos = sizeof(ofs) - 1;
+
+	memcpy(delta + 8, tail, 8);
+
+	if (base_oid) {
+		put_object_header(pack, GIT_OBJ_REF_DELTA, sizeof(delta));
+		cl_git_pass(git_buf_put(pack, (char *)base_oid->id, GIT_OID_RAWSZ));
+	} else {
+		ofs[pos] = base_ofs & 127;
+		while (base_ofs >>= 7)
+			ofs[--pos] = 128 | (--base_ofs & 127);
+
+		put_object_header(pack, GIT_OBJ_OFS_DELTA, sizeof(delta));
+		cl_git_pass(git_buf_put(pack, (char *)ofs + pos, sizeof(ofs) - pos));
+	}
+
+	cl_git_pass(git__compress(pack, delta, sizeof(delta)));
+}
+
+static void build_deep_chain(git_buf *pack, git_oid *top, git_oid *leaves)
+{
+	struct git_pack_header hdr;
+	git_hash_ctx *ctx;
+	git_oid *chain, trailer;
+	char object[CHAIN_SIZE], tail[9];
+	size_t start, prev = 0;
+	int i;
+
+	chain = git__malloc((CHAIN_DEPTH + 1) * sizeof(git_oid));
+	cl_assert(chain);
+
+	hdr.hdr_signature = htonl(PACK_SIGNATURE);
+	hdr.hdr_version = htonl(2);
+	hdr.hdr_entries = htonl(1 + CHAIN_DEPTH + CHAIN_LEAVES);
+	cl_git_pass(git_buf_put(pack, (char *)&hdr, sizeof(hdr)));
+
+	for (i = 0; i <= CHAIN_DEPTH; ++i) {
+		p_snprintf(tail, sizeof(tail), "%08d", i);
+		chain_object(object, tail);
+		cl_git_pass(git_odb_hash(&chain[i], object, CHAIN_SIZE, GIT_OBJ_BLOB));
+
+		start = pack->size;
+		if (i == 0) {
+			put_object_header(pack, GIT_OBJ_BLOB, CHAIN_SIZE);
+			cl_git_pass(git__compress(pack, object, CHAIN_SIZE));
+		} else {
+			put_delta(pack, start - prev, NULL, tail);
+		}
+		prev = start;
+	}
+
+	for (i = 0; i < CHAIN_LEAVES; ++i) {
+		int level = i * 1000 + 500;
+
+		p_snprintf(tail, sizeof(tail), "leaf%04d", i);
+		chain_object(object, tail);
+		cl_git_pass(git_odb_hash(&leaves[i], object, CHAIN_SIZE, GIT_OBJ_BLOB));
+
+		put_delta(pack, 0, &chain[level], tail);
+	}
+
+	cl_assert((ctx = git_hash_new_ctx()) != NULL);
+	git_hash_update(ctx, pack->ptr, pack->size);
+	git_hash_final(&trailer, ctx);
+	git_hash_free_ctx(ctx);
+	cl_git_pass(git_buf_put(pack, (char *)trailer.id, GIT_OID_RAWSZ));
+
+	git_oid_cpy(top, &chain[CHAIN_DEPTH]);
+	git__free(chain);
+}
+
+static void check_packed(struct git_pack_file *pack, const char *sha, size_t size)
+{
+	struct git_pack_entry e;
+	git_rawobj obj;
+	git_oid oid;
+	git_off_t off;
+
+	cl_git_pass(git_oid_fromstr(&oid, sha));
+	cl_git_pass(git_pack_entry_find(&e, pack, &oid, GIT_OID_HEXSZ));
+
+	off = e.offset;
+	cl_git_pass(git_packfile_unpack(&obj, pack, &off));
+	cl_assert_equal_i(GIT_OBJ_BLOB, obj.type);
+	cl_assert_equal_i(size, obj.len);
+	git__free(obj.data);
+}
+
+void test_pack_indexer__completes_thin_packs(void)
+{
+	git_repository *repo;
+	git_odb *odb;
+	git_indexer_stream *idx;
+	git_transfer_progress stats;
+	struct git_pack_file *pack;
+	git_buf path = GIT_BUF_INIT;
+	char hash[GIT_OID_HEXSZ + 1];
+
+	memset(&stats, 0, sizeof(stats));
+
+	repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_repository_odb(&odb, repo));
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&idx, "indexed", NULL, NULL));
+	git_indexer_stream_set_odb(idx, odb);
+	stream_pack(idx, &stats, "thin.pack", 64);
+	cl_git_pass(git_indexer_stream_finalize(idx, &stats));
+
+	/* the base was added to the pack */
+	cl_assert_equal_i(4, stats.total_objects);
+	cl_assert_equal_i(4, stats.indexed_objects);
+
+	git_oid_fmt(hash, git_indexer_stream_hash(idx));
+	hash[GIT_OID_HEXSZ] = '\0';
+	cl_git_pass(git_buf_printf(&path, "indexed/pack-%s.idx", hash));
+	git_indexer_stream_free(idx);
+
+	/* and the pack reads on its own */
+	cl_git_pass(git_packfile_check(&pack, git_buf_cstr(&path)));
+	check_packed(pack, THIN_BASE, 18760);
+	check_packed(pack, THIN_BLOB, 18783);
+
+	packfile_free(pack);
+	git_buf_free(&path);
+	git_odb_free(odb);
+}
+
+void test_pack_indexer__resolves_deep_delta_chains(void)
+{
+	git_indexer_stream *idx;
+	git_transfer_progress stats;
+	struct git_pack_file *pack;
+	struct git_pack_entry e;
+	git_buf data = GIT_BUF_INIT, path = GIT_BUF_INIT;
+	git_oid top, leaves[CHAIN_LEAVES];
+	char hash[GIT_OID_HEXSZ + 1];
+	size_t off;
+	int i;
+
+	memset(&stats, 0, sizeof(stats));
+	build_deep_chain(&data, &top, leaves);
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&idx, "indexed", NULL, NULL));
+
+	for (off = 0; off < data.size; off += 65536)
+		cl_git_pass(git_indexer_stream_add(idx, data.ptr + off, min(65536, data.size - off), &stats));
+
+	cl_git_pass(git_indexer_stream_finalize(idx, &stats));
+	cl_assert_equal_i(1 + CHAIN_DEPTH + CHAIN_LEAVES, stats.indexed_objects);
+
+	git_oid_fmt(hash, git_indexer_stream_hash(idx));
+	hash[GIT_OID_HEXSZ] = '\0';
+	cl_git_pass(git_buf_printf(&path, "indexed/pack-%s.idx", hash));
+	git_indexer_stream_free(idx);
+
+	/* the leaves were made from bases which had to be built again */
+	cl_git_pass(git_packfile_check(&pack, git_buf_cstr(&path)));
+	for (i = 0; i < CHAIN_LEAVES; ++i)
+		cl_git_pass(git_pack_entry_find(&e, pack, &leaves[i], GIT_OID_HEXSZ));
+
+	git_oid_fmt(hash, &top);
+	check_packed(pack, hash, CHAIN_SIZE);
+
+	packfile_free(pack);
+	git_buf_free(&path);
+	git_buf_free(&data);
+}
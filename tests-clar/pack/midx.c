@@ -0,0 +1,141 @@
+#include "clar_libgit2.h"
+#include "midx.h"
+#include "odb.h"
+#include "../odb/pack_data.h"
+
+static git_repository *_repo;
+static git_buf _pack_dir;
+
+void test_pack_midx__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_buf_joinpath(&_pack_dir, git_repository_path(_repo), "objects/pack"));
+}
+
+void test_pack_midx__cleanup(void)
+{
+	git_buf_free(&_pack_dir);
+	cl_git_sandbox_cleanup();
+}
+
+static void write_midx(void)
+{
+	git_midx_writer *w;
+
+	cl_git_pass(git_midx_writer_new(&w, git_buf_cstr(&_pack_dir)));
+	cl_git_pass(git_midx_writer_add_all(w));
+	cl_git_pass(git_midx_writer_commit(w));
+	git_midx_writer_free(w);
+}
+
+void test_pack_midx__write_and_parse(void)
+{
+	git_buf path = GIT_BUF_INIT;
+	git_midx_file *idx;
+	git_midx_entry e;
+	git_oid oid;
+	unsigned int i;
+
+	write_midx();
+
+	cl_git_pass(git_buf_joinpath(&path, git_buf_cstr(&_pack_dir), GIT_MIDX_FILE));
+	cl_git_pass(git_midx_open(&idx, git_buf_cstr(&path)));
+	cl_assert_equal_i(3, idx->packfile_names.length);
+	cl_assert(!git_midx_needs_refresh(idx));
+
+	for (i = 0; i < ARRAY_SIZE(packed_objects); ++i) {
+		cl_git_pass(git_oid_fromstr(&oid, packed_objects[i]));
+		cl_git_pass(git_midx_entry_find(&e, idx, &oid, GIT_OID_HEXSZ));
+		cl_assert(git_oid_cmp(&oid, &e.sha1) == 0);
+		cl_assert(e.pack_index < idx->packfile_names.length);
+	}
+
+	cl_git_pass(git_oid_fromstr(&oid, "0000000000000000000000000000000000000000"));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_midx_entry_find(&e, idx, &oid, GIT_OID_HEXSZ));
+
+	git_midx_free(idx);
+	git_buf_free(&path);
+}
+
+void test_pack_midx__adding_a_pack_twice_is_harmless(void)
+{
+	git_midx_writer *w;
+
+	cl_git_pass(git_midx_writer_new(&w, git_buf_cstr(&_pack_dir)));
+	cl_git_pass(git_midx_writer_add(w, "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695.idx"));
+	cl_git_pass(git_midx_writer_add(w, "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695.idx"));
+	cl_git_fail(git_midx_writer_add(w, "pack-0000000000000000000000000000000000000000.idx"));
+	cl_git_fail(git_midx_writer_add(w, "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695.pack"));
+	cl_git_pass(git_midx_writer_commit(w));
+	git_midx_writer_free(w);
+}
+
+void test_pack_midx__odb_reads_through_midx(void)
+{
+	git_odb *odb;
+	git_odb_object *obj;
+	git_oid oid, hashed;
+	git_rawobj raw;
+	unsigned int i;
+
+	write_midx();
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	for (i = 0; i < ARRAY_SIZE(packed_objects); ++i) {
+		cl_git_pass(git_oid_fromstr(&oid, packed_objects[i]));
+		cl_git_pass(git_odb_read(&obj, odb, &oid));
+
+		raw.data = (void *)git_odb_object_data(obj);
+		raw.len = git_odb_object_size(obj);
+		raw.type = git_odb_object_type(obj);
+		cl_git_pass(git_odb__hashobj(&hashed, &raw));
+		cl_assert(git_oid_cmp(&oid, &hashed) == 0);
+		git_odb_object_free(obj);
+
+		cl_git_pass(git_odb_read_prefix(&obj, odb, &oid, 10));
+		cl_assert(git_oid_cmp(&oid, git_odb_object_id(obj)) == 0);
+		git_odb_object_free(obj);
+	}
+
+	/* loose objects are still found next to the multi-pack index */
+	for (i = 0; i < ARRAY_SIZE(loose_objects); ++i) {
+		cl_git_pass(git_oid_fromstr(&oid, loose_objects[i]));
+		cl_assert(git_odb_exists(odb, &oid));
+	}
+
+	git_odb_free(odb);
+}
+
+static int count_cb(git_oid *oid, void *data)
+{
+	GIT_UNUSED(oid);
+	(*(int *)data)++;
+	return 0;
+}
+
+void test_pack_midx__foreach_lists_every_object_once(void)
+{
+	git_odb *odb;
+	int before = 0, after = 0;
+	git_midx_file *idx;
+	git_buf path = GIT_BUF_INIT;
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb_foreach(odb, count_cb, &before));
+	git_odb_free(odb);
+
+	write_midx();
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb_foreach(odb, count_cb, &after));
+	git_odb_free(odb);
+
+	/* objects stored in several packs are only listed once */
+	cl_git_pass(git_buf_joinpath(&path, git_buf_cstr(&_pack_dir), GIT_MIDX_FILE));
+	cl_git_pass(git_midx_open(&idx, git_buf_cstr(&path)));
+	cl_assert(after <= before);
+	cl_assert(after >= (int)idx->num_objects);
+	git_midx_free(idx);
+	git_buf_free(&path);
+}
@@ -0,0 +1,143 @@
+#include "clar_libgit2.h"
+#include "odb.h"
+#include "mwindow.h"
+#include "posix.h"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+static size_t _window_size, _mapped_limit, _file_limit;
+static int _whole_files;
+
+void test_pack_mwindow__initialize(void)
+{
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_MWINDOW_SIZE, &_window_size));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_MWINDOW_MAPPED_LIMIT, &_mapped_limit));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_MWINDOW_FILE_LIMIT, &_file_limit));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_MWINDOW_MAP_WHOLE_FILES, &_whole_files));
+
+	_repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_pack_mwindow__cleanup(void)
+{
+	git_odb_free(_odb);
+	_odb = NULL;
+	cl_git_sandbox_cleanup();
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, _window_size));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, _mapped_limit));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_FILE_LIMIT, _file_limit));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAP_WHOLE_FILES, _whole_files));
+}
+
+#define OBJECT_COUNT (1640 + 46)
+
+struct object_list {
+	git_oid ids[OBJECT_COUNT];
+	size_t count;
+};
+
+static int collect_object(git_oid *oid, void *payload)
+{
+	struct object_list *list = payload;
+
+	cl_assert(list->count < OBJECT_COUNT);
+	git_oid_cpy(&list->ids[list->count++], oid);
+	return 0;
+}
+
+static void check_all_objects(void)
+{
+	struct object_list *list;
+	git_odb_object *obj;
+	git_oid hashed;
+	size_t i, pos;
+
+	list = git__calloc(1, sizeof(struct object_list));
+	cl_assert(list);
+
+	cl_git_pass(git_odb_foreach(_odb, collect_object, list));
+	cl_assert_equal_i(OBJECT_COUNT, list->count);
+
+	/* jump around, so that we keep going back to packs we've left */
+	for (i = 0; i < list->count; ++i) {
+		pos = (i * 997) % list->count;
+
+		cl_git_pass(git_odb_read(&obj, _odb, &list->ids[pos]));
+		cl_git_pass(git_odb__hashobj(&hashed, &obj->raw));
+		cl_assert(git_oid_cmp(&list->ids[pos], &hashed) == 0);
+		git_odb_object_free(obj);
+	}
+
+	git__free(list);
+}
+
+void test_pack_mwindow__window_size_is_rounded_up(void)
+{
+	size_t size;
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)1));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_MWINDOW_SIZE, &size));
+	cl_assert(size > 1);
+	cl_assert(size % 4096 == 0);
+
+	cl_git_fail(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)0));
+}
+
+void test_pack_mwindow__tiny_windows_and_limits(void)
+{
+	/* every read has to map, unmap and reopen packs over and over */
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)1));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, (size_t)1));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_FILE_LIMIT, (size_t)1));
+
+	check_all_objects();
+}
+
+void test_pack_mwindow__whole_files(void)
+{
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)1));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAP_WHOLE_FILES, 1));
+
+	check_all_objects();
+}
+
+/* What's left of a window can be more than an unsigned int holds */
+void test_pack_mwindow__windows_larger_than_4gb(void)
+{
+	git_mwindow_file mwf;
+	git_mwindow *w = NULL;
+	git_off_t size = ((git_off_t)5 << 30);
+	unsigned int left;
+	int fd;
+
+	if (sizeof(size_t) < 8)
+		return;
+
+	/* sparse, so this doesn't take any room */
+	cl_assert((fd = p_open("big.file", O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0);
+	cl_assert(p_lseek(fd, size - 1, SEEK_SET) == size - 1);
+	cl_git_pass(p_write(fd, "x", 1));
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)8 << 30));
+
+	memset(&mwf, 0, sizeof(mwf));
+	git_mwindow_file_init(&mwf);
+	mwf.fd = fd;
+	mwf.size = size;
+	cl_git_pass(git_mwindow_file_register(&mwf));
+
+	cl_assert(git_mwindow_open(&mwf, &w, 0, 0, &left) != NULL);
+	cl_assert(left == UINT_MAX);
+
+	cl_assert(git_mwindow_open(&mwf, &w, size - 10, 0, &left) != NULL);
+	cl_assert_equal_i(10, left);
+
+	git_mwindow_close(&w);
+	git_mwindow_free_all(&mwf);
+	git_mwindow_file_free(&mwf);
+	p_close(fd);
+	cl_must_pass(p_unlink("big.file"));
+}
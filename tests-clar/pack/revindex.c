@@ -0,0 +1,110 @@
+#include "clar_libgit2.h"
+#include "pack.h"
+#include "buffer.h"
+#include "path.h"
+
+static git_repository *_repo;
+static struct git_pack_file *_pack;
+static git_buf _idx_path;
+
+#define PACK_NAME "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695"
+
+void test_pack_revindex__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_buf_joinpath(&_idx_path,
+		git_repository_path(_repo), "objects/pack/" PACK_NAME ".idx"));
+	cl_git_pass(git_packfile_check(&_pack, git_buf_cstr(&_idx_path)));
+}
+
+void test_pack_revindex__cleanup(void)
+{
+	if (_pack)
+		packfile_free(_pack);
+	_pack = NULL;
+
+	git_buf_free(&_idx_path);
+	cl_git_sandbox_cleanup();
+}
+
+struct check_data {
+	struct git_pack_file *pack;
+	git_off_t last_offset;
+	git_off_t total_size;
+	int count;
+};
+
+static int check_object(git_oid *oid, void *payload)
+{
+	struct check_data *data = payload;
+	struct git_pack_entry e;
+	git_off_t size;
+	git_oid found;
+	uint32_t pos;
+
+	cl_git_pass(git_pack_entry_find(&e, data->pack, oid, GIT_OID_HEXSZ));
+
+	/* objects are listed in pack order */
+	cl_assert(e.offset > data->last_offset);
+	data->last_offset = e.offset;
+
+	cl_git_pass(git_pack_revindex_find(&pos, data->pack, e.offset));
+	cl_assert_equal_i(data->count, pos);
+
+	cl_git_pass(git_pack_offset_to_oid(&found, data->pack, e.offset));
+	cl_assert(git_oid_cmp(oid, &found) == 0);
+
+	cl_git_pass(git_pack_object_disk_size(&size, data->pack, e.offset));
+	cl_assert(size > 0);
+	data->total_size += size;
+
+	data->count++;
+	return 0;
+}
+
+static void check_pack(struct git_pack_file *pack)
+{
+	struct check_data data = {0};
+	uint32_t pos;
+
+	data.pack = pack;
+	cl_git_pass(git_pack_foreach_entry(pack, check_object, &data));
+
+	cl_assert_equal_i(pack->num_objects, data.count);
+
+	/* every byte between the header and the trailer belongs to an object */
+	cl_assert(data.total_size == pack->mwf.size - 12 - GIT_OID_RAWSZ);
+
+	cl_assert_equal_i(GIT_ENOTFOUND, git_pack_revindex_find(&pos, pack, 13));
+}
+
+void test_pack_revindex__built_in_memory(void)
+{
+	check_pack(_pack);
+	cl_assert(_pack->revindex != NULL);
+	cl_assert(_pack->revindex_map.data == NULL);
+}
+
+void test_pack_revindex__written_and_reloaded(void)
+{
+	struct git_pack_file *reloaded;
+
+	cl_git_pass(git_pack_revindex_write(_pack));
+	cl_assert(git_path_exists("testrepo.git/objects/pack/" PACK_NAME ".rev"));
+
+	cl_git_pass(git_packfile_check(&reloaded, git_buf_cstr(&_idx_path)));
+	cl_git_pass(git_pack_revindex_load(reloaded));
+	cl_assert(reloaded->revindex_map.data != NULL);
+
+	check_pack(reloaded);
+	packfile_free(reloaded);
+}
+
+void test_pack_revindex__ignores_a_bogus_rev_file(void)
+{
+	cl_git_rewritefile("testrepo.git/objects/pack/" PACK_NAME ".rev", "not a reverse index");
+
+	cl_git_pass(git_pack_revindex_load(_pack));
+	cl_assert(_pack->revindex_map.data == NULL);
+	check_pack(_pack);
+}
@@ -0,0 +1,142 @@
+#include "clar_libgit2.h"
+#include "git2/pack.h"
+#include "pack.h"
+#include "buffer.h"
+#include "posix.h"
+
+#define PACK_NAME "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695"
+#define PACK_PATH "testrepo.git/objects/pack/" PACK_NAME
+
+/* a blob in the pack, which no other object is a delta of */
+#define BLOB "c36f4cf1e38ec1bb9d9ad146ed572b89ecfc9f18"
+
+static unsigned int progress_calls;
+static unsigned int verified;
+
+struct corrupt {
+	git_oid oid;
+	git_off_t offset;
+	int count;
+};
+
+static void count_progress(const git_transfer_progress *stats, void *payload)
+{
+	GIT_UNUSED(payload);
+	progress_calls++;
+	verified = stats->indexed_objects;
+}
+
+static int note_corrupt(const git_oid *oid, git_off_t offset, const char *message, void *payload)
+{
+	struct corrupt *c = payload;
+
+	cl_assert(message != NULL);
+	git_oid_cpy(&c->oid, oid);
+	c->offset = offset;
+	c->count++;
+	return 0;
+}
+
+void test_pack_verify__cleanup(void)
+{
+	git_libgit2_opts(GIT_OPT_SET_PACK_CHECK_CRC, 0);
+	cl_git_sandbox_cleanup();
+}
+
+void test_pack_verify__checks_every_object(void)
+{
+	struct corrupt c = {{{0}}};
+
+	progress_calls = verified = 0;
+	cl_git_pass(git_pack_verify(cl_fixture(PACK_PATH ".idx"), 1, count_progress, note_corrupt, &c));
+	cl_assert(progress_calls > 0);
+	cl_assert_equal_i(0, c.count);
+
+	progress_calls = verified = 0;
+	cl_git_pass(git_pack_verify(cl_fixture(PACK_PATH ".idx"), 4, count_progress, note_corrupt, &c));
+	cl_assert_equal_i(0, c.count);
+	cl_assert(verified > 0);
+}
+
+/* Flip a byte in the middle of the blob's compressed data */
+static git_off_t damage_blob(const char *pack_path, const char *idx_path)
+{
+	struct git_pack_file *pack;
+	struct git_pack_entry e;
+	git_off_t size;
+	git_oid oid;
+	unsigned char c;
+	int fd;
+
+	cl_git_pass(git_oid_fromstr(&oid, BLOB));
+	cl_git_pass(git_packfile_check(&pack, idx_path));
+	cl_git_pass(git_pack_entry_find(&e, pack, &oid, GIT_OID_HEXSZ));
+	cl_git_pass(git_pack_object_disk_size(&size, pack, e.offset));
+	packfile_free(pack);
+
+	cl_must_pass(p_chmod(pack_path, 0644));
+	cl_assert((fd = p_open(pack_path, O_RDWR)) >= 0);
+	cl_assert(p_lseek(fd, e.offset + size / 2, SEEK_SET) >= 0);
+	cl_assert_equal_i(1, p_read(fd, &c, 1));
+	c ^= 0xff;
+	cl_assert(p_lseek(fd, e.offset + size / 2, SEEK_SET) >= 0);
+	cl_git_pass(p_write(fd, &c, 1));
+	p_close(fd);
+
+	return e.offset;
+}
+
+void test_pack_verify__reports_corrupt_objects(void)
+{
+	git_repository *repo;
+	git_buf pack_path = GIT_BUF_INIT, idx_path = GIT_BUF_INIT;
+	struct corrupt c = {{{0}}};
+	git_oid oid;
+	git_off_t offset;
+
+	repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_buf_joinpath(&pack_path, git_repository_path(repo), "objects/pack/" PACK_NAME ".pack"));
+	cl_git_pass(git_buf_joinpath(&idx_path, git_repository_path(repo), "objects/pack/" PACK_NAME ".idx"));
+
+	offset = damage_blob(git_buf_cstr(&pack_path), git_buf_cstr(&idx_path));
+
+	cl_git_fail(git_pack_verify(git_buf_cstr(&idx_path), 4, NULL, note_corrupt, &c));
+	cl_assert(strstr(giterr_last()->message, "corrupt") != NULL);
+
+	cl_git_pass(git_oid_fromstr(&oid, BLOB));
+	cl_assert_equal_i(1, c.count);
+	cl_assert(git_oid_cmp(&oid, &c.oid) == 0);
+	cl_assert(offset == c.offset);
+
+	git_buf_free(&pack_path);
+	git_buf_free(&idx_path);
+}
+
+void test_pack_verify__can_check_the_crc_on_read(void)
+{
+	git_repository *repo;
+	git_buf pack_path = GIT_BUF_INIT, idx_path = GIT_BUF_INIT;
+	struct git_pack_file *pack;
+	git_rawobj obj;
+	git_off_t offset;
+	int enabled;
+
+	repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_buf_joinpath(&pack_path, git_repository_path(repo), "objects/pack/" PACK_NAME ".pack"));
+	cl_git_pass(git_buf_joinpath(&idx_path, git_repository_path(repo), "objects/pack/" PACK_NAME ".idx"));
+
+	offset = damage_blob(git_buf_cstr(&pack_path), git_buf_cstr(&idx_path));
+
+	cl_git_pass(git_libgit2_opts(GIT_OPT_SET_PACK_CHECK_CRC, 1));
+	cl_git_pass(git_libgit2_opts(GIT_OPT_GET_PACK_CHECK_CRC, &enabled));
+	cl_assert_equal_i(1, enabled);
+
+	cl_git_pass(git_packfile_check(&pack, git_buf_cstr(&idx_path)));
+	cl_git_pass(git_packfile_open(pack));
+	cl_git_fail(git_packfile_unpack(&obj, pack, &offset));
+	cl_assert(strstr(giterr_last()->message, "CRC32") != NULL);
+	packfile_free(pack);
+
+	git_buf_free(&pack_path);
+	git_buf_free(&idx_path);
+}
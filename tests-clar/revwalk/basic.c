@@ -187,3 +187,117 @@ void test_revwalk_basic__disallow_non_commit(void)
 	cl_git_pass(git_oid_fromstr(&oid, "521d87c1ec3aef9824daf6d96cc0ae3710766d91"));
 	cl_git_fail(git_revwalk_push(_walk, &oid));
 }
+
+/* Walk every branch, and check that no commit comes after one of its parents */
+static void check_topo_walk(unsigned int sorting)
+{
+	git_oid walked[20];
+	git_commit *commit;
+	unsigned int i, j, k, count = 0;
+
+	git_revwalk_sorting(_walk, sorting);
+	cl_git_pass(git_revwalk_push_glob(_walk, "heads"));
+
+	while (count < 20 && git_revwalk_next(&walked[count], _walk) == 0)
+		count++;
+
+	/* git log --branches --oneline | wc -l => 14 */
+	cl_assert_equal_i(14, count);
+
+	for (i = 0; i < count; ++i) {
+		cl_git_pass(git_commit_lookup(&commit, _repo, &walked[i]));
+
+		for (j = 0; j < git_commit_parentcount(commit); ++j) {
+			for (k = 0; k < i; ++k)
+				cl_assert(git_oid_cmp(&walked[k], git_commit_parent_oid(commit, j)) != 0);
+		}
+
+		git_commit_free(commit);
+	}
+}
+
+void test_revwalk_basic__topological_walks_of_many_tips(void)
+{
+	check_topo_walk(GIT_SORT_TOPOLOGICAL);
+	check_topo_walk(GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME);
+
+	/* the walker can be used again once a walk is over */
+	check_topo_walk(GIT_SORT_TOPOLOGICAL);
+}
+
+void test_revwalk_basic__sorted_walks_can_be_stopped_and_reused(void)
+{
+	git_oid id, first;
+
+	git_oid_fromstr(&id, commit_head);
+
+	git_revwalk_sorting(_walk, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+	cl_git_pass(git_revwalk_push(_walk, &id));
+	cl_git_pass(git_revwalk_next(&first, _walk));
+	git_revwalk_reset(_walk);
+
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE, commit_sorting_topo_reverse, 2));
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TOPOLOGICAL, commit_sorting_topo, 2));
+}
+
+void test_revwalk_basic__first_parent(void)
+{
+	static const int first_parents[][6] = {
+		{0, 3, 5, 4, -1, -1}
+	};
+	git_oid id;
+
+	git_oid_fromstr(&id, commit_head);
+	git_revwalk_set_first_parent(_walk, 1);
+
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME, first_parents, 1));
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TOPOLOGICAL, first_parents, 1));
+
+	git_revwalk_set_first_parent(_walk, 0);
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME, commit_sorting_time, 1));
+}
+
+void test_revwalk_basic__max_count(void)
+{
+	static const int newest[][6] = {
+		{0, 3, 1, -1, -1, -1}
+	};
+	/* like `git log -n 2 --reverse`: the newest two, oldest first */
+	static const int newest_reversed[][6] = {
+		{3, 0, -1, -1, -1, -1}
+	};
+	git_oid id;
+
+	git_oid_fromstr(&id, commit_head);
+	git_revwalk_set_max_count(_walk, 3);
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME, newest, 1));
+
+	git_revwalk_set_max_count(_walk, 2);
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME | GIT_SORT_REVERSE, newest_reversed, 1));
+}
+
+void test_revwalk_basic__time_range(void)
+{
+	static const int since[][6] = {
+		{0, 3, 1, 2, -1, -1}
+	};
+	static const int until[][6] = {
+		{1, 2, 5, 4, -1, -1}
+	};
+	static const int between[][6] = {
+		{1, 2, -1, -1, -1, -1}
+	};
+	git_oid id;
+
+	git_oid_fromstr(&id, commit_head);
+
+	/* 4a202b3 and 9fd738e were committed at 1274721544 and 1274721559 */
+	git_revwalk_set_time_range(_walk, 1274721544, 0);
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME, since, 1));
+
+	git_revwalk_set_time_range(_walk, 0, 1274721559);
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME, until, 1));
+
+	git_revwalk_set_time_range(_walk, 1274721544, 1274721559);
+	cl_git_pass(test_walk(_walk, &id, GIT_SORT_TIME, between, 1));
+}
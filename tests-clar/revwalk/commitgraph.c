@@ -0,0 +1,359 @@
+#include "clar_libgit2.h"
+#include "git2/odb_backend.h"
+#include "commit_graph.h"
+#include "fileops.h"
+
+#define GRAPH_PATH "testrepo.git/objects/info/commit-graph"
+
+/*
+	$ git log --oneline --graph --decorate
+	*   a4a7dce (HEAD, br2) Merge branch 'master' into br2
+	|\
+	| * 9fd738e (master) a fourth commit
+	| * 4a202b3 a third commit
+	* | c47800c branch commit one
+	|/
+	* 5b5b025 another commit
+	* 8496071 testing
+*/
+#define MERGE_COMMIT "a4a7dce85cf63874e984719f4fdd239f5145052f"
+#define FIRST_PARENT "c47800c7266a2be04c571c04d5a6614691ea99bd"
+#define SECOND_PARENT "9fd738e8f7967c078dceed8190330fc8648ee56a"
+#define ROOT_COMMIT "8496071c1b46c854b31185ea97743be6a8774479"
+
+/* on top of c47800c, adds the only files in folders */
+#define SUBTREES_COMMIT "763d71aadf09a7951596c9746c024e7eece7c7af"
+
+static git_repository *_repo;
+
+void test_revwalk_commitgraph__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+}
+
+void test_revwalk_commitgraph__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+static void write_graph_with(git_repository *repo, int changed_paths)
+{
+	git_commit_graph_writer *w;
+	git_revwalk *walk;
+	git_buf info_dir = GIT_BUF_INIT;
+
+	cl_git_pass(git_buf_joinpath(&info_dir, git_repository_path(repo), "objects/info"));
+
+	cl_git_pass(git_revwalk_new(&walk, repo));
+	cl_git_pass(git_revwalk_push_glob(walk, "heads"));
+
+	cl_git_pass(git_commit_graph_writer_new(&w, git_buf_cstr(&info_dir)));
+	if (changed_paths >= 0)
+		git_commit_graph_writer_set_changed_paths(w, changed_paths);
+	cl_git_pass(git_commit_graph_writer_add_revwalk(w, walk));
+	cl_git_pass(git_commit_graph_writer_commit(w));
+
+	git_commit_graph_writer_free(w);
+	git_revwalk_free(walk);
+	git_buf_free(&info_dir);
+}
+
+static void write_graph(git_repository *repo)
+{
+	write_graph_with(repo, -1);
+}
+
+/* Walk every branch, and list what comes out in a single buffer */
+static void walk_all(git_buf *out, unsigned int sorting)
+{
+	git_revwalk *walk;
+	git_oid id;
+	char hex[GIT_OID_HEXSZ + 1];
+
+	hex[GIT_OID_HEXSZ] = '\0';
+
+	cl_git_pass(git_revwalk_new(&walk, _repo));
+	git_revwalk_sorting(walk, sorting);
+	cl_git_pass(git_revwalk_push_glob(walk, "heads"));
+	cl_git_pass(git_revwalk_hide_ref(walk, "refs/heads/packed-test"));
+
+	while (git_revwalk_next(&id, walk) == 0) {
+		git_oid_fmt(hex, &id);
+		cl_git_pass(git_buf_printf(out, "%s\n", hex));
+	}
+
+	git_revwalk_free(walk);
+}
+
+void test_revwalk_commitgraph__roundtrip(void)
+{
+	git_commit_graph_file *file;
+	git_commit_graph_entry entry, parent;
+	git_commit *commit;
+	git_oid id;
+
+	write_graph(_repo);
+
+	cl_git_pass(git_commit_graph_open(&file, GRAPH_PATH));
+	cl_assert(file->num_commits > 6);
+	cl_assert(!git_commit_graph_needs_refresh(file));
+
+	cl_git_pass(git_oid_fromstr(&id, MERGE_COMMIT));
+	cl_git_pass(git_commit_lookup(&commit, _repo, &id));
+
+	cl_git_pass(git_commit_graph_entry_find(&entry, file, &id, GIT_OID_HEXSZ));
+	cl_assert(git_oid_cmp(&id, &entry.sha1) == 0);
+	cl_assert(git_oid_cmp(git_commit_tree_oid(commit), &entry.tree_oid) == 0);
+	cl_assert(git_commit_time(commit) == entry.commit_time);
+	cl_assert_equal_i(2, entry.parent_count);
+	cl_assert_equal_i(5, entry.generation);
+
+	cl_git_pass(git_commit_graph_entry_parent(&parent, file, &entry, 0));
+	cl_git_pass(git_oid_fromstr(&id, FIRST_PARENT));
+	cl_assert(git_oid_cmp(&id, &parent.sha1) == 0);
+	cl_assert_equal_i(3, parent.generation);
+
+	cl_git_pass(git_commit_graph_entry_parent(&parent, file, &entry, 1));
+	cl_git_pass(git_oid_fromstr(&id, SECOND_PARENT));
+	cl_assert(git_oid_cmp(&id, &parent.sha1) == 0);
+	cl_assert_equal_i(4, parent.generation);
+	cl_git_fail(git_commit_graph_entry_parent(&parent, file, &entry, 2));
+
+	/* short names, and names we don't have */
+	cl_git_pass(git_oid_fromstrn(&id, ROOT_COMMIT, 7));
+	cl_git_pass(git_commit_graph_entry_find(&entry, file, &id, 7));
+	cl_assert_equal_i(0, entry.parent_count);
+	cl_assert_equal_i(1, entry.generation);
+
+	cl_git_pass(git_oid_fromstr(&id, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_commit_graph_entry_find(&entry, file, &id, GIT_OID_HEXSZ));
+
+	git_commit_free(commit);
+	git_commit_graph_free(file);
+}
+
+void test_revwalk_commitgraph__walks_and_merge_bases_match(void)
+{
+	git_buf time_before = GIT_BUF_INIT, topo_before = GIT_BUF_INIT,
+		time_after = GIT_BUF_INIT, topo_after = GIT_BUF_INIT;
+	git_oid one, two, before, after;
+
+	walk_all(&time_before, GIT_SORT_TIME);
+	walk_all(&topo_before, GIT_SORT_TOPOLOGICAL);
+
+	cl_git_pass(git_oid_fromstr(&one, FIRST_PARENT));
+	cl_git_pass(git_oid_fromstr(&two, SECOND_PARENT));
+	cl_git_pass(git_merge_base(&before, _repo, &one, &two));
+
+	write_graph(_repo);
+
+	walk_all(&time_after, GIT_SORT_TIME);
+	walk_all(&topo_after, GIT_SORT_TOPOLOGICAL);
+	cl_git_pass(git_merge_base(&after, _repo, &one, &two));
+
+	cl_assert(time_before.size > 0);
+	cl_assert_equal_s(time_before.ptr, time_after.ptr);
+	cl_assert_equal_s(topo_before.ptr, topo_after.ptr);
+	cl_assert(git_oid_cmp(&before, &after) == 0);
+
+	git_buf_free(&time_before);
+	git_buf_free(&topo_before);
+	git_buf_free(&time_after);
+	git_buf_free(&topo_after);
+}
+
+/*
+ * On top of the merge, rounds of a commit on a side branch merged
+ * back with --no-ff: each merge has its own first parent as the
+ * parent of its second one.
+ */
+static void build_no_ff_chain(git_oid *tip, git_oid *side, int rounds)
+{
+	git_signature *sig;
+	git_commit *parents[2];
+	git_tree *tree;
+	char message[64];
+	int i;
+
+	cl_git_pass(git_signature_new(&sig, "me", "me@example.com", 1234567890, 60));
+	cl_git_pass(git_oid_fromstr(tip, MERGE_COMMIT));
+
+	for (i = 0; i < rounds; ++i) {
+		cl_git_pass(git_commit_lookup(&parents[0], _repo, tip));
+		cl_git_pass(git_commit_tree(&tree, parents[0]));
+
+		p_snprintf(message, sizeof(message), "side %d\n", i);
+		cl_git_pass(git_commit_create(side, _repo, NULL, sig, sig, NULL,
+			message, tree, 1, (const git_commit **)parents));
+		cl_git_pass(git_commit_lookup(&parents[1], _repo, side));
+
+		p_snprintf(message, sizeof(message), "merge %d\n", i);
+		cl_git_pass(git_commit_create(tip, _repo, NULL, sig, sig, NULL,
+			message, tree, 2, (const git_commit **)parents));
+
+		git_tree_free(tree);
+		git_commit_free(parents[0]);
+		git_commit_free(parents[1]);
+	}
+
+	git_signature_free(sig);
+}
+
+void test_revwalk_commitgraph__no_ff_merge_chain(void)
+{
+	git_commit_graph_file *file;
+	git_commit_graph_entry entry;
+	git_reference *ref;
+	git_oid tip, side;
+
+	build_no_ff_chain(&tip, &side, 40);
+	cl_git_pass(git_reference_create_oid(&ref, _repo, "refs/heads/no-ff", &tip, 0));
+
+	write_graph(_repo);
+
+	/* two generations a round, on top of the merge's five */
+	cl_git_pass(git_commit_graph_open(&file, GRAPH_PATH));
+	cl_git_pass(git_commit_graph_entry_find(&entry, file, &tip, GIT_OID_HEXSZ));
+	cl_assert_equal_i(5 + 2 * 40, entry.generation);
+	cl_git_pass(git_commit_graph_entry_find(&entry, file, &side, GIT_OID_HEXSZ));
+	cl_assert_equal_i(5 + 2 * 40 - 1, entry.generation);
+
+	git_commit_graph_free(file);
+	git_reference_free(ref);
+}
+
+typedef struct {
+	git_odb_backend base;
+	int read_calls;
+} counting_backend;
+
+static int counting_read(
+	void **data, size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid)
+{
+	GIT_UNUSED(data); GIT_UNUSED(len); GIT_UNUSED(type); GIT_UNUSED(oid);
+
+	((counting_backend *)backend)->read_calls++;
+	return GIT_ENOTFOUND;
+}
+
+/* Walk the history of `start`, listing it in `out` if given */
+static int count_walk_reads(git_buf *out, const char *start, const char *path)
+{
+	git_repository *repo;
+	git_odb *odb;
+	git_revwalk *walk;
+	counting_backend *backend;
+	git_strarray pathspec;
+	git_oid id;
+	char hex[GIT_OID_HEXSZ + 1];
+	int reads, walked = 0;
+
+	hex[GIT_OID_HEXSZ] = '\0';
+
+	/* a fresh repository, so nothing is cached yet */
+	cl_git_pass(git_repository_open(&repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&odb, repo));
+
+	backend = git__calloc(1, sizeof(counting_backend));
+	cl_assert(backend);
+	backend->base.read = counting_read;
+	cl_git_pass(git_odb_add_backend(odb, (git_odb_backend *)backend, 10));
+
+	cl_git_pass(git_oid_fromstr(&id, start));
+	cl_git_pass(git_revwalk_new(&walk, repo));
+	git_revwalk_sorting(walk, GIT_SORT_TIME);
+	cl_git_pass(git_revwalk_push(walk, &id));
+
+	if (path != NULL) {
+		pathspec.strings = (char **)&path;
+		pathspec.count = 1;
+		cl_git_pass(git_revwalk_set_pathspec(walk, &pathspec));
+	}
+
+	while (git_revwalk_next(&id, walk) == 0) {
+		walked++;
+
+		if (out != NULL) {
+			git_oid_fmt(hex, &id);
+			cl_git_pass(git_buf_printf(out, "%s\n", hex));
+		}
+	}
+
+	if (path == NULL)
+		cl_assert_equal_i(6, walked);
+
+	reads = backend->read_calls;
+
+	git_revwalk_free(walk);
+	git_odb_free(odb);
+	git_repository_free(repo);
+
+	return reads;
+}
+
+void test_revwalk_commitgraph__walks_without_reading_commits(void)
+{
+	cl_assert(count_walk_reads(NULL, MERGE_COMMIT, NULL) > 0);
+
+	write_graph(_repo);
+	cl_assert_equal_i(0, count_walk_reads(NULL, MERGE_COMMIT, NULL));
+
+	/* a broken graph is ignored */
+	cl_git_pass(p_chmod(GRAPH_PATH, 0644));
+	cl_git_rewritefile(GRAPH_PATH, "CGPH");
+	cl_assert(count_walk_reads(NULL, MERGE_COMMIT, NULL) > 0);
+}
+
+void test_revwalk_commitgraph__changed_path_filters(void)
+{
+	git_commit_graph_file *file;
+	git_commit_graph_bloom_key key;
+	git_oid id;
+
+	write_graph_with(_repo, 1);
+
+	cl_git_pass(git_commit_graph_open(&file, GRAPH_PATH));
+	cl_assert(file->bloom_data != NULL);
+
+	/* the root commit adds README to the empty tree */
+	cl_git_pass(git_oid_fromstr(&id, ROOT_COMMIT));
+	git_commit_graph_bloom_key_init(&key, file, "README", strlen("README"));
+	cl_assert_equal_i(1, git_commit_graph_bloom_maybe_changed(file, &id, &key, 1));
+	git_commit_graph_bloom_key_init(&key, file, "new.txt", strlen("new.txt"));
+	cl_assert_equal_i(0, git_commit_graph_bloom_maybe_changed(file, &id, &key, 1));
+
+	cl_git_pass(git_oid_fromstr(&id, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_assert_equal_i(GIT_ENOTFOUND, git_commit_graph_bloom_maybe_changed(file, &id, &key, 1));
+
+	git_commit_graph_free(file);
+
+	/* they're kept when the file is rewritten, unless asked not to */
+	write_graph(_repo);
+	cl_git_pass(git_commit_graph_open(&file, GRAPH_PATH));
+	cl_assert(file->bloom_data != NULL);
+	git_commit_graph_free(file);
+
+	write_graph_with(_repo, 0);
+	cl_git_pass(git_commit_graph_open(&file, GRAPH_PATH));
+	cl_assert(file->bloom_data == NULL);
+	git_commit_graph_free(file);
+}
+
+void test_revwalk_commitgraph__pathspec_walks_skip_trees(void)
+{
+	git_buf before = GIT_BUF_INIT, after = GIT_BUF_INIT;
+	int reads_before, reads_after;
+
+	write_graph_with(_repo, 0);
+	reads_before = count_walk_reads(&before, SUBTREES_COMMIT, "ab/de/fgh/1.txt");
+
+	write_graph_with(_repo, 1);
+	reads_after = count_walk_reads(&after, SUBTREES_COMMIT, "ab/de/fgh/1.txt");
+
+	cl_assert_equal_s(SUBTREES_COMMIT "\n", before.ptr);
+	cl_assert_equal_s(before.ptr, after.ptr);
+	cl_assert(reads_after < reads_before);
+
+	git_buf_free(&before);
+	git_buf_free(&after);
+}
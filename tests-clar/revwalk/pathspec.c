@@ -0,0 +1,100 @@
+#include "clar_libgit2.h"
+#include "buffer.h"
+
+/*
+	$ git log --oneline --graph --decorate
+	*   a4a7dce (HEAD, br2) Merge branch 'master' into br2
+	|\
+	| * 9fd738e (master) a fourth commit
+	| * 4a202b3 a third commit
+	* | c47800c branch commit one
+	|/
+	* 5b5b025 another commit
+	* 8496071 testing
+*/
+#define MERGE_COMMIT "a4a7dce85cf63874e984719f4fdd239f5145052f"
+
+static git_repository *_repo;
+static git_revwalk *_walk;
+
+void test_revwalk_pathspec__initialize(void)
+{
+	_repo = cl_git_sandbox_init("testrepo.git");
+	cl_git_pass(git_revwalk_new(&_walk, _repo));
+}
+
+void test_revwalk_pathspec__cleanup(void)
+{
+	git_revwalk_free(_walk);
+	_walk = NULL;
+	cl_git_sandbox_cleanup();
+}
+
+/* Walk from the merge, showing what changes the paths */
+static void check_walk(unsigned int sorting, const char *expected, char *path1, char *path2)
+{
+	git_strarray pathspec;
+	char *paths[2];
+	git_buf walked = GIT_BUF_INIT;
+	git_oid id;
+	char hex[8];
+
+	paths[0] = path1;
+	paths[1] = path2;
+	pathspec.strings = paths;
+	pathspec.count = path2 ? 2 : (path1 ? 1 : 0);
+	cl_git_pass(git_revwalk_set_pathspec(_walk, &pathspec));
+
+	git_revwalk_sorting(_walk, sorting);
+	cl_git_pass(git_oid_fromstr(&id, MERGE_COMMIT));
+	cl_git_pass(git_revwalk_push(_walk, &id));
+
+	while (git_revwalk_next(&id, _walk) == 0) {
+		git_oid_tostr(hex, sizeof(hex), &id);
+		cl_git_pass(git_buf_printf(&walked, "%s ", hex));
+	}
+
+	cl_assert_equal_s(expected, git_buf_cstr(&walked));
+	git_buf_free(&walked);
+}
+
+void test_revwalk_pathspec__simplifies_merges(void)
+{
+	/* the merge brings nothing new for these paths, so it isn't shown */
+	check_walk(GIT_SORT_TIME, "9fd738e 5b5b025 ", "new.txt", NULL);
+	check_walk(GIT_SORT_TIME, "4a202b3 8496071 ", "README", NULL);
+	check_walk(GIT_SORT_TIME, "c47800c ", "branch_file.txt", NULL);
+	check_walk(GIT_SORT_TIME, "", "not/there", NULL);
+}
+
+void test_revwalk_pathspec__several_paths(void)
+{
+	check_walk(GIT_SORT_TIME, "9fd738e 4a202b3 5b5b025 8496071 ", "README", "new.txt");
+	check_walk(GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE,
+		"8496071 5b5b025 4a202b3 9fd738e ", "new.txt", "README");
+}
+
+void test_revwalk_pathspec__folders(void)
+{
+	git_strarray pathspec;
+	char *paths[] = { "/ab/de/" };
+	git_oid id;
+
+	pathspec.strings = paths;
+	pathspec.count = 1;
+	cl_git_pass(git_revwalk_set_pathspec(_walk, &pathspec));
+	cl_git_pass(git_revwalk_push_glob(_walk, "heads"));
+
+	cl_git_pass(git_revwalk_next(&id, _walk));
+	cl_assert(!git_oid_streq(&id, "763d71aadf09a7951596c9746c024e7eece7c7af"));
+	cl_assert_equal_i(GIT_ITEROVER, git_revwalk_next(&id, _walk));
+
+	/* the merge has no "ab" folder anywhere in its history */
+	check_walk(GIT_SORT_TIME, "", "ab/de", NULL);
+}
+
+void test_revwalk_pathspec__can_be_cleared(void)
+{
+	check_walk(GIT_SORT_TIME, "c47800c ", "branch_file.txt", NULL);
+	check_walk(GIT_SORT_TIME, "a4a7dce c47800c 9fd738e 4a202b3 5b5b025 8496071 ", NULL, NULL);
+}